@@ -0,0 +1,356 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "bare.h"
+
+#include "bare/BlockCache.h"
+
+using namespace bare;
+
+// Cache blocks are aligned to a cache line so they can be DMA targets
+static constexpr size_t DataAlignment = 32;
+
+BlockCache::BlockCache(Volume::RawIO* rawIO, uint32_t size)
+    : _rawIO(rawIO)
+    , _size(size)
+{
+    _entries = new Entry[_size];
+    _data = static_cast<char*>(aligned_alloc(DataAlignment, _size * BlockSize));
+    
+    // Use a power of 2 hash table at least twice the size of the cache.
+    // Block numbers are mostly sequential, so the low bits hash well.
+    _hashSize = 1;
+    while (_hashSize < _size * 2) {
+        _hashSize <<= 1;
+    }
+    _hashTable = new uint32_t[_hashSize];
+    for (uint32_t i = 0; i < _hashSize; ++i) {
+        _hashTable[i] = None;
+    }
+    
+    for (uint32_t i = 0; i < _size; ++i) {
+        pushFrontLRU(i);
+    }
+}
+
+BlockCache::~BlockCache()
+{
+    flush();
+    delete [ ] _entries;
+    delete [ ] _hashTable;
+    aligned_free(_data, DataAlignment);
+}
+
+Volume::Error BlockCache::read(char* buf, Block blockAddr, uint32_t blocks)
+{
+    if (blocks == 1) {
+        uint32_t index;
+        Volume::Error error = lookup(blockAddr.value(), true, index);
+        if (error != Volume::Error::OK) {
+            return error;
+        }
+        if (index != None) {
+            memcpy(buf, data(index), BlockSize);
+            return Volume::Error::OK;
+        }
+        
+        // Everything is pinned, go to the device
+        ++_stats.uncached;
+        return _rawIO->read(buf, blockAddr, 1);
+    }
+    
+    _stats.uncached += blocks;
+    Volume::Error error = _rawIO->read(buf, blockAddr, blocks);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    // Dirty blocks in the cache are newer than what's on the device
+    for (uint32_t i = 0; i < blocks; ++i) {
+        uint32_t index = find(blockAddr.value() + i);
+        if (index != None && _entries[index].dirty) {
+            memcpy(buf + i * BlockSize, data(index), BlockSize);
+        }
+    }
+    return Volume::Error::OK;
+}
+
+Volume::Error BlockCache::write(const char* buf, Block blockAddr, uint32_t blocks)
+{
+    if (blocks == 1) {
+        uint32_t index;
+        Volume::Error error = lookup(blockAddr.value(), false, index);
+        if (error != Volume::Error::OK) {
+            return error;
+        }
+        if (index != None) {
+            memcpy(data(index), buf, BlockSize);
+            _entries[index].dirty = true;
+            return Volume::Error::OK;
+        }
+        
+        ++_stats.uncached;
+        return _rawIO->write(buf, blockAddr, 1);
+    }
+    
+    _stats.uncached += blocks;
+    Volume::Error error = _rawIO->write(buf, blockAddr, blocks);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    // Bring any cached copies up to date. They now match the device
+    for (uint32_t i = 0; i < blocks; ++i) {
+        uint32_t index = find(blockAddr.value() + i);
+        if (index != None) {
+            memcpy(data(index), buf + i * BlockSize, BlockSize);
+            _entries[index].dirty = false;
+        }
+    }
+    return Volume::Error::OK;
+}
+
+Volume::Error BlockCache::submit(Request* request)
+{
+    // Requests go straight to the device like multi-block transfers. Dirty
+    // blocks a read covers are written back first so it gets them. Cached
+    // copies of blocks a write covers are replaced, and then match what
+    // the device will have.
+    for (uint32_t i = 0; i < request->blocks; ++i) {
+        uint32_t index = find(request->blockAddr.value() + i);
+        if (index == None) {
+            continue;
+        }
+        if (request->write) {
+            memcpy(data(index), request->buf + i * BlockSize, BlockSize);
+            _entries[index].dirty = false;
+        } else if (_entries[index].dirty) {
+            Volume::Error error = writeBack(index);
+            if (error != Volume::Error::OK) {
+                if (request->completion) {
+                    request->completion(request, error);
+                }
+                return Volume::Error::OK;
+            }
+        }
+    }
+    
+    _stats.uncached += request->blocks;
+    return _rawIO->submit(request);
+}
+
+Volume::Error BlockCache::flush()
+{
+    // Write the lowest numbered dirty block each time around, so the device
+    // sees the writes in order
+    while (true) {
+        uint32_t next = None;
+        for (uint32_t i = 0; i < _size; ++i) {
+            const Entry& entry = _entries[i];
+            if (entry.valid && entry.dirty && (next == None || entry.block < _entries[next].block)) {
+                next = i;
+            }
+        }
+        
+        if (next == None) {
+            return Volume::Error::OK;
+        }
+        
+        Volume::Error error = writeBack(next);
+        if (error != Volume::Error::OK) {
+            return error;
+        }
+    }
+}
+
+char* BlockCache::pin(Block block, bool load)
+{
+    uint32_t index;
+    if (lookup(block.value(), load, index) != Volume::Error::OK || index == None) {
+        return nullptr;
+    }
+    
+    ++_entries[index].pinCount;
+    return data(index);
+}
+
+void BlockCache::unpin(Block block, bool dirty)
+{
+    uint32_t index = find(block.value());
+    if (index == None || _entries[index].pinCount == 0) {
+        return;
+    }
+    
+    --_entries[index].pinCount;
+    if (dirty) {
+        _entries[index].dirty = true;
+    }
+}
+
+uint32_t BlockCache::dirtyCount() const
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < _size; ++i) {
+        if (_entries[i].valid && _entries[i].dirty) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+uint32_t BlockCache::pinnedCount() const
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < _size; ++i) {
+        if (_entries[i].pinCount) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+uint32_t BlockCache::find(uint32_t block) const
+{
+    for (uint32_t index = _hashTable[hash(block)]; index != None; index = _entries[index].hashNext) {
+        if (_entries[index].block == block) {
+            return index;
+        }
+    }
+    return None;
+}
+
+uint32_t BlockCache::allocate(uint32_t block)
+{
+    for (uint32_t index = _lruTail; index != None; index = _entries[index].prev) {
+        Entry& entry = _entries[index];
+        if (entry.pinCount) {
+            continue;
+        }
+        
+        if (entry.valid) {
+            if (entry.dirty && writeBack(index) != Volume::Error::OK) {
+                return None;
+            }
+            removeHash(index);
+            entry.valid = false;
+            ++_stats.evictions;
+        }
+        
+        entry.block = block;
+        unlinkLRU(index);
+        pushFrontLRU(index);
+        return index;
+    }
+    return None;
+}
+
+Volume::Error BlockCache::lookup(uint32_t block, bool load, uint32_t& index)
+{
+    index = find(block);
+    if (index != None) {
+        ++_stats.hits;
+        unlinkLRU(index);
+        pushFrontLRU(index);
+        return Volume::Error::OK;
+    }
+    
+    ++_stats.misses;
+    index = allocate(block);
+    if (index == None) {
+        return Volume::Error::OK;
+    }
+    
+    Entry& entry = _entries[index];
+    if (load) {
+        Volume::Error error = _rawIO->read(data(index), block, 1);
+        if (error != Volume::Error::OK) {
+            // Leave the entry invalid and make it the first one reused
+            unlinkLRU(index);
+            pushBackLRU(index);
+            index = None;
+            return error;
+        }
+    }
+    
+    entry.valid = true;
+    entry.dirty = false;
+    entry.hashNext = _hashTable[hash(block)];
+    _hashTable[hash(block)] = index;
+    return Volume::Error::OK;
+}
+
+Volume::Error BlockCache::writeBack(uint32_t index)
+{
+    Entry& entry = _entries[index];
+    Volume::Error error = _rawIO->write(data(index), entry.block, 1);
+    if (error == Volume::Error::OK) {
+        entry.dirty = false;
+        ++_stats.writeBacks;
+    }
+    return error;
+}
+
+void BlockCache::unlinkLRU(uint32_t index)
+{
+    Entry& entry = _entries[index];
+    if (entry.prev != None) {
+        _entries[entry.prev].next = entry.next;
+    } else {
+        _lruHead = entry.next;
+    }
+    if (entry.next != None) {
+        _entries[entry.next].prev = entry.prev;
+    } else {
+        _lruTail = entry.prev;
+    }
+    entry.prev = None;
+    entry.next = None;
+}
+
+void BlockCache::pushFrontLRU(uint32_t index)
+{
+    Entry& entry = _entries[index];
+    entry.prev = None;
+    entry.next = _lruHead;
+    if (_lruHead != None) {
+        _entries[_lruHead].prev = index;
+    } else {
+        _lruTail = index;
+    }
+    _lruHead = index;
+}
+
+void BlockCache::pushBackLRU(uint32_t index)
+{
+    Entry& entry = _entries[index];
+    entry.prev = _lruTail;
+    entry.next = None;
+    if (_lruTail != None) {
+        _entries[_lruTail].next = index;
+    } else {
+        _lruHead = index;
+    }
+    _lruTail = index;
+}
+
+void BlockCache::removeHash(uint32_t index)
+{
+    uint32_t* link = &_hashTable[hash(_entries[index].block)];
+    while (*link != None) {
+        if (*link == index) {
+            *link = _entries[index].hashNext;
+            _entries[index].hashNext = None;
+            return;
+        }
+        link = &_entries[*link].hashNext;
+    }
+}
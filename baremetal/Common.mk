@@ -14,6 +14,8 @@ PLATFORMDIR ?= RPi
 BUILDDIR ?= $(PLATFORMDIR)/build
 TOOLCHAIN ?= arm-none-eabi-
 
+BAREMETALHOME ?= ../baremetal
+
 LOADADDR ?= 0x8000
 
 AR = $(TOOLCHAIN)ar
@@ -24,8 +26,16 @@ LD = $(TOOLCHAIN)ld
 OBJDUMP = $(TOOLCHAIN)objdump
 OBJCOPY = $(TOOLCHAIN)objcopy
 
-ASFLAGS = $(INCLUDES) -mcpu=arm1176jzf-s -mfpu=vfp
-CFLAGS = $(INCLUDES) -D$(PLATFORM) -D$(FLOATTYPE) -Wall -nostdlib -nostartfiles -ffreestanding -mcpu=arm1176jzf-s -mtune=arm1176jzf-s -mhard-float -mfpu=vfp -MMD
+ifeq ($(PLATFORM), PLATFORM_LINUX)
+    # Built with the host compiler and run as a normal process. The C library
+    # is there, but memcpy and friends still come from utilities.cpp, so keep
+    # the compiler from turning their loops into calls to themselves
+    ASFLAGS = $(INCLUDES)
+    CFLAGS = $(INCLUDES) -D$(PLATFORM) -D$(FLOATTYPE) -Wall -pthread -fno-builtin -fno-tree-loop-distribute-patterns -MMD
+else
+    ASFLAGS = $(INCLUDES) -mcpu=arm1176jzf-s -mfpu=vfp
+    CFLAGS = $(INCLUDES) -D$(PLATFORM) -D$(FLOATTYPE) -Wall -nostdlib -nostartfiles -ffreestanding -mcpu=arm1176jzf-s -mtune=arm1176jzf-s -mhard-float -mfpu=vfp -MMD
+endif
 
 DEBUG ?= 0
 ifeq ($(DEBUG), 1)
@@ -57,10 +67,10 @@ $(BUILDDIR):
 	@mkdir -p $@
 
 makelibs:
-	cd ../baremetal; make DEBUG=$(DEBUG) PLATFORM=$(PLATFORM) FLOATTYPE=$(FLOATTYPE) PLATFORMDIR=$(PLATFORMDIR)
+	cd $(BAREMETALHOME); make DEBUG=$(DEBUG) PLATFORM=$(PLATFORM) FLOATTYPE=$(FLOATTYPE) PLATFORMDIR=$(PLATFORMDIR)
 	
 cleanlibs:
-	cd ../baremetal; make clean
+	cd $(BAREMETALHOME); make clean PLATFORMDIR=$(PLATFORMDIR)
 
 $(PRODUCTDIR)/$(PRODUCT).bin : $(LOADER) $(OBJS) makelibs
 	@echo "  LD      -Map $(BUILDDIR)/$(PRODUCT).map $(BUILDDIR)/$(PRODUCT).elf"
@@ -26,6 +26,7 @@ using namespace bare;
 #include <stdio.h>
 
 static FILE* sdCardFP = nullptr;
+static SDCard::Stats sdCardStats;
 
 SDCard::SDCard()
 {
@@ -34,11 +35,32 @@ SDCard::SDCard()
     sdCardFP = fopen("FAT32.img", "r+");
 }
 
+SDCard::Mode SDCard::mode() const
+{
+    // The simulated card has no bus to negotiate
+    return Mode();
+}
+
+const SDCard::Stats& SDCard::stats() const
+{
+    return sdCardStats;
+}
+
+// The simulated card counts commands like a card without CMD23. A
+// multi-block transfer is one read or write command, then CMD12.
+static void countTransfer(uint32_t blocks)
+{
+    sdCardStats.commands += (blocks > 1) ? 2 : 1;
+    ++sdCardStats.transfers;
+    sdCardStats.blocks += blocks;
+}
+
 Volume::Error SDCard::read(char* buf, Block blockAddr, uint32_t blocks)
 {
     if (!sdCardFP) {
         return Volume::Error::InternalError;
     }
+    countTransfer(blocks);
     fseek(sdCardFP, blockAddr.value() * 512, SEEK_SET);
     size_t size = fread(buf, 1, blocks * 512, sdCardFP);
     return (size == blocks * 512) ? Volume::Error::OK : Volume::Error::Failed;
@@ -49,7 +71,13 @@ Volume::Error SDCard::write(const char* buf, Block blockAddr, uint32_t blocks)
     if (!sdCardFP) {
         return Volume::Error::InternalError;
     }
+    countTransfer(blocks);
     fseek(sdCardFP, blockAddr.value() * 512, SEEK_SET);
     size_t size = fwrite(buf, 1, blocks * 512, sdCardFP);
     return (size == blocks * 512) ? Volume::Error::OK : Volume::Error::Failed;
 }
+
+Volume::Error SDCard::submit(Request* request)
+{
+    return RawIO::submit(request);
+}
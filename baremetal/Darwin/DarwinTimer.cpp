@@ -18,6 +18,7 @@
 #include "bare/Serial.h"
 
 #include <sys/time.h>
+#include <time.h>
 
 using namespace bare;
 
@@ -43,6 +44,13 @@ int64_t Timer::systemTime()
     return ((static_cast<int64_t>(time.tv_sec)) * 1000000) + (static_cast<int64_t>(time.tv_usec));
 }
 
+int64_t Timer::systemTimeNS()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
 void Timer::usleep(uint32_t us)
 {
     int64_t t0 = systemTime();
@@ -55,6 +55,11 @@ int64_t Timer::systemTime()
     return static_cast<int64_t>(_systemTimeOffset) << 32 + t;
 }
 
+int64_t Timer::systemTimeNS()
+{
+    return systemTime() * 1000;
+}
+
 void Timer::usleep(uint32_t us)
 {
     delayMicroseconds(us);
@@ -1,11 +1,11 @@
 /*-------------------------------------------------------------------------
     This source file is a part of Placid
-
+    
     For the latest info, see http:www.marrin.org/
-
+    
     Copyright (c) 2018-2019, Chris Marrin
     All rights reserved.
-
+    
     Use of this source code is governed by the MIT license that can be
     found in the LICENSE file.
 -------------------------------------------------------------------------*/
@@ -14,6 +14,7 @@
 
 #include "bare/FAT32.h"
 
+#include "bare/FAT32DirectoryIndex.h"
 #include "bare/FAT32DirectoryIterator.h"
 #include "bare/Serial.h"
 
@@ -81,14 +82,436 @@ struct BootBlock
 
 static_assert(sizeof(BootBlock) == 512, "Wrong BootBlock size");
 
+struct FSInfo
+{
+    uint8_t leadSignature[4];
+    uint8_t reserved1[480];
+    uint8_t structSignature[4];
+    uint8_t freeCount[4];
+    uint8_t nextFree[4];
+    uint8_t reserved2[12];
+    uint8_t trailSignature[4];
+};
+
+static_assert(sizeof(FSInfo) == 512, "Wrong FSInfo size");
+
+static constexpr uint32_t FSInfoLeadSignature = 0x41615252;
+static constexpr uint32_t FSInfoStructSignature = 0x61417272;
+static constexpr uint32_t FSInfoTrailSignature = 0xaa550000;
+static constexpr uint32_t FSInfoUnknown = 0xffffffff;
+
+static constexpr uint32_t EntriesPerFATBlock = BlockSize / sizeof(uint32_t);
+
+// Most clusters allocated in one step, so a step touches at most 17 FAT
+// blocks and stays under FAT32::MaxOperationBlocks
+static constexpr uint32_t MaxAllocationStep = 16 * EntriesPerFATBlock;
+
+// Most blocks copied to the second FAT in one write
+static constexpr uint32_t MirrorRunBlocks = 8;
+
+// The first block of the journal file. It's followed by the blocks of the
+// last transaction, in the order given in homeBlocks. A transaction is
+// only replayed if the checksum of the header and blocks is correct, so
+// one which was only partly written is ignored.
+struct JournalHeader
+{
+    uint8_t signature[4];
+    uint8_t sequence[4];
+    uint8_t count[4];
+    uint8_t checksum[4];
+    uint8_t homeBlocks[FAT32::JournalBlocks][4];
+    uint8_t reserved[BlockSize - 16 - FAT32::JournalBlocks * 4];
+};
+
+static_assert(sizeof(JournalHeader) == 512, "Wrong JournalHeader size");
+static_assert(FAT32::MaxOperationBlocks >= MaxAllocationStep / EntriesPerFATBlock + 8, "Allocation step too big for an operation");
+
+static constexpr uint32_t JournalSignature = 0x4c4e4a50;
+static constexpr uint32_t JournalFileSize = (FAT32::JournalBlocks + 1) * BlockSize;
+
+static uint32_t journalChecksum(const char* buf, uint32_t blocks)
+{
+    const uint32_t* p = reinterpret_cast<const uint32_t*>(buf);
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < blocks * BlockSize / sizeof(uint32_t); ++i) {
+        sum = ((sum << 1) | (sum >> 31)) + p[i];
+    }
+    return sum;
+}
+
+FAT32::FAT32(Volume::RawIO* rawIO, uint8_t partition, uint32_t fatCacheBlocks)
+    : _rawIO(rawIO)
+    , _partition(partition)
+{
+    if (fatCacheBlocks == 0) {
+        fatCacheBlocks = 1;
+    } else if (fatCacheBlocks > MaxFATCacheBlocks) {
+        fatCacheBlocks = MaxFATCacheBlocks;
+    }
+    _fatCacheBlocks = fatCacheBlocks;
+}
+
+FAT32::~FAT32()
+{
+    if (_mounted) {
+        sync();
+    }
+    delete [ ] _fatCacheData;
+    delete [ ] _fatMirrorPending;
+    delete [ ] _fatBlockFreeCount;
+    delete [ ] _journalBuffer;
+    
+    for (uint32_t i = 0; i < MaxDirectoryIndexes; ++i) {
+        delete _directoryIndexes[i];
+    }
+}
+
 Volume::Error FAT32::rawRead(char* buf, Block block, uint32_t blocks)
 {
-    return _rawIO->read(buf, block, blocks);
+    Volume::Error error = _rawIO->read(buf, block, blocks);
+    if (error != Volume::Error::OK || _journalCount == 0) {
+        return error;
+    }
+    
+    // Blocks in the current transaction haven't been written to the device
+    for (uint32_t i = 0; i < _journalCount; ++i) {
+        uint32_t home = journalHome(i);
+        if (home >= block.value() && home < block.value() + blocks) {
+            memcpy(buf + (home - block.value()) * BlockSize, journalImage(i), BlockSize);
+        }
+    }
+    return Volume::Error::OK;
 }
 
 Volume::Error FAT32::rawWrite(const char* buf, Block block, uint32_t blocks)
 {
-    return _rawIO->write(buf, block, blocks);
+    Volume::Error error = _rawIO->write(buf, block, blocks);
+    if (error != Volume::Error::OK || _journalCount == 0) {
+        return error;
+    }
+    
+    // File data replaces any metadata for the same block in the current
+    // transaction. That happens when a directory cluster is freed and
+    // reused for a file before the transaction is committed. Move the
+    // last block in the transaction into the hole.
+    JournalHeader* header = reinterpret_cast<JournalHeader*>(_journalBuffer);
+    for (uint32_t i = 0; i < _journalCount; ) {
+        uint32_t home = journalHome(i);
+        if (home < block.value() || home >= block.value() + blocks) {
+            ++i;
+            continue;
+        }
+        
+        --_journalCount;
+        if (i != _journalCount) {
+            memcpy(header->homeBlocks[i], header->homeBlocks[_journalCount], 4);
+            memcpy(journalImage(i), journalImage(_journalCount), BlockSize);
+        }
+    }
+    return Volume::Error::OK;
+}
+
+Volume::Error FAT32::writeMetadata(const char* buf, Block block, uint32_t blocks)
+{
+    if (!journalEnabled()) {
+        return rawWrite(buf, block, blocks);
+    }
+    
+    JournalHeader* header = reinterpret_cast<JournalHeader*>(_journalBuffer);
+    for ( ; blocks > 0; --blocks) {
+        uint32_t i = journalIndex(block);
+        if (i == _journalCount) {
+            if (_journalCount == JournalBlocks) {
+                // Commit points keep room for a whole operation, and
+                // committing part of one would defeat the journal
+                Serial::printf("*** FAT32::writeMetadata journal transaction full\n");
+                _error = Error::JournalError;
+                return Volume::Error::InternalError;
+            }
+            uint32ToBuf(block.value(), header->homeBlocks[i]);
+            ++_journalCount;
+        }
+        
+        memcpy(journalImage(i), buf, BlockSize);
+        buf += BlockSize;
+        block = block + Block(1);
+    }
+    return Volume::Error::OK;
+}
+
+uint32_t FAT32::journalHome(uint32_t i) const
+{
+    return bufToUInt32(reinterpret_cast<JournalHeader*>(_journalBuffer)->homeBlocks[i]);
+}
+
+uint32_t FAT32::journalIndex(Block block) const
+{
+    uint32_t i = 0;
+    while (i < _journalCount && journalHome(i) != block.value()) {
+        ++i;
+    }
+    return i;
+}
+
+void FAT32::setJournalHeader(uint32_t sequence, uint32_t count)
+{
+    JournalHeader* header = reinterpret_cast<JournalHeader*>(_journalBuffer);
+    uint32ToBuf(JournalSignature, header->signature);
+    uint32ToBuf(sequence, header->sequence);
+    uint32ToBuf(count, header->count);
+    uint32ToBuf(0, header->checksum);
+    uint32ToBuf(journalChecksum(_journalBuffer, count + 1), header->checksum);
+}
+
+Volume::Error FAT32::commitJournal()
+{
+    if (_journalCount == 0) {
+        return Volume::Error::OK;
+    }
+    
+    // Flush first, so file data gets to the device before the metadata
+    // which points at it, and so the record is written ahead of anything
+    // else. A record of 2 or more blocks goes around the block cache, but
+    // flush again in case this RawIO holds multi-block writes.
+    Volume::Error error = _rawIO->flush();
+    
+    // Sort the blocks by home location, so neighbouring blocks, like a
+    // stretch of the FAT, go home in one write
+    JournalHeader* header = reinterpret_cast<JournalHeader*>(_journalBuffer);
+    char image[BlockSize] __attribute__((aligned(4)));
+    for (uint32_t i = 1; i < _journalCount; ++i) {
+        uint32_t home = journalHome(i);
+        uint32_t j = i;
+        while (j > 0 && journalHome(j - 1) > home) {
+            --j;
+        }
+        if (j == i) {
+            continue;
+        }
+        memcpy(image, journalImage(i), BlockSize);
+        memmove(journalImage(j + 1), journalImage(j), (i - j) * BlockSize);
+        memcpy(journalImage(j), image, BlockSize);
+        memmove(header->homeBlocks[j + 1], header->homeBlocks[j], (i - j) * 4);
+        uint32ToBuf(home, header->homeBlocks[j]);
+    }
+    
+    if (error == Volume::Error::OK) {
+        setJournalHeader(++_journalSequence, _journalCount);
+        error = _rawIO->write(_journalBuffer, _journalBlock, _journalCount + 1);
+    }
+    if (error == Volume::Error::OK) {
+        error = _rawIO->flush();
+    }
+    
+    // The transaction is committed. Now write the blocks home. FAT
+    // blocks go to both FATs, so the second one never needs a replay.
+    uint32_t fatStart = _startFATBlock.value();
+    uint32_t fatEnd = fatStart + _blocksPerFAT;
+    for (uint32_t i = 0; i < _journalCount && error == Volume::Error::OK; ) {
+        uint32_t home = journalHome(i);
+        bool fat = home >= fatStart && home < fatEnd;
+        uint32_t run = 1;
+        while (i + run < _journalCount && journalHome(i + run) == home + run && (home + run < fatEnd) == fat) {
+            ++run;
+        }
+        error = _rawIO->write(journalImage(i), home, run);
+        if (error == Volume::Error::OK && fat) {
+            error = _rawIO->write(journalImage(i), home + _blocksPerFAT, run);
+            _fatStats.mirrorWrites += run;
+        }
+        i += run;
+    }
+    if (error == Volume::Error::OK) {
+        error = _rawIO->flush();
+    }
+    
+    // Mark the journal empty, so the transaction isn't replayed over
+    // blocks which are later reused for file data
+    if (error == Volume::Error::OK) {
+        setJournalHeader(_journalSequence, 0);
+        error = _rawIO->write(_journalBuffer, _journalBlock, 1);
+    }
+    if (error == Volume::Error::OK) {
+        error = _rawIO->flush();
+    }
+    
+    if (error != Volume::Error::OK) {
+        _error = Error::JournalError;
+        return Volume::Error::Failed;
+    }
+    
+    ++_fatStats.journalCommits;
+    _fatStats.journalBlocks += _journalCount;
+    _journalCount = 0;
+    return Volume::Error::OK;
+}
+
+bool FAT32::commitPoint()
+{
+    return !commitNeeded() || commit() == Volume::Error::OK;
+}
+
+bool FAT32::commitNeeded() const
+{
+    if (!journalEnabled()) {
+        return false;
+    }
+    
+    // Dirty FAT blocks join the transaction when it's committed. A block
+    // both in the transaction and dirty is counted twice, which is safe.
+    uint32_t pending = _journalCount + 1;
+    for (uint32_t i = 0; i < _fatCacheBlocks; ++i) {
+        if (_fatCache[i].valid && _fatCache[i].dirty) {
+            ++pending;
+        }
+    }
+    return pending + MaxOperationBlocks > JournalBlocks;
+}
+
+bool FAT32::openJournal()
+{
+    FileInfo fileInfo;
+    if (!findInDirectory(_rootDirectoryStartCluster, JournalName, fileInfo)) {
+        return true;
+    }
+    if (fileInfo.size != JournalFileSize || fileInfo.baseCluster.value() < 2) {
+        _error = Error::JournalError;
+        return false;
+    }
+    
+    if (!_journalBuffer) {
+        _journalBuffer = new char[JournalFileSize];
+    }
+    _journalCluster = fileInfo.baseCluster;
+    _journalBlock = clusterToBlock(_journalCluster);
+    _journalCount = 0;
+    
+    if (_rawIO->read(_journalBuffer, _journalBlock, 1) != Volume::Error::OK) {
+        _error = Error::JournalError;
+        return false;
+    }
+    
+    JournalHeader* header = reinterpret_cast<JournalHeader*>(_journalBuffer);
+    _journalSequence = bufToUInt32(header->sequence);
+    uint32_t count = bufToUInt32(header->count);
+    if (bufToUInt32(header->signature) != JournalSignature || count == 0 || count > JournalBlocks) {
+        return true;
+    }
+    
+    if (_rawIO->read(_journalBuffer, _journalBlock, count + 1) != Volume::Error::OK) {
+        _error = Error::JournalError;
+        return false;
+    }
+    uint32_t checksum = bufToUInt32(header->checksum);
+    uint32ToBuf(0, header->checksum);
+    if (journalChecksum(_journalBuffer, count + 1) != checksum) {
+        // The transaction was never committed, so none of it went home
+        return true;
+    }
+    
+    // Replay the transaction and drop anything read from the device
+    // before it was replayed. Writing the blocks again is harmless if
+    // they had already reached home.
+    _journalCount = count;
+    if (commitJournal() != Volume::Error::OK) {
+        return false;
+    }
+    _fatStats.replayedBlocks += count;
+    
+    for (uint32_t i = 0; i < _fatCacheBlocks; ++i) {
+        _fatCache[i].valid = false;
+    }
+    for (uint32_t i = 0; i < MaxDirectoryIndexes; ++i) {
+        delete _directoryIndexes[i];
+        _directoryIndexes[i] = nullptr;
+    }
+    return true;
+}
+
+Volume::Error FAT32::enableJournal()
+{
+    if (!_mounted) {
+        return Volume::Error::NotMounted;
+    }
+    if (journalEnabled()) {
+        return Volume::Error::OK;
+    }
+    
+    Volume::Error error = create(JournalName);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    // The journal has to be contiguous so a transaction can be written
+    // in one transfer
+    FAT32RawFile* file = static_cast<FAT32RawFile*>(open(JournalName));
+    if (!file) {
+        return Volume::Error::Failed;
+    }
+    
+    error = file->reserve(JournalFileSize);
+    Block first;
+    if (error == Volume::Error::OK) {
+        error = file->logicalToPhysicalBlock(0, first);
+    }
+    for (uint32_t i = 1; i < JournalBlocks + 1 && error == Volume::Error::OK; ++i) {
+        Block physical;
+        error = file->logicalToPhysicalBlock(i, physical);
+        if (error == Volume::Error::OK && physical.value() != first.value() + i) {
+            error = Volume::Error::Failed;
+        }
+    }
+    
+    // Write an empty journal
+    if (error == Volume::Error::OK) {
+        delete [ ] _journalBuffer;
+        _journalBuffer = new char[JournalFileSize];
+        memset(_journalBuffer, 0, JournalFileSize);
+        _journalCount = 0;
+        setJournalHeader(_journalSequence, 0);
+        error = file->write(_journalBuffer, 0, JournalBlocks + 1);
+    }
+    if (error == Volume::Error::OK) {
+        file->setSize(JournalFileSize);
+        error = file->updateSize();
+    }
+    delete file;
+    
+    if (error == Volume::Error::OK) {
+        error = sync();
+    }
+    if (error == Volume::Error::OK) {
+        error = _rawIO->flush();
+    }
+    if (error != Volume::Error::OK) {
+        remove(JournalName);
+        return error;
+    }
+    
+    // Metadata writes go through the journal from now on
+    FileInfo fileInfo;
+    find(fileInfo, JournalName);
+    _journalCluster = fileInfo.baseCluster;
+    _journalBlock = first;
+    return Volume::Error::OK;
+}
+
+Volume::Error FAT32::disableJournal()
+{
+    if (!journalEnabled()) {
+        return Volume::Error::OK;
+    }
+    
+    Volume::Error error = sync();
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    _journalBlock = 0;
+    _journalCluster = 0;
+    delete [ ] _journalBuffer;
+    _journalBuffer = nullptr;
+    return remove(JournalName);
 }
 
 Volume::Error FAT32::mount()
@@ -112,19 +535,19 @@ Volume::Error FAT32::mount()
     }
     
     MBR* mbr = reinterpret_cast<MBR*>(buf);
-
+    
     // Do validation checks
     if (mbr->signature[0] != 0x55 || mbr->signature[1] != 0xaa) {
         _error = Error::BadMBRSignature;
         return Volume::Error::Failed;
     }
-        
+    
     uint8_t partitionType = mbr->partitions[_partition].type;
     if (partitionType != 0x0b && partitionType != 0x0c) {
         _error = Error::OnlyFAT32LBASupported;
         return Volume::Error::Failed;
     }
-
+    
     // Extract the needed values
     _firstBlock = bufToUInt32(mbr->partitions[_partition].lbaStart);
     _sizeInBlocks = bufToUInt32(mbr->partitions[_partition].lbaCount);
@@ -141,7 +564,7 @@ Volume::Error FAT32::mount()
         _error = Error::BadBPBSignature;
         return Volume::Error::Failed;
     }
-            
+    
     if (bufToUInt16(bootBlock->bytesPerBlock) != 512) {
         _error = Error::UnsupportedBlockSize;
         return Volume::Error::Failed;
@@ -170,170 +593,1264 @@ Volume::Error FAT32::mount()
     _startFATBlock = _firstBlock + reservedBlocks;
     _startDataBlock = _startFATBlock + Block(_blocksPerFAT * 2);
     _rootDirectoryStartCluster = bufToUInt32(bootBlock->rootDirectoryStartCluster);
+    _clusterCount = (_sizeInBlocks - (_startDataBlock.value() - _firstBlock.value())) / _blocksPerCluster;
+    
+    // Don't trust a FAT which can't hold all the clusters
+    if (_clusterCount + 2 > _blocksPerFAT * EntriesPerFATBlock) {
+        _clusterCount = _blocksPerFAT * EntriesPerFATBlock - 2;
+    }
+    
+    uint16_t infoBlock = bufToUInt16(bootBlock->infoBlock);
+    
+    // Set up the FAT cache
+    delete [ ] _fatCacheData;
+    _fatCacheData = new char[_fatCacheBlocks * BlockSize];
+    for (uint32_t i = 0; i < _fatCacheBlocks; ++i) {
+        _fatCache[i] = FATCacheEntry();
+        _fatCache[i].buf = _fatCacheData + i * BlockSize;
+    }
+    
+    delete [ ] _fatMirrorPending;
+    uint32_t mirrorWords = (_blocksPerFAT + 31) / 32;
+    _fatMirrorPending = new uint32_t[mirrorWords];
+    memset(_fatMirrorPending, 0, mirrorWords * sizeof(uint32_t));
+    
+    // This has to be done before anything else looks at the FAT or directories
+    if (!openJournal()) {
+        return Volume::Error::Failed;
+    }
+    
+    // Mounting doesn't read the FAT. The free count comes from FSInfo and
+    // the FAT blocks are counted as they're used. A stale count is fixed
+    // once they've all been counted. Without a free count in FSInfo the
+    // whole FAT has to be read to count.
+    initFreeSummary();
+    _fsInfoBlock = 0;
+    _fsInfoNeedsWriting = false;
+    bool haveFreeCount = infoBlock != 0 && infoBlock != 0xffff && readFSInfo(_firstBlock + Block(infoBlock));
+    if (!haveFreeCount && !countFreeClusters()) {
+        return Volume::Error::Failed;
+    }
     
     _mounted = true;
     return Volume::Error::OK;
 }
 
-bool FAT32::readFATBlock(uint32_t block)
+Volume::Error FAT32::format(Volume::RawIO* rawIO, uint32_t sizeInBlocks, uint8_t blocksPerCluster)
 {
-    if (!_fatBufferValid || block != _currentFATBufferAddr) {
-        if (_fatBufferNeedsWriting) {
-            if (!writeFATBlock()) {
-                return false;
-            }
-        }
-        
-        if (rawRead(_fatBuffer, block, 1) != Volume::Error::OK) {
-            _error = Error::FATReadError;
-            return false;
+    // Start the partition on a 1MB boundary, as SD cards come formatted
+    static constexpr uint32_t PartitionStart = 2048;
+    static constexpr uint32_t ReservedBlocks = 32;
+    static constexpr uint32_t BackupBootBlock = 6;
+    static constexpr uint32_t ZeroBlocks = 64;
+    
+    if (blocksPerCluster == 0 || (blocksPerCluster & (blocksPerCluster - 1)) != 0 || blocksPerCluster > 128) {
+        return Volume::Error::Failed;
+    }
+    if (sizeInBlocks <= PartitionStart + ReservedBlocks + 2 * blocksPerCluster) {
+        return Volume::Error::Failed;
+    }
+    uint32_t partitionBlocks = sizeInBlocks - PartitionStart;
+    
+    // The FATs come out of the partition, so size them for the clusters
+    // which are left
+    uint32_t blocksPerFAT = 1;
+    uint32_t clusterCount;
+    while (true) {
+        clusterCount = (partitionBlocks - ReservedBlocks - 2 * blocksPerFAT) / blocksPerCluster;
+        uint32_t needed = ((clusterCount + 2) * sizeof(uint32_t) + BlockSize - 1) / BlockSize;
+        if (needed <= blocksPerFAT) {
+            break;
         }
-        _fatBufferValid = true;
-        _currentFATBufferAddr = block;
+        blocksPerFAT = needed;
     }
-    return true;
+    if (clusterCount < 2) {
+        return Volume::Error::Failed;
+    }
+    
+    char buf[BlockSize] __attribute__((aligned(4)));
+    
+    // MBR
+    memset(buf, 0, BlockSize);
+    MBR* mbr = reinterpret_cast<MBR*>(buf);
+    mbr->partitions[0].type = 0x0c;
+    uint32ToBuf(PartitionStart, mbr->partitions[0].lbaStart);
+    uint32ToBuf(partitionBlocks, mbr->partitions[0].lbaCount);
+    mbr->signature[0] = 0x55;
+    mbr->signature[1] = 0xaa;
+    if (rawIO->write(buf, 0, 1) != Volume::Error::OK) {
+        return Volume::Error::Failed;
+    }
+    
+    // Boot block and its backup
+    memset(buf, 0, BlockSize);
+    BootBlock* bootBlock = reinterpret_cast<BootBlock*>(buf);
+    memcpy(bootBlock->jump, "\xeb\x58\x90", 3);
+    memcpy(bootBlock->oemName, "PLACID  ", 8);
+    uint16ToBuf(BlockSize, bootBlock->bytesPerBlock);
+    bootBlock->blocksPerCluster = blocksPerCluster;
+    uint16ToBuf(ReservedBlocks, bootBlock->reservedBlocks);
+    bootBlock->numberOfFATCopies = 2;
+    bootBlock->mediaDescriptor = 0xf8;
+    uint16ToBuf(63, bootBlock->blocksPerTrack);
+    uint16ToBuf(255, bootBlock->headCount);
+    uint32ToBuf(PartitionStart, bootBlock->totalHiddenBlocks);
+    uint32ToBuf(partitionBlocks, bootBlock->totalBlocks);
+    uint32ToBuf(blocksPerFAT, bootBlock->blocksPerFAT32);
+    uint32ToBuf(2, bootBlock->rootDirectoryStartCluster);
+    uint16ToBuf(1, bootBlock->infoBlock);
+    uint16ToBuf(BackupBootBlock, bootBlock->backupBootBlock);
+    bootBlock->logicalDriveNumber = 0x80;
+    bootBlock->extendedSignature = 0x29;
+    memcpy(bootBlock->volumeName, "NO NAME    ", 11);
+    memcpy(bootBlock->fatName, "FAT32   ", 8);
+    bootBlock->signature[0] = 0x55;
+    bootBlock->signature[1] = 0xaa;
+    if (rawIO->write(buf, PartitionStart, 1) != Volume::Error::OK ||
+            rawIO->write(buf, PartitionStart + BackupBootBlock, 1) != Volume::Error::OK) {
+        return Volume::Error::Failed;
+    }
+    
+    // FSInfo. Cluster 2 is taken by the root directory
+    memset(buf, 0, BlockSize);
+    FSInfo* info = reinterpret_cast<FSInfo*>(buf);
+    uint32ToBuf(FSInfoLeadSignature, info->leadSignature);
+    uint32ToBuf(FSInfoStructSignature, info->structSignature);
+    uint32ToBuf(clusterCount - 1, info->freeCount);
+    uint32ToBuf(3, info->nextFree);
+    uint32ToBuf(FSInfoTrailSignature, info->trailSignature);
+    if (rawIO->write(buf, PartitionStart + 1, 1) != Volume::Error::OK) {
+        return Volume::Error::Failed;
+    }
+    
+    // Clear both FATs and the root directory, which follows them
+    char* zeros = new char[ZeroBlocks * BlockSize];
+    memset(zeros, 0, ZeroBlocks * BlockSize);
+    Block fatStart = PartitionStart + ReservedBlocks;
+    uint32_t remaining = 2 * blocksPerFAT + blocksPerCluster;
+    Volume::Error error = Volume::Error::OK;
+    for (Block block = fatStart; remaining > 0 && error == Volume::Error::OK; ) {
+        uint32_t blocks = (remaining < ZeroBlocks) ? remaining : ZeroBlocks;
+        error = rawIO->write(zeros, block, blocks);
+        block = block + Block(blocks);
+        remaining -= blocks;
+    }
+    delete [ ] zeros;
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    // The first two FAT entries are reserved and the root directory is
+    // a chain of one cluster
+    memset(buf, 0, BlockSize);
+    uint32ToBuf(0x0ffffff8, reinterpret_cast<uint8_t*>(buf));
+    uint32ToBuf(0x0fffffff, reinterpret_cast<uint8_t*>(buf) + 4);
+    uint32ToBuf(0x0fffffff, reinterpret_cast<uint8_t*>(buf) + 8);
+    if (rawIO->write(buf, fatStart, 1) != Volume::Error::OK ||
+            rawIO->write(buf, fatStart + Block(blocksPerFAT), 1) != Volume::Error::OK) {
+        return Volume::Error::Failed;
+    }
+    return rawIO->flush();
 }
 
-bool FAT32::writeFATBlock()
+FAT32::FATCacheEntry* FAT32::fatBlock(uint32_t block)
 {
-    if (!_fatBufferValid || !_fatBufferNeedsWriting) {
-        return true;
+    ++_fatCacheClock;
+    
+    FATCacheEntry* victim = &_fatCache[0];
+    for (uint32_t i = 0; i < _fatCacheBlocks; ++i) {
+        FATCacheEntry* entry = &_fatCache[i];
+        if (entry->valid && entry->block == block) {
+            ++_fatStats.hits;
+            entry->lastUsed = _fatCacheClock;
+            return entry;
+        }
+        
+        if (!entry->valid) {
+            victim = entry;
+        } else if (victim->valid && entry->lastUsed < victim->lastUsed) {
+            victim = entry;
+        }
+    }
+    
+    ++_fatStats.misses;
+    
+    if (victim->valid && victim->dirty) {
+        if (!writeFATBlock(victim)) {
+            return nullptr;
+        }
+    }
+    victim->valid = false;
+    
+    if (rawRead(victim->buf, _startFATBlock + Block(block), 1) != Volume::Error::OK) {
+        _error = Error::FATReadError;
+        return nullptr;
     }
-                
-    _fatBufferNeedsWriting = false;
+    ++_fatStats.reads;
+    if (_fatBlockFreeCount[block] == UncountedFATBlock) {
+        setFreeCount(block, countFreeEntries(block, victim->buf));
+    }
+    
+    victim->block = block;
+    victim->valid = true;
+    victim->dirty = false;
+    victim->lastUsed = _fatCacheClock;
+    return victim;
+}
 
-    // Assume 2 FAT copies
-    if (rawWrite(_fatBuffer, _currentFATBufferAddr, 1) != Volume::Error::OK) {
+bool FAT32::writeFATBlock(FATCacheEntry* entry)
+{
+    if (writeMetadata(entry->buf, _startFATBlock + Block(entry->block), 1) != Volume::Error::OK) {
         _error = Error::FATWriteError;
         return false;
     }
+    ++_fatStats.writes;
+    entry->dirty = false;
+    
+    // With the journal on, the commit writes both FATs
+    if (!journalEnabled()) {
+        setMirrorPending(entry->block);
+    }
+    return true;
+}
 
-    if (rawWrite(_fatBuffer, _currentFATBufferAddr + _blocksPerFAT, 1) != Volume::Error::OK) {
-        _error = Error::FATWriteError;
+bool FAT32::readFATEntry(Cluster cluster, uint32_t& value)
+{
+    FATCacheEntry* entry = fatBlock(cluster.value() * 4 / BlockSize);
+    if (!entry) {
         return false;
     }
-
+    value = bufToUInt32(reinterpret_cast<uint8_t*>(entry->buf + cluster.value() * 4 % BlockSize));
     return true;
 }
 
-FAT32::FATEntryType FAT32::nextClusterFATEntry(Cluster cluster, Cluster& nextCluster)
+bool FAT32::writeFATEntry(Cluster cluster, uint32_t value)
 {
-    uint32_t fatBlockAddr = cluster.value() * 4 / 512 + _startFATBlock.value();
-    uint32_t fatBlockOffset = cluster.value() * 4 % 512;
-    
-    if (!readFATBlock(fatBlockAddr)) {
-        return FATEntryType::Error;
+    FATCacheEntry* entry = fatBlock(cluster.value() * 4 / BlockSize);
+    if (!entry) {
+        return false;
     }
+    uint8_t* p = reinterpret_cast<uint8_t*>(entry->buf + cluster.value() * 4 % BlockSize);
+    bool wasFree = (bufToUInt32(p) & 0x0fffffff) == 0;
+    bool isFree = (value & 0x0fffffff) == 0;
     
-    uint32_t entry = bufToUInt32(reinterpret_cast<uint8_t*>(_fatBuffer + fatBlockOffset));
-    if (entry == 0) {
-        return FATEntryType::Free;
-    }
-    if (entry >= 0x0ffffff8) {
-        return FATEntryType::End;
+    // Keep the free summary in step with the FAT
+    if (wasFree != isFree && cluster.value() >= 2 && cluster.value() <= _clusterCount + 1) {
+        if (isFree) {
+            ++_fatBlockFreeCount[entry->block];
+            ++_freeClusterCount;
+            if (cluster.value() < _nextFreeCluster) {
+                _nextFreeCluster = cluster.value();
+            }
+        } else {
+            --_fatBlockFreeCount[entry->block];
+            --_freeClusterCount;
+        }
+        _fsInfoNeedsWriting = true;
     }
-    nextCluster = entry & 0x0fffffff;
-    return FATEntryType::Normal;
+    
+    uint32ToBuf(value, p);
+    entry->dirty = true;
+    return true;
+}
+
+void FAT32::initFreeSummary()
+{
+    delete [ ] _fatBlockFreeCount;
+    _fatBlockFreeCount = new uint8_t[_blocksPerFAT];
+    
+    // Blocks past the last cluster have no free entries
+    uint32_t fatBlocks = (_clusterCount + 1) / EntriesPerFATBlock + 1;
+    memset(_fatBlockFreeCount, UncountedFATBlock, fatBlocks);
+    memset(_fatBlockFreeCount + fatBlocks, 0, _blocksPerFAT - fatBlocks);
+    _uncountedFATBlocks = fatBlocks;
+    _freeClusterCount = 0;
+    _nextFreeCluster = 2;
+}
+
+uint8_t FAT32::countFreeEntries(uint32_t block, const char* buf) const
+{
+    uint32_t lastCluster = _clusterCount + 1;
+    uint32_t firstCluster = block * EntriesPerFATBlock;
+    uint8_t count = 0;
+    for (uint32_t entry = 0; entry < EntriesPerFATBlock; ++entry) {
+        uint32_t cluster = firstCluster + entry;
+        if (cluster < 2 || cluster > lastCluster) {
+            continue;
+        }
+        if ((bufToUInt32(reinterpret_cast<const uint8_t*>(buf + entry * 4)) & 0x0fffffff) == 0) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+void FAT32::setFreeCount(uint32_t block, uint8_t count)
+{
+    _fatBlockFreeCount[block] = count;
+    if (--_uncountedFATBlocks != 0) {
+        return;
+    }
+    
+    // Everything is counted, so the total is exact now
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < _blocksPerFAT; ++i) {
+        total += _fatBlockFreeCount[i];
+    }
+    if (total != _freeClusterCount) {
+        _freeClusterCount = total;
+        _fsInfoNeedsWriting = true;
+    }
+}
+
+bool FAT32::countFreeClusters()
+{
+    // Read in large chunks, bypassing the FAT cache. Nothing is cached
+    // yet, so the FAT on the card is current.
+    static constexpr uint32_t ChunkBlocks = 16;
+    char* buf = new char[ChunkBlocks * BlockSize];
+    uint32_t fatBlocks = (_clusterCount + 1) / EntriesPerFATBlock + 1;
+    
+    for (uint32_t block = 0; block < fatBlocks && _uncountedFATBlocks; block += ChunkBlocks) {
+        uint32_t blocks = (fatBlocks - block < ChunkBlocks) ? (fatBlocks - block) : ChunkBlocks;
+        if (rawRead(buf, _startFATBlock + Block(block), blocks) != Volume::Error::OK) {
+            delete [ ] buf;
+            _error = Error::FATReadError;
+            return false;
+        }
+        _fatStats.reads += blocks;
+        
+        for (uint32_t i = 0; i < blocks; ++i) {
+            if (_fatBlockFreeCount[block + i] == UncountedFATBlock) {
+                setFreeCount(block + i, countFreeEntries(block + i, buf + i * BlockSize));
+            }
+        }
+    }
+    
+    delete [ ] buf;
+    return true;
+}
+
+bool FAT32::readFSInfo(Block block)
+{
+    char buf[BlockSize] __attribute__((aligned(4)));
+    if (rawRead(buf, block, 1) != Volume::Error::OK) {
+        return false;
+    }
+    
+    FSInfo* info = reinterpret_cast<FSInfo*>(buf);
+    if (bufToUInt32(info->leadSignature) != FSInfoLeadSignature ||
+            bufToUInt32(info->structSignature) != FSInfoStructSignature ||
+            bufToUInt32(info->trailSignature) != FSInfoTrailSignature) {
+        return false;
+    }
+    
+    _fsInfoBlock = block;
+    
+    uint32_t nextFree = bufToUInt32(info->nextFree);
+    if (nextFree >= 2 && nextFree <= _clusterCount + 1) {
+        _nextFreeCluster = nextFree;
+    }
+    
+    uint32_t freeCount = bufToUInt32(info->freeCount);
+    if (freeCount == FSInfoUnknown || freeCount > _clusterCount) {
+        return false;
+    }
+    _freeClusterCount = freeCount;
+    return true;
+}
+
+bool FAT32::writeFSInfo()
+{
+    if (_fsInfoBlock == 0 || !_fsInfoNeedsWriting) {
+        return true;
+    }
+    
+    char buf[BlockSize] __attribute__((aligned(4)));
+    if (rawRead(buf, _fsInfoBlock, 1) != Volume::Error::OK) {
+        return false;
+    }
+    
+    FSInfo* info = reinterpret_cast<FSInfo*>(buf);
+    uint32ToBuf(_freeClusterCount, info->freeCount);
+    uint32ToBuf(_nextFreeCluster, info->nextFree);
+    
+    if (writeMetadata(buf, _fsInfoBlock, 1) != Volume::Error::OK) {
+        return false;
+    }
+    _fsInfoNeedsWriting = false;
+    return true;
+}
+
+Volume::Error FAT32::commit()
+{
+    for (uint32_t i = 0; i < _fatCacheBlocks; ++i) {
+        FATCacheEntry* entry = &_fatCache[i];
+        if (entry->valid && entry->dirty && !writeFATBlock(entry)) {
+            return Volume::Error::Failed;
+        }
+    }
+    
+    if (!writeFSInfo()) {
+        _error = Error::FSInfoWriteError;
+        return Volume::Error::Failed;
+    }
+    return commitJournal();
+}
+
+Volume::Error FAT32::sync()
+{
+    if (!_mounted) {
+        return Volume::Error::NotMounted;
+    }
+    
+    // Write back the first FAT
+    Volume::Error error = commit();
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    // Copy changed blocks to the second FAT, up to MirrorRunBlocks
+    // neighbouring blocks in one write. The first FAT on the device is up
+    // to date now, so a run with any block no longer in the FAT cache is
+    // read back from there.
+    char* buf = nullptr;
+    for (uint32_t block = 0; block < _blocksPerFAT && error == Volume::Error::OK; ) {
+        if (_fatMirrorPending[block / 32] == 0) {
+            block = (block / 32 + 1) * 32;
+            continue;
+        }
+        if (!mirrorPending(block)) {
+            ++block;
+            continue;
+        }
+        
+        uint32_t run = 1;
+        while (run < MirrorRunBlocks && block + run < _blocksPerFAT && mirrorPending(block + run)) {
+            ++run;
+        }
+        if (!buf) {
+            buf = new char[MirrorRunBlocks * BlockSize];
+        }
+        
+        uint32_t cached = 0;
+        for (uint32_t i = 0; i < _fatCacheBlocks; ++i) {
+            if (_fatCache[i].valid && _fatCache[i].block >= block && _fatCache[i].block < block + run) {
+                memcpy(buf + (_fatCache[i].block - block) * BlockSize, _fatCache[i].buf, BlockSize);
+                ++cached;
+            }
+        }
+        if (cached < run) {
+            if (rawRead(buf, _startFATBlock + Block(block), run) != Volume::Error::OK) {
+                _error = Error::FATReadError;
+                error = Volume::Error::Failed;
+                break;
+            }
+            _fatStats.reads += run;
+        }
+        
+        if (rawWrite(buf, _startFATBlock + Block(_blocksPerFAT + block), run) != Volume::Error::OK) {
+            _error = Error::FATWriteError;
+            error = Volume::Error::Failed;
+            break;
+        }
+        _fatStats.mirrorWrites += run;
+        for (uint32_t i = 0; i < run; ++i) {
+            clearMirrorPending(block + i);
+        }
+        block += run;
+    }
+    delete [ ] buf;
+    return error;
+}
+
+FAT32::FATEntryType FAT32::nextClusterFATEntry(Cluster cluster, Cluster& nextCluster)
+{
+    uint32_t entry;
+    if (!readFATEntry(cluster, entry)) {
+        return FATEntryType::Error;
+    }
+    
+    if (entry == 0) {
+        return FATEntryType::Free;
+    }
+    if (entry >= 0x0ffffff8) {
+        return FATEntryType::End;
+    }
+    nextCluster = entry & 0x0fffffff;
+    return FATEntryType::Normal;
+}
+
+Cluster FAT32::allocateCluster(Cluster prev)
+{
+    uint32_t allocated;
+    return allocateClusters(prev, 1, allocated);
+}
+
+Cluster FAT32::allocateClusters(Cluster prev, uint32_t count, uint32_t& allocated)
+{
+    allocated = 0;
+    Cluster firstCluster = 0;
+    uint32_t lastCluster = _clusterCount + 1;
+    bool linked = prev.value() != 0;
+    
+    // Until every FAT block is counted the total is from FSInfo, which may
+    // be stale, so look anyway
+    while (allocated < count && (_freeClusterCount > 0 || _uncountedFATBlocks > 0)) {
+        uint32_t needed = count - allocated;
+        uint32_t runStart = 0;
+        uint32_t runLength = 0;
+        
+        // Grow the file in place if the clusters right after it are free,
+        // even if there aren't enough of them, so it stays contiguous
+        if (prev.value() >= 2 && prev.value() < lastCluster) {
+            uint32_t from = prev.value() + 1;
+            uint32_t to = (needed < lastCluster + 1 - from) ? (from + needed) : (lastCluster + 1);
+            if (!findFreeRun(from, to, needed, runStart, runLength)) {
+                break;
+            }
+            if (runStart != from) {
+                runLength = 0;
+            }
+        }
+        
+        // Otherwise use the best fit on the volume
+        if (runLength == 0 && !findFreeRun(_nextFreeCluster, needed, runStart, runLength)) {
+            break;
+        }
+        if (runLength == 0) {
+            // The search counted every block, so the total is right now
+            break;
+        }
+        if (runLength > needed) {
+            runLength = needed;
+        }
+        if (runLength > MaxAllocationStep) {
+            // The rest goes right after it in the next step
+            runLength = MaxAllocationStep;
+        }
+        
+        uint32_t oldNext = 0x0ffffff8; // By default make this the last cluster in the chain
+        if (prev.value() > 0) {
+            // Insert the run into the FAT chain
+            if (!readFATEntry(prev, oldNext) || !writeFATEntry(prev, runStart)) {
+                break;
+            }
+        }
+        
+        uint32_t runEnd = runStart + runLength;
+        bool failed = false;
+        for (uint32_t cluster = runStart; cluster < runEnd; ++cluster) {
+            if (!writeFATEntry(cluster, (cluster + 1 < runEnd) ? (cluster + 1) : oldNext)) {
+                failed = true;
+                break;
+            }
+        }
+        if (failed) {
+            break;
+        }
+        
+        if (_nextFreeCluster >= runStart && _nextFreeCluster < runEnd) {
+            _nextFreeCluster = (runEnd <= lastCluster) ? runEnd : 2;
+        }
+        
+        if (firstCluster.value() == 0) {
+            firstCluster = runStart;
+        }
+        allocated += runLength;
+        prev = runEnd - 1;
+        
+        if (linked ? !commitPoint() : commitNeeded()) {
+            break;
+        }
+    }
+    
+    // There is no Cluster 0, so check for this on return mean we've run out of disk space
+    return firstCluster;
+}
+
+bool FAT32::RunSearch::endRun()
+{
+    if (currentLength >= count) {
+        if (fitLength == 0 || currentLength < fitLength) {
+            fitStart = currentStart;
+            fitLength = currentLength;
+        }
+    } else if (currentLength > longestLength) {
+        longestStart = currentStart;
+        longestLength = currentLength;
+    }
+    currentLength = 0;
+    return fitLength == count;
+}
+
+bool FAT32::RunSearch::hasCandidate() const
+{
+    if (fitLength || currentLength >= count) {
+        return true;
+    }
+    return !fitsOnly && (longestLength || currentLength);
+}
+
+bool FAT32::RunSearch::done() const
+{
+    if (fitLength == count) {
+        return true;
+    }
+    
+    // Once there's a candidate only look a little further for a better
+    // one. That also ends a long run without walking all of it.
+    if (hasCandidate()) {
+        return blocksSinceCandidate >= CandidateSearchBlocks;
+    }
+    return fitsOnly && blocksSearched >= MaxFitSearchBlocks;
+}
+
+bool FAT32::findFreeRun(uint32_t start, uint32_t count, uint32_t& runStart, uint32_t& runLength)
+{
+    uint32_t lastCluster = _clusterCount + 1;
+    if (start < 2 || start > lastCluster) {
+        start = 2;
+    }
+    
+    // First look for a run which fits. Failing that, take the longest run
+    // near start. A run can't wrap around the end, so each looks in two
+    // pieces.
+    for (bool fitsOnly : { true, false }) {
+        RunSearch search(count, fitsOnly);
+        if (!searchFreeRun(search, start, lastCluster + 1)) {
+            return false;
+        }
+        if (start != 2 && !search.done() && !searchFreeRun(search, 2, start)) {
+            return false;
+        }
+        if (search.fitLength || !fitsOnly) {
+            runStart = search.fitLength ? search.fitStart : search.longestStart;
+            runLength = search.fitLength ? search.fitLength : search.longestLength;
+            return true;
+        }
+    }
+    return true;
+}
+
+bool FAT32::findFreeRun(uint32_t from, uint32_t to, uint32_t count, uint32_t& runStart, uint32_t& runLength)
+{
+    RunSearch search(count, false);
+    if (!searchFreeRun(search, from, to)) {
+        return false;
+    }
+    runStart = search.fitLength ? search.fitStart : search.longestStart;
+    runLength = search.fitLength ? search.fitLength : search.longestLength;
+    return true;
+}
+
+bool FAT32::searchFreeRun(RunSearch& search, uint32_t from, uint32_t to)
+{
+    uint32_t lastCluster = _clusterCount + 1;
+    uint32_t minBlockFree = (search.count < EntriesPerFATBlock) ? search.count : EntriesPerFATBlock;
+    
+    uint32_t cluster = from;
+    while (cluster < to && !search.done()) {
+        uint32_t block = cluster / EntriesPerFATBlock;
+        uint32_t blockEnd = (block + 1) * EntriesPerFATBlock;
+        if (blockEnd > to) {
+            blockEnd = to;
+        }
+        uint8_t freeCount = _fatBlockFreeCount[block];
+        
+        // Full blocks end a run. When looking for a fit, so do blocks with
+        // too few free entries to start one, without reading them.
+        if (freeCount == 0 || (search.fitsOnly && search.currentLength == 0 && freeCount != UncountedFATBlock && freeCount < minBlockFree)) {
+            search.endRun();
+            cluster = blockEnd;
+            continue;
+        }
+        
+        ++search.blocksSearched;
+        if (search.hasCandidate()) {
+            ++search.blocksSinceCandidate;
+        }
+        
+        if (freeCount == EntriesPerFATBlock && (block + 1) * EntriesPerFATBlock - 1 <= lastCluster) {
+            // The whole block is free, no need to read it
+            if (search.currentLength == 0) {
+                search.currentStart = cluster;
+            }
+            search.currentLength += blockEnd - cluster;
+            cluster = blockEnd;
+            continue;
+        }
+        
+        FATCacheEntry* entry = fatBlock(block);
+        if (!entry) {
+            return false;
+        }
+        
+        for ( ; cluster < blockEnd; ++cluster) {
+            uint32_t offset = (cluster - block * EntriesPerFATBlock) * 4;
+            if ((bufToUInt32(reinterpret_cast<uint8_t*>(entry->buf + offset)) & 0x0fffffff) != 0) {
+                if (search.endRun()) {
+                    return true;
+                }
+                continue;
+            }
+            if (search.currentLength == 0) {
+                search.currentStart = cluster;
+            }
+            ++search.currentLength;
+        }
+    }
+    
+    // Runs don't continue from one piece of a search to the next
+    search.endRun();
+    return true;
+}
+
+bool FAT32::freeClusters(Cluster cluster)
+{
+    Cluster nextCluster;
+    uint32_t fatBlock = cluster.value() / EntriesPerFATBlock;
+    
+    while (1) {
+        if (cluster.value() / EntriesPerFATBlock != fatBlock) {
+            fatBlock = cluster.value() / EntriesPerFATBlock;
+            if (!commitPoint()) {
+                return false;
+            }
+        }
+        
+        FATEntryType type = nextClusterFATEntry(cluster, nextCluster);
+        if (type == FATEntryType::Error) {
+            return false;
+        }
+        
+        // Free this cluster
+        if (!writeFATEntry(cluster, 0)) {
+            return false;
+        }
+        
+        if (type == FATEntryType::Normal) {
+            cluster = nextCluster;
+            continue;
+        }
+        
+        return type == FATEntryType::End;
+    }
+}
+
+bool FAT32::find(FileInfo& fileInfo, const char* path)
+{
+    Cluster directory;
+    char leaf[FilenameLength];
+    if (resolvePath(path, directory, leaf) != Volume::Error::OK || leaf[0] == '\0') {
+        return false;
+    }
+    return findInDirectory(directory, leaf, fileInfo);
+}
+
+Volume::Error FAT32::resolvePath(const char* path, Cluster& directory, char* leaf)
+{
+    directory = _rootDirectoryStartCluster;
+    
+    // All paths are relative to the root
+    while (1) {
+        while (*path == '/') {
+            ++path;
+        }
+        
+        const char* end = path;
+        while (*end && *end != '/') {
+            ++end;
+        }
+        
+        uint32_t length = static_cast<uint32_t>(end - path);
+        if (length >= FilenameLength) {
+            return Volume::Error::InvalidName;
+        }
+        memcpy(leaf, path, length);
+        leaf[length] = '\0';
+        
+        while (*end == '/') {
+            ++end;
+        }
+        if (*end == '\0') {
+            return Volume::Error::OK;
+        }
+        
+        Volume::Error error = lookupDirectory(directory, leaf, directory);
+        if (error != Volume::Error::OK) {
+            return error;
+        }
+        path = end;
+    }
+}
+
+FAT32::Dentry& FAT32::dentry(Cluster parent, const char* name)
+{
+    uint32_t h = FAT32DirectoryIndex::hash(name) ^ (parent.value() * 2654435761u);
+    return _dentryCache[h % DentryCacheSize];
+}
+
+Volume::Error FAT32::lookupDirectory(Cluster parent, const char* name, Cluster& directory)
+{
+    if (name[0] == '.' && name[1] == '\0') {
+        directory = parent;
+        return Volume::Error::OK;
+    }
+    if (name[0] == '.' && name[1] == '.' && name[2] == '\0' && parent.value() == _rootDirectoryStartCluster.value()) {
+        directory = parent;
+        return Volume::Error::OK;
+    }
+    
+    bool cacheable = strlen(name) < DentryNameLength;
+    if (cacheable) {
+        Dentry& entry = dentry(parent, name);
+        if (entry.cluster != 0 && entry.parent == parent.value() && FAT32DirectoryIndex::equal(entry.name, name)) {
+            directory = entry.cluster;
+            return Volume::Error::OK;
+        }
+    }
+    
+    FileInfo fileInfo;
+    if (!findInDirectory(parent, name, fileInfo)) {
+        return Volume::Error::FileNotFound;
+    }
+    if (!fileInfo.subdir()) {
+        return Volume::Error::NotADirectory;
+    }
+    
+    // The ".." entry of a directory in the root has a cluster of 0
+    directory = (fileInfo.baseCluster.value() == 0) ? _rootDirectoryStartCluster : fileInfo.baseCluster;
+    
+    if (cacheable) {
+        Dentry& entry = dentry(parent, name);
+        entry.parent = parent.value();
+        entry.cluster = directory.value();
+        strcpy(entry.name, name);
+    }
+    return Volume::Error::OK;
+}
+
+void FAT32::forgetDirectory(Cluster directory)
+{
+    for (Dentry& entry : _dentryCache) {
+        if (entry.cluster == directory.value() || entry.parent == directory.value()) {
+            entry.cluster = 0;
+        }
+    }
+    
+    for (uint32_t i = 0; i < MaxDirectoryIndexes; ++i) {
+        if (_directoryIndexes[i] && _directoryIndexes[i]->directoryCluster().value() == directory.value()) {
+            delete _directoryIndexes[i];
+            _directoryIndexes[i] = nullptr;
+        }
+    }
+}
+
+bool FAT32::findInDirectory(Cluster directoryCluster, const char* name, FileInfo& fileInfo)
+{
+    FAT32DirectoryIndex* index = directoryIndex(directoryCluster);
+    if (!index) {
+        return false;
+    }
+    
+    FAT32DirectoryIndex::Location location;
+    const char* foundName = index->find(name, location);
+    if (!foundName) {
+        return false;
+    }
+    
+    if (!readDirEntry(location.block, location.index, fileInfo)) {
+        return false;
+    }
+    
+    strcpy(fileInfo.name, foundName);
+    fileInfo.directoryCluster = directoryCluster;
+    fileInfo.directorySlot = location.slot;
+    fileInfo.directoryEntries = location.entries;
+    return true;
+}
+
+bool FAT32::readDirEntry(Block block, uint32_t index, FileInfo& fileInfo)
+{
+    // The directory block is almost always in the block cache
+    char buf[BlockSize] __attribute__((aligned(4)));
+    if (rawRead(buf, block, 1) != Volume::Error::OK) {
+        _error = Error::DirReadError;
+        return false;
+    }
+    
+    FATDirEntry* entry = reinterpret_cast<FATDirEntry*>(buf) + index;
+    memcpy(fileInfo.shortName, entry->name, sizeof(fileInfo.shortName));
+    formatShortName(fileInfo.name, entry->name, entry->reserved1);
+    
+    fileInfo.attr = entry->attr;
+    fileInfo.size = bufToUInt32(entry->size);
+    fileInfo.baseCluster = (static_cast<uint32_t>(bufToUInt16(entry->firstClusterHi)) << 16) + 
+                           static_cast<uint32_t>(bufToUInt16(entry->firstClusterLo));
+    fileInfo.directoryBlock = block;
+    fileInfo.directoryBlockIndex = index;
+    fileInfo.directorySlot = 0;
+    fileInfo.directoryEntries = 1;
+    return true;
 }
 
-Cluster FAT32::allocateCluster(Cluster prev)
+FAT32DirectoryIndex* FAT32::directoryIndex(Cluster directoryCluster)
 {
-    Cluster dummyCluster;
-    uint32_t lastCluster = _blocksPerFAT * 512 / sizeof(uint32_t) - 1;
-    
-    for (uint32_t currentCluster = 2; currentCluster <= lastCluster; ++currentCluster) {
-        FATEntryType type = nextClusterFATEntry(currentCluster, dummyCluster);
-        if (type == FATEntryType::Free) {
-            uint32_t oldNext = 0x0ffffff8; // By default make this the last cluster in the chain
-            uint32_t fatBlockAddr;
-            uint32_t fatBlockOffset;
-           
-            if (prev.value() > 0) {
-                // Insert this cluster into the FAT chain
-                fatBlockAddr = prev.value() * 4 / 512 + _startFATBlock.value();
-                fatBlockOffset = prev.value() * 4 % 512;
-                
-                if (!readFATBlock(fatBlockAddr)) {
-                    return 0;
-                }
-                
-                oldNext = bufToUInt32(reinterpret_cast<uint8_t*>(_fatBuffer + fatBlockOffset));
-                uint32ToBuf(currentCluster, reinterpret_cast<uint8_t*>(_fatBuffer + fatBlockOffset));
-                _fatBufferNeedsWriting = true;
-            }
-                
-            fatBlockAddr = currentCluster * 4 / 512 + _startFATBlock.value();
-            fatBlockOffset = currentCluster * 4 % 512;
-                
-            if (!readFATBlock(fatBlockAddr)) {
-                return 0;
-            }
+    ++_directoryIndexClock;
+    
+    uint32_t victim = 0;
+    for (uint32_t i = 0; i < MaxDirectoryIndexes; ++i) {
+        FAT32DirectoryIndex* index = _directoryIndexes[i];
+        if (index && index->directoryCluster().value() == directoryCluster.value()) {
+            _directoryIndexLastUsed[i] = _directoryIndexClock;
+            return index;
+        }
+        
+        if (!_directoryIndexes[victim]) {
+            continue;
+        }
+        if (!index || _directoryIndexLastUsed[i] < _directoryIndexLastUsed[victim]) {
+            victim = i;
+        }
+    }
+    
+    // Build the index from the directory. Files with long names are also
+    // indexed by their 8.3 alias, so the alias is reserved
+    FAT32DirectoryIndex* index = new FAT32DirectoryIndex(directoryCluster);
+    FAT32DirectoryIterator it(this, directoryCluster, true);
+    for ( ; it; it.next()) {
+        const FileInfo& fileInfo = it.fileInfo();
+        FAT32DirectoryIndex::Location location;
+        location.block = fileInfo.directoryBlock.value();
+        location.index = fileInfo.directoryBlockIndex;
+        location.slot = fileInfo.directorySlot;
+        location.entries = fileInfo.directoryEntries;
+        
+        if (fileInfo.directoryEntries > 1) {
+            char alias[13];
+            formatShortName(alias, fileInfo.shortName, 0);
+            index->add(fileInfo.name, alias, location);
+        } else {
+            index->add(fileInfo.name, nullptr, location);
+        }
+    }
+    
+    delete _directoryIndexes[victim];
+    _directoryIndexes[victim] = index;
+    _directoryIndexLastUsed[victim] = _directoryIndexClock;
+    return index;
+}
+
+Volume::Error FAT32::addEntry(Cluster directoryCluster, const char* name, FATDirEntry& entry, FileInfo& fileInfo)
+{
+    FAT32DirectoryIndex* index = directoryIndex(directoryCluster);
+    if (!index) {
+        return Volume::Error::Failed;
+    }
+    
+    uint8_t caseFlags;
+    bool longName = !shortNameFor(name, entry.name, caseFlags);
+    if (longName && !makeShortAlias(index, name, entry.name)) {
+        return Volume::Error::CreationFailure;
+    }
+    entry.reserved1 = longName ? 0 : caseFlags;
+    
+    FATDirEntry entries[MaxLongNameEntries + 1];
+    uint32_t count = 0;
+    
+    if (longName) {
+        // LFN entries go before the 8.3 entry, last part first
+        uint32_t length = static_cast<uint32_t>(strlen(name));
+        uint32_t parts = (length + FATLongNameEntry::CharsPerEntry - 1) / FATLongNameEntry::CharsPerEntry;
+        uint8_t checksum = shortNameChecksum(entry.name);
+        
+        for (uint32_t part = parts; part > 0; --part) {
+            FATLongNameEntry* lfn = reinterpret_cast<FATLongNameEntry*>(&entries[count++]);
+            memset(lfn, 0, sizeof(FATLongNameEntry));
+            lfn->order = static_cast<uint8_t>(part) | ((part == parts) ? FATLongNameEntry::LastPart : 0);
+            lfn->attr = FATAttrLongName;
+            lfn->checksum = checksum;
             
-            uint32ToBuf(oldNext, reinterpret_cast<uint8_t*>(_fatBuffer + fatBlockOffset));
-            _fatBufferNeedsWriting = true;
+            // The name is null terminated if there's room and then padded with 0xffff
+            uint8_t* chars[FATLongNameEntry::CharsPerEntry] = {
+                lfn->name1, lfn->name1 + 2, lfn->name1 + 4, lfn->name1 + 6, lfn->name1 + 8,
+                lfn->name2, lfn->name2 + 2, lfn->name2 + 4, lfn->name2 + 6, lfn->name2 + 8, lfn->name2 + 10,
+                lfn->name3, lfn->name3 + 2
+            };
             
-            if (!writeFATBlock()) {
-                return 0;
+            uint32_t position = (part - 1) * FATLongNameEntry::CharsPerEntry;
+            for (uint32_t i = 0; i < FATLongNameEntry::CharsPerEntry; ++i, ++position) {
+                uint16_t c = (position < length) ? static_cast<uint8_t>(name[position]) : ((position == length) ? 0 : 0xffff);
+                uint16ToBuf(c, chars[i]);
             }
-            
-            return currentCluster;
         }
     }
+    entries[count++] = entry;
     
-    // There is no Cluster 0, so check for this on return mean we've run out of disk space
-    return 0;
+    uint32_t slot;
+    if (!findFreeEntries(directoryCluster, count, slot)) {
+        return Volume::Error::Failed;
+    }
+    
+    Block block;
+    uint32_t blockIndex;
+    Volume::Error error = writeDirEntries(directoryCluster, slot, entries, count, block, blockIndex);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    if (index->searchStart() == slot) {
+        index->setSearchStart(slot + count);
+    }
+    
+    FAT32DirectoryIndex::Location location;
+    location.block = block.value();
+    location.index = blockIndex;
+    location.slot = slot;
+    location.entries = count;
+    
+    char alias[13];
+    formatShortName(alias, entry.name, entry.reserved1);
+    index->add(longName ? name : alias, longName ? alias : nullptr, location);
+    
+    fileInfo.directoryCluster = directoryCluster;
+    fileInfo.directoryBlock = block;
+    fileInfo.directoryBlockIndex = blockIndex;
+    fileInfo.directorySlot = slot;
+    fileInfo.directoryEntries = count;
+    return Volume::Error::OK;
 }
 
-bool FAT32::freeClusters(Cluster cluster)
+bool FAT32::findFreeEntries(Cluster directoryCluster, uint32_t count, uint32_t& slot)
 {
-    Cluster nextCluster;
+    FAT32DirectoryIndex* index = directoryIndex(directoryCluster);
+    if (!index) {
+        return false;
+    }
     
-    while (1) {
-        FATEntryType type = nextClusterFATEntry(cluster, nextCluster);
-        if (type == FATEntryType::Error) {
+    FAT32RawFile directory(this, directoryCluster, 0);
+    char buf[BlockSize] __attribute__((aligned(4)));
+    
+    uint32_t runStart = 0;
+    uint32_t runLength = 0;
+    bool sawFree = false;
+    
+    for (uint32_t block = index->searchStart() / FAT32DirectoryIterator::EntriesPerBlock; ; ++block) {
+        Volume::Error error = directory.read(buf, block, 1);
+        if (error == Volume::Error::EndOfFile) {
+            // Everything from here on is free once the directory is extended
+            slot = runLength ? runStart : block * FAT32DirectoryIterator::EntriesPerBlock;
+            if (!sawFree) {
+                index->setSearchStart(slot);
+            }
+            return true;
+        }
+        if (error != Volume::Error::OK) {
+            _error = Error::DirReadError;
             return false;
         }
-  
-        // Free this cluster
-        uint32_t fatBlockOffset = cluster.value() * 4 % 512;
-        uint32ToBuf(0, reinterpret_cast<uint8_t*>(_fatBuffer + fatBlockOffset));
-        _fatBufferNeedsWriting = true;
+        
+        for (uint32_t i = 0; i < FAT32DirectoryIterator::EntriesPerBlock; ++i) {
+            uint32_t current = block * FAT32DirectoryIterator::EntriesPerBlock + i;
+            if (current < index->searchStart()) {
+                continue;
+            }
+            
+            const FATDirEntry* entry = reinterpret_cast<FATDirEntry*>(buf) + i;
+            if (entry->name[0] == '\0') {
+                // End of the directory. All the entries after this are free
+                slot = runLength ? runStart : current;
+                if (!sawFree) {
+                    index->setSearchStart(slot);
+                }
+                return true;
+            }
+            
+            if (static_cast<uint8_t>(entry->name[0]) != 0xe5) {
+                runLength = 0;
+                continue;
+            }
+            
+            if (!sawFree) {
+                sawFree = true;
+                index->setSearchStart(current);
+            }
+            if (runLength++ == 0) {
+                runStart = current;
+            }
+            if (runLength == count) {
+                slot = runStart;
+                return true;
+            }
+        }
+    }
+}
 
-        if (type == FATEntryType::Normal) {
-            cluster = nextCluster;
-            continue;
+Volume::Error FAT32::writeDirEntries(Cluster directoryCluster, uint32_t slot, const FATDirEntry* entries, uint32_t count, Block& block, uint32_t& index)
+{
+    FAT32RawFile directory(this, directoryCluster, 0);
+    char buf[BlockSize] __attribute__((aligned(4)));
+    
+    while (count > 0) {
+        Block logicalBlock = slot / FAT32DirectoryIterator::EntriesPerBlock;
+        Volume::Error error = directory.read(buf, logicalBlock, 1);
+        if (error == Volume::Error::EndOfFile) {
+            // Extend the directory with a cleared cluster
+            error = directory.insertCluster();
+            if (error != Volume::Error::OK) {
+                return error;
+            }
+            
+            // The new cluster starts at logicalBlock
+            Block physicalBlock;
+            error = directory.logicalToPhysicalBlock(logicalBlock, physicalBlock);
+            if (error == Volume::Error::OK) {
+                error = clearBlocks(physicalBlock, _blocksPerCluster);
+            }
+            if (error != Volume::Error::OK) {
+                return error;
+            }
+            memset(buf, 0, sizeof(buf));
+        } else if (error != Volume::Error::OK) {
+            return error;
         }
         
-        if (!writeFATBlock()) {
-            return false;
+        uint32_t i = slot % FAT32DirectoryIterator::EntriesPerBlock;
+        for ( ; i < FAT32DirectoryIterator::EntriesPerBlock && count > 0; ++i, ++slot, ++entries, --count) {
+            memcpy(reinterpret_cast<FATDirEntry*>(buf) + i, entries, sizeof(FATDirEntry));
+        }
+        
+        error = directory.write(buf, logicalBlock, 1);
+        if (error != Volume::Error::OK) {
+            return error;
+        }
+        
+        if (count == 0) {
+            index = i - 1;
+            return directory.logicalToPhysicalBlock(logicalBlock, block);
         }
-        return type == FATEntryType::End;
     }
+    return Volume::Error::OK;
 }
 
-bool FAT32::find(FileInfo& fileInfo, const char* name)
+Volume::Error FAT32::deleteDirEntries(Cluster directoryCluster, uint32_t slot, uint32_t count)
 {
-    // Convert the incoming filename to 8.3 and then compare all 11 characters
-    char nameToFind[12];
-    convertTo8dot3(nameToFind, name);
+    FAT32RawFile directory(this, directoryCluster, 0);
+    char buf[BlockSize] __attribute__((aligned(4)));
     
-    FAT32DirectoryIterator it = FAT32DirectoryIterator(this, "/");
-    for ( ; it; it.next()) {
-        char testName[12];
-        convertTo8dot3(testName, it.name());
-        if (memcmp(nameToFind, testName, 11) == 0) {
-            memcpy(&fileInfo, &it.fileInfo(), sizeof(FileInfo));
-            return true;
+    FAT32DirectoryIndex* index = directoryIndex(directoryCluster);
+    if (index && slot < index->searchStart()) {
+        index->setSearchStart(slot);
+    }
+    
+    while (count > 0) {
+        Block logicalBlock = slot / FAT32DirectoryIterator::EntriesPerBlock;
+        Volume::Error error = directory.read(buf, logicalBlock, 1);
+        if (error != Volume::Error::OK) {
+            return error;
+        }
+        
+        uint32_t i = slot % FAT32DirectoryIterator::EntriesPerBlock;
+        for ( ; i < FAT32DirectoryIterator::EntriesPerBlock && count > 0; ++i, ++slot, --count) {
+            reinterpret_cast<FATDirEntry*>(buf)[i].name[0] = 0xe5;
+        }
+        
+        error = directory.write(buf, logicalBlock, 1);
+        if (error != Volume::Error::OK) {
+            return error;
         }
     }
+    return Volume::Error::OK;
+}
+
+Volume::Error FAT32::clearBlocks(Block block, uint32_t count)
+{
+    char buf[BlockSize] __attribute__((aligned(4)));
+    memset(buf, 0, sizeof(buf));
     
-    // No match
-    return false;
+    // The blocks are in a cluster which was just allocated, so like file
+    // data they can go around the journal
+    for (uint32_t i = 0; i < count; ++i) {
+        Volume::Error error = rawWrite(buf, block + Block(i), 1);
+        if (error != Volume::Error::OK) {
+            return error;
+        }
+    }
+    return Volume::Error::OK;
 }
+
+Volume::Error FAT32::renameEntry(Cluster& directoryCluster, Block& block, uint32_t& index, const char* to)
+{
+    Operation operation(this);
+    Cluster toDirectory;
+    char leaf[FilenameLength];
+    Volume::Error error = resolvePath(to, toDirectory, leaf);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    if (!validName(leaf)) {
+        return Volume::Error::InvalidName;
+    }
+    
+    // First make sure to does not exist
+    FileInfo fileInfo;
+    if (findInDirectory(toDirectory, leaf, fileInfo)) {
+        return Volume::Error::FileExists;
+    }
+    
+    // Find the entries used by the current name through its 8.3 name
+    char buf[BlockSize] __attribute__((aligned(4)));
+    error = rawRead(buf, block, 1);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    FATDirEntry entry = reinterpret_cast<FATDirEntry*>(buf)[index];
+    char shortName[13];
+    formatShortName(shortName, entry.name, entry.reserved1);
+    
+    FAT32DirectoryIndex* fromIndex = directoryIndex(directoryCluster);
+    FAT32DirectoryIndex::Location location;
+    if (!fromIndex || !fromIndex->find(shortName, location)) {
+        return Volume::Error::InternalError;
+    }
+    
+    // Add the new entry before removing the old one
+    error = addEntry(toDirectory, leaf, entry, fileInfo);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    error = deleteDirEntries(directoryCluster, location.slot, location.entries);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
     
+    // The index may have been evicted while adding the new entry
+    fromIndex = directoryIndex(directoryCluster);
+    if (fromIndex) {
+        fromIndex->remove(shortName);
+    }
+    
+    directoryCluster = toDirectory;
+    block = fileInfo.directoryBlock;
+    index = fileInfo.directoryBlockIndex;
+    return Volume::Error::OK;
+}
+
 DirectoryIterator* FAT32::directoryIterator(const char* path)
 {
-    FAT32DirectoryIterator* it = new FAT32DirectoryIterator(this, path);
+    Cluster directory;
+    char leaf[FilenameLength];
+    if (resolvePath(path, directory, leaf) != Volume::Error::OK) {
+        return nullptr;
+    }
+    if (leaf[0] != '\0' && lookupDirectory(directory, leaf, directory) != Volume::Error::OK) {
+        return nullptr;
+    }
+    
+    FAT32DirectoryIterator* it = new FAT32DirectoryIterator(this, directory);
     return it;
 }
 
@@ -350,12 +1867,14 @@ const char* FAT32::errorDetail(Volume::Error error) const
     case Error::BPBReadError:           return "BPB read error";
     case Error::FATReadError:           return "FAT read error";
     case Error::FATWriteError:          return "FAT write error";
+    case Error::FSInfoWriteError:       return "FSInfo write error";
     case Error::DirReadError:           return "dir read error";
     case Error::OnlyFAT32LBASupported:  return "only FAT32 LBA supported";
     case Error::InvalidFAT32Volume:     return "invalid FAT32 volume";
     case Error::WrongSizeRead:          return "wrong size read";
     case Error::WrongSizeWrite:         return "wrong size write";
     case Error::Incomplete:             return "incomplete";
+    case Error::JournalError:           return "journal error";
     default:                            return Volume::errorDetail(error);
     }
 }
@@ -367,48 +1886,150 @@ RawFile* FAT32::open(const char* name)
     }
     
     FileInfo fileInfo;
-    if (!find(fileInfo, name)) {
+    if (!find(fileInfo, name) || fileInfo.subdir()) {
         return nullptr;
     }
     
-    return new FAT32RawFile(this, fileInfo.baseCluster, fileInfo.size, fileInfo.directoryBlock, fileInfo.directoryBlockIndex);
+    return new FAT32RawFile(this, fileInfo.baseCluster, fileInfo.size, fileInfo.directoryBlock, fileInfo.directoryBlockIndex, fileInfo.directoryCluster);
 }
 
 Volume::Error FAT32::create(const char* name)
 {
-    // Find an empty directory entry
-    FAT32DirectoryIterator it = FAT32DirectoryIterator(this, "/");
+    Cluster directory;
+    char leaf[FilenameLength];
+    Operation operation(this);
+    Volume::Error error = resolvePath(name, directory, leaf);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    if (!validName(leaf)) {
+        return Volume::Error::InvalidName;
+    }
     
-    while (1) {
-        if (it.deleted() || !it) {
-            // Create an initial cluster
-            Cluster cluster = allocateCluster();
-            it.createEntry(name, 0, cluster);
-            return Volume::Error::OK;
-        }
-        it.rawNext(true);
+    FileInfo fileInfo;
+    if (findInDirectory(directory, leaf, fileInfo)) {
+        return Volume::Error::FileExists;
+    }
+    
+    // Create an initial cluster
+    Cluster cluster = allocateCluster();
+    if (cluster.value() == 0) {
+        return Volume::Error::Failed;
+    }
+    
+    FATDirEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    uint16ToBuf(cluster.value() >> 16, entry.firstClusterHi);
+    uint16ToBuf(cluster.value(), entry.firstClusterLo);
+    
+    error = addEntry(directory, leaf, entry, fileInfo);
+    if (error != Volume::Error::OK) {
+        freeClusters(cluster);
+    }
+    return error;
+}
+
+Volume::Error FAT32::createDirectory(const char* name)
+{
+    Cluster parent;
+    char leaf[FilenameLength];
+    Operation operation(this);
+    Volume::Error error = resolvePath(name, parent, leaf);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    if (!validName(leaf)) {
+        return Volume::Error::InvalidName;
+    }
+    
+    FileInfo fileInfo;
+    if (findInDirectory(parent, leaf, fileInfo)) {
+        return Volume::Error::FileExists;
+    }
+    
+    Cluster cluster = allocateCluster();
+    if (cluster.value() == 0) {
+        return Volume::Error::Failed;
+    }
+    
+    // A new directory has "." and ".." entries. The ".." entry of a
+    // directory in the root has a cluster of 0
+    error = clearBlocks(clusterToBlock(cluster), _blocksPerCluster);
+    if (error == Volume::Error::OK) {
+        FATDirEntry dots[2];
+        memset(dots, 0, sizeof(dots));
+        memset(dots[0].name, ' ', sizeof(dots[0].name));
+        memset(dots[1].name, ' ', sizeof(dots[1].name));
+        dots[0].name[0] = '.';
+        dots[1].name[0] = '.';
+        dots[1].name[1] = '.';
+        dots[0].attr = FATAttrDirectory;
+        dots[1].attr = FATAttrDirectory;
+        
+        uint32_t parentCluster = (parent.value() == _rootDirectoryStartCluster.value()) ? 0 : parent.value();
+        uint16ToBuf(cluster.value() >> 16, dots[0].firstClusterHi);
+        uint16ToBuf(cluster.value(), dots[0].firstClusterLo);
+        uint16ToBuf(parentCluster >> 16, dots[1].firstClusterHi);
+        uint16ToBuf(parentCluster, dots[1].firstClusterLo);
+        
+        Block block;
+        uint32_t index;
+        error = writeDirEntries(cluster, 0, dots, 2, block, index);
+    }
+    
+    if (error == Volume::Error::OK) {
+        FATDirEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.attr = FATAttrDirectory;
+        uint16ToBuf(cluster.value() >> 16, entry.firstClusterHi);
+        uint16ToBuf(cluster.value(), entry.firstClusterLo);
+        error = addEntry(parent, leaf, entry, fileInfo);
     }
+    
+    if (error != Volume::Error::OK) {
+        freeClusters(cluster);
+    }
+    return error;
 }
 
 Volume::Error FAT32::remove(const char* name)
 {
-    // Convert the incoming filename to 8.3 and then compare all 11 characters
-    char nameToFind[12];
-    convertTo8dot3(nameToFind, name);
+    Operation operation(this);
+    FileInfo fileInfo;
+    if (!find(fileInfo, name)) {
+        return Volume::Error::FileNotFound;
+    }
     
-    FAT32DirectoryIterator it = FAT32DirectoryIterator(this, "/");
-    for ( ; it; it.next()) {
-        char testName[12];
-        convertTo8dot3(testName, it.name());
-        if (memcmp(nameToFind, testName, 11) == 0) {
-            freeClusters(it.baseCluster());
-            it.deleteEntry();
-            return Volume::Error::OK;
+    if (fileInfo.shortName[0] == '.') {
+        // Can't remove "." or ".."
+        return Volume::Error::InvalidName;
+    }
+    
+    if (journalEnabled() && fileInfo.baseCluster.value() == _journalCluster.value()) {
+        // The journal is removed with disableJournal
+        return Volume::Error::InvalidName;
+    }
+    
+    if (fileInfo.subdir()) {
+        FAT32DirectoryIterator it(this, fileInfo.baseCluster);
+        if (it) {
+            return Volume::Error::DirectoryNotEmpty;
         }
+        forgetDirectory(fileInfo.baseCluster);
+    }
+    
+    // Unlink the chain before freeing it, so a commit while a long chain
+    // is being freed can't leave an entry pointing at free clusters
+    Volume::Error error = deleteDirEntries(fileInfo.directoryCluster, fileInfo.directorySlot, fileInfo.directoryEntries);
+    if (error != Volume::Error::OK) {
+        return error;
     }
+    directoryIndex(fileInfo.directoryCluster)->remove(fileInfo.name);
     
-    // No match
-    return Volume::Error::FileNotFound;
+    if (fileInfo.baseCluster.value() != 0) {
+        freeClusters(fileInfo.baseCluster);
+    }
+    return Volume::Error::OK;
 }
 
 bool FAT32::exists(const char* name)
@@ -417,47 +2038,205 @@ bool FAT32::exists(const char* name)
     return find(dummy, name);
 }
 
-void FAT32::convertTo8dot3(char* name8dot3, const char* name)
+bool FAT32::fileID(const char* name, uint64_t& id)
 {
-    // Find the dot
-    int dot = 0;
-    const char* p = name;
-    while (*p) {
-        if (*p == '.') {
-            dot = static_cast<int>(p - name);
-            break;
+    // This only needs the directory index, so there's no I/O for a
+    // directory that was searched recently
+    Cluster directory;
+    char leaf[FilenameLength];
+    if (resolvePath(name, directory, leaf) != Volume::Error::OK || leaf[0] == '\0') {
+        return false;
+    }
+    
+    FAT32DirectoryIndex* index = directoryIndex(directory);
+    FAT32DirectoryIndex::Location location;
+    if (!index || !index->find(leaf, location)) {
+        return false;
+    }
+    id = directoryEntryID(location.block, location.index);
+    return true;
+}
+
+void FAT32::formatShortName(char* name, const char* name11, uint8_t caseFlags)
+{
+    uint32_t j = 0;
+    for (uint32_t i = 0; i < 8 && name11[i] != ' '; ++i) {
+        name[j++] = (caseFlags & FATCaseLowerBase) ? toLower(name11[i]) : name11[i];
+    }
+    
+    if (name11[8] != ' ') {
+        name[j++] = '.';
+        for (uint32_t i = 8; i < 11 && name11[i] != ' '; ++i) {
+            name[j++] = (caseFlags & FATCaseLowerExt) ? toLower(name11[i]) : name11[i];
+        }
+    }
+    name[j] = '\0';
+}
+
+uint8_t FAT32::shortNameChecksum(const char* name11)
+{
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < 11; ++i) {
+        sum = static_cast<uint8_t>(((sum & 1) << 7) + (sum >> 1) + static_cast<uint8_t>(name11[i]));
+    }
+    return sum;
+}
+
+static bool validLongNameChar(uint8_t c)
+{
+    if (c < 0x20) {
+        return false;
+    }
+    switch (c) {
+    case '"': case '*': case '/': case ':': case '<': case '>': case '?': case '\\': case '|': case 0x7f:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static bool validShortNameChar(uint8_t c)
+{
+    if (!validLongNameChar(c) || c == ' ' || c == '.') {
+        return false;
+    }
+    switch (c) {
+    case '+': case ',': case ';': case '=': case '[': case ']':
+        return false;
+    default:
+        return true;
+    }
+}
+
+bool FAT32::validName(const char* name)
+{
+    uint32_t length = static_cast<uint32_t>(strlen(name));
+    if (length == 0 || length >= FilenameLength) {
+        return false;
+    }
+    
+    // "." and "..", and names ending in a dot or space aren't allowed
+    if (name[length - 1] == '.' || name[length - 1] == ' ') {
+        return false;
+    }
+    
+    for (uint32_t i = 0; i < length; ++i) {
+        if (!validLongNameChar(name[i])) {
+            return false;
         }
-        p++;
-        dot++;
-    }
-    
-    if (dot <= 8) {
-        // We have the simple case
-        int index = 0;
-        for (int i = 0; i < 8; ++i) {
-            name8dot3[i] = (index < dot) ? toUpper(name[index++]) : ' ';
-        }
-    } else {
-        // We need to add '~1'
-        for (int i = 0; i < 8; ++i) {
-            if (i < 6) {
-                name8dot3[i] = toUpper(name[i]);
-            } else if (i == 6) {
-                name8dot3[i] = '~';
-            } else {
-                name8dot3[i] = '1';
+    }
+    return true;
+}
+
+bool FAT32::shortNameFor(const char* name, char* name11, uint8_t& caseFlags)
+{
+    memset(name11, ' ', 11);
+    caseFlags = 0;
+    
+    // 8.3 names have a base of 1 to 8 characters and an optional extension of
+    // 1 to 3 characters. The base and extension can each be all upper or all
+    // lower case, which is recorded in the case flags.
+    bool sawUpper = false;
+    bool sawLower = false;
+    uint32_t length = 0;
+    uint32_t limit = 8;
+    char* p = name11;
+    
+    for (const char* s = name; ; ++s) {
+        if (*s == '.' || *s == '\0') {
+            if (length == 0 || (sawUpper && sawLower)) {
+                return false;
+            }
+            if (sawLower) {
+                caseFlags |= (limit == 8) ? FATCaseLowerBase : FATCaseLowerExt;
             }
+            if (*s == '\0') {
+                return true;
+            }
+            if (limit == 3) {
+                // Only one dot allowed
+                return false;
+            }
+            
+            p = name11 + 8;
+            limit = 3;
+            length = 0;
+            sawUpper = false;
+            sawLower = false;
+            continue;
+        }
+        
+        uint8_t c = static_cast<uint8_t>(*s);
+        if (!validShortNameChar(c) || length >= limit) {
+            return false;
         }
+        
+        sawUpper |= isUpper(c);
+        sawLower |= isLower(c);
+        p[length++] = toUpper(c);
     }
+}
 
-    // Now add the extension
-    if (name[dot] == '.') {
-        dot++;
+bool FAT32::makeShortAlias(FAT32DirectoryIndex* index, const char* name, char* name11)
+{
+    // Use the characters from the name which are valid in an 8.3 name, up to
+    // the last dot for the base and after it for the extension
+    const char* lastDot = nullptr;
+    for (const char* s = name; *s; ++s) {
+        if (*s == '.') {
+            lastDot = s;
+        }
     }
     
-    for (int i = 8; i < 11; ++i) {
-        name8dot3[i] = name[dot] ? toUpper(name[dot++]) : ' ';
+    char base[8];
+    uint32_t baseLength = 0;
+    for (const char* s = name; *s && s != lastDot && baseLength < 8; ++s) {
+        uint8_t c = static_cast<uint8_t>(*s);
+        if (c == ' ' || c == '.') {
+            continue;
+        }
+        base[baseLength++] = validShortNameChar(c) ? toUpper(c) : '_';
+    }
+    
+    memset(name11, ' ', 11);
+    if (lastDot) {
+        uint32_t extLength = 0;
+        for (const char* s = lastDot + 1; *s && extLength < 3; ++s) {
+            uint8_t c = static_cast<uint8_t>(*s);
+            if (c == ' ') {
+                continue;
+            }
+            name11[8 + extLength++] = validShortNameChar(c) ? toUpper(c) : '_';
+        }
     }
     
-    name8dot3[11] = '\0';
+    // Add the first ~N which isn't already used
+    for (uint32_t n = 1; n < 1000000; ++n) {
+        char suffix[8];
+        uint32_t suffixLength = 0;
+        for (uint32_t value = n; value; value /= 10) {
+            suffix[suffixLength++] = '0' + value % 10;
+        }
+        suffix[suffixLength++] = '~';
+        
+        uint32_t keep = 8 - suffixLength;
+        if (keep > baseLength) {
+            keep = baseLength;
+        }
+        memcpy(name11, base, keep);
+        for (uint32_t i = 0; i < suffixLength; ++i) {
+            name11[keep + i] = suffix[suffixLength - 1 - i];
+        }
+        for (uint32_t i = keep + suffixLength; i < 8; ++i) {
+            name11[i] = ' ';
+        }
+        
+        char alias[13];
+        formatShortName(alias, name11, 0);
+        FAT32DirectoryIndex::Location location;
+        if (!index->find(alias, location)) {
+            return true;
+        }
+    }
+    return false;
 }
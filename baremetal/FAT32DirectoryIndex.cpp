@@ -0,0 +1,177 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "bare.h"
+
+#include "bare/FAT32DirectoryIndex.h"
+
+using namespace bare;
+
+static constexpr uint32_t InitialBuckets = 16;
+
+uint32_t FAT32DirectoryIndex::hash(const char* name)
+{
+    // FNV-1a of the upper cased name
+    uint32_t h = 2166136261u;
+    for ( ; *name; ++name) {
+        h ^= toUpper(static_cast<uint8_t>(*name));
+        h *= 16777619u;
+    }
+    return h;
+}
+
+bool FAT32DirectoryIndex::equal(const char* a, const char* b)
+{
+    for ( ; *a && *b; ++a, ++b) {
+        if (toUpper(static_cast<uint8_t>(*a)) != toUpper(static_cast<uint8_t>(*b))) {
+            return false;
+        }
+    }
+    return *a == *b;
+}
+
+void FAT32DirectoryIndex::rehash(uint32_t bucketCount)
+{
+    _buckets.assign(bucketCount, None);
+    for (uint32_t i = 0; i < _entries.size(); ++i) {
+        Entry& entry = _entries[i];
+        if (entry.name == None) {
+            // On the free list
+            continue;
+        }
+        uint32_t b = bucket(&_names[entry.name]);
+        entry.next = _buckets[b];
+        _buckets[b] = i;
+    }
+}
+
+void FAT32DirectoryIndex::compact()
+{
+    std::vector<char> names;
+    names.reserve(_names.size() - _deadNameBytes);
+    for (Entry& entry : _entries) {
+        if (entry.name == None) {
+            continue;
+        }
+        const char* name = &_names[entry.name];
+        entry.name = static_cast<uint32_t>(names.size());
+        names.insert(names.end(), name, name + strlen(name) + 1);
+    }
+    _names.swap(names);
+    _deadNameBytes = 0;
+}
+
+uint32_t FAT32DirectoryIndex::insert(const char* name, const Location& location)
+{
+    if (_buckets.empty()) {
+        _buckets.assign(InitialBuckets, None);
+    } else if (_count >= _buckets.size()) {
+        // Keep the load factor at or below 1
+        rehash(static_cast<uint32_t>(_buckets.size()) * 2);
+    }
+    
+    uint32_t i;
+    if (_freeList != None) {
+        i = _freeList;
+        _freeList = _entries[i].next;
+    } else {
+        i = static_cast<uint32_t>(_entries.size());
+        _entries.push_back(Entry());
+    }
+    
+    Entry& entry = _entries[i];
+    entry.name = static_cast<uint32_t>(_names.size());
+    _names.insert(_names.end(), name, name + strlen(name) + 1);
+    entry.partner = None;
+    entry.alias = false;
+    entry.location = location;
+    
+    uint32_t b = bucket(name);
+    entry.next = _buckets[b];
+    _buckets[b] = i;
+    ++_count;
+    return i;
+}
+
+void FAT32DirectoryIndex::add(const char* name, const char* alias, const Location& location)
+{
+    uint32_t i = insert(name, location);
+    if (alias) {
+        uint32_t aliasIndex = insert(alias, location);
+        _entries[i].partner = aliasIndex;
+        _entries[aliasIndex].partner = i;
+        _entries[aliasIndex].alias = true;
+    }
+}
+
+const char* FAT32DirectoryIndex::find(const char* name, Location& location) const
+{
+    if (_buckets.empty()) {
+        return nullptr;
+    }
+    
+    for (uint32_t i = _buckets[bucket(name)]; i != None; i = _entries[i].next) {
+        const Entry& entry = _entries[i];
+        if (equal(&_names[entry.name], name)) {
+            location = entry.location;
+            
+            // If this is the alias of a long name, return the long name
+            if (entry.alias) {
+                return &_names[_entries[entry.partner].name];
+            }
+            return &_names[entry.name];
+        }
+    }
+    return nullptr;
+}
+
+void FAT32DirectoryIndex::unlink(uint32_t i)
+{
+    Entry& entry = _entries[i];
+    uint32_t* link = &_buckets[bucket(&_names[entry.name])];
+    while (*link != i) {
+        link = &_entries[*link].next;
+    }
+    *link = entry.next;
+    
+    _deadNameBytes += strlen(&_names[entry.name]) + 1;
+    entry.name = None;
+    entry.next = _freeList;
+    _freeList = i;
+    --_count;
+}
+
+bool FAT32DirectoryIndex::remove(const char* name)
+{
+    if (_buckets.empty()) {
+        return false;
+    }
+    
+    for (uint32_t i = _buckets[bucket(name)]; i != None; i = _entries[i].next) {
+        if (!equal(&_names[_entries[i].name], name)) {
+            continue;
+        }
+        
+        uint32_t partner = _entries[i].partner;
+        unlink(i);
+        if (partner != None) {
+            unlink(partner);
+        }
+        
+        // Don't let the names of removed entries pile up
+        if (_deadNameBytes > 1024 && _deadNameBytes > _names.size() / 2) {
+            compact();
+        }
+        return true;
+    }
+    return false;
+}
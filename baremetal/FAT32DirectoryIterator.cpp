@@ -14,51 +14,49 @@
 
 #include "bare/FAT32DirectoryIterator.h"
 
+#include "bare/ObjectCache.h"
+
 using namespace bare;
 
-FAT32DirectoryIterator::FAT32DirectoryIterator(FAT32* fs, const char* path)
+static ObjectCache<FAT32DirectoryIterator> directoryIteratorCache("FAT32DirectoryIterator");
+
+void* FAT32DirectoryIterator::operator new(size_t size)
+{
+    return (size == sizeof(FAT32DirectoryIterator)) ? directoryIteratorCache.alloc() : ::operator new(size);
+}
+
+void FAT32DirectoryIterator::operator delete(void* p, size_t size)
+{
+    if (size == sizeof(FAT32DirectoryIterator)) {
+        directoryIteratorCache.free(static_cast<FAT32DirectoryIterator*>(p));
+    } else {
+        ::operator delete(p);
+    }
+}
+
+FAT32DirectoryIterator::FAT32DirectoryIterator(FAT32* fs, Cluster directoryCluster, bool includeDots)
     : _fs(fs)
+    , _directoryCluster(directoryCluster)
+    , _includeDots(includeDots)
 {
-    // FIXME: Ignore path for now
-    _file = new FAT32RawFile(_fs, _fs->rootDirectoryStartCluster(), 0);
+    _file = new FAT32RawFile(_fs, _directoryCluster, 0);
     next();
 }
 
 DirectoryIterator& FAT32DirectoryIterator::next()
 {
-    while (1) {
-        rawNext();
-        if (!deleted() && !subdir()) {
-            return *this;
-        }
-    }
+    rawNext();
+    return *this;
 }
 
-void FAT32DirectoryIterator::rawNext(bool extend)
+void FAT32DirectoryIterator::rawNext()
 {
-    _subdir = false;
-    _deleted = false;
-    
     while (1) {
         if (_entryIndex < 0 || ++_entryIndex >= static_cast<int32_t>(EntriesPerBlock)) {
             // get the next block
             if (_file->read(_buf, ++_blockIndex, 1) != Volume::Error::OK) {
-                if (_file->error() != Volume::Error::EndOfFile || !extend) {                
-                    _valid = false;
-                    return;
-                }
-                
-                // Extend the directory
-                _file->insertCluster();
-                
-                // Clear all the directory entries
-                memset(_buf, 0, sizeof(_buf));
-
-                // Write out the new directory block
-                if (_file->write(_buf, _blockIndex, 1) != Volume::Error::OK) {
-                    _valid = false;
-                    return;
-                }
+                _valid = false;
+                return;
             }
             
             _entryIndex = 0;
@@ -78,48 +76,94 @@ void FAT32DirectoryIterator::rawNext(bool extend)
     }
 }
 
-FAT32DirectoryIterator::FileInfoResult FAT32DirectoryIterator::getFileInfo()
+void FAT32DirectoryIterator::addLongNamePart(FATLongNameEntry* entry)
 {
-    FATDirEntry* entry = reinterpret_cast<FATDirEntry*>(_buf) + _entryIndex;
-    if (entry->attr & 0x0f) {
-        // Regular files have lower 4 bits clear. Skip other types
-        return FileInfoResult::Skip;
+    uint8_t order = entry->order & ~FATLongNameEntry::LastPart;
+    if (entry->order & FATLongNameEntry::LastPart) {
+        // First entry of a new name
+        if (order == 0 || order > FAT32::MaxLongNameEntries) {
+            _longNameValid = false;
+            return;
+        }
+        _longNameValid = true;
+        _longNameParts = order;
+        _longNamePending = order;
+        _longNameChecksum = entry->checksum;
+        _longNameSlot = _blockIndex * EntriesPerBlock + _entryIndex;
+        
+        uint32_t length = order * FATLongNameEntry::CharsPerEntry;
+        _longName[(length < FAT32::FilenameLength) ? length : (FAT32::FilenameLength - 1)] = '\0';
     }
     
-    if (entry->attr & 0x10) {
-        // Bit 0x10 is the subdir bit.
-        return FileInfoResult::SubDir;
+    if (!_longNameValid || order != _longNamePending || entry->checksum != _longNameChecksum) {
+        _longNameValid = false;
+        return;
     }
-
-    if (static_cast<uint8_t>(entry->name[0]) == 0xe5 || entry->name[0] == 0x05) {
-        // If the first char of the name is 0x05 or 0xe5 it means the file has been deleted
-        return FileInfoResult::Deleted;
+    --_longNamePending;
+    
+    // Characters are UCS-2. Anything outside of ASCII is shown as '_'
+    uint8_t* chars[FATLongNameEntry::CharsPerEntry] = {
+        entry->name1, entry->name1 + 2, entry->name1 + 4, entry->name1 + 6, entry->name1 + 8,
+        entry->name2, entry->name2 + 2, entry->name2 + 4, entry->name2 + 6, entry->name2 + 8, entry->name2 + 10,
+        entry->name3, entry->name3 + 2
+    };
+    
+    uint32_t position = (order - 1) * FATLongNameEntry::CharsPerEntry;
+    for (uint32_t i = 0; i < FATLongNameEntry::CharsPerEntry; ++i, ++position) {
+        if (position >= FAT32::FilenameLength - 1) {
+            break;
+        }
+        
+        uint16_t c = FAT32::bufToUInt16(chars[i]);
+        if (c == 0) {
+            _longName[position] = '\0';
+            break;
+        }
+        _longName[position] = (c < 0x80) ? static_cast<char>(c) : '_';
     }
+}
+
+FAT32DirectoryIterator::FileInfoResult FAT32DirectoryIterator::getFileInfo()
+{
+    FATDirEntry* entry = reinterpret_cast<FATDirEntry*>(_buf) + _entryIndex;
     
     if (entry->name[0] == '\0') {
         // End of directory
         return FileInfoResult::End;
     }
-
-    // Format the name
-    uint32_t j = 0;
-    for (uint32_t i = 0; i < 8; ++i) {
-        if (entry->name[i] == ' ') {
-            break;
-        }
-        _fileInfo.name[j++] = entry->name[i];
+    
+    if (static_cast<uint8_t>(entry->name[0]) == 0xe5) {
+        // If the first char of the name is 0xe5 it means the file has been deleted
+        _longNameValid = false;
+        return FileInfoResult::Deleted;
     }
     
-    _fileInfo.name[j++] = '.';
+    if ((entry->attr & FATAttrLongName) == FATAttrLongName) {
+        addLongNamePart(reinterpret_cast<FATLongNameEntry*>(entry));
+        return FileInfoResult::LongName;
+    }
     
-    for (uint32_t i = 8; i < 11; ++i) {
-        if (entry->name[i] == ' ') {
-            break;
-        }
-        _fileInfo.name[j++] = entry->name[i];
+    bool hasLongName = _longNameValid && _longNamePending == 0 && FAT32::shortNameChecksum(entry->name) == _longNameChecksum;
+    _longNameValid = false;
+    
+    if ((entry->attr & FATAttrVolumeID) || (entry->name[0] == '.' && !_includeDots)) {
+        return FileInfoResult::Skip;
+    }
+    
+    uint32_t slot = _blockIndex * EntriesPerBlock + _entryIndex;
+    if (hasLongName) {
+        strcpy(_fileInfo.name, _longName);
+        _fileInfo.directorySlot = _longNameSlot;
+        _fileInfo.directoryEntries = _longNameParts + 1;
+    } else {
+        FAT32::formatShortName(_fileInfo.name, entry->name, entry->reserved1);
+        _fileInfo.directorySlot = slot;
+        _fileInfo.directoryEntries = 1;
     }
     
-    _fileInfo.name[j] = '\0';
+    memcpy(_fileInfo.shortName, entry->name, sizeof(_fileInfo.shortName));
+    _fileInfo.attr = entry->attr;
+    _fileInfo.directoryCluster = _directoryCluster;
     _fileInfo.size = FAT32::bufToUInt32(entry->size);
     _fileInfo.baseCluster = (static_cast<uint32_t>(FAT32::bufToUInt16(entry->firstClusterHi)) << 16) + 
                             static_cast<uint32_t>(FAT32::bufToUInt16(entry->firstClusterLo));
@@ -133,23 +177,3 @@ FAT32DirectoryIterator::FileInfoResult FAT32DirectoryIterator::getFileInfo()
     
     return FileInfoResult::OK;
 }
-
-bool FAT32DirectoryIterator::createEntry(const char* name, uint32_t size, Cluster baseCluster)
-{
-    FATDirEntry* entry = reinterpret_cast<FATDirEntry*>(_buf) + _entryIndex;
-    
-    memset(entry, 0, sizeof(FATDirEntry));
-    FAT32::convertTo8dot3(entry->name, name);
-    FAT32::uint32ToBuf(size, entry->size);
-    FAT32::uint16ToBuf(baseCluster.value() >> 16, entry->firstClusterHi);
-    FAT32::uint16ToBuf(baseCluster.value(), entry->firstClusterLo);
-
-    return _file->write(_buf, _blockIndex, 1) == Volume::Error::OK;
-}
-
-bool FAT32DirectoryIterator::deleteEntry()
-{
-    FATDirEntry* entry = reinterpret_cast<FATDirEntry*>(_buf) + _entryIndex;
-    entry->name[0] = 0xe5;
-    return _file->write(_buf, _blockIndex, 1) == Volume::Error::OK;
-}
@@ -15,38 +15,89 @@
 #include "bare/FAT32RawFile.h"
 
 #include "bare/FAT32DirectoryIterator.h"
+#include "bare/ObjectCache.h"
 #include "bare/Serial.h"
 
 using namespace bare;
 
-Volume::Error FAT32RawFile::read(char* buf, Block logicalBlock, uint32_t blocks)
+static ObjectCache<FAT32RawFile> rawFileCache("FAT32RawFile");
+
+void* FAT32RawFile::operator new(size_t size)
 {
-    Block physicalBlock;
-    _error = logicalToPhysicalBlock(logicalBlock, physicalBlock);
-    if (_error != Volume::Error::OK) {
-        return _error;
+    return (size == sizeof(FAT32RawFile)) ? rawFileCache.alloc() : ::operator new(size);
+}
+
+void FAT32RawFile::operator delete(void* p, size_t size)
+{
+    if (size == sizeof(FAT32RawFile)) {
+        rawFileCache.free(static_cast<FAT32RawFile*>(p));
+    } else {
+        ::operator delete(p);
     }
+}
+
+Volume::Error FAT32RawFile::read(char* buf, Block logicalBlock, uint32_t blocks)
+{
+    // Read the blocks in runs which are physically contiguous on the
+    // device, so a file laid out in consecutive clusters is read with
+    // a single multi-block transfer
+    while (blocks > 0) {
+        Block physicalBlock;
+        uint32_t run;
+        _error = physicalRun(logicalBlock, blocks, physicalBlock, run);
+        if (_error != Volume::Error::OK) {
+            return _error;
+        }
 
-    return static_cast<Volume::Error>(_fat32->rawRead(buf, physicalBlock, blocks));
+        _error = _fat32->rawRead(buf, physicalBlock, run);
+        if (_error != Volume::Error::OK) {
+            return _error;
+        }
+        
+        buf += run * BlockSize;
+        logicalBlock = logicalBlock + Block(run);
+        blocks -= run;
+    }
+    return Volume::Error::OK;
 }
 
 Volume::Error FAT32RawFile::write(const char* buf, Block logicalBlock, uint32_t blocks)
 {
-    Block physicalBlock;
-    Volume::Error error = logicalToPhysicalBlock(logicalBlock, physicalBlock);
-    if (error == Volume::Error::EndOfFile) {
-        error = insertCluster();
+    FAT32::Operation operation(_fat32);
+    while (blocks > 0) {
+        Block physicalBlock;
+        uint32_t run;
+        Volume::Error error = physicalRun(logicalBlock, blocks, physicalBlock, run);
+        if (error == Volume::Error::EndOfFile) {
+            // Grow the file by everything the rest of this write needs, so
+            // it can go in one extent
+            error = reserve((logicalBlock.value() + blocks) * BlockSize);
+            if (error != Volume::Error::OK) {
+                return error;
+            }
+            error = physicalRun(logicalBlock, blocks, physicalBlock, run);
+        }
+        
         if (error != Volume::Error::OK) {
             return error;
         }
-        error = logicalToPhysicalBlock(logicalBlock, physicalBlock);
-    }
-    
-    if (error != Volume::Error::OK) {
-        return error;
-    }
 
-    return static_cast<Volume::Error>(_fat32->rawWrite(buf, physicalBlock, blocks));
+        // A file without a directory entry is a directory being changed
+        // by FAT32, so the write is metadata
+        if (_directoryBlock == 0) {
+            error = _fat32->writeMetadata(buf, physicalBlock, run);
+        } else {
+            error = _fat32->rawWrite(buf, physicalBlock, run);
+        }
+        if (error != Volume::Error::OK) {
+            return error;
+        }
+        
+        buf += run * BlockSize;
+        logicalBlock = logicalBlock + Block(run);
+        blocks -= run;
+    }
+    return Volume::Error::OK;
 }
 
 Volume::Error FAT32RawFile::rename(const char* to)
@@ -56,36 +107,101 @@ Volume::Error FAT32RawFile::rename(const char* to)
         return Volume::Error::InternalError;
     }
     
-    // First make sure to does not exist
-    if (_fat32->exists(to)) {
-        _error = Volume::Error::FileExists;
-        return _error;
+    // This moves the entry, so its location changes
+    Volume::Error error = _fat32->renameEntry(_directoryCluster, _directoryBlock, _directoryBlockIndex, to);
+    if (error == Volume::Error::FileExists) {
+        _error = error;
+    }
+    return error;
+}
+
+Volume::Error FAT32RawFile::insertCluster()
+{
+    FAT32::Operation operation(_fat32);
+    Volume::Error error = extendMap(0xffffffff);
+    if (error != Volume::Error::EndOfFile) {
+        return (error == Volume::Error::OK) ? Volume::Error::InternalError : error;
+    }
+    if (_extents.empty()) {
+        return allocateFirstClusters(1);
     }
     
-    char buf[BlockSize];
-    Volume::Error error = _fat32->rawRead(buf, _directoryBlock, 1);
-    if (error != Volume::Error::OK) {
-        return error;
+    const Extent& last = _extents.back();
+    if (_fat32->allocateCluster(last.physicalCluster + last.length - 1) == 0) {
+        return Volume::Error::Failed;
+    }
+    return Volume::Error::OK;
+}
+
+Volume::Error FAT32RawFile::reserve(uint32_t size)
+{
+    FAT32::Operation operation(_fat32);
+    uint32_t clusterSize = _fat32->clusterSize();
+    uint32_t clusters = (size + clusterSize - 1) / clusterSize;
+    if (clusters == 0) {
+        return Volume::Error::OK;
     }
     
-    FATDirEntry* entry = reinterpret_cast<FATDirEntry*>(buf) + _directoryBlockIndex;
-    FAT32::convertTo8dot3(entry->name, to);
+    // If the last cluster needed is already there we're done. Otherwise
+    // the map now covers the whole chain
+    Volume::Error error = extendMap(clusters - 1);
+    if (error != Volume::Error::EndOfFile) {
+        return error;
+    }
+    if (_extents.empty()) {
+        // This might only allocate the first run. The rest goes after it
+        // once it's linked to the directory entry.
+        error = allocateFirstClusters(clusters);
+        if (error == Volume::Error::OK) {
+            error = extendMap(clusters - 1);
+        }
+        if (error != Volume::Error::EndOfFile) {
+            return error;
+        }
+    }
     
-    return _fat32->rawWrite(buf, _directoryBlock, 1);
+    const Extent& last = _extents.back();
+    uint32_t needed = clusters - mappedClusters();
+    uint32_t allocated;
+    _fat32->allocateClusters(last.physicalCluster + last.length - 1, needed, allocated);
+    return (allocated == needed) ? Volume::Error::OK : Volume::Error::Failed;
 }
 
-Volume::Error FAT32RawFile::insertCluster()
+Volume::Error FAT32RawFile::allocateFirstClusters(uint32_t count)
 {
-    if (_lastPhysicalCluster == 0) {
+    if (_directoryBlock == 0) {
+        Serial::printf("*** FAT32RawFile::allocateFirstClusters invalid directoryBlock\n");
         return Volume::Error::InternalError;
     }
     
-    _fat32->allocateCluster(_lastPhysicalCluster);
+    char buf[BlockSize];
+    Volume::Error error = _fat32->rawRead(buf, _directoryBlock, 1);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    uint32_t allocated;
+    Cluster cluster = _fat32->allocateClusters(0, count, allocated);
+    if (cluster.value() == 0) {
+        return Volume::Error::Failed;
+    }
+    
+    FATDirEntry* entry = reinterpret_cast<FATDirEntry*>(buf) + _directoryBlockIndex;
+    FAT32::uint16ToBuf(static_cast<uint16_t>(cluster.value() >> 16), entry->firstClusterHi);
+    FAT32::uint16ToBuf(static_cast<uint16_t>(cluster.value()), entry->firstClusterLo);
+    error = _fat32->writeMetadata(buf, _directoryBlock, 1);
+    if (error != Volume::Error::OK) {
+        _fat32->freeClusters(cluster);
+        return error;
+    }
+    
+    _baseCluster = cluster;
     return Volume::Error::OK;
 }
 
 Volume::Error FAT32RawFile::updateSize()
 {
+    FAT32::Operation operation(_fat32);
     if (_directoryBlock == 0) {
         Serial::printf("*** FAT32RawFile::updateSize invalid directoryBlock\n");
         return Volume::Error::InternalError;
@@ -100,56 +216,123 @@ Volume::Error FAT32RawFile::updateSize()
     FATDirEntry* entry = reinterpret_cast<FATDirEntry*>(buf) + _directoryBlockIndex;
     FAT32::uint32ToBuf(_size, entry->size);
     
-    return _fat32->rawWrite(buf, _directoryBlock, 1);
+    return _fat32->writeMetadata(buf, _directoryBlock, 1);
 }
 
 Volume::Error FAT32RawFile::logicalToPhysicalBlock(Block logicalBlock, Block& physicalBlock)
 {
-    // 4 cases:
-    //
-    //      1) Cluster number of block matches last cluster - use same physical cluster
-    //      2) Cluster number of block is one more than the last - get the next FAT entry
-    //          a) If the right FAT sector is loaded and the next entry is still in this sector, get it
-    //          b) Otherwise, load the right FAT sector and get the entry
-    //      3) Cluster number is higher that the last but not consecutive - search the FAT from this point
-    //      4) Cluster number is lower or we don't have a last entry - search from the start of the FAT
-    //
     if (_fat32->blocksPerCluster() == 0) {
         return static_cast<Volume::Error>(FAT32::Error::UnsupportedBlockSize);
     }
     
-    Cluster currentLogicalCluster = (logicalBlock / Block(_fat32->blocksPerCluster())).value();
-    Block currentLogicalClusterBlock = logicalBlock % Block(_fat32->blocksPerCluster());
+    uint32_t blocksPerCluster = _fat32->blocksPerCluster();
+    uint32_t physicalCluster;
+    uint32_t contiguous;
+    Volume::Error error = mapCluster(logicalBlock.value() / blocksPerCluster, physicalCluster, contiguous);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+
+    physicalBlock = _fat32->clusterToBlock(physicalCluster) + Block(logicalBlock.value() % blocksPerCluster);
+    return Volume::Error::OK;
+}
+
+Volume::Error FAT32RawFile::physicalRun(Block logicalBlock, uint32_t maxBlocks, Block& physicalBlock, uint32_t& blocks)
+{
+    if (_fat32->blocksPerCluster() == 0) {
+        return static_cast<Volume::Error>(FAT32::Error::UnsupportedBlockSize);
+    }
+    
+    uint32_t blocksPerCluster = _fat32->blocksPerCluster();
+    uint32_t logicalCluster = logicalBlock.value() / blocksPerCluster;
+    uint32_t clusterOffset = logicalBlock.value() % blocksPerCluster;
+    
+    // Map as far as this transfer could go, so the extent containing the
+    // first block is as long as it can be. Hitting the end of the chain
+    // just ends the run. The caller will see EndOfFile when it asks for
+    // the next block.
+    uint32_t lastLogicalCluster = (logicalBlock.value() + maxBlocks - 1) / blocksPerCluster;
+    Volume::Error error = extendMap(lastLogicalCluster);
+    if (error != Volume::Error::OK && error != Volume::Error::EndOfFile) {
+        return error;
+    }
+    
+    uint32_t physicalCluster;
+    uint32_t contiguous;
+    error = mapCluster(logicalCluster, physicalCluster, contiguous);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    physicalBlock = _fat32->clusterToBlock(physicalCluster) + Block(clusterOffset);
+    blocks = contiguous * blocksPerCluster - clusterOffset;
+    if (blocks > maxBlocks) {
+        blocks = maxBlocks;
+    }
+    return Volume::Error::OK;
+}
+
+Volume::Error FAT32RawFile::mapCluster(uint32_t logicalCluster, uint32_t& physicalCluster, uint32_t& contiguous)
+{
+    if (logicalCluster >= mappedClusters()) {
+        Volume::Error error = extendMap(logicalCluster);
+        if (error != Volume::Error::OK) {
+            return error;
+        }
+    }
+    
+    // Find the last extent starting at or before logicalCluster
+    size_t low = 0;
+    size_t high = _extents.size();
+    while (high - low > 1) {
+        size_t mid = (low + high) / 2;
+        if (_extents[mid].logicalCluster <= logicalCluster) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
     
-    if (_lastLogicalCluster != currentLogicalCluster) {
-        if (currentLogicalCluster < _lastLogicalCluster) {
-            _lastPhysicalCluster = _baseCluster;
-            _lastLogicalCluster = 0;
+    const Extent& extent = _extents[low];
+    uint32_t offset = logicalCluster - extent.logicalCluster;
+    physicalCluster = extent.physicalCluster + offset;
+    contiguous = extent.length - offset;
+    return Volume::Error::OK;
+}
+
+Volume::Error FAT32RawFile::extendMap(uint32_t logicalCluster)
+{
+    if (_extents.empty()) {
+        if (_baseCluster == 0) {
+            return Volume::Error::EndOfFile;
         }
+        _extents.push_back({ 0, _baseCluster.value(), 1 });
+    }
+    
+    while (mappedClusters() <= logicalCluster) {
+        Extent& last = _extents.back();
+        Cluster lastCluster = last.physicalCluster + last.length - 1;
+        Cluster nextCluster;
         
-        while (_lastLogicalCluster < currentLogicalCluster) {
-            FAT32::FATEntryType type = _fat32->nextClusterFATEntry(_lastPhysicalCluster, _lastPhysicalCluster);
-            if (type == FAT32::FATEntryType::Normal) {
-                ++_lastLogicalCluster;
-                continue;
-            }
-            
-            // The only time _lastPhysicalCluster gets updated is if the return type is Normal.
-            // If we have an error decrement _lastLogicalCluster to keep it consistent with
-            // the existing value of _lastPhysicalCluster.
-            if (type == FAT32::FATEntryType::End) {
-                return Volume::Error::EndOfFile;
+        FAT32::FATEntryType type = _fat32->nextClusterFATEntry(lastCluster, nextCluster);
+        if (type == FAT32::FATEntryType::Normal) {
+            if (nextCluster.value() == lastCluster.value() + 1) {
+                ++last.length;
+            } else {
+                _extents.push_back({ last.logicalCluster + last.length, nextCluster.value(), 1 });
             }
-            if (type == FAT32::FATEntryType::Error) {
-                Serial::printf("**** Error: failed to read FAT block\n");
-                return Volume::Error::Failed;
-            }
-            Serial::printf("**** Error: Disk inconsistency - next FAT entry is free\n");
-            return Volume::Error::InternalError;
+            continue;
+        }
+        
+        if (type == FAT32::FATEntryType::End) {
+            return Volume::Error::EndOfFile;
+        }
+        if (type == FAT32::FATEntryType::Error) {
+            Serial::printf("**** Error: failed to read FAT block\n");
+            return Volume::Error::Failed;
         }
+        Serial::printf("**** Error: Disk inconsistency - next FAT entry is free\n");
+        return Volume::Error::InternalError;
     }
-
-    physicalBlock = _fat32->clusterToBlock(_lastPhysicalCluster) + currentLogicalClusterBlock;
     return Volume::Error::OK;
 }
-
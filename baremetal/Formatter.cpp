@@ -303,7 +303,7 @@ int32_t Formatter::vformat(Formatter::Generator gen, const char *format, va_list
             size += outInteger(gen, reinterpret_cast<int64_t>(va_arg(va.value, void*)), Signed::No, width, precision, flags, 16, Formatter::Capital::No);
             break;
         default:
-            gen(*format++);
+            gen(*format);
             size++;
             break;
         }
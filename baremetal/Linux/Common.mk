@@ -0,0 +1,14 @@
+PLATFORM = PLATFORM_LINUX
+TOOLCHAIN =
+
+PLATFORMSRC = \
+	Linux/LinuxBare.cpp \
+	Linux/LinuxGPIO.cpp \
+	Linux/LinuxGraphics.cpp \
+	Linux/LinuxMemory.cpp \
+	Linux/LinuxMutex.cpp \
+	Linux/LinuxReceiveFile.cpp \
+	Linux/LinuxSDCard.cpp \
+	Linux/LinuxSerial.cpp \
+	Linux/LinuxSPIMaster.cpp \
+	Linux/LinuxTimer.cpp \
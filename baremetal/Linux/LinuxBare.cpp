@@ -0,0 +1,80 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "bare.h"
+
+#include "bare/Serial.h"
+#include <stdlib.h>
+
+using namespace bare;
+
+static bool inited = false;
+
+void bare::initSystem()
+{
+    inited = true;
+}
+
+bool bare::useAllocator()
+{
+    return inited;
+}
+
+void bare::runCode(void* memory, uint32_t size, uint32_t startOffset)
+{
+    Serial::printf("runCode: ARM code can't run in a Linux process\n");
+}
+
+// Setup a dummy area of "kernel space" to dump data to
+uint8_t _dummyKernel[8 * 1024 * 1024];
+
+extern "C" {
+
+uint8_t* kernelBase() { return _dummyKernel; }
+
+void PUT8(uint8_t* addr, uint8_t value)
+{
+    *addr = value;
+}
+
+void BRANCHTO(uint8_t* addr)
+{
+    Serial::printf("BRANCHTO: => 0x%p\n", addr);
+    exit(1);
+}
+
+// There are no interrupts. Timers fire while Serial::read is waiting for
+// input, so nothing else can be running when they do.
+bool interruptsSupported()
+{
+    return false;
+}
+
+void disableIRQ()
+{
+}
+
+void enableIRQ()
+{
+}
+
+void WFE()
+{
+}
+
+void restart()
+{
+    Serial::printf("RESTART\n");
+    exit(0);
+}
+
+}
@@ -0,0 +1,36 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "bare.h"
+
+#include "bare/Graphics.h"
+
+using namespace bare;
+
+// There is no display, drawing does nothing
+
+bool Graphics::init()
+{
+    return true;
+}
+
+void Graphics::clear(uint32_t color)
+{
+}
+
+void Graphics::drawTriangle()
+{
+}
+
+void Graphics::render()
+{
+}
@@ -0,0 +1,54 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "bare.h"
+
+#include "bare/Memory.h"
+
+#include "bare/Serial.h"
+#include <sys/mman.h>
+
+using namespace bare;
+
+// The kernel heap is an arena mapped from the host when Memory is
+// initialized, so it's page aligned like it would be on the Pi. Pages are
+// only backed when they're touched, so the arena is made big enough for
+// a KernelHeap of any size a host program, like the benchmarks, wants.
+
+static constexpr size_t ArenaSize = 256 * 1024 * 1024;
+
+static void* kernelHeapMemory = nullptr;
+
+Memory::Heap* Memory::_kernelHeap = nullptr;
+
+void* Memory::heapStart()
+{
+    return kernelHeapMemory;
+}
+
+size_t Memory::heapSize()
+{
+    return kernelHeapMemory ? ArenaSize : 0;
+}
+
+void Memory::init(Heap* kernelHeap)
+{
+    void* addr = mmap(nullptr, ArenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        Serial::printf("*** Could not map kernel heap arena of %d bytes\n", static_cast<uint32_t>(ArenaSize));
+        return;
+    }
+    
+    kernelHeapMemory = addr;
+    _kernelHeap = kernelHeap;
+    _kernelHeap->_heapStart = kernelHeapMemory;
+}
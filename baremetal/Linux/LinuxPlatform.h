@@ -0,0 +1,25 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <stdint.h>
+
+namespace bare {
+    
+    // A Linux process has no timer interrupt. Instead Serial::read only
+    // waits for input until the first timer is due and then calls
+    // Timer::handleInterrupt. This returns the systemTime when the first
+    // timer is due, or Timer::DoNotFire if none are running.
+    int64_t nextTimerTime();
+
+}
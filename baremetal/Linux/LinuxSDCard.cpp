@@ -0,0 +1,127 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "bare.h"
+
+#include "bare/SDCard.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace bare;
+
+// The SD card is an image file of a FAT32 card, FAT32.img unless
+// PLACID_SDCARD names another. If PLACID_SDCARD_MMAP is set the image is
+// mapped into memory and blocks are copied in and out of the mapping.
+// Otherwise they are transferred with pread and pwrite.
+
+static int sdCardFD = -1;
+static char* sdCardImage = nullptr;
+static uint64_t sdCardSize = 0;
+static SDCard::Stats sdCardStats;
+
+SDCard::SDCard()
+{
+    const char* name = getenv("PLACID_SDCARD");
+    if (!name) {
+        name = "FAT32.img";
+    }
+    
+    sdCardFD = open(name, O_RDWR);
+    if (sdCardFD < 0) {
+        fprintf(stderr, "Error opening SD card image '%s': %s\n", name, strerror(errno));
+        return;
+    }
+    
+    struct stat info;
+    if (fstat(sdCardFD, &info) == 0) {
+        sdCardSize = info.st_size;
+    }
+    
+    if (getenv("PLACID_SDCARD_MMAP") && sdCardSize) {
+        void* addr = mmap(nullptr, sdCardSize, PROT_READ | PROT_WRITE, MAP_SHARED, sdCardFD, 0);
+        if (addr == MAP_FAILED) {
+            fprintf(stderr, "Error mapping SD card image '%s': %s\n", name, strerror(errno));
+        } else {
+            sdCardImage = reinterpret_cast<char*>(addr);
+        }
+    }
+}
+
+SDCard::Mode SDCard::mode() const
+{
+    // The simulated card has no bus to negotiate
+    return Mode();
+}
+
+const SDCard::Stats& SDCard::stats() const
+{
+    return sdCardStats;
+}
+
+// The simulated card counts commands like a card without CMD23. A
+// multi-block transfer is one read or write command, then CMD12.
+static void countTransfer(uint32_t blocks)
+{
+    sdCardStats.commands += (blocks > 1) ? 2 : 1;
+    ++sdCardStats.transfers;
+    sdCardStats.blocks += blocks;
+}
+
+Volume::Error SDCard::read(char* buf, Block blockAddr, uint32_t blocks)
+{
+    if (sdCardFD < 0) {
+        return Volume::Error::InternalError;
+    }
+    countTransfer(blocks);
+    
+    uint64_t offset = static_cast<uint64_t>(blockAddr.value()) * 512;
+    size_t size = blocks * 512;
+    if (sdCardImage) {
+        if (offset + size > sdCardSize) {
+            return Volume::Error::Failed;
+        }
+        memcpy(buf, sdCardImage + offset, size);
+        return Volume::Error::OK;
+    }
+    return (pread(sdCardFD, buf, size, offset) == static_cast<ssize_t>(size)) ? Volume::Error::OK : Volume::Error::Failed;
+}
+
+Volume::Error SDCard::write(const char* buf, Block blockAddr, uint32_t blocks)
+{
+    if (sdCardFD < 0) {
+        return Volume::Error::InternalError;
+    }
+    countTransfer(blocks);
+    
+    uint64_t offset = static_cast<uint64_t>(blockAddr.value()) * 512;
+    size_t size = blocks * 512;
+    if (sdCardImage) {
+        if (offset + size > sdCardSize) {
+            return Volume::Error::Failed;
+        }
+        memcpy(sdCardImage + offset, buf, size);
+        return Volume::Error::OK;
+    }
+    return (pwrite(sdCardFD, buf, size, offset) == static_cast<ssize_t>(size)) ? Volume::Error::OK : Volume::Error::Failed;
+}
+
+Volume::Error SDCard::submit(Request* request)
+{
+    return RawIO::submit(request);
+}
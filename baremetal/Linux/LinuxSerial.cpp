@@ -0,0 +1,160 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "bare.h"
+
+#include "bare/Serial.h"
+
+#include "bare/Timer.h"
+#include "Linux/LinuxPlatform.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+using namespace bare;
+
+// Serial is stdin and stdout, unless PLACID_PTY is set in the environment.
+// Then it's the master side of a pseudo terminal, and the slave side is
+// printed so a terminal program can connect to it like it would to the
+// Pi's UART.
+//
+// When the input is a terminal it's put in raw mode, and return and delete
+// are sent as the newline and backspace the shell expects. Otherwise, like
+// a file or a pipe, the input is passed unchanged and read returns NoData
+// at the end.
+
+static int inputFD = STDIN_FILENO;
+static int outputFD = STDOUT_FILENO;
+static bool isTerminal = false;
+static bool isPTY = false;
+static struct termios savedTermios;
+
+static void restoreTerminal()
+{
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &savedTermios);
+}
+
+void Serial::init(uint32_t baudrate)
+{
+    if (getenv("PLACID_PTY")) {
+        struct termios tty;
+        memset(&tty, 0, sizeof(tty));
+        tty.c_cflag = CS8 | CREAD;
+        
+        int master, slave;
+        char name[256];
+        if (openpty(&master, &slave, name, &tty, nullptr) < 0) {
+            fprintf(stderr, "Error opening pty: %s\n", strerror(errno));
+            exit(1);
+        }
+        
+        fprintf(stderr, "Slave PTY: %s\n", name);
+        inputFD = master;
+        outputFD = master;
+        isTerminal = true;
+        isPTY = true;
+        return;
+    }
+    
+    if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &savedTermios) == 0) {
+        struct termios tty = savedTermios;
+        tty.c_iflag &= ~(ICRNL | INLCR | IXON);
+        tty.c_lflag &= ~(ICANON | ECHO);
+        tty.c_cc[VMIN] = 1;
+        tty.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &tty);
+        atexit(restoreTerminal);
+        isTerminal = true;
+    }
+}
+
+static bool waitForInput(int timeout)
+{
+    struct pollfd fd = { inputFD, POLLIN, 0 };
+    return poll(&fd, 1, timeout) > 0;
+}
+
+Serial::Error Serial::read(uint8_t& c)
+{
+    while (true) {
+        // Wait until the first timer is due and fire it if nothing comes in
+        int64_t timeToFire = nextTimerTime();
+        int timeout = -1;
+        if (timeToFire != Timer::DoNotFire) {
+            int64_t ms = (timeToFire - Timer::systemTime() + 999) / 1000;
+            timeout = (ms <= 0) ? 0 : ((ms > INT_MAX) ? INT_MAX : static_cast<int>(ms));
+        }
+        
+        if (!waitForInput(timeout)) {
+            if (timeToFire != Timer::DoNotFire && Timer::systemTime() >= timeToFire) {
+                Timer::handleInterrupt();
+            }
+            continue;
+        }
+        
+        ssize_t size = ::read(inputFD, &c, 1);
+        if (size < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return Error::Fail;
+        }
+        if (size == 0) {
+            return Error::NoData;
+        }
+        
+        if (isTerminal) {
+            if (c == '\r') {
+                c = '\n';
+            } else if (c == 0x7f) {
+                c = '\b';
+            }
+        }
+        return Error::OK;
+    }
+}
+
+bool Serial::rxReady()
+{
+    return waitForInput(0);
+}
+
+Serial::Error Serial::write(uint8_t c)
+{
+    // Newlines are turned into CR/LF by the terminal, except on a pty where
+    // nothing is between us and the terminal program
+    if (c == '\r') {
+        return Error::OK;
+    }
+    if (c == '\n' && isPTY) {
+        ::write(outputFD, "\r", 1);
+    }
+    return (::write(outputFD, &c, 1) == 1) ? Error::OK : Error::Fail;
+}
+
+void Serial::handleInterrupt()
+{
+}
+
+void Serial::clearInput() 
+{
+    if (isTerminal) {
+        tcflush(inputFD, TCIFLUSH);
+    }
+}
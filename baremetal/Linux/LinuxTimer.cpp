@@ -0,0 +1,63 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "bare.h"
+
+#include "bare/Timer.h"
+
+#include "Linux/LinuxPlatform.h"
+#include <time.h>
+
+using namespace bare;
+
+static int64_t timeToFire = Timer::DoNotFire;
+
+int64_t bare::nextTimerTime()
+{
+    return timeToFire;
+}
+
+void  Timer::TimerManager::init()
+{
+}
+
+void Timer::TimerManager::updateTimers()
+{
+    timeToFire = _timers.empty() ? DoNotFire : _timers[0]->_timeToFire;
+}
+
+void Timer::handleInterrupt()
+{
+    Timer::TimerManager::instance().fireTimers();
+}
+
+int64_t Timer::systemTime()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return static_cast<int64_t>(time.tv_sec) * 1000000 + time.tv_nsec / 1000;
+}
+
+int64_t Timer::systemTimeNS()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+void Timer::usleep(uint32_t us)
+{
+    struct timespec time;
+    time.tv_sec = us / 1000000;
+    time.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&time, &time) != 0) ;
+}
@@ -0,0 +1,94 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "bare.h"
+
+#include "bare/ObjectCache.h"
+
+#include "bare/Memory.h"
+#include <new>
+
+using namespace bare;
+
+ObjectCacheBase* ObjectCacheBase::_first = nullptr;
+
+ObjectCacheBase::ObjectCacheBase(const char* name, size_t objectSize, size_t align)
+    : _name(name)
+{
+    // Free objects hold the free stack link
+    if (align < alignof(FreeObject)) {
+        align = alignof(FreeObject);
+    }
+    if (objectSize < sizeof(FreeObject)) {
+        objectSize = sizeof(FreeObject);
+    }
+    _objectSize = (objectSize + align - 1) & ~(align - 1);
+    
+    _slabSize = SlabSize;
+    if (_objectSize * MinObjectsPerSlab > _slabSize) {
+        _slabSize = (_objectSize * MinObjectsPerSlab + SlabSize - 1) / SlabSize * SlabSize;
+    }
+    
+    _next = _first;
+    _first = this;
+}
+
+bool ObjectCacheBase::grow()
+{
+    void* slab;
+    if (!Memory::mapSegment(_slabSize, slab)) {
+        slab = ::operator new(_slabSize);
+        if (!slab) {
+            return false;
+        }
+    }
+    
+    _carve = static_cast<uint8_t*>(slab);
+    _carveEnd = _carve + _slabSize / _objectSize * _objectSize;
+    ++_stats.slabs;
+    return true;
+}
+
+void* ObjectCacheBase::alloc()
+{
+    void* p;
+    if (_free) {
+        p = _free;
+        _free = _free->next;
+    } else {
+        if (_carve == _carveEnd && !grow()) {
+            return nullptr;
+        }
+        p = _carve;
+        _carve += _objectSize;
+    }
+    
+    ++_stats.allocs;
+    if (++_stats.inUse > _stats.maxInUse) {
+        _stats.maxInUse = _stats.inUse;
+    }
+    return p;
+}
+
+void ObjectCacheBase::free(void* p)
+{
+    if (!p) {
+        return;
+    }
+    
+    assert(_stats.inUse > 0);
+    FreeObject* object = static_cast<FreeObject*>(p);
+    object->next = _free;
+    _free = object;
+    ++_stats.frees;
+    --_stats.inUse;
+}
@@ -0,0 +1,363 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "bare.h"
+
+#include "bare/RAMDisk.h"
+
+#include "bare/Memory.h"
+
+using namespace bare;
+
+RAMDisk::~RAMDisk()
+{
+    if (_data) {
+        Memory::unmapSegment(_data, _sizeInBlocks * BlockSize);
+    }
+}
+
+Volume::Error RAMDisk::mount()
+{
+    if (_data) {
+        return Volume::Error::OK;
+    }
+    
+    void* addr;
+    if (_sizeInBlocks == 0 || !Memory::mapSegment(_sizeInBlocks * BlockSize, addr)) {
+        _error = Volume::Error::Failed;
+        return _error;
+    }
+    
+    _data = reinterpret_cast<char*>(addr);
+    _blockMap.assign((_sizeInBlocks + 31) / 32, 0);
+    _freeBlocks = _sizeInBlocks;
+    _nextFreeBlock = 0;
+    
+    _nodes.clear();
+    _nodes.emplace_back();
+    _nodes[Root].parent = Root;
+    _nodes[Root].directory = true;
+    
+    _error = Volume::Error::OK;
+    return _error;
+}
+
+RawFile* RAMDisk::open(const char* name)
+{
+    uint32_t node;
+    if (lookup(name, node) != Volume::Error::OK || _nodes[node].directory) {
+        return nullptr;
+    }
+    return new RAMDiskRawFile(this, node, _nodes[node].size);
+}
+
+Volume::Error RAMDisk::create(const char* name)
+{
+    return addNode(name, false);
+}
+
+Volume::Error RAMDisk::createDirectory(const char* name)
+{
+    return addNode(name, true);
+}
+
+Volume::Error RAMDisk::remove(const char* name)
+{
+    uint32_t node;
+    Volume::Error error = lookup(name, node);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    if (node == Root) {
+        return Volume::Error::InvalidName;
+    }
+    if (_nodes[node].opens) {
+        return Volume::Error::FileBusy;
+    }
+    
+    if (_nodes[node].directory) {
+        for (const Node& child : _nodes) {
+            if (child.parent == node) {
+                return Volume::Error::DirectoryNotEmpty;
+            }
+        }
+    }
+    
+    releaseBlocks(node);
+    _nodes[node].name.clear();
+    _nodes[node].parent = None;
+    _nodes[node].directory = false;
+    _nodes[node].size = 0;
+    return Volume::Error::OK;
+}
+
+bool RAMDisk::exists(const char* name)
+{
+    uint32_t node;
+    return lookup(name, node) == Volume::Error::OK;
+}
+
+bool RAMDisk::fileID(const char* name, uint64_t& id)
+{
+    uint32_t node;
+    if (lookup(name, node) != Volume::Error::OK) {
+        return false;
+    }
+    id = node;
+    return true;
+}
+
+DirectoryIterator* RAMDisk::directoryIterator(const char* path)
+{
+    uint32_t node;
+    if (lookup(path, node) != Volume::Error::OK || !_nodes[node].directory) {
+        return nullptr;
+    }
+    return new RAMDiskDirectoryIterator(this, node);
+}
+
+Volume::Error RAMDisk::lookup(const char* path, uint32_t& node, String* leaf) const
+{
+    if (_error != Volume::Error::OK) {
+        return _error;
+    }
+    
+    uint32_t directory = Root;
+    while (true) {
+        while (*path == '/') {
+            ++path;
+        }
+        if (*path == '\0') {
+            if (leaf) {
+                // There's no last component
+                return Volume::Error::InvalidName;
+            }
+            node = directory;
+            return Volume::Error::OK;
+        }
+        
+        const char* end = path;
+        while (*end != '\0' && *end != '/') {
+            ++end;
+        }
+        const char* next = end;
+        while (*next == '/') {
+            ++next;
+        }
+        
+        if (leaf && *next == '\0') {
+            *leaf = String(path, static_cast<int32_t>(end - path));
+            node = directory;
+            return Volume::Error::OK;
+        }
+        
+        uint32_t child = findChild(directory, path, end - path);
+        if (child == None) {
+            return Volume::Error::FileNotFound;
+        }
+        if (*next == '\0') {
+            node = child;
+            return Volume::Error::OK;
+        }
+        if (!_nodes[child].directory) {
+            return Volume::Error::NotADirectory;
+        }
+        directory = child;
+        path = next;
+    }
+}
+
+uint32_t RAMDisk::findChild(uint32_t directory, const char* name, size_t length) const
+{
+    for (uint32_t i = Root + 1; i < _nodes.size(); ++i) {
+        const Node& node = _nodes[i];
+        if (node.parent == directory && node.name.size() == length && memcmp(node.name.c_str(), name, length) == 0) {
+            return i;
+        }
+    }
+    return None;
+}
+
+Volume::Error RAMDisk::addNode(const char* path, bool directory)
+{
+    uint32_t parent;
+    String leaf;
+    Volume::Error error = lookup(path, parent, &leaf);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    if (leaf == "." || leaf == "..") {
+        return Volume::Error::InvalidName;
+    }
+    if (findChild(parent, leaf.c_str(), leaf.size()) != None) {
+        return Volume::Error::FileExists;
+    }
+    
+    // Reuse a free node if there is one
+    uint32_t node = Root + 1;
+    while (node < _nodes.size() && _nodes[node].parent != None) {
+        ++node;
+    }
+    if (node == _nodes.size()) {
+        _nodes.emplace_back();
+    }
+    
+    _nodes[node].name = leaf;
+    _nodes[node].parent = parent;
+    _nodes[node].directory = directory;
+    _nodes[node].size = 0;
+    return Volume::Error::OK;
+}
+
+Volume::Error RAMDisk::rename(uint32_t node, const char* to)
+{
+    uint32_t parent;
+    String leaf;
+    Volume::Error error = lookup(to, parent, &leaf);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    if (leaf == "." || leaf == "..") {
+        return Volume::Error::InvalidName;
+    }
+    if (findChild(parent, leaf.c_str(), leaf.size()) != None) {
+        return Volume::Error::FileExists;
+    }
+    
+    // A directory can't be moved inside itself
+    for (uint32_t i = parent; i != Root; i = _nodes[i].parent) {
+        if (i == node) {
+            return Volume::Error::InvalidName;
+        }
+    }
+    
+    _nodes[node].name = leaf;
+    _nodes[node].parent = parent;
+    return Volume::Error::OK;
+}
+
+Volume::Error RAMDisk::allocateBlocks(uint32_t node, uint32_t blocks)
+{
+    std::vector<uint32_t>& nodeBlocks = _nodes[node].blocks;
+    if (blocks <= nodeBlocks.size()) {
+        return Volume::Error::OK;
+    }
+    if (blocks - nodeBlocks.size() > _freeBlocks) {
+        return Volume::Error::Failed;
+    }
+    
+    while (nodeBlocks.size() < blocks) {
+        // Look for a free block starting where the last one was found, so
+        // a file's blocks tend to be together
+        uint32_t block = _nextFreeBlock;
+        while (_blockMap[block / 32] & (1u << (block % 32))) {
+            if (++block == _sizeInBlocks) {
+                block = 0;
+            }
+        }
+        
+        _blockMap[block / 32] |= 1u << (block % 32);
+        --_freeBlocks;
+        _nextFreeBlock = (block + 1 == _sizeInBlocks) ? 0 : block + 1;
+        nodeBlocks.push_back(block);
+    }
+    return Volume::Error::OK;
+}
+
+void RAMDisk::releaseBlocks(uint32_t node)
+{
+    for (uint32_t block : _nodes[node].blocks) {
+        _blockMap[block / 32] &= ~(1u << (block % 32));
+        ++_freeBlocks;
+    }
+    _nodes[node].blocks.clear();
+}
+
+Volume::Error RAMDiskRawFile::read(char* buf, Block blockAddr, uint32_t blocks)
+{
+    const std::vector<uint32_t>& nodeBlocks = _disk->_nodes[_node].blocks;
+    uint32_t block = blockAddr.value();
+    if (block + blocks > nodeBlocks.size()) {
+        return Volume::Error::EndOfFile;
+    }
+    
+    // Copy runs of consecutive blocks at once
+    while (blocks > 0) {
+        uint32_t run = 1;
+        while (run < blocks && nodeBlocks[block + run] == nodeBlocks[block] + run) {
+            ++run;
+        }
+        memcpy(buf, _disk->blockData(nodeBlocks[block]), run * BlockSize);
+        buf += run * BlockSize;
+        block += run;
+        blocks -= run;
+    }
+    return Volume::Error::OK;
+}
+
+Volume::Error RAMDiskRawFile::write(const char* buf, Block blockAddr, uint32_t blocks)
+{
+    uint32_t block = blockAddr.value();
+    Volume::Error error = _disk->allocateBlocks(_node, block + blocks);
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    
+    const std::vector<uint32_t>& nodeBlocks = _disk->_nodes[_node].blocks;
+    while (blocks > 0) {
+        uint32_t run = 1;
+        while (run < blocks && nodeBlocks[block + run] == nodeBlocks[block] + run) {
+            ++run;
+        }
+        memcpy(_disk->blockData(nodeBlocks[block]), buf, run * BlockSize);
+        buf += run * BlockSize;
+        block += run;
+        blocks -= run;
+    }
+    return Volume::Error::OK;
+}
+
+Volume::Error RAMDiskRawFile::insertCluster()
+{
+    return _disk->allocateBlocks(_node, static_cast<uint32_t>(_disk->_nodes[_node].blocks.size()) + 1);
+}
+
+Volume::Error RAMDiskRawFile::updateSize()
+{
+    _disk->_nodes[_node].size = _size;
+    return Volume::Error::OK;
+}
+
+Volume::Error RAMDiskRawFile::reserve(uint32_t size)
+{
+    return _disk->allocateBlocks(_node, (size + BlockSize - 1) / BlockSize);
+}
+
+Volume::Error RAMDiskRawFile::logicalToPhysicalBlock(Block logical, Block& physical)
+{
+    const std::vector<uint32_t>& nodeBlocks = _disk->_nodes[_node].blocks;
+    if (logical.value() >= nodeBlocks.size()) {
+        return Volume::Error::EndOfFile;
+    }
+    physical = nodeBlocks[logical.value()];
+    return Volume::Error::OK;
+}
+
+DirectoryIterator& RAMDiskDirectoryIterator::next()
+{
+    while (++_index < _disk->_nodes.size()) {
+        if (_disk->_nodes[_index].parent == _directory) {
+            break;
+        }
+    }
+    return *this;
+}
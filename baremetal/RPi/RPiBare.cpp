@@ -88,19 +88,6 @@ T intToFloat(long long a)
 
 extern "C" {
 
-    void* malloc(size_t size)
-    {
-        bare::Serial::printf("Attempted to malloc %d bytes\n", size);
-        abort();
-        return nullptr;
-    }
-
-    void free(void*)
-    {
-        bare::Serial::printf("Attempted to free\n");
-        abort();
-    }
-
     void disableIRQ()
     {
         __asm volatile (
@@ -22,8 +22,10 @@
 #include "bare/SDCard.h"
 
 #include "bare/GPIO.h"
+#include "bare/InterruptManager.h"
 #include "bare/Serial.h"
 #include "bare/Timer.h"
+#include "RPiMailbox.h"
 
 //#define ENABLE_DEBUG_LOG
 #include "bare/Log.h"
@@ -89,6 +91,7 @@ CMD(CMD_READ_MULTI,     0x12220032)
 CMD(CMD_WRITE_SINGLE,   0x18220000)
 CMD(CMD_WRITE_MULTI,    0x19220022)
 CMD(CMD_SET_BLOCKCNT,   0x17020000)
+CMD(CMD_SWITCH_FUNC,    0x06220010)
 CMD(CMD_APP_CMD,        0x37000000)
 CMD(CMD_APP_CMD_48,     (0x37000000 | CMDFLAG_RSPNS_48))
 CMD(CMD_SET_BUS_WIDTH,  (0x06020000 | CMDFLAG_NEED_APP))
@@ -106,6 +109,7 @@ CMD(CMD_SEND_SCR,       (0x33220010 | CMDFLAG_NEED_APP))
 #define INT_CMD_TIMEOUT     0x00010000
 #define INT_READ_RDY        0x00000020
 #define INT_WRITE_RDY       0x00000010
+#define INT_DATA_DONE       0x00000002
 #define INT_CMD_DONE        0x00000001
 
 #define INT_ERROR_MASK      0x017E8000
@@ -133,6 +137,7 @@ CMD(CMD_SEND_SCR,       (0x33220010 | CMDFLAG_NEED_APP))
 #define HOST_SPEC_V1        0
 
 // SCR flags
+#define SCR_SD_SPEC         0x0000000f
 #define SCR_SD_BUS_WIDTH_4  0x00000400
 #define SCR_SUPP_SET_BLKCNT 0x02000000
 #define SCR_SUPP_CCS        0x00000001
@@ -141,7 +146,26 @@ CMD(CMD_SEND_SCR,       (0x33220010 | CMDFLAG_NEED_APP))
 #define ACMD41_CMD_COMPLETE 0x80000000
 #define ACMD41_CMD_CCS      0x40000000
 #define ACMD41_ARG_HC       0x51ff8000
+
+// CMD6 (SWITCH_FUNC) arguments and status. The argument leaves every group
+// but group 1 (access mode) unchanged. Function 1 in that group is high speed
+#define SWITCH_CHECK_HS     0x00fffff1
+#define SWITCH_SET_HS       0x80fffff1
+#define SWITCH_STATUS_SIZE  64
+#define SWITCH_HS_SUPPORTED(status) (((status)[13] & 0x02) != 0)
+#define SWITCH_HS_SELECTED(status)  (((status)[16] & 0x0f) == 1)
+
+// Clock rates for each bus mode
+#define CLOCK_IDENTIFY      400000
+#define CLOCK_DEFAULT       25000000
+#define CLOCK_HIGH_SPEED    50000000
+
+// Used if the GPU can't tell us the EMMC base clock
+#define DEFAULT_BASE_CLOCK  41666666
     
+// Largest number of blocks that fit in the BLKSIZECNT count field
+constexpr uint32_t MaxBlocksPerTransfer = 0xffff;
+
 constexpr uint32_t GPIO_CD   = 47;
 constexpr uint32_t GPIO_CLK  = 48;
 constexpr uint32_t GPIO_CMD  = 49;
@@ -152,32 +176,175 @@ constexpr uint32_t GPIO_DAT3 = 53;
 
 static uint32_t _rca = 0;
 static uint32_t _scr[2] { 0, 0 };
+static SDCard::Mode _mode;
+static SDCard::Stats _stats;
+
+// DMA
+//
+// Asynchronous requests move their data with the DMA controller, paced by
+// the EMMC DREQ. The request is completed from the EMMC interrupt when the
+// data done flag is raised, so the CPU is free while the transfer runs.
+static constexpr uint32_t DMABase = 0x20007000;
+static constexpr uint32_t DMAEnableAddr = 0x20007ff0;
+
+struct DMAChannel
+{
+    uint32_t controlStatus;
+    uint32_t controlBlockAddr;
+    uint32_t transferInfo;
+    uint32_t sourceAddr;
+    uint32_t destAddr;
+    uint32_t transferLength;
+    uint32_t stride;
+    uint32_t nextControlBlockAddr;
+    uint32_t debug;
+    uint32_t unused[55];
+};
+
+static_assert(sizeof(DMAChannel) == 0x100, "Wrong size for DMAChannel");
+
+struct DMAControlBlock
+{
+    uint32_t transferInfo;
+    uint32_t sourceAddr;
+    uint32_t destAddr;
+    uint32_t transferLength;
+    uint32_t stride;
+    uint32_t nextControlBlockAddr;
+    uint32_t reserved[2];
+};
+
+static_assert(sizeof(DMAControlBlock) == 32, "Wrong size for DMAControlBlock");
+
+inline volatile DMAChannel& dma(uint32_t channel)
+{
+    return *(reinterpret_cast<volatile DMAChannel*>(DMABase + channel * sizeof(DMAChannel)));
+}
 
+// DMA CS register settings
+#define DMA_CS_RESET        0x80000000
+#define DMA_CS_ABORT        0x40000000
+#define DMA_CS_END          0x00000002
+#define DMA_CS_ACTIVE       0x00000001
 
+// DMA TI register settings
+#define DMA_TI_PERMAP(n)    ((n) << 16)
+#define DMA_TI_SRC_DREQ     0x00000400
+#define DMA_TI_SRC_INC      0x00000100
+#define DMA_TI_DEST_DREQ    0x00000040
+#define DMA_TI_DEST_INC     0x00000010
+#define DMA_TI_WAIT_RESP    0x00000008
+
+static constexpr uint32_t DMAPeripheralEMMC = 11;
+static constexpr uint32_t PeripheralBusBase = 0x7e000000;
+static constexpr uint32_t ARMPeripheralBase = 0x20000000;
+static constexpr uint32_t GPUAddressAlias = 0x40000000;
+static constexpr uint32_t CacheLineSize = 32;
+
+// The EMMC interrupt is bit 62 of the GPU IRQs. InterruptManager numbers
+// those starting at 32.
+static constexpr uint32_t EMMCInterruptBit = 32 + 62;
+
+static constexpr uint32_t NoDMAChannel = 0xffffffff;
+
+static uint32_t _dmaChannel = NoDMAChannel;
+static DMAControlBlock _dmaControlBlock __attribute__((aligned(32)));
+
+static Volume::RawIO::Request* _currentRequest = nullptr;
+static Volume::RawIO::Request* _requestHead = nullptr;
+static Volume::RawIO::Request* _requestTail = nullptr;
+static bool _currentRequestNeedsStop = false;
+static int64_t _currentRequestDeadline = 0;
+
+// How long a request gets to complete before the card is taken to have
+// stopped responding: a fixed allowance plus time for the data at 5MB/s,
+// slower than any card we'd run on.
+static constexpr int64_t RequestTimeout = 1000000;
+static constexpr int64_t RequestTimePerBlock = 100;
+
+static void initDMA();
+
+static inline uint32_t busAddr(const void* addr)
+{
+    return reinterpret_cast<uint32_t>(addr) | GPUAddressAlias;
+}
+
+static inline uint32_t peripheralBusAddr(volatile const void* addr)
+{
+    return reinterpret_cast<uint32_t>(addr) - ARMPeripheralBase + PeripheralBusBase;
+}
+
+static inline void dataSyncBarrier()
+{
+    __asm volatile ("mcr p15, 0, %0, c7, c10, 4" : : "r" (0) : "memory");
+}
+
+// Write back any dirty lines in the range so the DMA sees what the CPU wrote
+static void cleanDataCache(const void* addr, uint32_t size)
+{
+    uint32_t p = reinterpret_cast<uint32_t>(addr) & ~(CacheLineSize - 1);
+    uint32_t end = reinterpret_cast<uint32_t>(addr) + size;
+    for ( ; p < end; p += CacheLineSize) {
+        __asm volatile ("mcr p15, 0, %0, c7, c10, 1" : : "r" (p) : "memory");
+    }
+    dataSyncBarrier();
+}
+
+// Toss any lines in the range so the CPU sees what the DMA wrote
+static void invalidateDataCache(const void* addr, uint32_t size)
+{
+    uint32_t p = reinterpret_cast<uint32_t>(addr) & ~(CacheLineSize - 1);
+    uint32_t end = reinterpret_cast<uint32_t>(addr) + size;
+    for ( ; p < end; p += CacheLineSize) {
+        __asm volatile ("mcr p15, 0, %0, c7, c6, 1" : : "r" (p) : "memory");
+    }
+    dataSyncBarrier();
+}
+
+static inline bool irqsDisabled()
+{
+    uint32_t cpsr;
+    __asm volatile ("mrs %0, cpsr" : "=r" (cpsr));
+    return (cpsr & 0x80) != 0;
+}
+
+
+// Poll func until it returns true or count ms have passed. Polling is
+// done back to back rather than sleeping between checks, so a status
+// change is seen as soon as it happens.
 static bool checkStatusWithTimeout(std::function<bool()> func, const char* error, uint32_t count = 1000)
 {
-    for (uint32_t i = 0; ; ++i) {
+    int64_t timeout = Timer::systemTime() + static_cast<int64_t>(count) * 1000;
+    while (1) {
         if (func()) {
             return true;
         }
-        if (i >= count) {
+        if (Timer::systemTime() >= timeout) {
             if (error) {
                 ERROR_LOG("ERROR: %s\n", error);
             }
             return false;
         }
-        Timer::usleep(1000);
     }
 }
 
+static uint32_t baseClock()
+{
+    uint32_t buf[5];
+    if (Mailbox::tagMessage(buf, 5,
+            static_cast<uint32_t>(Mailbox::Command::GetClockRate), 8, 8,
+            static_cast<uint32_t>(Mailbox::ClockId::EMMC), 0) != Mailbox::Error::OK || buf[4] == 0) {
+        return DEFAULT_BASE_CLOCK;
+    }
+    return buf[4];
+}
+
+// The card clock is baseClock / (2 * divisor), or baseClock itself when the
+// divisor is 0. Spec 3 hosts take any 10 bit divisor, older ones only take
+// powers of 2 up to 0x80. Round the divisor up so the card is never clocked
+// faster than it asked for.
 static SDCard::Error setClock(uint32_t freq, uint32_t hostVersion)
 {
-    uint32_t d;
-    uint32_t c= 41666666 / freq;
-    uint32_t x;
-    uint32_t s = 32;
-    uint32_t h = 0;
-    
     if (!checkStatusWithTimeout(
         []{ return (emmc().status & (SR_CMD_INHIBIT | SR_DAT_INHIBIT)) == 0; },
         "setClock timeout waiting for inhibit flag")) {
@@ -187,54 +354,26 @@ static SDCard::Error setClock(uint32_t freq, uint32_t hostVersion)
     emmc().control1 &= ~C1_CLK_EN;
     Timer::usleep(10000);
     
-    x = c - 1;
-    if (!x) {
-        s = 0;
-    } else {
-        if (!(x & 0xffff0000u)) {
-            x <<= 16;
-            s -= 16;
-        }
-        if (!(x & 0xff000000u)) {
-            x <<= 8;
-            s -= 8;
-        }
-        if (!(x & 0xf0000000u)) {
-            x <<= 4;
-            s -= 4;
-        }
-        if (!(x & 0xc0000000u)) {
-            x <<= 2;
-            s -= 2;
-        }
-        if (!(x & 0x80000000u)) {
-            x <<= 1;
-            s -= 1;
-        }
-        if (s > 0) {
-            s--;
+    uint32_t base = baseClock();
+    uint32_t divisor = (freq >= base) ? 0 : (base + 2 * freq - 1) / (2 * freq);
+
+    if (hostVersion > HOST_SPEC_V2) {
+        if (divisor > 0x3ff) {
+            divisor = 0x3ff;
         }
-        if (s > 7) {
-            s = 7;
+    } else if (divisor) {
+        uint32_t d = 1;
+        while (d < divisor && d < 0x80) {
+            d <<= 1;
         }
+        divisor = d;
     }
     
-    if (hostVersion > HOST_SPEC_V2) {
-        d = c;
-    } else {
-        d = (1 << s);
-    }
-    if (d <= 2) {
-        d=2;
-        s=0;
-    }
+    _mode.clockRate = divisor ? (base / (2 * divisor)) : base;
     
-    DEBUG_LOG("SDCard: clock divisor=0x%08x, shift=0x%08x\n", d, s);
+    DEBUG_LOG("SDCard: base clock=%d, divisor=%d, clock=%d\n", base, divisor, _mode.clockRate);
 
-    if (hostVersion > HOST_SPEC_V2) {
-        h = (d & 0x300) >> 2;
-    }
-    d = ((d & 0x0ff) << 8) | h;
+    uint32_t d = ((divisor & 0x0ff) << 8) | ((divisor & 0x300) >> 2);
     
     emmc().control1 = (emmc().control1 & 0xffff003f) | d;
     Timer::usleep(10000);
@@ -313,6 +452,7 @@ static SDCard::Error sendCommand(const Command& cmd, uint32_t arg, uint32_t& res
     emmc().interrupt = emmc().interrupt;
     emmc().arg1 = arg;
     emmc().commandAndTransferMode = code;
+    ++_stats.commands;
 
     if (code == CMD_SEND_OP_COND()) {
         Timer::usleep(1000000);
@@ -386,6 +526,67 @@ static SDCard::Error setSCRValues()
     return SDCard::Error::OK;
 }
 
+static SDCard::Error switchFunction(uint32_t arg, uint8_t* status)
+{
+    emmc().blockSizeCount = (1 << 16) | SWITCH_STATUS_SIZE;
+
+    SDCard::Error error = sendCommand(CMD_SWITCH_FUNC(), arg);
+    if (error != SDCard::Error::OK) {
+        return error;
+    }
+    error = waitForInterrupt(INT_READ_RDY);
+    if (error != SDCard::Error::OK) {
+        return error;
+    }
+    
+    uint32_t* buf = reinterpret_cast<uint32_t*>(status);
+    uint32_t index = 0;
+    for (uint32_t count = 10000; index < SWITCH_STATUS_SIZE / 4 && count > 0; --count) {
+        if (emmc().status & SR_READ_AVAILABLE) {
+            buf[index++] = emmc().data;
+        } else {
+            Timer::usleep(100);
+        }
+    }
+    if (index != SWITCH_STATUS_SIZE / 4) {
+        ERROR_LOG("SDCard: ERROR switchFunction SR_READ_AVAILABLE never true\n");
+        return SDCard::Error::Error;
+    }
+    return waitForInterrupt(INT_DATA_DONE);
+}
+
+// Cards from SD spec 1.10 on support CMD6. If the card can do high speed,
+// switch to it and raise the clock. Failure isn't fatal, the card just
+// stays at the default speed.
+static void setHighSpeed(uint32_t hostVersion)
+{
+    if ((_scr[0] & SCR_SD_SPEC) == 0) {
+        return;
+    }
+    
+    uint8_t status[SWITCH_STATUS_SIZE] __attribute__((aligned(4)));
+    if (switchFunction(SWITCH_CHECK_HS, status) != SDCard::Error::OK || !SWITCH_HS_SUPPORTED(status)) {
+        DEBUG_LOG("SDCard: high speed not supported\n");
+        return;
+    }
+    
+    if (switchFunction(SWITCH_SET_HS, status) != SDCard::Error::OK || !SWITCH_HS_SELECTED(status)) {
+        ERROR_LOG("SDCard: switch to high speed failed\n");
+        return;
+    }
+    
+    // The card switches within 8 clocks of the end of the status block
+    Timer::usleep(100);
+    emmc().control0 |= C0_HCTL_HS_EN;
+    
+    if (setClock(CLOCK_HIGH_SPEED, hostVersion) != SDCard::Error::OK) {
+        ERROR_LOG("SDCard: failed to set high speed clock\n");
+        return;
+    }
+    
+    _mode.highSpeed = true;
+}
+
 SDCard::SDCard()
 {
     DEBUG_LOG("SDCard: Start init\n");
@@ -426,7 +627,7 @@ SDCard::SDCard()
     Timer::usleep(10000);
 
     // Set clock to setup frequency.
-    if ((setClock(400000, hostVersion)) != Error::OK) {
+    if ((setClock(CLOCK_IDENTIFY, hostVersion)) != Error::OK) {
         finishFail();
         return;
     }
@@ -481,7 +682,7 @@ SDCard::SDCard()
         return;
     }
     
-    if (setClock(25000000, hostVersion) != Error::OK) {
+    if (setClock(CLOCK_DEFAULT, hostVersion) != Error::OK) {
         finishFail();
         return;
     }
@@ -506,13 +707,20 @@ SDCard::SDCard()
     DEBUG_LOG("SDCard: setSCRValues succeeded 0x%08x 0x%08x\n", _scr[0], _scr[1]);
 
     if (_scr[0] & SCR_SD_BUS_WIDTH_4) {
-        if (sendCommand(CMD_SET_BUS_WIDTH(), _rca | 2) != Error::OK) {
+        // ACMD6 argument is the bus width: 0 for 1 bit, 2 for 4 bits
+        if (sendCommand(CMD_SET_BUS_WIDTH(), 2) != Error::OK) {
             finishFail();
             return;
         }
         emmc().control0 |= C0_HCTL_DWITDH;
+        _mode.busWidth = 4;
     }
     
+    setHighSpeed(hostVersion);
+    
+    DEBUG_LOG("SDCard: %d bit bus, %s speed, clock=%d\n",
+        _mode.busWidth, _mode.highSpeed ? "high" : "default", _mode.clockRate);
+    
     // add software flag
     DEBUG_LOG("EMMC: supports %s%s\n",
         (_scr[0] & SCR_SUPP_SET_BLKCNT) ? "SET_BLKCNT " : "",
@@ -520,69 +728,81 @@ SDCard::SDCard()
         
     _scr[0] &= ~SCR_SUPP_CCS;
     _scr[0] |= ccs;
+    
+    initDMA();
     DEBUG_LOG("SDCard: EMMC init succeeded\n");
 }
 
-Volume::Error SDCard::read(char* buf, Block blockAddr, uint32_t blocks)
+// Transfer a run of blocks with a single read or write command. When the card
+// supports CMD23 the block count is set up front and the card stops on its
+// own. Otherwise the run is ended with CMD12. SDSC cards (no CCS) use byte
+// addressing but otherwise take the same path.
+static Volume::Error transferBlocks(bool write, uint32_t* buf, uint32_t blockAddr, uint32_t blocks)
 {
-    if (blocks < 1) {
-        blocks = 1;
-    }
-    
-    DEBUG_LOG("SDCard: readBlock addr=%d, num=%d\n", blockAddr.value(), blocks);
-
-    if (readStatus(SR_DAT_INHIBIT) != Error::OK) {
-        ERROR_LOG("SDCard: readBlock timeout on readStatus(SR_DAT_INHIBIT)\n");
+    if (readStatus(SR_DAT_INHIBIT) != SDCard::Error::OK) {
+        ERROR_LOG("SDCard: transferBlocks timeout on readStatus(SR_DAT_INHIBIT)\n");
         return Volume::Error::InternalError;
     }
     
-    uint32_t* currentPtr = reinterpret_cast<uint32_t*>(buf);
-    Error error = Error::OK;
+    bool multi = blocks > 1;
+    bool setBlockCount = multi && (_scr[0] & SCR_SUPP_SET_BLKCNT);
+    SDCard::Error error = SDCard::Error::OK;
     
-    if (_scr[0] & SCR_SUPP_CCS) {
-        if (blocks > 1 && (_scr[0] & SCR_SUPP_SET_BLKCNT)) {
-            error = sendCommand(CMD_SET_BLOCKCNT(), blocks);
-            if(error != Error::OK) {
-                ERROR_LOG("SDCard: error sending CMD_SET_BLOCKCNT\n");
-                return Volume::Error::InternalError;
-            }
-        }
-        
-        emmc().blockSizeCount = (blocks << 16) | 512;
-        
-        error = sendCommand((blocks == 1) ? CMD_READ_SINGLE() : CMD_READ_MULTI(), blockAddr.value());
-        if (error != Error::OK) {
-            ERROR_LOG("SDCard: error sending CMD_READ_*\n");
+    if (setBlockCount) {
+        error = sendCommand(CMD_SET_BLOCKCNT(), blocks);
+        if (error != SDCard::Error::OK) {
+            ERROR_LOG("SDCard: error sending CMD_SET_BLOCKCNT\n");
             return Volume::Error::InternalError;
         }
-    } else {
-        emmc().blockSizeCount = (1 << 16) | 512;
     }
     
+    emmc().blockSizeCount = (blocks << 16) | BlockSize;
+    ++_stats.transfers;
+    _stats.blocks += blocks;
+    
+    uint32_t arg = (_scr[0] & SCR_SUPP_CCS) ? blockAddr : (blockAddr * BlockSize);
+    if (write) {
+        error = sendCommand(multi ? CMD_WRITE_MULTI() : CMD_WRITE_SINGLE(), arg);
+    } else {
+        error = sendCommand(multi ? CMD_READ_MULTI() : CMD_READ_SINGLE(), arg);
+    }
+    if (error != SDCard::Error::OK) {
+        ERROR_LOG("SDCard: error sending %s command for addr %d\n", write ? "write" : "read", blockAddr);
+        return Volume::Error::InternalError;
+    }
+
     for (uint32_t currentBlock = 0; currentBlock < blocks; ++currentBlock) {
-        if(!(_scr[0] & SCR_SUPP_CCS)) {
-            error = sendCommand(CMD_READ_SINGLE(), (blockAddr.value() + currentBlock) * 512);
-            if (error != Error::OK) {
-                ERROR_LOG("SDCard: error sending CMD_READ_SINGLE for addr %d\n", (blockAddr.value() + currentBlock) * 512);
-                return Volume::Error::InternalError;
-            }
-        }
-        error = waitForInterrupt(INT_READ_RDY);
-        if (error != Error::OK) {
-            ERROR_LOG("ERROR: Timeout waiting for ready to read\n");
+        error = waitForInterrupt(write ? INT_WRITE_RDY : INT_READ_RDY);
+        if (error != SDCard::Error::OK) {
+            ERROR_LOG("ERROR: Timeout waiting for ready to %s\n", write ? "write" : "read");
             return Volume::Error::InternalError;
         }
         
-        for (uint32_t d = 0; d < 128; d++) {
-            currentPtr[d] = emmc().data;
+        if (write) {
+            for (uint32_t d = 0; d < BlockSize / 4; d++) {
+                emmc().data = buf[d];
+            }
+        } else {
+            for (uint32_t d = 0; d < BlockSize / 4; d++) {
+                buf[d] = emmc().data;
+            }
         }
         
-        currentPtr += 128;
+        buf += BlockSize / 4;
     }
     
-    if (blocks > 1 && !(_scr[0] & SCR_SUPP_SET_BLKCNT) && (_scr[0] & SCR_SUPP_CCS)) {
+    // Wait for the last block to make it across the bus. For writes
+    // the card may still be busy programming, but that is picked up
+    // by the SR_DAT_INHIBIT check on the next transfer.
+    error = waitForInterrupt(INT_DATA_DONE);
+    if (error != SDCard::Error::OK) {
+        ERROR_LOG("ERROR: Timeout waiting for data done\n");
+        return Volume::Error::InternalError;
+    }
+
+    if (multi && !setBlockCount) {
         error = sendCommand(CMD_STOP_TRANS(), 0);
-        if (error != Error::OK) {
+        if (error != SDCard::Error::OK) {
             ERROR_LOG("ERROR: sending CMD_STOP_TRANS\n");
             return Volume::Error::InternalError;
         }
@@ -591,73 +811,322 @@ Volume::Error SDCard::read(char* buf, Block blockAddr, uint32_t blocks)
     return Volume::Error::OK;
 }
 
-Volume::Error SDCard::write(const char* buf, Block blockAddr, uint32_t blocks)
+static Volume::Error transfer(bool write, char* buf, Block blockAddr, uint32_t blocks)
 {
     if (blocks < 1) {
         blocks = 1;
     }
     
-    DEBUG_LOG("SDCard: writeBlock addr=%d, num=%d\n", blockAddr.value(), blocks);
+    DEBUG_LOG("SDCard: %s addr=%d, num=%d\n", write ? "write" : "read", blockAddr.value(), blocks);
 
-    if (readStatus(SR_DAT_INHIBIT) != Error::OK) {
-        ERROR_LOG("SDCard: writeBlock timeout on readStatus(SR_DAT_INHIBIT)\n");
+    uint32_t* currentPtr = reinterpret_cast<uint32_t*>(buf);
+    uint32_t currentAddr = blockAddr.value();
+    
+    // The block count field of the EMMC is 16 bits, so very large
+    // runs are split into the biggest transfers it can handle
+    while (blocks > 0) {
+        uint32_t count = (blocks > MaxBlocksPerTransfer) ? MaxBlocksPerTransfer : blocks;
+        Volume::Error error = transferBlocks(write, currentPtr, currentAddr, count);
+        if (error != Volume::Error::OK) {
+            return error;
+        }
+        
+        currentPtr += count * BlockSize / 4;
+        currentAddr += count;
+        blocks -= count;
+    }
+    
+    return Volume::Error::OK;
+}
+
+// Asynchronous request engine
+
+static Volume::Error startRequest(Volume::RawIO::Request* request)
+{
+    if (readStatus(SR_DAT_INHIBIT) != SDCard::Error::OK) {
+        ERROR_LOG("SDCard: startRequest timeout on readStatus(SR_DAT_INHIBIT)\n");
         return Volume::Error::InternalError;
     }
     
-    const uint32_t* currentPtr = reinterpret_cast<const uint32_t*>(buf);
-    Error error = Error::OK;
+    uint32_t size = request->blocks * BlockSize;
     
-    if (_scr[0] & SCR_SUPP_CCS) {
-        if (blocks > 1 && (_scr[0] & SCR_SUPP_SET_BLKCNT)) {
-            error = sendCommand(CMD_SET_BLOCKCNT(), blocks);
-            if(error != Error::OK) {
-                ERROR_LOG("SDCard: error sending CMD_SET_BLOCKCNT\n");
-                return Volume::Error::InternalError;
-            }
-        }
-        
-        emmc().blockSizeCount = (blocks << 16) | 512;
+    // For reads, get rid of any dirty lines before the DMA fills the buffer
+    // so they can't be written back on top of the incoming data later
+    cleanDataCache(request->buf, size);
+    if (!request->write) {
+        invalidateDataCache(request->buf, size);
+    }
+
+    if (request->write) {
+        _dmaControlBlock.transferInfo = DMA_TI_PERMAP(DMAPeripheralEMMC) | DMA_TI_WAIT_RESP | DMA_TI_SRC_INC | DMA_TI_DEST_DREQ;
+        _dmaControlBlock.sourceAddr = busAddr(request->buf);
+        _dmaControlBlock.destAddr = peripheralBusAddr(&emmc().data);
+    } else {
+        _dmaControlBlock.transferInfo = DMA_TI_PERMAP(DMAPeripheralEMMC) | DMA_TI_WAIT_RESP | DMA_TI_SRC_DREQ | DMA_TI_DEST_INC;
+        _dmaControlBlock.sourceAddr = peripheralBusAddr(&emmc().data);
+        _dmaControlBlock.destAddr = busAddr(request->buf);
+    }
+    _dmaControlBlock.transferLength = size;
+    _dmaControlBlock.stride = 0;
+    _dmaControlBlock.nextControlBlockAddr = 0;
+    cleanDataCache(&_dmaControlBlock, sizeof(_dmaControlBlock));
+    
+    dma(_dmaChannel).controlStatus = DMA_CS_RESET;
+    dma(_dmaChannel).controlBlockAddr = busAddr(&_dmaControlBlock);
+    dma(_dmaChannel).controlStatus = DMA_CS_ACTIVE;
+    
+    bool multi = request->blocks > 1;
+    bool setBlockCount = multi && (_scr[0] & SCR_SUPP_SET_BLKCNT);
+    _currentRequestNeedsStop = multi && !setBlockCount;
+    
+    SDCard::Error error = SDCard::Error::OK;
+    if (setBlockCount) {
+        error = sendCommand(CMD_SET_BLOCKCNT(), request->blocks);
+    }
+    
+    if (error == SDCard::Error::OK) {
+        emmc().blockSizeCount = (request->blocks << 16) | BlockSize;
+        ++_stats.transfers;
+        _stats.blocks += request->blocks;
         
-        error = sendCommand((blocks == 1) ? CMD_WRITE_SINGLE() : CMD_WRITE_MULTI(), blockAddr.value());
-        if (error != Error::OK) {
-            ERROR_LOG("SDCard: error sending CMD_WRITE_*\n");
-            return Volume::Error::InternalError;
+        uint32_t addr = request->blockAddr.value();
+        uint32_t arg = (_scr[0] & SCR_SUPP_CCS) ? addr : (addr * BlockSize);
+        if (request->write) {
+            error = sendCommand(multi ? CMD_WRITE_MULTI() : CMD_WRITE_SINGLE(), arg);
+        } else {
+            error = sendCommand(multi ? CMD_READ_MULTI() : CMD_READ_SINGLE(), arg);
         }
-    } else {
-        emmc().blockSizeCount = (1 << 16) | 512;
     }
     
-    for (uint32_t currentBlock = 0; currentBlock < blocks; ++currentBlock) {
-        if(!(_scr[0] & SCR_SUPP_CCS)) {
-            error = sendCommand(CMD_WRITE_SINGLE(), (blockAddr.value() + currentBlock) * 512);
-            if (error != Error::OK) {
-                ERROR_LOG("SDCard: error sending CMD_WRITE_SINGLE for addr %d\n", (blockAddr.value() + currentBlock) * 512);
-                return Volume::Error::InternalError;
-            }
+    if (error != SDCard::Error::OK) {
+        ERROR_LOG("SDCard: error starting %s request for addr %d\n", request->write ? "write" : "read", request->blockAddr.value());
+        dma(_dmaChannel).controlStatus = DMA_CS_RESET;
+        return Volume::Error::InternalError;
+    }
+    
+    // Have the EMMC interrupt us when the data is done or something goes wrong
+    _currentRequestDeadline = Timer::systemTime() + RequestTimeout + request->blocks * RequestTimePerBlock;
+    emmc().interruptEnable = INT_DATA_DONE | INT_ERROR_MASK;
+    return Volume::Error::OK;
+}
+
+static void startNextRequest()
+{
+    while (!_currentRequest && _requestHead) {
+        Volume::RawIO::Request* request = _requestHead;
+        _requestHead = request->next;
+        if (!_requestHead) {
+            _requestTail = nullptr;
         }
-        error = waitForInterrupt(INT_WRITE_RDY);
-        if (error != Error::OK) {
-            ERROR_LOG("ERROR: Timeout waiting for ready to write\n");
-            return Volume::Error::InternalError;
+        request->next = nullptr;
+        
+        _currentRequest = request;
+        Volume::Error error = startRequest(request);
+        if (error == Volume::Error::OK) {
+            return;
         }
         
-        for (uint32_t d = 0; d < 128; d++) {
-            emmc().data = currentPtr[d];
+        _currentRequest = nullptr;
+        if (request->completion) {
+            request->completion(request, error);
+        }
+    }
+}
+
+static void handleEMMCInterrupt()
+{
+    uint32_t r = emmc().interrupt;
+    if (!_currentRequest || (r & (INT_DATA_DONE | INT_ERROR_MASK)) == 0) {
+        return;
+    }
+    
+    emmc().interruptEnable = 0;
+    emmc().interrupt = r;
+    
+    Volume::Error error = Volume::Error::OK;
+    
+    if (r & INT_ERROR_MASK) {
+        ERROR_LOG("SDCard: request failed, interrupt=0x%08x\n", r);
+        dma(_dmaChannel).controlStatus = DMA_CS_RESET;
+        emmc().control1 |= C1_SRST_DATA;
+        checkStatusWithTimeout(
+            []{ return (emmc().control1 & C1_SRST_DATA) == 0; },
+            "SDCard: timeout resetting data line");
+        error = Volume::Error::InternalError;
+    } else {
+        // The last writes from the DMA to memory might still be in flight
+        if (!checkStatusWithTimeout(
+            []{ return (dma(_dmaChannel).controlStatus & DMA_CS_ACTIVE) == 0; },
+            "SDCard: timeout waiting for DMA to finish")) {
+            error = Volume::Error::InternalError;
         }
         
-        currentPtr += 128;
+        if (_currentRequestNeedsStop && sendCommand(CMD_STOP_TRANS(), 0) != SDCard::Error::OK) {
+            ERROR_LOG("ERROR: sending CMD_STOP_TRANS\n");
+            error = Volume::Error::InternalError;
+        }
     }
     
-    // Sleep to give write a chance to finish
-    Timer::usleep(50000);
+    Volume::RawIO::Request* request = _currentRequest;
+    _currentRequest = nullptr;
+    
+    if (!request->write) {
+        invalidateDataCache(request->buf, request->blocks * BlockSize);
+    }
+    
+    // Get the next transfer going before telling the caller about this one
+    startNextRequest();
+    
+    if (request->completion) {
+        request->completion(request, error);
+    }
+}
 
-    if (blocks > 1 && !(_scr[0] & SCR_SUPP_SET_BLKCNT) && (_scr[0] & SCR_SUPP_CCS)) {
-        error = sendCommand(CMD_STOP_TRANS(), 0);
-        if (error != Error::OK) {
-            ERROR_LOG("ERROR: sending CMD_STOP_TRANS\n");
-            return Volume::Error::InternalError;
+// Give up on the current request and everything queued behind it. The
+// card has stopped responding, so there's no point starting the rest. The
+// queue is emptied before any completions are called, so a completion can
+// submit a new request.
+static void failRequests(Volume::Error error)
+{
+    emmc().interruptEnable = 0;
+    emmc().interrupt = emmc().interrupt;
+    dma(_dmaChannel).controlStatus = DMA_CS_RESET;
+    emmc().control1 |= C1_SRST_DATA;
+    checkStatusWithTimeout(
+        []{ return (emmc().control1 & C1_SRST_DATA) == 0; },
+        "SDCard: timeout resetting data line");
+    
+    Volume::RawIO::Request* request = _currentRequest;
+    request->next = _requestHead;
+    _currentRequest = nullptr;
+    _requestHead = nullptr;
+    _requestTail = nullptr;
+    
+    while (request) {
+        Volume::RawIO::Request* next = request->next;
+        request->next = nullptr;
+        if (request->completion) {
+            request->completion(request, error);
+        }
+        request = next;
+    }
+}
+
+// Programmed I/O can't be mixed with a DMA transfer in progress, so finish
+// off any queued requests first. This might be called with IRQs disabled,
+// so poll for completion instead of waiting for the interrupt. If a
+// request doesn't complete in time, it and the rest of the queue are
+// failed and an error is returned.
+static Volume::Error drainRequests()
+{
+    if (!_currentRequest) {
+        return Volume::Error::OK;
+    }
+    
+    Volume::Error error = Volume::Error::OK;
+    bool wasDisabled = irqsDisabled();
+    disableIRQ();
+    while (_currentRequest) {
+        handleEMMCInterrupt();
+        if (_currentRequest && Timer::systemTime() >= _currentRequestDeadline) {
+            ERROR_LOG("SDCard: request for addr %d timed out\n", _currentRequest->blockAddr.value());
+            error = Volume::Error::InternalError;
+            failRequests(error);
+        }
+    }
+    if (!wasDisabled) {
+        enableIRQ();
+    }
+    return error;
+}
+
+static void initDMA()
+{
+    // Use the first full DMA channel the GPU says is free. Channels 7 and
+    // up are the lite channels, which are slower and limited to 64KB
+    uint32_t mask = 0;
+    if (Mailbox::getParameter(Mailbox::Command::GetDMAChannels, &mask, 1) != Mailbox::Error::OK) {
+        return;
+    }
+    
+    for (uint32_t channel = 1; channel < 7; ++channel) {
+        if (mask & (1 << channel)) {
+            _dmaChannel = channel;
+            break;
         }
     }
     
+    if (_dmaChannel == NoDMAChannel) {
+        DEBUG_LOG("SDCard: no DMA channel available, using programmed I/O\n");
+        return;
+    }
+    
+    *reinterpret_cast<volatile uint32_t*>(DMAEnableAddr) |= 1 << _dmaChannel;
+    _mode.dma = true;
+    dma(_dmaChannel).controlStatus = DMA_CS_RESET;
+    
+    emmc().interruptEnable = 0;
+    InterruptManager::instance().addInterruptHandler(EMMCInterruptBit, handleEMMCInterrupt);
+    InterruptManager::instance().enableIRQ(EMMCInterruptBit, true);
+    DEBUG_LOG("SDCard: using DMA channel %d\n", _dmaChannel);
+}
+
+SDCard::Mode SDCard::mode() const
+{
+    return _mode;
+}
+
+const SDCard::Stats& SDCard::stats() const
+{
+    return _stats;
+}
+
+Volume::Error SDCard::read(char* buf, Block blockAddr, uint32_t blocks)
+{
+    Volume::Error error = drainRequests();
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    return transfer(false, buf, blockAddr, blocks);
+}
+
+Volume::Error SDCard::write(const char* buf, Block blockAddr, uint32_t blocks)
+{
+    Volume::Error error = drainRequests();
+    if (error != Volume::Error::OK) {
+        return error;
+    }
+    return transfer(true, const_cast<char*>(buf), blockAddr, blocks);
+}
+
+Volume::Error SDCard::submit(Request* request)
+{
+    // Fall back to programmed I/O when there's no DMA channel or when the
+    // buffer doesn't start on a cache line. Cache maintenance on a shared
+    // line could clobber a neighbor's data.
+    if (_dmaChannel == NoDMAChannel || request->blocks == 0 || request->blocks > MaxBlocksPerTransfer ||
+            (reinterpret_cast<uint32_t>(request->buf) & (CacheLineSize - 1)) != 0) {
+        return RawIO::submit(request);
+    }
+    
+    request->next = nullptr;
+    
+    bool wasDisabled = irqsDisabled();
+    disableIRQ();
+    
+    if (_requestTail) {
+        _requestTail->next = request;
+    } else {
+        _requestHead = request;
+    }
+    _requestTail = request;
+    
+    if (!_currentRequest) {
+        startNextRequest();
+    }
+    
+    if (!wasDisabled) {
+        enableIRQ();
+    }
     return Volume::Error::OK;
 }
@@ -112,6 +112,12 @@ int64_t Timer::systemTime()
     return (static_cast<int64_t>(systemTimer().counter1) << 32) | static_cast<int64_t>(systemTimer().counter0);
 }
 
+int64_t Timer::systemTimeNS()
+{
+    // The system timer counts at 1MHz
+    return systemTime() * 1000;
+}
+
 void Timer::usleep(uint32_t us)
 {
     int64_t t0 = systemTime();
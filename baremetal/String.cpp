@@ -15,6 +15,8 @@
 #include "bare/String.h"
 
 #include "bare/Formatter.h"
+#include "bare/ObjectCache.h"
+#include <cstdlib>
 
 using namespace bare;
 
@@ -34,19 +36,83 @@ String::String(const char* s, int32_t len) : _size(1), _capacity(0), _data(nullp
     _data[_size - 1] = '\0';
 }
 
+// The words from splitting a command line and most other strings fit in
+// these. The caches are made on first use, so static Strings can use them.
+static constexpr size_t SmallBufferSizes[] = { 16, 32, 64 };
+static constexpr uint32_t SmallBufferCaches = sizeof(SmallBufferSizes) / sizeof(SmallBufferSizes[0]);
+
+static ObjectCacheBase& smallBufferCache(uint32_t i)
+{
+    static ObjectCacheBase caches[SmallBufferCaches] = {
+        { "String16", SmallBufferSizes[0], 1 },
+        { "String32", SmallBufferSizes[1], 1 },
+        { "String64", SmallBufferSizes[2], 1 },
+    };
+    return caches[i];
+}
+
+char* String::allocBuffer(size_t& capacity)
+{
+    for (uint32_t i = 0; i < SmallBufferCaches; ++i) {
+        if (capacity <= SmallBufferSizes[i]) {
+            capacity = SmallBufferSizes[i];
+            return static_cast<char*>(smallBufferCache(i).alloc());
+        }
+    }
+    return static_cast<char*>(::malloc(capacity));
+}
+
+char* String::growBuffer(char* buffer, size_t used, size_t oldCapacity, size_t& capacity)
+{
+    // Big buffers are realloced, which can often grow them without a copy
+    if (buffer && oldCapacity > SmallBufferSizes[SmallBufferCaches - 1]) {
+        char* newBuffer = static_cast<char*>(::realloc(buffer, capacity));
+        if (!newBuffer) {
+            ::free(buffer);
+        }
+        return newBuffer;
+    }
+    
+    char* newBuffer = allocBuffer(capacity);
+    if (buffer) {
+        if (newBuffer) {
+            memcpy(newBuffer, buffer, used);
+        }
+        freeBuffer(buffer, oldCapacity);
+    }
+    return newBuffer;
+}
+
+void String::freeBuffer(char* buffer, size_t capacity)
+{
+    if (!buffer) {
+        return;
+    }
+    for (uint32_t i = 0; i < SmallBufferCaches; ++i) {
+        if (capacity == SmallBufferSizes[i]) {
+            smallBufferCache(i).free(buffer);
+            return;
+        }
+    }
+    ::free(buffer);
+}
+
 String& String::operator=(const String& other)
 {
-    if (_data) {
-        delete [ ] _data;
+    if (this == &other) {
+        return *this;
     }
+    
+    freeBuffer(_data, _capacity);
     _size = other._size;
-    _capacity = other._capacity;
+    _capacity = other._size;
     if (!other._data) {
         _data = nullptr;
+        _capacity = 0;
         return *this;
     }
     
-    _data = new char[_capacity];
+    _data = allocBuffer(_capacity);
     assert(_data);
     if (_data) {
         memcpy(_data, other._data, _size);
@@ -15,10 +15,17 @@
 #include "bare/Timer.h"
 
 #include "bare/InterruptManager.h"
+#include "bare/ObjectCache.h"
 #include "bare/Serial.h"
 
 using namespace bare;
 
+// Timers are made with allocate_shared, so each one is a single block
+// with its shared_ptr control block. That adds a vtable pointer, the
+// counts and the allocator to the Timer. If a library's control block is
+// bigger the allocator falls back to operator new.
+static ObjectCacheBase timerCache("Timer", sizeof(Timer) + 4 * sizeof(void*), alignof(Timer));
+
 std::shared_ptr<Timer> Timer::create(Handler handler)
 {
     struct MakeSharedEnabler : public Timer
@@ -26,7 +33,7 @@ std::shared_ptr<Timer> Timer::create(Handler handler)
         MakeSharedEnabler(Handler handler) : Timer(handler) { }
     };
     
-    std::shared_ptr<MakeSharedEnabler> timer = std::make_shared<MakeSharedEnabler>(handler);
+    std::shared_ptr<MakeSharedEnabler> timer = std::allocate_shared<MakeSharedEnabler>(ObjectCacheAllocator<MakeSharedEnabler>(timerCache), handler);
     TimerManager::instance().add(timer);
     return timer;
 }
@@ -36,8 +43,9 @@ void Timer::TimerManager::fireTimers()
     int64_t currentTime = systemTime();
     for (std::shared_ptr<Timer> timer : _timers) {
         if (timer->_timeToFire <= currentTime) {
-            timer->_handler(timer);
+            // Set the next time to fire first, so the handler can restart the timer
             timer->_timeToFire = timer->_repeat ? (currentTime + timer->_timeout) : DoNotFire;
+            timer->_handler(timer);
         } else {
             break;
         }
@@ -34,7 +34,24 @@ const char* Volume::errorDetail(Error error) const
     case Error::EndOfFile: return "end of file";
     case Error::UnsupportedDevice: return "unsupported device";
     case Error::NotImplemented: return "not implemented";
+    case Error::NotADirectory: return "not a directory";
+    case Error::IsADirectory: return "is a directory";
+    case Error::DirectoryNotEmpty: return "directory not empty";
+    case Error::InvalidName: return "invalid name";
+    case Error::CrossVolume: return "not on the same volume";
+    case Error::FileBusy: return "file is open";
     default: return "*****";
     }
 }
 
+Volume::Error Volume::RawIO::submit(Request* request)
+{
+    Volume::Error error = request->write ?
+        write(request->buf, request->blockAddr, request->blocks) :
+        read(request->buf, request->blockAddr, request->blocks);
+    
+    if (request->completion) {
+        request->completion(request, error);
+    }
+    return Volume::Error::OK;
+}
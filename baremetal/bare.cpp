@@ -14,26 +14,20 @@
 
 #include "bare/Serial.h"
 #include "bare/Timer.h"
+#include <new>
 
 using namespace bare;
 
 void* bare::aligned_alloc(size_t align, size_t size)
 {
-    if(align < alignof(void*)) { 
-        align = alignof(void*); 
-    }
-    
-    size_t space = size + align - 1;
-    void* allocated_mem = ::operator new(space + sizeof(void*));
-    void* aligned_mem = static_cast<void*>(static_cast<char*>(allocated_mem) + sizeof(void*)); 
-    std::align(align, size, aligned_mem, space);
-    *(static_cast<void**>(aligned_mem) - 1) = allocated_mem;
-    return aligned_mem;
+    // The kernel's aligned operator new goes to the Allocator, which aligns
+    // without a separate header
+    return ::operator new(size, std::align_val_t(align));
 }
 
-void bare::aligned_free(void* ptr)
+void bare::aligned_free(void* ptr, size_t align)
 {
-    ::operator delete(*(static_cast<void**>(ptr) - 1));
+    ::operator delete(ptr, std::align_val_t(align));
 }
 
 #ifdef PLATFORM_RPI
@@ -25,7 +25,10 @@
 //      PLATFORM_RPI        - Raspberry Pi (defined in baremetal/Makefile)
 //      PLATFORM_CIRCLE     - Raspberry Pi using the Circle library
 //      PLATFORM_ESP        - ESP8266 (defined if ESP8266 is defined)
-#if defined(__APPLE__)
+//      PLATFORM_HOST       - Host side tools, like tools/fatimage (defined in their Makefile)
+//      PLATFORM_LINUX      - Kernel running as a Linux process (defined in baremetal/Linux/Common.mk)
+#if defined(PLATFORM_HOST) || defined(PLATFORM_LINUX)
+#elif defined(__APPLE__)
 #define PLATFORM_APPLE
 #elif defined(ESP8266)
 #define PLATFORM_ESP
@@ -56,8 +59,9 @@ namespace bare {
     using ReceiveFunction = std::function<bool(char byte)>;
     bool receiveFile(ReceiveFunction);
     
+    // Memory from aligned_alloc must be freed with the same align
     void* aligned_alloc(size_t align, size_t size);
-    void aligned_free(void*);
+    void aligned_free(void*, size_t align);
     
     void runCode(void* memory, uint32_t size, uint32_t startOffset);
 
@@ -85,7 +89,7 @@ namespace bare {
     static inline bool isLCHex(uint8_t c)       { return c >= 'a' && c <= 'f'; }
     static inline bool isUCHex(uint8_t c)       { return c >= 'A' && c <= 'F'; }
     static inline bool isHex(uint8_t c)         { return isUCHex(c) || isLCHex(c); }
-    static inline bool isXDigit(uint8_t c)        { return isHex(c) || isdigit(c); }
+    static inline bool isXDigit(uint8_t c)        { return isHex(c) || isDigit(c); }
     static inline bool isOctal(uint8_t c)       { return c >= '0' && c <= '7'; }
     static inline bool isUpper(uint8_t c)        { return (c >= 'A' && c <= 'Z'); }
     static inline bool isLower(uint8_t c)        { return (c >= 'a' && c <= 'z'); }
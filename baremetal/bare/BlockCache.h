@@ -0,0 +1,127 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Volume.h"
+#include <stdint.h>
+
+namespace bare {
+    
+    // BlockCache
+    //
+    // Write-back LRU cache of device blocks. It sits between a RawIO device
+    // and a Volume, so everything the Volume reads and writes goes through
+    // it. Single block reads and writes are cached. Multi-block transfers
+    // and asynchronous requests are file data, which would just push the
+    // metadata out of the cache, so they go straight to the device. Any
+    // cached copies are kept coherent with them.
+    //
+    // Blocks can be pinned, which keeps them in the cache and gives direct
+    // access to the cached data until they are unpinned.
+    class BlockCache : public Volume::RawIO
+    {
+    public:
+        static constexpr uint32_t DefaultSize = 64;
+        
+        struct Stats
+        {
+            uint32_t hits = 0;
+            uint32_t misses = 0;
+            uint32_t uncached = 0;      // blocks transferred around the cache
+            uint32_t evictions = 0;
+            uint32_t writeBacks = 0;
+        };
+        
+        BlockCache(Volume::RawIO* rawIO, uint32_t size = DefaultSize);
+        ~BlockCache();
+        
+        virtual Volume::Error read(char* buf, Block blockAddr, uint32_t blocks) override;
+        virtual Volume::Error write(const char* buf, Block blockAddr, uint32_t blocks) override;
+        
+        // Pass the request on to the device, keeping the cache coherent with
+        // it. Blocks it reads are written back first if they're dirty, and
+        // cached copies of blocks it writes are updated.
+        virtual Volume::Error submit(Request*) override;
+        
+        // Write all dirty blocks back to the device, in block order
+        virtual Volume::Error flush() override;
+        
+        // Return a pointer to the cached data for the block, loading it if
+        // needed. If load is false the caller is going to overwrite the whole
+        // block so it isn't read. Returns nullptr on error or if every block
+        // in the cache is pinned.
+        char* pin(Block block, bool load = true);
+        
+        // Release a pinned block. Pass dirty if the data was changed
+        void unpin(Block block, bool dirty);
+        
+        uint32_t size() const { return _size; }
+        uint32_t dirtyCount() const;
+        uint32_t pinnedCount() const;
+        const Stats& stats() const { return _stats; }
+        void resetStats() { _stats = Stats(); }
+    
+    private:
+        static constexpr uint32_t None = 0xffffffff;
+        
+        struct Entry
+        {
+            uint32_t block = 0;
+            uint32_t pinCount = 0;
+            bool valid = false;
+            bool dirty = false;
+            
+            // LRU list and hash chain links, as entry indexes
+            uint32_t prev = None;
+            uint32_t next = None;
+            uint32_t hashNext = None;
+        };
+        
+        char* data(uint32_t index) const { return _data + index * BlockSize; }
+        uint32_t hash(uint32_t block) const { return block & (_hashSize - 1); }
+        
+        uint32_t find(uint32_t block) const;
+        
+        // Get an entry for the block, evicting the least recently used
+        // unpinned one if needed. The entry is returned invalid and at the
+        // front of the LRU list. Returns None if everything is pinned or
+        // the evicted block could not be written back.
+        uint32_t allocate(uint32_t block);
+        
+        // Find the block, loading it if needed. Sets index to None without
+        // an error if the block can't be cached because everything is pinned.
+        Volume::Error lookup(uint32_t block, bool load, uint32_t& index);
+        
+        Volume::Error writeBack(uint32_t index);
+        
+        void unlinkLRU(uint32_t index);
+        void pushFrontLRU(uint32_t index);
+        void pushBackLRU(uint32_t index);
+        void removeHash(uint32_t index);
+        
+        Volume::RawIO* _rawIO = nullptr;
+        
+        uint32_t _size = 0;
+        Entry* _entries = nullptr;
+        char* _data = nullptr;
+        
+        uint32_t* _hashTable = nullptr;
+        uint32_t _hashSize = 0;
+        
+        uint32_t _lruHead = None;   // most recently used
+        uint32_t _lruTail = None;   // least recently used
+        
+        Stats _stats;
+    };
+
+}
@@ -21,10 +21,30 @@ namespace bare {
 class ClusterType;
 using Cluster = Scalar<ClusterType, uint32_t>;
 
+    class FAT32DirectoryIndex;
+    struct FATDirEntry;
+    
     class FAT32 : public Volume
     {
     public:
-        static constexpr uint32_t FilenameLength = 32;
+        // Long names are up to 255 characters, in up to 20 LFN entries
+        static constexpr uint32_t FilenameLength = 256;
+        static constexpr uint32_t MaxLongNameEntries = 20;
+        
+        // Number of FAT blocks cached in memory
+        static constexpr uint32_t DefaultFATCacheBlocks = 16;
+        static constexpr uint32_t MaxFATCacheBlocks = 64;
+        
+        // Most blocks one operation adds to a journal transaction. Long
+        // allocations and frees are split into steps which stay under it.
+        static constexpr uint32_t MaxOperationBlocks = 32;
+        
+        // Most blocks held in one journal transaction, and the name of the
+        // file in the root directory which holds the journal. A commit
+        // holds every dirty FAT cache block, FSInfo and the operation which
+        // ended last, so a transaction never has to be split.
+        static constexpr uint32_t JournalBlocks = MaxFATCacheBlocks + 1 + MaxOperationBlocks;
+        static constexpr const char* JournalName = "PLACID.JNL";
         
         enum class Error {
             UnsupportedType = 1000, 
@@ -37,30 +57,55 @@ using Cluster = Scalar<ClusterType, uint32_t>;
             BPBReadError,
             FATReadError,
             FATWriteError,
+            FSInfoWriteError,
             DirReadError,
             OnlyFAT32LBASupported,
             InvalidFAT32Volume,
             WrongSizeRead,
             WrongSizeWrite,
             Incomplete,
+            JournalError,
         };
         
         struct FileInfo {
-            char name[FilenameLength]; // Passed in name converted to 8.3
+            char name[FilenameLength]; // Long name if there is one, otherwise the 8.3 name
+            char shortName[11];        // 8.3 name as stored in the directory entry
+            uint8_t attr = 0;
             uint32_t size = 0;
             Cluster baseCluster = 0;
-            Block directoryBlock = 0;
+            Cluster directoryCluster = 0;
+            Block directoryBlock = 0;       // block and index of the 8.3 entry
             uint32_t directoryBlockIndex = 0;
+            uint32_t directorySlot = 0;     // position of the first (LFN) entry in the directory
+            uint32_t directoryEntries = 1;  // number of entries, including LFN entries
+            
+            bool subdir() const { return (attr & 0x10) != 0; }
+        };
+
+        struct FATStats
+        {
+            uint32_t hits = 0;
+            uint32_t misses = 0;
+            uint32_t reads = 0;         // FAT blocks read from the device
+            uint32_t writes = 0;        // FAT blocks written to the first FAT
+            uint32_t mirrorWrites = 0;  // FAT blocks copied to the second FAT
+            uint32_t journalCommits = 0;
+            uint32_t journalBlocks = 0; // blocks written to their home locations through the journal
+            uint32_t replayedBlocks = 0;
         };
 
-        FAT32(Volume::RawIO* rawIO, uint8_t partition) : _rawIO(rawIO), _partition(partition) { }
+        FAT32(Volume::RawIO* rawIO, uint8_t partition, uint32_t fatCacheBlocks = DefaultFATCacheBlocks);
+        ~FAT32();
         
         virtual uint32_t sizeInBlocks() const override { return _sizeInBlocks; }
         virtual Volume::Error mount() override;
+        virtual Volume::Error sync() override;
         virtual RawFile* open(const char* name) override;
         virtual Volume::Error create(const char* name) override;
         virtual Volume::Error remove(const char* name) override;
+        virtual Volume::Error createDirectory(const char* name) override;
         virtual bool exists(const char* name) override;
+        virtual bool fileID(const char* name, uint64_t& id) override;
         virtual const char* errorDetail(Volume::Error) const override;
         virtual DirectoryIterator* directoryIterator(const char* path) override;
         virtual Volume::Error error() const override
@@ -75,9 +120,48 @@ using Cluster = Scalar<ClusterType, uint32_t>;
         Volume::Error rawRead(char* buf, Block block, uint32_t blocks);    
         Volume::Error rawWrite(const char* buf, Block block, uint32_t blocks);    
         
+        // Write FAT, FSInfo or directory blocks. If the journal is enabled
+        // they are held in the current transaction until it's committed.
+        Volume::Error writeMetadata(const char* buf, Block block, uint32_t blocks);
+        
+        // The journal makes metadata updates crash consistent. Changed
+        // metadata blocks are kept in memory until a commit, when they are
+        // written to the journal file in one sequential transfer and only
+        // then to their home locations. Commits happen on sync and between
+        // operations, never in the middle of one. If the journal file
+        // exists, mount() replays a transaction which was committed but
+        // might not have reached home, so recovery only needs to read the
+        // journal. FAT blocks go home to both FATs, so the second FAT has
+        // no separate copy in the journal.
+        Volume::Error enableJournal();
+        Volume::Error disableJournal();
+        bool journalEnabled() const { return _journalBlock.value() != 0; }
+        
+        // Every call which changes metadata holds one of these. When the
+        // outermost one ends the metadata is consistent, so it's a commit
+        // point.
+        class Operation
+        {
+        public:
+            Operation(FAT32* fat32) : _fat32(fat32) { ++_fat32->_operations; }
+            ~Operation() { if (--_fat32->_operations == 0) { _fat32->commitPoint(); } }
+        
+        private:
+            FAT32* _fat32;
+        };
+        
         Cluster rootDirectoryStartCluster() const { return _rootDirectoryStartCluster; }
-        uint32_t blocksPerCluster() { return _blocksPerCluster; }
-        uint32_t clusterSize() { return _blocksPerCluster * 512; }
+        uint32_t blocksPerCluster() const { return _blocksPerCluster; }
+        uint32_t clusterSize() const { return _blocksPerCluster * 512; }
+        uint32_t clusterCount() const { return _clusterCount; }
+        Block startFATBlock() const { return _startFATBlock; }
+        uint32_t blocksPerFAT() const { return _blocksPerFAT; }
+        Block fsInfoBlock() const { return _fsInfoBlock; }
+        
+        // Write an empty volume to a device of sizeInBlocks, with an MBR
+        // and a single FAT32 partition. This is for tools which build card
+        // images, so it doesn't need a mounted volume.
+        static Volume::Error format(Volume::RawIO* rawIO, uint32_t sizeInBlocks, uint8_t blocksPerCluster);
         
         Block clusterToBlock(Cluster cluster)
         {
@@ -90,9 +174,24 @@ using Cluster = Scalar<ClusterType, uint32_t>;
         // Passing 0 as prev Cluster indicates that this is the first cluster of a file
         Cluster allocateCluster(Cluster prev = 0);
         
+        // Allocate count clusters and insert them after prev. They go right
+        // after prev if those clusters are free. Otherwise they go in the
+        // smallest free run big enough for all of them, or if there isn't
+        // one, in the fewest, largest runs available. Returns the first cluster
+        // allocated, or 0 if none could be. allocated is set to the number
+        // of clusters actually allocated, which is less than count if the
+        // volume is full. Otherwise each run is a commit point. A new chain
+        // (prev of 0) isn't linked to anything yet, so if a commit is needed
+        // it stops there and the caller extends the chain once it's linked.
+        Cluster allocateClusters(Cluster prev, uint32_t count, uint32_t& allocated);
+        
+        // Free the chain starting at start, which must no longer be linked
+        // to anything, so each FAT block is a commit point
         bool freeClusters(Cluster start);
         
-        static uint32_t bufToUInt32(uint8_t* buf)
+        uint32_t freeClusterCount() const { return _freeClusterCount; }
+        
+        static uint32_t bufToUInt32(const uint8_t* buf)
         {
             return  static_cast<uint32_t>(buf[0]) + 
                     static_cast<uint32_t>((buf[1] << 8)) + 
@@ -100,7 +199,7 @@ using Cluster = Scalar<ClusterType, uint32_t>;
                     static_cast<uint32_t>((buf[3] << 24));
         }
 
-        static uint16_t bufToUInt16(uint8_t* buf)
+        static uint16_t bufToUInt16(const uint8_t* buf)
         {
             return  static_cast<uint16_t>(buf[0]) + 
                     static_cast<uint16_t>((buf[1] << 8));
@@ -120,13 +219,192 @@ using Cluster = Scalar<ClusterType, uint32_t>;
             buf[1] = static_cast<uint8_t>(value >> 8);
         }
         
-        static void convertTo8dot3(char* name8dot3, const char* name);
+        // Format the 11 character name from a directory entry as NAME.EXT,
+        // using the case flags from the entry
+        static void formatShortName(char* name, const char* name11, uint8_t caseFlags);
+        static uint8_t shortNameChecksum(const char* name11);
+        
+        // A file is identified by the location of its 8.3 entry
+        static uint64_t directoryEntryID(Block block, uint32_t index) { return (static_cast<uint64_t>(block.value()) << 4) | index; }
+        
+        // Rename or move the file whose 8.3 entry is at block/index in the
+        // directory starting at directoryCluster. to is a path. On success
+        // all three are changed to the location of the new entry.
+        Volume::Error renameEntry(Cluster& directoryCluster, Block& block, uint32_t& index, const char* to);
+        
+        const FATStats& fatStats() const { return _fatStats; }
 
     private:
-        bool find(FileInfo&, const char* name);
-        bool readFATBlock(uint32_t block);
-        bool writeFATBlock();
-
+        struct FATCacheEntry
+        {
+            char* buf = nullptr;
+            uint32_t block = 0;         // relative to the start of the FAT
+            uint32_t lastUsed = 0;
+            bool valid = false;
+            bool dirty = false;
+        };
+        
+        static constexpr uint32_t MaxDirectoryIndexes = 8;
+        static constexpr uint32_t DentryCacheSize = 64;
+        static constexpr uint32_t DentryNameLength = 32;
+        
+        // Entry in the cache of directories found by walking paths. parent
+        // is the cluster of the directory containing the named directory
+        // and cluster is its first cluster, or 0 if the entry is empty.
+        struct Dentry
+        {
+            uint32_t parent = 0;
+            uint32_t cluster = 0;
+            char name[DentryNameLength];
+        };
+        
+        bool find(FileInfo&, const char* path);
+        
+        // Walk all but the last component of path. directory is set to the
+        // directory containing the last component and the component is
+        // copied to leaf, which must be FilenameLength long. leaf is empty
+        // if the path names the root directory.
+        Volume::Error resolvePath(const char* path, Cluster& directory, char* leaf);
+        
+        // Find the subdirectory name in parent, using the dentry cache
+        Volume::Error lookupDirectory(Cluster parent, const char* name, Cluster& directory);
+        Dentry& dentry(Cluster parent, const char* name);
+        
+        // Drop everything cached about a directory which is going away
+        void forgetDirectory(Cluster directory);
+        
+        // Look up a name in the directory
+        bool findInDirectory(Cluster directoryCluster, const char* name, FileInfo&);
+        bool readDirEntry(Block block, uint32_t index, FileInfo&);
+        
+        // Return the index for the directory, building it if needed
+        FAT32DirectoryIndex* directoryIndex(Cluster directoryCluster);
+        
+        // Add a directory entry for name to the directory. The name and case
+        // flags of entry are filled in, along with any LFN entries needed. The
+        // rest of entry must be set by the caller. fileInfo is set to the
+        // location of the new entry.
+        Volume::Error addEntry(Cluster directoryCluster, const char* name, FATDirEntry& entry, FileInfo& fileInfo);
+        
+        // Find count consecutive free entries in the directory. slot is set
+        // to the first one, which may be past the end of the directory.
+        bool findFreeEntries(Cluster directoryCluster, uint32_t count, uint32_t& slot);
+        
+        // Write count entries starting at slot, growing the directory if
+        // needed. block and index are set to the location of the last entry.
+        Volume::Error writeDirEntries(Cluster directoryCluster, uint32_t slot, const FATDirEntry* entries, uint32_t count, Block& block, uint32_t& index);
+        
+        // Mark count entries starting at slot as deleted
+        Volume::Error deleteDirEntries(Cluster directoryCluster, uint32_t slot, uint32_t count);
+        
+        Volume::Error clearBlocks(Block block, uint32_t count);
+        
+        static bool validName(const char* name);
+        
+        // Make the 11 character 8.3 name for name. Returns false if name
+        // can't be stored as an 8.3 name and needs LFN entries.
+        static bool shortNameFor(const char* name, char* name11, uint8_t& caseFlags);
+        
+        // Make a NAME~N.EXT alias for name which isn't already in the directory
+        static bool makeShortAlias(FAT32DirectoryIndex*, const char* name, char* name11);
+        
+        // Return the cache entry holding the FAT block, loading it if needed
+        FATCacheEntry* fatBlock(uint32_t block);
+        bool writeFATBlock(FATCacheEntry*);
+        
+        bool readFATEntry(Cluster cluster, uint32_t& value);
+        bool writeFATEntry(Cluster cluster, uint32_t value);
+        
+        // A search for a run of free clusters. It keeps the smallest run of
+        // at least count clusters (a fit) and the longest shorter run. The
+        // search is bounded: it stops at an exact fit, or CandidateSearchBlocks
+        // FAT blocks after the first candidate, cutting short the run it's
+        // in. A search for fits only skips blocks with too few free entries
+        // to start one and gives up after MaxFitSearchBlocks blocks.
+        // Otherwise any run is a candidate.
+        static constexpr uint32_t CandidateSearchBlocks = 8;
+        static constexpr uint32_t MaxFitSearchBlocks = 64;
+        
+        struct RunSearch
+        {
+            RunSearch(uint32_t count, bool fitsOnly) : count(count), fitsOnly(fitsOnly) { }
+            
+            // End the current run. Returns true if it fits exactly.
+            bool endRun();
+            bool hasCandidate() const;
+            bool done() const;
+            
+            uint32_t count;
+            bool fitsOnly;
+            uint32_t blocksSearched = 0;
+            uint32_t blocksSinceCandidate = 0;
+            uint32_t fitStart = 0;
+            uint32_t fitLength = 0;
+            uint32_t longestStart = 0;
+            uint32_t longestLength = 0;
+            uint32_t currentStart = 0;
+            uint32_t currentLength = 0;
+        };
+        
+        // Look for a run of count free clusters from start to the end of the
+        // volume and then from the beginning. The best fit found is used,
+        // or if there's none, the longest run near start. The range version
+        // looks from from to to, taking the first run found and whatever is
+        // near it. runLength is 0 if no free clusters were found. Returns
+        // false on error.
+        bool findFreeRun(uint32_t start, uint32_t count, uint32_t& runStart, uint32_t& runLength);
+        bool findFreeRun(uint32_t from, uint32_t to, uint32_t count, uint32_t& runStart, uint32_t& runLength);
+        bool searchFreeRun(RunSearch&, uint32_t from, uint32_t to);
+        
+        // Mark every FAT block's free count as not counted yet. Blocks are
+        // counted as they're loaded into the FAT cache.
+        void initFreeSummary();
+        
+        // Count the free entries in a FAT block's data
+        uint8_t countFreeEntries(uint32_t block, const char* buf) const;
+        void setFreeCount(uint32_t block, uint8_t count);
+        
+        // Count the free clusters in every block not yet counted, reading
+        // the FAT directly. For volumes without a usable FSInfo free count.
+        bool countFreeClusters();
+        
+        // Read the FSInfo block. Returns true if it has a free count, which
+        // is then used as the total until every FAT block is counted.
+        bool readFSInfo(Block);
+        bool writeFSInfo();
+        
+        bool mirrorPending(uint32_t block) const { return (_fatMirrorPending[block / 32] & (1 << (block % 32))) != 0; }
+        void setMirrorPending(uint32_t block) { _fatMirrorPending[block / 32] |= 1 << (block % 32); }
+        void clearMirrorPending(uint32_t block) { _fatMirrorPending[block / 32] &= ~(1 << (block % 32)); }
+        
+        // Find the journal file and replay its last transaction if it was
+        // committed. Returns false on error. The journal stays disabled if
+        // there's no journal file.
+        bool openJournal();
+        
+        // Write the current transaction to the journal, then to the home
+        // locations of its blocks, then mark the journal empty
+        Volume::Error commitJournal();
+        
+        // Write the dirty FAT cache blocks and FSInfo and commit them with
+        // the rest of the transaction
+        Volume::Error commit();
+        
+        // Called where the metadata is consistent. Commit if the next
+        // operation might not fit in the transaction.
+        bool commitPoint();
+        bool commitNeeded() const;
+        
+        // Fill in the journal header for a transaction of count blocks,
+        // including the checksum of the header and blocks
+        void setJournalHeader(uint32_t sequence, uint32_t count);
+        
+        uint32_t journalHome(uint32_t i) const;
+        char* journalImage(uint32_t i) const { return _journalBuffer + (i + 1) * BlockSize; }
+        
+        // Return the index of block in the current transaction, or _journalCount
+        uint32_t journalIndex(Block block) const;
+        
         bool _mounted = false;
         Block _firstBlock = 0;                  // first block of this partition
         uint32_t _sizeInBlocks = 0;             // size in blocks of this partition
@@ -136,10 +414,51 @@ using Cluster = Scalar<ClusterType, uint32_t>;
         uint32_t _blocksPerFAT = 0;             // size of a FAT in blocks
         Block _startDataBlock = 0;              // start of data
         
-        char _fatBuffer[512] __attribute__((aligned(4)));
-        uint32_t _currentFATBufferAddr = 0;
-        bool _fatBufferValid = false;
-        bool _fatBufferNeedsWriting = false;
+        // The first FAT is cached and written back when a block is evicted
+        // or on sync. Without the journal, changed blocks are only copied
+        // to the second FAT on sync. _fatMirrorPending has a bit for each block of the FAT which
+        // still needs to be copied.
+        FATCacheEntry _fatCache[MaxFATCacheBlocks];
+        uint32_t _fatCacheBlocks = 0;
+        char* _fatCacheData = nullptr;
+        uint32_t _fatCacheClock = 0;
+        uint32_t* _fatMirrorPending = nullptr;
+        FATStats _fatStats;
+        
+        // Free cluster summary. _fatBlockFreeCount has the number of free
+        // entries in each FAT block, so allocation can skip full blocks, or
+        // UncountedFATBlock if the block hasn't been loaded yet. The total
+        // and next free hint are kept in the FSInfo block. Mount takes the
+        // total from there, and once every block is counted the total is
+        // their sum.
+        static constexpr uint8_t UncountedFATBlock = 0xff;
+        uint8_t* _fatBlockFreeCount = nullptr;
+        uint32_t _uncountedFATBlocks = 0;
+        uint32_t _clusterCount = 0;             // number of data clusters
+        uint32_t _freeClusterCount = 0;
+        uint32_t _nextFreeCluster = 2;
+        Block _fsInfoBlock = 0;                 // 0 if there is no FSInfo block
+        bool _fsInfoNeedsWriting = false;
+        
+        // Name indexes of the most recently searched directories
+        FAT32DirectoryIndex* _directoryIndexes[MaxDirectoryIndexes] = { };
+        uint32_t _directoryIndexLastUsed[MaxDirectoryIndexes] = { };
+        uint32_t _directoryIndexClock = 0;
+        
+        // Directories found by walking paths, so deep paths don't need a
+        // lookup in each parent directory on every open. Direct mapped by
+        // a hash of the parent cluster and name.
+        Dentry _dentryCache[DentryCacheSize];
+        
+        // Metadata journal. _journalBuffer holds a header block followed by
+        // the blocks in the current transaction, so a commit is a single
+        // write to the journal file, which is contiguous.
+        Block _journalBlock = 0;                // first block of the journal, 0 if it's disabled
+        Cluster _journalCluster = 0;
+        char* _journalBuffer = nullptr;
+        uint32_t _journalCount = 0;             // number of blocks in the current transaction
+        uint32_t _journalSequence = 0;
+        uint32_t _operations = 0;               // depth of Operations in progress
         
         Volume::RawIO* _rawIO = nullptr;
         uint8_t _partition = 0;
@@ -0,0 +1,94 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "FAT32.h"
+#include <vector>
+
+namespace bare {
+    
+    // FAT32DirectoryIndex
+    //
+    // In memory hash index of the entries in one directory. Maps a name to
+    // the location of its directory entry. Names are matched without regard
+    // to case, as FAT does. A file with a long name is in the index under
+    // both its long name and its 8.3 alias. FAT32 builds an index the first
+    // time a directory is searched and keeps it up to date as entries are
+    // created, removed and renamed.
+    class FAT32DirectoryIndex
+    {
+    public:
+        struct Location
+        {
+            uint32_t block = 0;     // physical block holding the short entry
+            uint32_t slot = 0;      // position in the directory of the first (LFN) entry
+            uint8_t index = 0;      // index of the short entry in block
+            uint8_t entries = 1;    // number of directory entries used, including LFN entries
+        };
+        
+        FAT32DirectoryIndex(Cluster directoryCluster) : _directoryCluster(directoryCluster) { }
+        
+        // Hash and compare names without regard to case
+        static uint32_t hash(const char* name);
+        static bool equal(const char* a, const char* b);
+        
+        Cluster directoryCluster() const { return _directoryCluster; }
+        uint32_t size() const { return _count; }
+        
+        // Pass the 8.3 alias for a file with a long name, otherwise nullptr
+        void add(const char* name, const char* alias, const Location&);
+        
+        // Returns the name as it was added (the long name if found by its
+        // alias), or nullptr if it isn't found
+        const char* find(const char* name, Location&) const;
+        
+        // Remove the entry found by name, along with its alias
+        bool remove(const char* name);
+        
+        // Where to start looking for free directory entries. All the entries
+        // before this are in use.
+        uint32_t searchStart() const { return _searchStart; }
+        void setSearchStart(uint32_t slot) { _searchStart = slot; }
+    
+    private:
+        static constexpr uint32_t None = 0xffffffff;
+        
+        struct Entry
+        {
+            uint32_t name;          // offset in _names, None if the entry is free
+            uint32_t next;
+            uint32_t partner;       // entry for the alias or long name, or None
+            bool alias;             // true if this is the 8.3 alias of a long name
+            Location location;
+        };
+        
+        uint32_t bucket(const char* name) const { return hash(name) & (static_cast<uint32_t>(_buckets.size()) - 1); }
+        void rehash(uint32_t bucketCount);
+        
+        uint32_t insert(const char* name, const Location&);
+        void unlink(uint32_t i);
+        
+        // Squeeze the names of removed entries out of _names
+        void compact();
+        
+        Cluster _directoryCluster;
+        std::vector<Entry> _entries;
+        std::vector<uint32_t> _buckets;
+        std::vector<char> _names;
+        uint32_t _deadNameBytes = 0;
+        uint32_t _freeList = None;
+        uint32_t _count = 0;
+        uint32_t _searchStart = 0;
+    };
+
+}
@@ -16,7 +16,21 @@
 #include "FAT32RawFile.h"
 
 namespace bare {
-
+    
+    // Directory entry attributes
+    static constexpr uint8_t FATAttrReadOnly = 0x01;
+    static constexpr uint8_t FATAttrHidden = 0x02;
+    static constexpr uint8_t FATAttrSystem = 0x04;
+    static constexpr uint8_t FATAttrVolumeID = 0x08;
+    static constexpr uint8_t FATAttrDirectory = 0x10;
+    static constexpr uint8_t FATAttrArchive = 0x20;
+    static constexpr uint8_t FATAttrLongName = 0x0f;
+    
+    // Bits in reserved1 which say the base name or extension of an 8.3
+    // name should be shown in lower case
+    static constexpr uint8_t FATCaseLowerBase = 0x08;
+    static constexpr uint8_t FATCaseLowerExt = 0x10;
+    
     struct FATDirEntry
     {
         char name[11];
@@ -34,15 +48,35 @@ namespace bare {
     };
 
     static_assert(sizeof(FATDirEntry) == 32, "Wrong FATDirEntry size");
-
+    
+    // Long filename entry. These come just before the 8.3 entry they belong
+    // to, last part first. Each holds 13 UCS-2 characters of the name.
+    struct FATLongNameEntry
+    {
+        static constexpr uint8_t LastPart = 0x40;
+        static constexpr uint32_t CharsPerEntry = 13;
+        
+        uint8_t order;
+        uint8_t name1[10];
+        uint8_t attr;
+        uint8_t type;
+        uint8_t checksum;
+        uint8_t name2[12];
+        uint8_t firstClusterLo[2];
+        uint8_t name3[4];
+    };
+    
+    static_assert(sizeof(FATLongNameEntry) == 32, "Wrong FATLongNameEntry size");
+    
     class FAT32DirectoryIterator : public DirectoryIterator
     {
         friend class FAT32;
     
     public:
         static constexpr uint32_t EntriesPerBlock = 512 / 32;
-
-        FAT32DirectoryIterator(FAT32* fs, const char* path);
+        
+        // The "." and ".." entries are skipped unless includeDots is true
+        FAT32DirectoryIterator(FAT32* fs, Cluster directoryCluster, bool includeDots = false);
         virtual ~FAT32DirectoryIterator()
         {
             if (_file) {
@@ -50,38 +84,45 @@ namespace bare {
             }
         }
         
+        // FAT32DirectoryIterators come from an ObjectCache
+        static void* operator new(size_t);
+        static void operator delete(void*, size_t);
+        
         virtual DirectoryIterator& next() override;
         
         virtual const char* name() const override { return _valid ? _fileInfo.name : ""; }
         virtual uint32_t size() const override { return _valid ? _fileInfo.size : 0; }
+        virtual bool subdir() const override { return _valid && _fileInfo.subdir(); }
         Cluster baseCluster() const { return _valid ? _fileInfo.baseCluster : 0; }
         virtual operator bool() const override { return _valid; }
         
-        bool subdir() const { return _subdir; }
-        bool deleted() const { return _deleted; }
-        
         const FAT32::FileInfo& fileInfo() const { return _fileInfo; }
         
     private:
-        enum class FileInfoResult { OK, SubDir, Deleted, Skip, End };
+        enum class FileInfoResult { OK, LongName, Deleted, Skip, End };
         
         FileInfoResult getFileInfo();
+        void addLongNamePart(FATLongNameEntry*);
+        void rawNext();
         
-        // If extend is true, append block when hit the end of the directory
-        void rawNext(bool extend = false);
-
-        bool createEntry(const char* name, uint32_t size, Cluster baseCluster);
-        bool deleteEntry();
-                
         FAT32* _fs;
+        Cluster _directoryCluster;
         FAT32::FileInfo _fileInfo;
         FAT32RawFile* _file = nullptr;
         int32_t _blockIndex = -1;
         int32_t _entryIndex = -1;
         char _buf[512] __attribute__((aligned(4)));
         bool _valid = true;
-        bool _subdir = false;
-        bool _deleted = false;
+        bool _includeDots = false;
+        
+        // Long name collected from the LFN entries seen so far. It is
+        // used if they are all there and match the 8.3 entry that follows.
+        char _longName[FAT32::FilenameLength];
+        bool _longNameValid = false;
+        uint8_t _longNameParts = 0;
+        uint8_t _longNamePending = 0;
+        uint8_t _longNameChecksum = 0;
+        uint32_t _longNameSlot = 0;
     };
 
 }
@@ -13,16 +13,17 @@
 #pragma once
 
 #include "FAT32.h"
+#include <vector>
 
 namespace bare {
 
     class FAT32RawFile: public RawFile
     {
     public:
-        FAT32RawFile(FAT32* fat32, Cluster baseCluster, uint32_t size, Block dirBlock = 0, uint32_t dirIndex = 0)
+        FAT32RawFile(FAT32* fat32, Cluster baseCluster, uint32_t size, Block dirBlock = 0, uint32_t dirIndex = 0, Cluster dirCluster = 0)
             : _fat32(fat32)
             , _baseCluster(baseCluster)
-            , _lastPhysicalCluster(baseCluster)
+            , _directoryCluster(dirCluster)
             , _directoryBlock(dirBlock)
             , _directoryBlockIndex(dirIndex)
         {
@@ -31,21 +32,56 @@ namespace bare {
         
         virtual ~FAT32RawFile() { }
         
+        // FAT32RawFiles come from an ObjectCache
+        static void* operator new(size_t);
+        static void operator delete(void*, size_t);
+        
         virtual Volume::Error read(char* buf, Block blockAddr, uint32_t blocks) override;
         virtual Volume::Error write(const char* buf, Block blockAddr, uint32_t blocks) override;
         virtual Volume::Error rename(const char* to) override;
         virtual Volume::Error insertCluster() override;
         virtual Volume::Error updateSize() override;
-
-        Volume::Error logicalToPhysicalBlock(Block logical, Block& physical);
-        
+        virtual Volume::Error reserve(uint32_t size) override;
+        virtual Volume::Error logicalToPhysicalBlock(Block logical, Block& physical) override;
+        virtual uint64_t fileID() const override { return FAT32::directoryEntryID(_directoryBlock, _directoryBlockIndex); }
+    
     private:
+        // A run of physically contiguous clusters in the file
+        struct Extent
+        {
+            uint32_t logicalCluster;
+            uint32_t physicalCluster;
+            uint32_t length;
+        };
+        
+        // Return the physical block for logicalBlock along with the number of
+        // blocks (up to maxBlocks) which are contiguous on the device from there
+        Volume::Error physicalRun(Block logicalBlock, uint32_t maxBlocks, Block& physicalBlock, uint32_t& blocks);
+        
+        // Return the physical cluster for logicalCluster and the number of
+        // clusters from there to the end of its extent
+        Volume::Error mapCluster(uint32_t logicalCluster, uint32_t& physicalCluster, uint32_t& contiguous);
+        
+        // Follow the FAT chain from the end of the extent map until it covers
+        // logicalCluster. Returns EndOfFile if the chain ends first.
+        Volume::Error extendMap(uint32_t logicalCluster);
+        
+        // Give a file which has no clusters a chain of up to count clusters
+        // and record the first one in its directory entry. The caller
+        // allocates the rest, see FAT32::allocateClusters.
+        Volume::Error allocateFirstClusters(uint32_t count);
+        
+        uint32_t mappedClusters() const { return _extents.empty() ? 0 : (_extents.back().logicalCluster + _extents.back().length); }
+
         FAT32* _fat32;
         Cluster _baseCluster;
         
-        Cluster _lastLogicalCluster = 0;
-        Cluster _lastPhysicalCluster = 0;
+        // Extents of the part of the FAT chain walked so far, in logical order.
+        // The file only ever grows at the end, so the map stays valid and is
+        // extended as needed.
+        std::vector<Extent> _extents;
         
+        Cluster _directoryCluster;
         Block _directoryBlock;
         uint32_t _directoryBlockIndex;
     };
@@ -86,8 +86,27 @@ namespace bare {
             
             virtual int32_t unmapSegment(void* addr, size_t size) override
             {
-                // FIXME: Implement
-                return -1;
+                // The segment must be one that mapSegment handed out
+                uint8_t* start = reinterpret_cast<uint8_t*>(_heapStart);
+                uint8_t* p = reinterpret_cast<uint8_t*>(addr);
+                uint32_t pages = (static_cast<uint32_t>(size) + PageSize - 1) / PageSize;
+                if (p < start || (p - start) % PageSize != 0 || pages == 0) {
+                    return -1;
+                }
+                uint32_t startBit = static_cast<uint32_t>((p - start) / PageSize);
+                if (startBit + pages > _pageBitmap.size()) {
+                    return -1;
+                }
+                for (uint32_t i = 0; i < pages; ++i) {
+                    if (!_pageBitmap[startBit + i]) {
+                        return -1;
+                    }
+                }
+                
+                for (uint32_t i = 0; i < pages; ++i) {
+                    _pageBitmap[startBit + i] = false;
+                }
+                return 0;
             }
 
         private:
@@ -107,11 +126,14 @@ namespace bare {
                             break;
                         }
                         
+                        if (firstBit + pages > _pageBitmap.size()) {
+                            break;
+                        }
                         keepTrying = false;
                         for (uint32_t n = 1; n < pages; ++n) {
                             if (_pageBitmap[firstBit + n]) {
-                                // not enough
-                                firstBit += n + 1;
+                                // not enough, start again past the used page
+                                firstBit += n;
                                 keepTrying = true;
                                 break;
                             }
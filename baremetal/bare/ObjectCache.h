@@ -0,0 +1,137 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <cassert>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace bare {
+    
+    // ObjectCache
+    //
+    // Slab cache of fixed size objects, for the kernel objects which are
+    // created and deleted all the time. Slabs are pages from
+    // Memory::mapSegment, or from operator new if there is no kernel heap
+    // yet. Freed objects go on a stack in the cache, so alloc pops the
+    // stack or carves the next object from the current slab and never
+    // searches for a fit. Slabs are kept for the life of the cache.
+    //
+    // Caches aren't locked. Like the rest of the kernel they are used from
+    // the main loop, not from interrupt handlers.
+    //
+    // ObjectCacheBase has the untyped implementation, which is also usable
+    // for blocks of bytes of one size. A class switches to a cache with
+    // its own operator new and delete.
+    class ObjectCacheBase
+    {
+    public:
+        static constexpr size_t SlabSize = 4096;
+        static constexpr uint32_t MinObjectsPerSlab = 4;
+        
+        struct Stats
+        {
+            uint32_t allocs = 0;
+            uint32_t frees = 0;
+            uint32_t inUse = 0;
+            uint32_t maxInUse = 0;
+            uint32_t slabs = 0;
+        };
+        
+        ObjectCacheBase(const char* name, size_t objectSize, size_t align);
+        
+        void* alloc();
+        void free(void*);
+        
+        const char* name() const { return _name; }
+        size_t objectSize() const { return _objectSize; }
+        size_t slabSize() const { return _slabSize; }
+        const Stats& stats() const { return _stats; }
+        
+        // All the caches, for reporting
+        static ObjectCacheBase* first() { return _first; }
+        ObjectCacheBase* next() const { return _next; }
+    
+    private:
+        bool grow();
+        
+        struct FreeObject
+        {
+            FreeObject* next;
+        };
+        
+        const char* _name;
+        size_t _objectSize;
+        size_t _slabSize;
+        FreeObject* _free = nullptr;
+        
+        // Part of the newest slab not handed out yet
+        uint8_t* _carve = nullptr;
+        uint8_t* _carveEnd = nullptr;
+        
+        Stats _stats;
+        
+        ObjectCacheBase* _next;
+        static ObjectCacheBase* _first;
+    };
+    
+    template<typename T> class ObjectCache : public ObjectCacheBase
+    {
+    public:
+        ObjectCache(const char* name) : ObjectCacheBase(name, sizeof(T), alignof(T)) { }
+        
+        T* alloc() { return static_cast<T*>(ObjectCacheBase::alloc()); }
+        void free(T* p) { ObjectCacheBase::free(p); }
+    };
+    
+    // ObjectCacheAllocator
+    //
+    // Standard allocator which takes single objects from a cache, for
+    // containers and std::allocate_shared. The cache's objects must be
+    // big enough for whatever type the allocator is rebound to. Anything
+    // else goes to operator new.
+    template<typename T> class ObjectCacheAllocator
+    {
+    public:
+        template<typename U> friend class ObjectCacheAllocator;
+        
+        using value_type = T;
+        
+        ObjectCacheAllocator(ObjectCacheBase& cache) : _cache(&cache) { }
+        template<typename U> ObjectCacheAllocator(const ObjectCacheAllocator<U>& other) : _cache(other._cache) { }
+        
+        T* allocate(size_t n)
+        {
+            if (n == 1 && sizeof(T) <= _cache->objectSize()) {
+                return static_cast<T*>(_cache->alloc());
+            }
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        
+        void deallocate(T* p, size_t n)
+        {
+            if (n == 1 && sizeof(T) <= _cache->objectSize()) {
+                _cache->free(p);
+            } else {
+                ::operator delete(p);
+            }
+        }
+        
+        template<typename U> bool operator==(const ObjectCacheAllocator<U>& other) const { return _cache == other._cache; }
+        template<typename U> bool operator!=(const ObjectCacheAllocator<U>& other) const { return _cache != other._cache; }
+    
+    private:
+        ObjectCacheBase* _cache;
+    };
+
+}
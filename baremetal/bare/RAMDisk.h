@@ -0,0 +1,132 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Volume.h"
+#include "String.h"
+#include <vector>
+
+namespace bare {
+    
+    // RAMDisk
+    //
+    // Volume kept in a memory segment from Memory::mapSegment. It's for
+    // scratch files and for copies of files which are used often, so they
+    // don't have to go to the SD card. The contents are lost on reset.
+    // Files are stored in 512 byte blocks so they look like any other
+    // volume to File. Unlike FAT32, names are case sensitive.
+    class RAMDisk : public Volume
+    {
+        friend class RAMDiskRawFile;
+        friend class RAMDiskDirectoryIterator;
+    
+    public:
+        RAMDisk(uint32_t sizeInBlocks) : _sizeInBlocks(sizeInBlocks) { }
+        ~RAMDisk();
+        
+        virtual uint32_t sizeInBlocks() const override { return _sizeInBlocks; }
+        virtual Volume::Error mount() override;
+        virtual RawFile* open(const char* name) override;
+        virtual Volume::Error create(const char* name) override;
+        
+        // A file can't be removed while a RawFile has it open
+        virtual Volume::Error remove(const char* name) override;
+        virtual Volume::Error createDirectory(const char* name) override;
+        virtual bool exists(const char* name) override;
+        virtual bool fileID(const char* name, uint64_t& id) override;
+        virtual DirectoryIterator* directoryIterator(const char* path) override;
+        virtual Volume::Error error() const override { return _error; }
+        
+        uint32_t freeBlocks() const { return _freeBlocks; }
+    
+    private:
+        static constexpr uint32_t None = 0xffffffff;
+        static constexpr uint32_t Root = 0;
+        
+        struct Node
+        {
+            String name;
+            uint32_t parent = None;     // None if the node is free. The root is its own parent.
+            bool directory = false;
+            uint32_t size = 0;
+            uint32_t opens = 0;         // RAMDiskRawFiles using the node
+            std::vector<uint32_t> blocks;
+        };
+        
+        // Find the node for path. If leaf is not null, find the directory
+        // which holds the last component of path instead and return that
+        // component in leaf.
+        Volume::Error lookup(const char* path, uint32_t& node, String* leaf = nullptr) const;
+        uint32_t findChild(uint32_t directory, const char* name, size_t length) const;
+        Volume::Error addNode(const char* path, bool directory);
+        Volume::Error rename(uint32_t node, const char* to);
+        
+        // Give node enough blocks for blocks blocks of data
+        Volume::Error allocateBlocks(uint32_t node, uint32_t blocks);
+        void releaseBlocks(uint32_t node);
+        
+        char* blockData(uint32_t block) { return _data + block * BlockSize; }
+        
+        uint32_t _sizeInBlocks;
+        char* _data = nullptr;
+        std::vector<uint32_t> _blockMap;    // A bit per block, set if it's in use
+        uint32_t _freeBlocks = 0;
+        uint32_t _nextFreeBlock = 0;
+        std::vector<Node> _nodes;
+        Volume::Error _error = Volume::Error::NotMounted;
+    };
+    
+    class RAMDiskRawFile : public RawFile
+    {
+    public:
+        RAMDiskRawFile(RAMDisk* disk, uint32_t node, uint32_t size) : _disk(disk), _node(node)
+        {
+            _size = size;
+            ++_disk->_nodes[_node].opens;
+        }
+        
+        virtual ~RAMDiskRawFile() { --_disk->_nodes[_node].opens; }
+        
+        virtual Volume::Error read(char* buf, Block blockAddr, uint32_t blocks) override;
+        virtual Volume::Error write(const char* buf, Block blockAddr, uint32_t blocks) override;
+        virtual Volume::Error rename(const char* to) override { return _disk->rename(_node, to); }
+        virtual Volume::Error insertCluster() override;
+        virtual Volume::Error updateSize() override;
+        virtual Volume::Error reserve(uint32_t size) override;
+        virtual Volume::Error logicalToPhysicalBlock(Block logical, Block& physical) override;
+        virtual uint64_t fileID() const override { return _node; }
+    
+    private:
+        RAMDisk* _disk;
+        uint32_t _node;
+    };
+    
+    class RAMDiskDirectoryIterator : public DirectoryIterator
+    {
+    public:
+        RAMDiskDirectoryIterator(RAMDisk* disk, uint32_t directory) : _disk(disk), _directory(directory) { next(); }
+        virtual ~RAMDiskDirectoryIterator() { }
+        
+        virtual DirectoryIterator& next() override;
+        virtual const char* name() const override { return *this ? _disk->_nodes[_index].name.c_str() : ""; }
+        virtual uint32_t size() const override { return *this ? _disk->_nodes[_index].size : 0; }
+        virtual bool subdir() const override { return *this && _disk->_nodes[_index].directory; }
+        virtual operator bool() const override { return _index < _disk->_nodes.size(); }
+    
+    private:
+        RAMDisk* _disk;
+        uint32_t _directory;
+        uint32_t _index = RAMDisk::Root;
+    };
+
+}
@@ -36,11 +36,33 @@ namespace bare {
     {
     public:
         enum class Error { OK, Timeout, Error };
+        
+        // Bus parameters negotiated with the card at init time
+        struct Mode
+        {
+            uint32_t busWidth = 1;
+            uint32_t clockRate = 0; // in Hz, 0 if unknown
+            bool highSpeed = false;
+            bool dma = false;
+        };
+
+        // Commands sent to the card, and transfers and blocks moved, since
+        // it was initialized
+        struct Stats
+        {
+            uint32_t commands = 0;
+            uint32_t transfers = 0;
+            uint32_t blocks = 0;
+        };
 
         SDCard();
         
+        Mode mode() const;
+        const Stats& stats() const;
+        
         virtual Volume::Error read(char* buf, Block blockAddr, uint32_t blocks) override;
         virtual Volume::Error write(const char* buf, Block blockAddr, uint32_t blocks) override;
+        virtual Volume::Error submit(Request*) override;
     };
 
 }
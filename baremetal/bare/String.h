@@ -31,7 +31,7 @@ namespace bare {
         
         String(const String& other) : _data(nullptr) { *this = other; }
         
-        ~String() { delete [ ] _data; };
+        ~String() { freeBuffer(_data, _capacity); };
 
         String& operator=(const String& other);
         
@@ -110,23 +110,27 @@ namespace bare {
             if (_capacity >= size) {
                 return;
             }
-            _capacity = _capacity ? _capacity * 2 : 1;
-            if (_capacity < size) {
-                _capacity = size;
+            size_t capacity = _capacity ? _capacity * 2 : 1;
+            if (capacity < size) {
+                capacity = size;
             }
-            char *newData = new char[_capacity];
-            assert(newData);
+            _data = growBuffer(_data, _size, _capacity, capacity);
+            assert(_data);
             if (_data) {
-                if (newData) {
-                    memcpy(newData, _data, _size);
-                } else {
-                    _capacity = 0;
-                    _size = 1;
-                }
-                delete _data;
+                _capacity = capacity;
+            } else {
+                _capacity = 0;
+                _size = 1;
             }
-            _data = newData;
         };
+        
+        // Small buffers come from caches of a few sizes, bigger ones from
+        // malloc. allocBuffer and growBuffer round capacity up to the size
+        // they allocated. growBuffer keeps the first used bytes of buffer
+        // and frees it or grows it in place.
+        static char* allocBuffer(size_t& capacity);
+        static char* growBuffer(char* buffer, size_t used, size_t oldCapacity, size_t& capacity);
+        static void freeBuffer(char*, size_t capacity);
 
         size_t _size;
         size_t _capacity;
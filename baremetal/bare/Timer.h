@@ -70,13 +70,10 @@ namespace bare {
         
         using Handler = std::function<void(std::shared_ptr<Timer>)>;
         
-        ~Timer() {
-            TimerManager::instance().remove(shared_from_this());
-            TimerManager::instance().updateTimers();
-        }
-        
+        // TimerManager keeps a reference to every Timer, so a Timer lives
+        // until the TimerManager goes away. Use stop() to cancel one.
         static std::shared_ptr<Timer> create(Handler);
-
+        
         static void init() { TimerManager::instance().init(); }
         
         // FIXME: repeat is currently not implemented 
@@ -100,6 +97,10 @@ namespace bare {
         static void handleInterrupt();
         static void usleep(uint32_t us);
         static int64_t systemTime();
+        
+        // Time in ns, for timing short runs of code. Platforms without a
+        // finer clock return systemTime() * 1000.
+        static int64_t systemTimeNS();
 
         static RealTime currentTime() { return TimerManager::instance().currentTime(); }
         static void setCurrentTime(const RealTime& t) { TimerManager::instance().setCurrentTime(t); }
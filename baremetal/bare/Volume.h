@@ -13,6 +13,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <functional>
 
 namespace bare {
 
@@ -74,20 +75,59 @@ namespace bare {
             EndOfFile,
             NotImplemented,
             UnsupportedDevice, 
+            NotADirectory,
+            IsADirectory,
+            DirectoryNotEmpty,
+            InvalidName,
+            CrossVolume,
+            FileBusy,
         };
         
         struct RawIO
         {
+            // Asynchronous transfer request. The caller owns the request and
+            // its buffer until the completion is called. Completions may be
+            // called from interrupt context.
+            struct Request
+            {
+                using Completion = std::function<void(Request*, Volume::Error)>;
+                
+                bool write = false;
+                char* buf = nullptr;
+                Block blockAddr = 0;
+                uint32_t blocks = 0;
+                Completion completion;
+                
+                Request* next = nullptr; // Used by the device to queue requests
+            };
+            
             virtual Volume::Error read(char* buf, Block blockAddr, uint32_t blocks) = 0;
             virtual Volume::Error write(const char* buf, Block blockAddr, uint32_t blocks) = 0;
+            
+            // Queue a request to the device. Devices which can't do transfers
+            // in the background use this default, which performs the transfer
+            // immediately and calls the completion before returning.
+            virtual Volume::Error submit(Request*);
+            
+            // Write anything held back by this layer to the device
+            virtual Volume::Error flush() { return Volume::Error::OK; }
         };
         
         virtual uint32_t sizeInBlocks() const = 0;
         virtual Error mount() = 0;
+        
+        // Write any cached metadata to the device
+        virtual Error sync() { return Error::OK; }
         virtual RawFile* open(const char* name) = 0;
         virtual Error create(const char* name) = 0;
         virtual Error remove(const char* name) = 0;
+        virtual Error createDirectory(const char* name) = 0;
         virtual bool exists(const char* name) = 0;
+        
+        // Set id to a value which identifies the file, the same value its
+        // RawFile's fileID() returns while the file exists. Returns false
+        // if it isn't found or the volume can't identify files.
+        virtual bool fileID(const char* name, uint64_t& id) { return false; }
         virtual const char* errorDetail(Error) const;
         virtual DirectoryIterator* directoryIterator(const char* path) = 0;
         virtual Error error() const = 0;
@@ -100,6 +140,7 @@ namespace bare {
         
     public:
         RawFile() { }
+        virtual ~RawFile() { }
         
         virtual Volume::Error read(char* buf, Block blockAddr, uint32_t blocks) = 0;    
         virtual Volume::Error write(const char* buf, Block blockAddr, uint32_t blocks) = 0;    
@@ -109,6 +150,16 @@ namespace bare {
         virtual Volume::Error insertCluster() = 0;
         virtual Volume::Error updateSize() = 0;
         
+        // Make sure there is space allocated for size bytes. This doesn't
+        // change the size of the file.
+        virtual Volume::Error reserve(uint32_t size) = 0;
+        
+        // Return the device block holding a block of the file
+        virtual Volume::Error logicalToPhysicalBlock(Block logical, Block& physical) = 0;
+        
+        // See Volume::fileID
+        virtual uint64_t fileID() const = 0;
+        
         bool valid() const { return _error == Volume::Error::OK; }
         Volume::Error error() const { return _error; }
         uint32_t size() const { return _size; }
@@ -126,6 +177,7 @@ namespace bare {
         virtual DirectoryIterator& next() = 0;
         virtual const char* name() const = 0;
         virtual uint32_t size() const = 0;
+        virtual bool subdir() const = 0;
         virtual operator bool() const = 0;
     };
 
@@ -67,9 +67,7 @@ extern "C" {
     char* strcpy(char* dst, const char* src)
     {
         char* ret = dst;
-        while (*src) {
-            *dst++ = *src++;
-        }
+        while ((*dst++ = *src++)) { }
         return ret;
     }
 
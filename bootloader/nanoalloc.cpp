@@ -16,6 +16,7 @@
 #include "bare/Serial.h"
 #include <cstdint>
 #include <cstdlib>
+#include <new>
 
 // Simple allocator for bootloader.
 //
@@ -24,16 +25,17 @@
 
 //#define DEBUG_NANOALLOC
 
-static void* alloc(size_t size)
+static void* alloc(size_t size, size_t align = sizeof(uint32_t))
 {
     if (!bare::useAllocator()) {
-        return malloc(size);
+        return (align > sizeof(uint32_t)) ? aligned_alloc(align, (size + align - 1) & ~(align - 1)) : malloc(size);
     }
     
     static uint32_t* HeapPtr = nullptr;
     if (!HeapPtr) {
         HeapPtr = reinterpret_cast<uint32_t*>(bare::Memory::heapStart());
     }
+    HeapPtr = reinterpret_cast<uint32_t*>((reinterpret_cast<uintptr_t>(HeapPtr) + align - 1) & ~(align - 1));
     uint32_t* r = HeapPtr;
     HeapPtr += (size + sizeof(uint32_t) - 1) / sizeof(uint32_t);
     if (HeapPtr > reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(bare::Memory::heapStart()) + bare::Memory::heapSize())) {
@@ -49,6 +51,28 @@ static void* alloc(size_t size)
     return r;
 }
 
+#ifdef PLATFORM_RPI
+// The kernel Allocator isn't linked into the bootloader, so the C
+// allocation functions come from here too
+extern "C" {
+
+    void* malloc(size_t size)
+    {
+        return alloc(size);
+    }
+
+    void* aligned_alloc(size_t align, size_t size)
+    {
+        return alloc(size, align);
+    }
+
+    void free(void*)
+    {
+    }
+
+}
+#endif
+
 void *operator new(size_t size)
 {
     return alloc(size);
@@ -59,6 +83,16 @@ void *operator new[] (size_t size)
     return alloc(size);
 }
 
+void *operator new(size_t size, std::align_val_t align)
+{
+    return alloc(size, static_cast<size_t>(align));
+}
+
+void *operator new[] (size_t size, std::align_val_t align)
+{
+    return alloc(size, static_cast<size_t>(align));
+}
+
 void operator delete(void *p) noexcept
 {
     if (!bare::useAllocator()) {
@@ -86,3 +120,17 @@ void operator delete [ ](void *p, size_t size) noexcept
         free(p);
     }
 }
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    if (!bare::useAllocator()) {
+        free(p);
+    }
+}
+
+void operator delete [ ](void *p, std::align_val_t) noexcept
+{
+    if (!bare::useAllocator()) {
+        free(p);
+    }
+}
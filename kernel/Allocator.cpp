@@ -1,11 +1,11 @@
 /*-------------------------------------------------------------------------
     This source file is a part of Placid
-
+    
     For the latest info, see http:www.marrin.org/
-
+    
     Copyright (c) 2018-2019, Chris Marrin
     All rights reserved.
-
+    
     Use of this source code is governed by the MIT license that can be
     found in the LICENSE file.
 -------------------------------------------------------------------------*/
@@ -15,40 +15,66 @@
 #include "Allocator.h"
 
 #include "bare/Memory.h"
+#include <new>
 
 //#define ENABLE_DEBUG_LOG
 #include "bare/Log.h"
 
 using namespace placid;
 
-static inline bool checkFreeList(Allocator::FreeChunk* list)
+Allocator Allocator::_kernelAllocator;
+
+Allocator::Allocator()
 {
-    if (list) {
-        assert(list->prev == nullptr);
-    }
-    while(list) {
-        assert(list->status() == Allocator::FreeChunk::Status::Free);
-        if (list->next) {
-            assert(list->next->prev == list);
+}
+
+uint32_t Allocator::firstBin(uint32_t bin) const
+{
+    // Bin 0 is the high bit of the first word, so the first bin with chunks
+    // is the count of leading zeros
+    for (uint32_t word = bin / 32; word < BinMapWords; ++word) {
+        uint32_t bits = _binMap[word];
+        if (word == bin / 32) {
+            bits &= 0xffffffff >> (bin % 32);
+        }
+        if (bits) {
+            return word * 32 + __builtin_clz(bits);
         }
-        list = list->next;
     }
-    return true;
+    return NumBins;
 }
 
-Allocator Allocator::_kernelAllocator;
-
-Allocator::Allocator()
+bool Allocator::checkBins() const
 {
+    for (uint32_t bin = 0; bin < NumBins; ++bin) {
+        FreeChunk* list = _bins[bin];
+        assert(((_binMap[bin / 32] & binBit(bin)) != 0) == (list != nullptr));
+        if (list) {
+            assert(list->prev == nullptr);
+        }
+        while (list) {
+            assert(list->status() == Allocator::FreeChunk::Status::Free);
+            assert(binIndex(list->size()) == bin);
+            assert(*(reinterpret_cast<size_t*>(list->Chunk::next()) - 1) == list->size());
+            assert(!list->Chunk::next()->prevInUse());
+            assert(list->prevInUse());
+            if (list->next) {
+                assert(list->next->prev == list);
+            }
+            list = list->next;
+        }
+    }
+    return true;
 }
 
-void Allocator::removeFromFreeList(FreeChunk* chunk)
+void Allocator::removeFromFreeList(FreeChunk* chunk, uint32_t bin)
 {
-    assert(checkFreeList(_freeList));
-    if (chunk == _freeList) {
-        _freeList = chunk->next;
-        if (_freeList) {
-            _freeList->prev = nullptr;
+    if (chunk == _bins[bin]) {
+        _bins[bin] = chunk->next;
+        if (_bins[bin]) {
+            _bins[bin]->prev = nullptr;
+        } else {
+            _binMap[bin / 32] &= ~binBit(bin);
         }
     } else {
         chunk->prev->next = chunk->next;
@@ -56,98 +82,146 @@ void Allocator::removeFromFreeList(FreeChunk* chunk)
             chunk->next->prev = chunk->prev;
         }
     }
-    assert(checkFreeList(_freeList));
-}
-
-void Allocator::splitFreeBlock(FreeChunk* chunk, size_t size)
-{
-    // Remove a size bytes section of the passed block from the free list
-    // and leave the rest
-    removeFromFreeList(chunk);
-    FreeChunk* newFreeChunk = reinterpret_cast<FreeChunk*>(reinterpret_cast<uint8_t*>(chunk) + size);
-    addToFreeList(newFreeChunk, chunk->size() - size);
+    _freeSize -= chunk->size();
 }
 
-void Allocator::addToFreeList(void* mem, size_t size)
+void Allocator::addToFreeList(Chunk* mem, size_t size)
 {
-    // FIXME: For now add to the head, but there might be better approaches
-    assert(checkFreeList(_freeList));
+    // Add to the head of the bin, so recently freed chunks are used first
     FreeChunk* chunk = reinterpret_cast<FreeChunk*>(mem);
     chunk->setSize(size);
     chunk->setStatus(Chunk::Status::Free);
-    if (_freeList) {
-        _freeList->prev = chunk;
+    chunk->setFooter();
+    chunk->Chunk::next()->setPrevInUse(false);
+    
+    uint32_t bin = binIndex(size);
+    if (_bins[bin]) {
+        _bins[bin]->prev = chunk;
+    } else {
+        _binMap[bin / 32] |= binBit(bin);
     }
-    chunk->next = _freeList;
+    chunk->next = _bins[bin];
     chunk->prev = nullptr;
-    _freeList = chunk;
-    assert(checkFreeList(_freeList));
+    _bins[bin] = chunk;
+    _freeSize += size;
 }
 
-bool Allocator::alloc(size_t size, void*& mem, size_t align)
+size_t Allocator::useChunk(Chunk* chunk, size_t size)
 {
-    // FIXME: Obey align. If zero align on any boundary, otherwise on passed align value
-    // (must be power of 2)
-    
-    if (!bare::useAllocator()) {
-        mem = ::malloc(size);
-        return mem;
+    if (size + MinSplitSize <= chunk->size()) {
+        DEBUG_LOG("Allocator::alloc: splitting free chunk\n");
+        Chunk* rest = reinterpret_cast<Chunk*>(reinterpret_cast<uint8_t*>(chunk) + size);
+        rest->init(0, Chunk::PrevInUseBit);
+        addToFreeList(rest, chunk->size() - size);
+        chunk->setSize(size);
+    } else {
+        DEBUG_LOG("Allocator::alloc: using entire free chunk\n");
+        chunk->next()->setPrevInUse(true);
     }
+    chunk->setStatus(Chunk::Status::InUse);
+    return chunk->size();
+}
 
-    _mutex.lock();
+Allocator::Chunk* Allocator::mapSegment(size_t size)
+{
+    // Allocate as much as needed, in multiples of BlockSize, with room for
+    // the fence
+    size_t segmentSize = (size + MinAllocSize + BlockSize - 1) / BlockSize * BlockSize;
+    void* segment;
+    if (!bare::Memory::mapSegment(segmentSize, segment)) {
+        ERROR_LOG("Allocator::alloc: failed to allocate segment of size %d\n", static_cast<uint32_t>(segmentSize));
+        return nullptr;
+    }
     
-    DEBUG_LOG("Allocator::alloc: enter, size=%d\n", static_cast<uint32_t>(size));
-    size = (size + sizeof(Chunk) + MinAllocSize - 1) / MinAllocSize * MinAllocSize;
+    _mappedSize += segmentSize;
+    ++_segments;
     
-    // Try to find a block in the free list
-    FreeChunk* entry = _freeList;
-    for ( ; entry; entry = entry->next) {
-        if (entry->size() >= size) {
-            break;
+    // The first chunk starts one header before MinAllocSize, so its memory
+    // is aligned. The fence is the last word of the segment. Nothing comes
+    // before the first chunk, so it's never merged backward.
+    Chunk* chunk = reinterpret_cast<Chunk*>(reinterpret_cast<uint8_t*>(segment) + SegmentHeaderOffset);
+    chunk->init(segmentSize - MinAllocSize, Chunk::FirstBit | Chunk::PrevInUseBit);
+    chunk->next()->init(0, Chunk::InUseBit);
+    return chunk;
+}
+
+Allocator::Chunk* Allocator::findChunk(size_t size)
+{
+    // Small bins only hold chunks of their size, so the first one fits. In
+    // a large bin look for the first one big enough. Failing that, every
+    // chunk in a higher bin is big enough.
+    uint32_t bin = binIndex(size);
+    FreeChunk* entry = _bins[bin];
+    if (bin >= SmallBins) {
+        while (entry && entry->size() < size) {
+            entry = entry->next;
+        }
+    }
+    if (!entry) {
+        bin = firstBin(bin + 1);
+        if (bin < NumBins) {
+            entry = _bins[bin];
         }
     }
     
     if (entry) {
         DEBUG_LOG("Allocator::alloc: found free chunk, size=%d\n", entry->size());
-        
-        // Should we split or just use it?
-        if (size + MinSplitSize > entry->size()) {
-            DEBUG_LOG("Allocator::alloc: using entire free chunk\n");
-            removeFromFreeList(entry);
+        removeFromFreeList(entry, bin);
+        return entry;
+    }
+    
+    DEBUG_LOG("Allocator::alloc: no free chunk found\n");
+    return mapSegment(size);
+}
+
+bool Allocator::alloc(size_t size, void*& mem, size_t align)
+{
+    assert((align & (align - 1)) == 0);
+    
+    if (!bare::useAllocator()) {
+        if (align <= sizeof(void*)) {
+            mem = ::malloc(size);
         } else {
-            DEBUG_LOG("Allocator::alloc: splitting free chunk\n");
-            splitFreeBlock(entry, size);
+            mem = ::aligned_alloc(align, (size + align - 1) & ~(align - 1));
         }
+        return mem;
+    }
+    
+    _mutex.lock();
+    
+    DEBUG_LOG("Allocator::alloc: enter, size=%d, align=%d\n", static_cast<uint32_t>(size), static_cast<uint32_t>(align));
+    size = (size + sizeof(Chunk) + MinAllocSize - 1) / MinAllocSize * MinAllocSize;
+    
+    Chunk* chunk;
+    if (align <= MinAllocSize) {
+        chunk = findChunk(size);
     } else {
-        DEBUG_LOG("Allocator::alloc: no free chunk found\n");
-
-        // No free entry found, alloc a new block
-        // Allocate as much as needed, in multiples of BlockSize
-        size_t sizeToAlloc = (size + BlockSize - 1) / BlockSize * BlockSize;
-        void* newSegment;
-        if (!bare::Memory::mapSegment(sizeToAlloc, newSegment)) {
-            ERROR_LOG("Allocator::alloc: failed to allocate segment of size %d\n", sizeToAlloc);
-            _mutex.unlock();
-            return false;
-        }
-        
-        entry = reinterpret_cast<FreeChunk*>(newSegment);
-        size_t newSize = BlockSize;
-        if (size + MinSplitSize < BlockSize) {
-            DEBUG_LOG("Allocator::alloc: splitting newly allocated segment\n");
-            addToFreeList(reinterpret_cast<uint8_t*>(entry) + size, sizeToAlloc - size);
-        } else {
-            DEBUG_LOG("Allocator::alloc: using entire newly allocated segment\n");
-            size = newSize;
+        // Memory is MinAllocSize aligned, so the aligned spot is at most
+        // align - MinAllocSize in. What's in front of it is a multiple of
+        // MinAllocSize, so it's big enough to be a free chunk.
+        chunk = findChunk(size + align - MinAllocSize);
+        if (chunk) {
+            uintptr_t addr = reinterpret_cast<uintptr_t>(chunk + 1);
+            size_t offset = ((addr + align - 1) & ~(align - 1)) - addr;
+            if (offset) {
+                DEBUG_LOG("Allocator::alloc: freeing %d bytes in front of aligned chunk\n", static_cast<uint32_t>(offset));
+                Chunk* aligned = reinterpret_cast<Chunk*>(reinterpret_cast<uint8_t*>(chunk) + offset);
+                aligned->init(chunk->size() - offset, 0);
+                addToFreeList(chunk, offset);
+                chunk = aligned;
+            }
         }
     }
-           
-    entry->setSize(size);
-    entry->setStatus(Chunk::Status::InUse);
-    _size += size;
+    if (!chunk) {
+        _mutex.unlock();
+        return false;
+    }
+    
+    _size += useChunk(chunk, size);
+    assert(checkBins());
     
     // return the part of the block past the header
-    mem = reinterpret_cast<Chunk*>(entry) + 1;
+    mem = chunk + 1;
     DEBUG_LOG("Allocator::alloc: exit with allocated memory. Heap size=%d\n", _size);
     _mutex.unlock();
     return true;
@@ -159,17 +233,234 @@ void Allocator::free(void *addr)
         ::free(addr);
         return;
     }
-
+    
+    if (!addr) {
+        return;
+    }
+    
     _mutex.lock();
-
+    
     DEBUG_LOG("Allocator::free: enter, addr=0x%08p\n", addr);
     Chunk* chunk = reinterpret_cast<Chunk*>(addr) - 1;
-    addToFreeList(chunk, chunk->size());
-    _size -= chunk->size();
-    DEBUG_LOG("Allocator::free: exit, size=%d\n", chunk->size());
+    assert(chunk->status() == Chunk::Status::InUse);
+    size_t size = chunk->size();
+    _size -= size;
+    
+    // Merge with the free chunks on either side
+    Chunk* next = chunk->next();
+    if (next->status() == Chunk::Status::Free) {
+        removeFromFreeList(reinterpret_cast<FreeChunk*>(next), binIndex(next->size()));
+        size += next->size();
+    }
+    if (!chunk->prevInUse()) {
+        size_t prevSize = *(reinterpret_cast<size_t*>(chunk) - 1);
+        chunk = reinterpret_cast<Chunk*>(reinterpret_cast<uint8_t*>(chunk) - prevSize);
+        removeFromFreeList(reinterpret_cast<FreeChunk*>(chunk), binIndex(prevSize));
+        size += prevSize;
+    }
+    chunk->setSize(size);
+    
+    // Give back the segment if the chunk is all of it
+    size_t segmentSize = size + MinAllocSize;
+    if (chunk->first() && chunk->next()->fence() && (segmentSize > KeepFreeSize || _freeSize + size > KeepFreeSize)) {
+        DEBUG_LOG("Allocator::free: unmapping segment, size=%d\n", static_cast<uint32_t>(segmentSize));
+        bare::Memory::unmapSegment(reinterpret_cast<uint8_t*>(chunk) - SegmentHeaderOffset, segmentSize);
+        _mappedSize -= segmentSize;
+        --_segments;
+    } else {
+        addToFreeList(chunk, size);
+    }
+    assert(checkBins());
+    
+    DEBUG_LOG("Allocator::free: exit, size=%d\n", static_cast<uint32_t>(size));
     _mutex.unlock();
 }
 
+bool Allocator::realloc(void* addr, size_t size, void*& mem)
+{
+    if (!addr) {
+        return alloc(size, mem);
+    }
+    
+    if (!bare::useAllocator()) {
+        mem = ::realloc(addr, size);
+        return mem;
+    }
+    
+    _mutex.lock();
+    
+    DEBUG_LOG("Allocator::realloc: enter, addr=0x%08p, size=%d\n", addr, static_cast<uint32_t>(size));
+    Chunk* chunk = reinterpret_cast<Chunk*>(addr) - 1;
+    assert(chunk->status() == Chunk::Status::InUse);
+    size_t oldSize = chunk->size();
+    size_t newSize = (size + sizeof(Chunk) + MinAllocSize - 1) / MinAllocSize * MinAllocSize;
+    
+    Chunk* next = chunk->next();
+    bool nextFree = next->status() == Chunk::Status::Free;
+    
+    if (newSize <= oldSize) {
+        // Free the end if it's big enough to be a chunk, or if it can be
+        // added to the free chunk after it
+        size_t rest = oldSize - newSize;
+        if (rest && (rest >= MinSplitSize || nextFree)) {
+            if (nextFree) {
+                removeFromFreeList(reinterpret_cast<FreeChunk*>(next), binIndex(next->size()));
+                rest += next->size();
+            }
+            chunk->setSize(newSize);
+            Chunk* restChunk = chunk->next();
+            restChunk->init(0, Chunk::PrevInUseBit);
+            addToFreeList(restChunk, rest);
+            _size -= oldSize - newSize;
+        }
+    } else if (nextFree && oldSize + next->size() >= newSize) {
+        DEBUG_LOG("Allocator::realloc: growing into next chunk, size=%d\n", next->size());
+        removeFromFreeList(reinterpret_cast<FreeChunk*>(next), binIndex(next->size()));
+        chunk->setSize(oldSize + next->size());
+        _size += useChunk(chunk, newSize) - oldSize;
+    } else {
+        _mutex.unlock();
+        
+        // Move it
+        if (!alloc(size, mem)) {
+            return false;
+        }
+        bare::memcpy(mem, addr, oldSize - sizeof(Chunk));
+        free(addr);
+        return true;
+    }
+    
+    assert(checkBins());
+    mem = addr;
+    _mutex.unlock();
+    return true;
+}
+
+Allocator::Stats Allocator::stats() const
+{
+    Stats stats;
+    stats.inUse = _size;
+    stats.free = _freeSize;
+    stats.mapped = _mappedSize;
+    stats.segments = _segments;
+    
+    // The largest free chunk is in the last bin with chunks in it
+    for (uint32_t bin = NumBins; bin-- > 0; ) {
+        if (_bins[bin]) {
+            for (FreeChunk* chunk = _bins[bin]; chunk; chunk = chunk->next) {
+                if (chunk->size() > stats.largestFree) {
+                    stats.largestFree = chunk->size();
+                }
+            }
+            break;
+        }
+    }
+    
+    if (stats.free) {
+        stats.fragmentation = static_cast<uint32_t>(100 - stats.largestFree * 100 / stats.free);
+    }
+    return stats;
+}
+
+// The C allocation functions. On Linux they replace the C library's, so
+// everything in the process uses the kernel heap like it would on the Pi.
+// Before the system is inited Allocator uses the C library's malloc, so
+// blocks from outside the kernel heap go back to the C library.
+#if defined(PLATFORM_RPI) || defined(PLATFORM_LINUX)
+
+#ifdef PLATFORM_LINUX
+#include <malloc.h>
+
+extern "C" {
+    void* __libc_malloc(size_t);
+    void* __libc_realloc(void*, size_t);
+    void* __libc_memalign(size_t, size_t);
+    void __libc_free(void*);
+}
+
+static bool inKernelHeap(void* p)
+{
+    uint8_t* start = reinterpret_cast<uint8_t*>(bare::Memory::heapStart());
+    return p >= start && p < start + bare::Memory::heapSize();
+}
+#endif
+
+extern "C" {
+
+    void* malloc(size_t size)
+    {
+#ifdef PLATFORM_LINUX
+        if (!bare::useAllocator()) {
+            return __libc_malloc(size);
+        }
+#endif
+        void* mem;
+        return Allocator::kernelAllocator().alloc(size, mem) ? mem : nullptr;
+    }
+    
+    void* calloc(size_t count, size_t size)
+    {
+        if (size && count > static_cast<size_t>(-1) / size) {
+            return nullptr;
+        }
+        void* mem = malloc(count * size);
+        if (mem) {
+            bare::memset(mem, 0, count * size);
+        }
+        return mem;
+    }
+    
+    void* realloc(void* p, size_t size)
+    {
+#ifdef PLATFORM_LINUX
+        if (!bare::useAllocator()) {
+            return __libc_realloc(p, size);
+        }
+        if (p && !inKernelHeap(p)) {
+            // Move it to the kernel heap
+            void* mem = malloc(size);
+            if (mem) {
+                size_t oldSize = malloc_usable_size(p);
+                bare::memcpy(mem, p, (oldSize < size) ? oldSize : size);
+                __libc_free(p);
+            }
+            return mem;
+        }
+#endif
+        if (size == 0) {
+            free(p);
+            return nullptr;
+        }
+        void* mem;
+        return Allocator::kernelAllocator().realloc(p, size, mem) ? mem : nullptr;
+    }
+    
+    void free(void* p)
+    {
+#ifdef PLATFORM_LINUX
+        if (!bare::useAllocator() || !inKernelHeap(p)) {
+            __libc_free(p);
+            return;
+        }
+#endif
+        Allocator::kernelAllocator().free(p);
+    }
+    
+    void* memalign(size_t align, size_t size)
+    {
+#ifdef PLATFORM_LINUX
+        if (!bare::useAllocator()) {
+            return __libc_memalign(align, size);
+        }
+#endif
+        void* mem;
+        return Allocator::kernelAllocator().alloc(size, mem, align) ? mem : nullptr;
+    }
+
+}
+
+#endif
+
 #ifndef __APPLE__
 void *operator new(size_t size)
 {
@@ -203,5 +494,37 @@ void operator delete [ ](void *p, size_t size) noexcept
 {
     Allocator::kernelAllocator().free(p);
 }
+
+void *operator new(size_t size, std::align_val_t align)
+{
+    void* mem;
+    return Allocator::kernelAllocator().alloc(size, mem, static_cast<size_t>(align)) ? mem : nullptr;
+}
+
+void *operator new[] (size_t size, std::align_val_t align)
+{
+    void* mem;
+    return Allocator::kernelAllocator().alloc(size, mem, static_cast<size_t>(align)) ? mem : nullptr;
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    Allocator::kernelAllocator().free(p);
+}
+
+void operator delete [ ](void *p, std::align_val_t) noexcept
+{
+    Allocator::kernelAllocator().free(p);
+}
+
+void operator delete(void *p, size_t size, std::align_val_t) noexcept
+{
+    Allocator::kernelAllocator().free(p);
+}
+
+void operator delete [ ](void *p, size_t size, std::align_val_t) noexcept
+{
+    Allocator::kernelAllocator().free(p);
+}
 #endif
 
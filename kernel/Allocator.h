@@ -1,11 +1,11 @@
 /*-------------------------------------------------------------------------
     This source file is a part of Placid
-
+    
     For the latest info, see http:www.marrin.org/
-
+    
     Copyright (c) 2018-2019, Chris Marrin
     All rights reserved.
-
+    
     Use of this source code is governed by the MIT license that can be
     found in the LICENSE file.
 -------------------------------------------------------------------------*/
@@ -16,7 +16,7 @@
 #include "bare/Mutex.h"
 
 namespace placid {
-
+    
     // Allocator
     //
     // Use the mapSegment API from Memory to manage a malloc-style memory
@@ -59,60 +59,177 @@ namespace placid {
     // (https://creativecommons.org/publicdomain/zero/1.0/) is a great gift to
     // the open source community (I'm looking at you, Richard Stallman).
     //
+    // Free chunks are kept in bins by size, like dlmalloc. Small bins hold
+    // chunks of one size each, MinAllocSize apart, so a small allocation
+    // takes the first chunk of its bin. Large bins each hold a power of two
+    // range of sizes. A bitmap has a bit set for each bin with chunks in it,
+    // so when a bin is empty the next bin up with chunks is found with
+    // count leading zeros rather than by walking lists.
+    //
+    // Chunks are carved from segments from Memory::mapSegment. Each chunk
+    // header says whether the chunk before it is free, and a free chunk
+    // has its size in its last word, so free merges a chunk with free
+    // neighbors without searching. A fence at the end of each segment
+    // keeps chunks from merging across segments. When a whole segment is
+    // free it's given back with Memory::unmapSegment.
+    //
+    // Chunks start one header before a multiple of MinAllocSize, so all
+    // memory returned is aligned to MinAllocSize. Bigger alignments are
+    // met by allocating enough extra to find an aligned spot and freeing
+    // the chunk in front of it.
+    //
     class Allocator
     {
     public:
         Allocator();
         
+        // align must be a power of 2. Memory is always aligned to at least
+        // MinAllocSize, so 0 or anything up to that costs nothing extra.
         bool alloc(size_t size, void*&, size_t align = 0);
         void free(void *);
         
-        uint32_t size() const { return _size; }
+        // Change the size of the block at addr, keeping its contents. It
+        // stays in place if it's shrinking or the chunk after it is free
+        // and big enough to grow into. Otherwise mem is a new block and
+        // addr is freed. A null addr is an alloc.
+        bool realloc(void* addr, size_t size, void*& mem);
+        
+        uint32_t size() const { return static_cast<uint32_t>(_size); }
+        
+        struct Stats
+        {
+            size_t inUse = 0;           // bytes in allocated chunks, including headers
+            size_t free = 0;            // bytes in free chunks
+            size_t mapped = 0;          // bytes in segments from Memory::mapSegment
+            size_t largestFree = 0;
+            uint32_t segments = 0;
+            uint32_t fragmentation = 0; // percent of free bytes not in the largest free chunk
+        };
+        
+        Stats stats() const;
         
         static Allocator& kernelAllocator() { return _kernelAllocator; }
-
+        
         static constexpr size_t MinAllocSize = 16 * sizeof(uintptr_t) / 4;
         static constexpr size_t MinSplitSize = 32;
         static constexpr size_t BlockSize = 4096;
-
+        
+        // A whole segment is given back only if it's bigger than this or
+        // keeping it would leave more than this much free, so allocating
+        // and freeing a block in a loop doesn't map and unmap a segment
+        // each time
+        static constexpr size_t KeepFreeSize = 2 * BlockSize;
+        
         class Chunk
         {
         public:
             enum class Status { Free = 0, InUse = 1 };
             
-            static constexpr size_t SizeMask = ~static_cast<size_t>(0x03);
+            static constexpr size_t InUseBit = 0x01;
+            static constexpr size_t PrevInUseBit = 0x02;    // the chunk before this one is not free
+            static constexpr size_t FirstBit = 0x04;        // first chunk in its segment
+            static constexpr size_t FlagMask = 0x07;
+            static constexpr size_t SizeMask = ~FlagMask;
             
-            void setSize(size_t size) { assert((size & 0x03) == 0); _value &= 0x03; _value |= size & SizeMask; }
+            void init(size_t size, size_t flags) { assert((size & FlagMask) == 0); _value = size | flags; }
+            void setSize(size_t size) { assert((size & FlagMask) == 0); _value &= FlagMask; _value |= size; }
             size_t size() const { return _value & SizeMask; }
-            void setStatus(Status status) { _value &= SizeMask; _value |= static_cast<size_t>(status); }
-            Status status() const { return static_cast<Status>(_value & 0x03); }
-
+            void setStatus(Status status) { _value &= ~InUseBit; _value |= static_cast<size_t>(status); }
+            Status status() const { return static_cast<Status>(_value & InUseBit); }
+            
+            bool prevInUse() const { return (_value & PrevInUseBit) != 0; }
+            void setPrevInUse(bool inUse) { if (inUse) { _value |= PrevInUseBit; } else { _value &= ~PrevInUseBit; } }
+            bool first() const { return (_value & FirstBit) != 0; }
+            
+            Chunk* next() { return reinterpret_cast<Chunk*>(reinterpret_cast<uint8_t*>(this) + size()); }
+            
+            // The fence has no size, and is always in use
+            bool fence() const { return size() == 0; }
+        
         private:
             size_t _value = 0;
         };
-
+        
         struct FreeChunk : public Chunk
         {
             FreeChunk* next;
             FreeChunk* prev;
+            
+            // The last word of a free chunk is its size
+            void setFooter() { *(reinterpret_cast<size_t*>(reinterpret_cast<uint8_t*>(this) + size()) - 1) = size(); }
         };
-
-        static_assert(sizeof(FreeChunk) < MinAllocSize, "MinAllocSize too small");
-        static_assert(sizeof(FreeChunk) < MinSplitSize, "MinSplitSize too small");
-
+        
+        // Where the first chunk starts in a segment, so chunk memory is
+        // MinAllocSize aligned
+        static constexpr size_t SegmentHeaderOffset = MinAllocSize - sizeof(Chunk);
+        
+        static_assert(sizeof(FreeChunk) + sizeof(size_t) <= MinAllocSize, "MinAllocSize too small");
+        static_assert(MinSplitSize >= MinAllocSize, "MinSplitSize too small");
+        static_assert((MinAllocSize & Chunk::FlagMask) == 0, "MinAllocSize must leave room for the chunk flags");
+        
+        static constexpr uint32_t SmallBins = 32;
+        static constexpr uint32_t LargeBins = 32;
+        static constexpr uint32_t NumBins = SmallBins + LargeBins;
+        
+        // Small bin n holds chunks of (n + 1) * MinAllocSize bytes
+        static constexpr size_t MaxSmallSize = SmallBins * MinAllocSize;
+        
+        static_assert((MaxSmallSize & (MaxSmallSize - 1)) == 0, "MaxSmallSize must be a power of 2");
+        
+        static uint32_t binIndex(size_t size)
+        {
+            if (size <= MaxSmallSize) {
+                return static_cast<uint32_t>(size / MinAllocSize) - 1;
+            }
+            
+            // Large bin n holds chunks from MaxSmallSize * 2^n up to twice
+            // that size. The last bin holds everything bigger.
+            constexpr uint32_t SizeBits = sizeof(unsigned long) * 8;
+            constexpr uint32_t MaxSmallBits = SizeBits - 1 - __builtin_clzl(MaxSmallSize);
+            uint32_t bin = SmallBins + (SizeBits - 1 - __builtin_clzl(size)) - MaxSmallBits;
+            return (bin < NumBins) ? bin : NumBins - 1;
+        }
+    
     private:
-        void removeFromFreeList(FreeChunk*);
-        void splitFreeBlock(FreeChunk*, size_t size);
-        void addToFreeList(void*, size_t size);
+        void removeFromFreeList(FreeChunk*, uint32_t bin);
+        
+        // Make size bytes at chunk a free chunk and put it in its bin. The
+        // flags in the header, other than InUse, must already be set.
+        void addToFreeList(Chunk*, size_t size);
+        
+        // Mark size bytes of chunk in use and free the rest if it's big enough
+        // to be a chunk. Returns the size of the chunk in use.
+        size_t useChunk(Chunk*, size_t size);
+        
+        // Map a segment big enough for a chunk of size bytes and return it as
+        // one free chunk, not in a bin
+        Chunk* mapSegment(size_t size);
         
-        FreeChunk* _freeList = nullptr;
+        // Take a free chunk of at least size bytes out of its bin, or map a
+        // new segment for one
+        Chunk* findChunk(size_t size);
+        
+        // Return the first bin at or after bin which has chunks in it, or
+        // NumBins if there isn't one
+        uint32_t firstBin(uint32_t bin) const;
+        
+        static constexpr uint32_t BinMapWords = NumBins / 32;
+        static uint32_t binBit(uint32_t bin) { return 0x80000000 >> (bin % 32); }
+        
+        bool checkBins() const;
+        
+        FreeChunk* _bins[NumBins] = { };
+        uint32_t _binMap[BinMapWords] = { };
         
         static Allocator _kernelAllocator;
         
-        uint32_t _size = 0;
+        size_t _size = 0;
+        size_t _freeSize = 0;
+        size_t _mappedSize = 0;
+        uint32_t _segments = 0;
         
         bare::Mutex _mutex;
     };
-    
+
 }
 
@@ -15,6 +15,7 @@
 #include "BootShell.h"
 
 #include "bare/Graphics.h"
+#include "bare/ObjectCache.h"
 #include "bare/Serial.h"
 #include "bare/WiFiSPI.h"
 #include "bare/Timer.h"
@@ -257,16 +258,21 @@ const char* BootShell::welcomeString() const
 const char* BootShell::helpString() const
 {
 	return
+            "    cache [flush]      : show block cache status or flush it\n"
             "    date [<time/date>] : set/get time/date\n"
             "    debug [on/off]     : turn debugging on/off\n"
             "    heap               : show heap status\n"
+            "    journal [on/off]   : turn the metadata journal on/off\n"
             "    put <file>         : put file (X/YModem send)\n"
             "    diff <file>        : compare file (X/YModem send)\n"
-            "    ls                 : list files\n"
+            "    ls [<dir>]         : list files\n"
+            "    mkdir <dir>        : create directory\n"
+            "    mount              : show mounted volumes\n"
             "    mv <src> <dst>     : rename file\n"
             "    reset              : restart kernel\n"
-            "    rm <file>          : remove file\n"
+            "    rm <file>          : remove file or empty directory\n"
             "    run <file>         : run user program\n"
+            "    sd                 : show SD card bus mode\n"
             "    stop <pid>         : stop user program\n"
     ;
 }
@@ -360,17 +366,35 @@ void BootShell::receiveFile(const char* name, bool diff)
             showMessage(MessageType::Info, "'%s' uploaded, size=%d\n", name, fp->size());
         }
         delete fp;
+        
+        // Closing leaves the upload in the block cache
+        if (!diff) {
+            bare::Volume::Error error = FileSystem::sharedFileSystem()->flush();
+            if (error != bare::Volume::Error::OK) {
+                showMessage(MessageType::Error, "flush of '%s' failed: %s\n", name, FileSystem::sharedFileSystem()->errorDetail(error));
+            }
+        }
     }
 }
 
 bool BootShell::executeShellCommand(const std::vector<bare::String>& array)
 {
     if (array[0] == "ls") {
-        bare::DirectoryIterator* it = FileSystem::sharedFileSystem()->directoryIterator("/");
+        const char* path = (array.size() > 1) ? array[1].c_str() : "/";
+        bare::DirectoryIterator* it = FileSystem::sharedFileSystem()->directoryIterator(path);
+        if (!it) {
+            showMessage(MessageType::Error, "'%s' is not a directory\n", path);
+            return true;
+        }
         for ( ; *it; it->next()) {
-            showMessage(MessageType::Info, "%-13s %10d\n", it->name(), it->size());
+            if (it->subdir()) {
+                showMessage(MessageType::Info, "%-13s %10s\n", it->name(), "<dir>");
+            } else {
+                showMessage(MessageType::Info, "%-13s %10d\n", it->name(), it->size());
+            }
         }
         delete it;
+        showMessage(MessageType::Info, "%lld bytes free\n", FileSystem::sharedFileSystem()->freeSpace());
     } else if (array[0] == "put") {
         if (array.size() != 2) {
             showMessage(MessageType::Error, "put requires one file name\n");
@@ -386,6 +410,7 @@ bool BootShell::executeShellCommand(const std::vector<bare::String>& array)
         receiveFile(array[1].c_str(), true);
         return true;
     } else if (array[0] == "reset") {
+        FileSystem::sharedFileSystem()->flush();
         bare::restart();
     } else if (array[0] == "rm") {
         if (array.size() != 2) {
@@ -399,6 +424,32 @@ bool BootShell::executeShellCommand(const std::vector<bare::String>& array)
             showMessage(MessageType::Info, "'%s' removed\n", array[1].c_str());
         }
         return true;
+    } else if (array[0] == "mkdir") {
+        if (array.size() != 2) {
+            showMessage(MessageType::Error, "mkdir requires one directory name\n");
+            return true;
+        }
+        bare::Volume::Error error = FileSystem::sharedFileSystem()->createDirectory(array[1].c_str());
+        if (error != bare::Volume::Error::OK) {
+            showMessage(MessageType::Error, "attempting to mkdir: %s\n", FileSystem::sharedFileSystem()->errorDetail(error));
+        } else {
+            showMessage(MessageType::Info, "'%s' created\n", array[1].c_str());
+        }
+        return true;
+    } else if (array[0] == "journal") {
+        if (array.size() > 1) {
+            bare::Volume::Error error = FileSystem::sharedFileSystem()->setJournal(array[1] == "on");
+            if (error != bare::Volume::Error::OK) {
+                showMessage(MessageType::Error, "journal %s failed: %s\n", array[1].c_str(), FileSystem::sharedFileSystem()->errorDetail(error));
+                return true;
+            }
+        }
+        showMessage(MessageType::Info, "journal is %s\n", FileSystem::sharedFileSystem()->journalEnabled() ? "on" : "off");
+    } else if (array[0] == "mount") {
+        FileSystem::sharedFileSystem()->forEachMount([this](const char* path, const bare::Volume* volume)
+        {
+            showMessage(MessageType::Info, "/%-12s %10d blocks\n", path, volume->sizeInBlocks());
+        });
     } else if (array[0] == "mv") {
         if (array.size() != 3) {
             showMessage(MessageType::Error, "mv requires from and to file names\n");
@@ -419,7 +470,7 @@ bool BootShell::executeShellCommand(const std::vector<bare::String>& array)
         bare::Volume::Error error = fp->rename(array[2].c_str());
         if (error == bare::Volume::Error::FileExists) {
             showMessage(MessageType::Error, "to filename '%s' exists. Please select a new file name\n", array[2].c_str());
-        } else if (fp->error() != bare::Volume::Error::OK) {
+        } else if (error != bare::Volume::Error::OK) {
             showMessage(MessageType::Error, "rename of '%s' to '%s' failed: %s\n", array[1].c_str(), array[2].c_str(), FileSystem::sharedFileSystem()->errorDetail(error));
         } else {
             showMessage(MessageType::Info, "'%s' renamed to '%s'\n", array[1].c_str(), array[2].c_str());
@@ -452,8 +503,50 @@ bool BootShell::executeShellCommand(const std::vector<bare::String>& array)
             showMessage(MessageType::Info, "set current time to: %s\n", currentTime.timeString(bare::RealTime::TimeFormat::DateTime).c_str());
         }
     } else if (array[0] == "heap") {
-        uint32_t size = Allocator::kernelAllocator().size();
-        showMessage(MessageType::Info, "heap size: %d\n", size);
+        Allocator::Stats stats = Allocator::kernelAllocator().stats();
+        showMessage(MessageType::Info, "heap size: %d\n", static_cast<uint32_t>(stats.inUse));
+        showMessage(MessageType::Info, "    free %d, largest free %d, fragmentation %d%%\n",
+                    static_cast<uint32_t>(stats.free), static_cast<uint32_t>(stats.largestFree), stats.fragmentation);
+        showMessage(MessageType::Info, "    mapped %d in %d segments\n", static_cast<uint32_t>(stats.mapped), stats.segments);
+        for (bare::ObjectCacheBase* cache = bare::ObjectCacheBase::first(); cache; cache = cache->next()) {
+            const bare::ObjectCacheBase::Stats& cacheStats = cache->stats();
+            showMessage(MessageType::Info, "cache %-22s size %4d, in use %4d (max %d), slabs %d, allocs %d\n",
+                        cache->name(), static_cast<uint32_t>(cache->objectSize()), cacheStats.inUse, cacheStats.maxInUse,
+                        cacheStats.slabs, cacheStats.allocs);
+        }
+    } else if (array[0] == "cache") {
+        if (array.size() > 1 && array[1] == "flush") {
+            bare::Volume::Error error = FileSystem::sharedFileSystem()->flush();
+            if (error != bare::Volume::Error::OK) {
+                showMessage(MessageType::Error, "flush failed: %s\n", FileSystem::sharedFileSystem()->errorDetail(error));
+                return true;
+            }
+        }
+        const bare::BlockCache& cache = FileSystem::sharedFileSystem()->blockCache();
+        const bare::BlockCache::Stats& stats = cache.stats();
+        showMessage(MessageType::Info, "block cache: %d blocks, %d dirty, %d pinned\n",
+                    cache.size(), cache.dirtyCount(), cache.pinnedCount());
+        showMessage(MessageType::Info, "    hits=%d, misses=%d, uncached=%d, evictions=%d, writeBacks=%d\n",
+                    stats.hits, stats.misses, stats.uncached, stats.evictions, stats.writeBacks);
+        const bare::FAT32::FATStats& fatStats = FileSystem::sharedFileSystem()->fatStats();
+        showMessage(MessageType::Info, "FAT cache: hits=%d, misses=%d, reads=%d, writes=%d, mirrorWrites=%d\n",
+                    fatStats.hits, fatStats.misses, fatStats.reads, fatStats.writes, fatStats.mirrorWrites);
+        showMessage(MessageType::Info, "journal: commits=%d, blocks=%d, replayed=%d\n",
+                    fatStats.journalCommits, fatStats.journalBlocks, fatStats.replayedBlocks);
+        const StreamStats& streamStats = FileSystem::sharedFileSystem()->streamStats();
+        showMessage(MessageType::Info, "file streams: hits=%d, misses=%d, readAhead=%d, reads=%d, writes=%d, blocksWritten=%d, maxWindow=%d\n",
+                    streamStats.hits, streamStats.misses, streamStats.readAheadBlocks, streamStats.reads,
+                    streamStats.writes, streamStats.blocksWritten, streamStats.maxWindow);
+        const OpenFileStats& openFileStats = FileSystem::sharedFileSystem()->openFileStats();
+        showMessage(MessageType::Info, "open files: hits=%d, misses=%d\n", openFileStats.hits, openFileStats.misses);
+    } else if (array[0] == "sd") {
+        bare::SDCard::Mode mode = FileSystem::sharedFileSystem()->sdCard().mode();
+        showMessage(MessageType::Info, "SD card: %d bit bus, %s speed, %d.%03dMHz clock, %s\n",
+                    mode.busWidth, mode.highSpeed ? "high" : "default",
+                    mode.clockRate / 1000000, (mode.clockRate / 1000) % 1000,
+                    mode.dma ? "DMA" : "programmed I/O");
+        const bare::SDCard::Stats& stats = FileSystem::sharedFileSystem()->sdCard().stats();
+        showMessage(MessageType::Info, "    commands=%d, transfers=%d, blocks=%d\n", stats.commands, stats.transfers, stats.blocks);
     } else if (array[0] == "run") {
         if (array.size() < 2) {
             showMessage(MessageType::Error, "enter a program to run\n");
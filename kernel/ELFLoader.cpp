@@ -79,82 +79,78 @@ ELFLoader::ELFLoader(const char* name)
     _entryPoint = elfHeader.e_entry;
     _sectionCount = elfHeader.e_shnum;
     _sectionOffset = elfHeader.e_shoff;
-
-    // Get string table offser from string section
-    Elf32_Shdr sectionHeader;
-    if (!readSectionHeader(&sectionHeader, elfHeader.e_shstrndx)) {
+    
+    // Map the section headers and the section name string table so they
+    // can be used in place rather than seeking and reading for each section
+    if (elfHeader.e_shstrndx >= _sectionCount) {
+        _error = Error::InvalidSHeaderOffset;
         return;
     }
-
+    
+    const char* sectionHeaders = _fp->map(_sectionOffset, _sectionCount * sizeof(Elf32_Shdr));
+    if (!sectionHeaders) {
+        _error = Error::InvalidSHeaderOffset;
+        return;
+    }
+    
+    Elf32_Shdr sectionHeader;
+    memcpy(&sectionHeader, sectionHeaders + elfHeader.e_shstrndx * sizeof(Elf32_Shdr), sizeof(Elf32_Shdr));
     _stringSectionOffset = sectionHeader.sh_offset;
+    uint32_t stringSectionSize = sectionHeader.sh_size;
+    
+    const char* strings = stringSectionSize ? _fp->map(_stringSectionOffset, stringSectionSize) : nullptr;
+    if (!strings) {
+        _fp->unmap(sectionHeaders);
+        _error = Error::InvalidSStringOffset;
+        return;
+    }
     
     // Collect info from program header
     Elf32_Phdr programHeader;
     
-    if (!_fp->seek(elfHeader.e_phoff, File::SeekWhence::Set)) {
+    if (!_fp->seek(elfHeader.e_phoff, File::SeekWhence::Set) ||
+        _fp->read(reinterpret_cast<char*>(&programHeader), sizeof(programHeader)) != sizeof(programHeader)) {
         _error = Error::ProgramHeaderRead;
-        return;
-    }
-
-    if (_fp->read(reinterpret_cast<char*>(&programHeader), sizeof(programHeader)) != sizeof(programHeader)) {
-        _error = Error::ProgramHeaderRead;
-        return;
-    }
-
-    if (programHeader.p_type != PT_LOAD) {
+    } else if (programHeader.p_type != PT_LOAD) {
         _error = Error::BadABI;
-        return;
+    } else {
+        // Allocate the data space
+        _memorySize = programHeader.p_memsz;
+        _memory = std::make_unique<char[]>(_memorySize);
+        
+        collectSections(sectionHeaders, strings, stringSectionSize);
     }
     
-    // Allocate the data space
-    _memorySize = programHeader.p_memsz;
-    _memory = std::make_unique<char[]>(_memorySize);
-    
+    _fp->unmap(strings);
+    _fp->unmap(sectionHeaders);
+}
+
+void ELFLoader::collectSections(const char* sectionHeaders, const char* strings, uint32_t stringsSize)
+{
     // Collect info from sections and load
     for (uint32_t i = 0; i < _sectionCount; i++) {
-        if (!readSectionHeader(&sectionHeader, i)) {
-            return;
+        // The mapped headers are only as aligned as their offset in the file
+        Elf32_Shdr sectionHeader;
+        memcpy(&sectionHeader, sectionHeaders + i * sizeof(Elf32_Shdr), sizeof(Elf32_Shdr));
+        if (!sectionHeader.sh_name) {
+            continue;
         }
-        if (sectionHeader.sh_name) {
-            bare::String name;
-            readSectionName(name, sectionHeader.sh_name);
-            collectSectionInfo(name, &sectionHeader, i);
+        
+        // Names must be terminated within the string table
+        uint32_t offset = sectionHeader.sh_name;
+        uint32_t end = offset;
+        while (end < stringsSize && strings[end] != '\0') {
+            ++end;
         }
+        if (end >= stringsSize) {
+            _error = Error::InvalidSStringOffset;
+            return;
+        }
+        
+        collectSectionInfo(strings + offset, &sectionHeader, i);
     }
 }
 
-bool ELFLoader::readSectionHeader(Elf32_Shdr* sectionHeader, uint32_t index)
-{
-    if (!_fp->seek(sectionOffset(index), File::SeekWhence::Set)) {
-        _error = Error::InvalidSHeaderOffset;
-        return false;
-    }
-
-    if (_fp->read(reinterpret_cast<char*>(sectionHeader), sizeof(Elf32_Shdr)) != sizeof(Elf32_Shdr)) {
-        _error = Error::InvalidSHeaderOffset;
-        return false;
-    }
-    
-    return true;
-}
-
-bool ELFLoader::readSectionName(bare::String& name, uint32_t offset)
-{
-    offset = _stringSectionOffset + offset;
-    if (!_fp->seek(offset, File::SeekWhence::Set)) {
-        _error = Error::InvalidSStringOffset;
-        return false;
-    }
-    
-    char buf[33];
-    if (_fp->read(buf, 33) == 0) {
-        _error = Error::StringReadFailure;
-        return false;
-    }
-    name = buf;
-    return true;
-}
-
 bool ELFLoader::loadSection(Section& section, Elf32_Shdr* sectionHeader)
 {
     if (!sectionHeader->sh_size) {
@@ -50,12 +50,9 @@ namespace placid {
             uint32_t _size = 0;
         };
         
-        bool readSectionHeader(Elf32_Shdr*, uint32_t index);
-        bool readSectionName(bare::String& name, uint32_t offset);
+        void collectSections(const char* sectionHeaders, const char* strings, uint32_t stringsSize);
         bool collectSectionInfo(const bare::String name, Elf32_Shdr*, uint32_t index);
         bool loadSection(Section&, Elf32_Shdr*);
-
-        uint32_t sectionOffset(uint32_t i) { return _sectionOffset + i * sizeof(Elf32_Shdr); }
         
         Section _text;
         Section _rodata;
@@ -14,11 +14,15 @@
 
 #include "FileSystem.h"
 
+#include "bare/ObjectCache.h"
 #include "bare/Serial.h"
 #include <sys/types.h>
 
 using namespace placid;
 
+// File buffers are aligned so they can be a DMA target
+static constexpr size_t BufferAlignment = 32;
+
 FileSystem* FileSystem::_sharedFileSystem = nullptr;
 
 FileSystem* FileSystem::sharedFileSystem()
@@ -30,39 +34,265 @@ FileSystem* FileSystem::sharedFileSystem()
 }
 
 FileSystem::FileSystem()
-    : _fatFS(&_sdCard, 0)
+    : _blockCache(&_sdCard)
+    , _fatFS(&_blockCache, 0)
+    , _ramDisk(RAMDiskBlocks)
 {
-    // FIXME: For now we just create a bare::FS for the FAT32 filesystem 
-    // partition 0 of the SD card
-    bare::Volume::Error e = _fatFS.mount();
-    if (e != bare::Volume::Error::OK) {
-        return;
+    _buffers.reserve(MaxPooledBuffers);
+    
+    // FIXME: For now we just mount the FAT32 filesystem in partition 0 of
+    // the SD card
+    if (_fatFS.mount() == bare::Volume::Error::OK) {
+        mount("/", &_fatFS, &_blockCache);
+    }
+    
+    if (_ramDisk.mount() == bare::Volume::Error::OK) {
+        mount("/ram", &_ramDisk);
+    }
+}
+
+FileSystem::~FileSystem()
+{
+    waitForRequests();
+    if (_requestTimer) {
+        _requestTimer->stop();
+    }
+    
+    // Files must all be closed by now
+    for (OpenFile& openFile : _openFiles) {
+        delete openFile.rawFile;
+    }
+    for (Buffer& buffer : _buffers) {
+        bare::aligned_free(buffer.data, BufferAlignment);
+    }
+}
+
+bare::Volume::Error FileSystem::mount(const char* path, bare::Volume* volume, bare::BlockCache* blockCache)
+{
+    if (!volume || volume->error() != bare::Volume::Error::OK) {
+        return bare::Volume::Error::NotMounted;
+    }
+    
+    while (*path == '/') {
+        ++path;
+    }
+    size_t length = strlen(path);
+    while (length > 0 && path[length - 1] == '/') {
+        --length;
+    }
+    
+    bare::String mountPath(path, static_cast<int32_t>(length));
+    for (const Mount& mount : _mounts) {
+        if (mount.path == mountPath) {
+            return bare::Volume::Error::FileExists;
+        }
+    }
+    
+    _mounts.push_back({ mountPath, volume, blockCache });
+    return bare::Volume::Error::OK;
+}
+
+bare::Volume::Error FileSystem::unmount(const char* path)
+{
+    const char* rest;
+    const Mount* mount = findMount(path, rest);
+    if (!mount || *rest != '\0') {
+        return bare::Volume::Error::FileNotFound;
+    }
+    
+    Busy busy(this);
+    bare::Volume::Error error = mount->volume->sync();
+    if (error != bare::Volume::Error::OK) {
+        return error;
+    }
+    
+    // Drop the closed files on the volume. Open ones must be closed first.
+    for (auto it = _openFiles.begin(); it != _openFiles.end(); ) {
+        if (it->volume == mount->volume && it->refs == 0) {
+            delete it->rawFile;
+            it = _openFiles.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    _mounts.erase(_mounts.begin() + (mount - &_mounts[0]));
+    return bare::Volume::Error::OK;
+}
+
+void FileSystem::forEachMount(const std::function<void(const char* path, const bare::Volume*)>& f) const
+{
+    for (const Mount& mount : _mounts) {
+        f(mount.path.c_str(), mount.volume);
+    }
+}
+
+const FileSystem::Mount* FileSystem::findMount(const char* path, const char*& rest) const
+{
+    while (*path == '/') {
+        ++path;
+    }
+    
+    // Mount paths are whole components, so "/ram" doesn't match "ramp"
+    const Mount* found = nullptr;
+    for (const Mount& mount : _mounts) {
+        size_t length = mount.path.size();
+        if (found && length <= found->path.size()) {
+            continue;
+        }
+        
+        // path may be shorter than the mount path
+        const char* mountPath = mount.path.c_str();
+        size_t i = 0;
+        while (i < length && path[i] == mountPath[i]) {
+            ++i;
+        }
+        if (i == length && (length == 0 || path[length] == '\0' || path[length] == '/')) {
+            found = &mount;
+        }
+    }
+    
+    if (found) {
+        rest = path + found->path.size();
     }
+    return found;
+}
+
+bare::RawFile* FileSystem::acquireRawFile(bare::Volume* volume, const char* name)
+{
+    uint64_t id;
+    if (volume->fileID(name, id)) {
+        for (auto it = _openFiles.begin(); it != _openFiles.end(); ++it) {
+            if (it->volume != volume || it->rawFile->fileID() != id) {
+                continue;
+            }
+            
+            // Keep the table in least recently used order
+            OpenFile openFile = *it;
+            _openFiles.erase(it);
+            ++openFile.refs;
+            _openFiles.push_back(openFile);
+            ++_openFileStats.hits;
+            return openFile.rawFile;
+        }
+    }
+    
+    bare::RawFile* rawFile = volume->open(name);
+    if (!rawFile) {
+        return nullptr;
+    }
+    
+    ++_openFileStats.misses;
+    _openFiles.push_back({ volume, rawFile, 1 });
+    return rawFile;
+}
+
+void FileSystem::releaseRawFile(bare::RawFile* rawFile)
+{
+    uint32_t closed = 0;
+    for (OpenFile& openFile : _openFiles) {
+        if (openFile.rawFile == rawFile) {
+            --openFile.refs;
+        }
+        if (openFile.refs == 0) {
+            ++closed;
+        }
+    }
+    
+    // Throw out the least recently used closed files
+    for (auto it = _openFiles.begin(); closed > MaxCachedFiles && it != _openFiles.end(); ) {
+        if (it->refs == 0) {
+            delete it->rawFile;
+            it = _openFiles.erase(it);
+            --closed;
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool FileSystem::forgetRawFile(bare::Volume* volume, const char* name)
+{
+    uint64_t id;
+    if (!volume->fileID(name, id)) {
+        return true;
+    }
+    
+    for (auto it = _openFiles.begin(); it != _openFiles.end(); ++it) {
+        if (it->volume != volume || it->rawFile->fileID() != id) {
+            continue;
+        }
+        
+        // Files using it would write to clusters the volume gives to
+        // other files once it's removed
+        if (it->refs != 0) {
+            return false;
+        }
+        delete it->rawFile;
+        _openFiles.erase(it);
+        return true;
+    }
+    return true;
+}
+
+bool FileSystem::syncSharedBuffers(File* file, uint32_t block, uint32_t blocks, bool write)
+{
+    for (File* other : _files) {
+        if (other == file || other->_rawFile != file->_rawFile || !other->_bufferBlocks) {
+            continue;
+        }
+        
+        bool overlaps = other->_bufferAddr < block + blocks && block < other->_bufferAddr + other->_bufferBlocks;
+        if (write && !overlaps) {
+            continue;
+        }
+        if (!other->writeBuffer()) {
+            file->_error = other->_error;
+            return false;
+        }
+        if (write) {
+            other->_bufferBlocks = 0;
+        }
+    }
+    return true;
 }
 
 bare::DirectoryIterator* FileSystem::directoryIterator(const char* path)
 {
-    return _fatFS.directoryIterator(path);
+    const char* rest;
+    const Mount* mount = findMount(path, rest);
+    if (!mount) {
+        return nullptr;
+    }
+    
+    Busy busy(this);
+    return mount->volume->directoryIterator(rest);
 }
 
 File* FileSystem::open(const char* name, OpenMode mode, OpenOption option)
 {
-    if (error() != bare::Volume::Error::OK) {
+    const char* rest;
+    const Mount* mount = findMount(name, rest);
+    if (!mount) {
         return nullptr;
     }
     
+    Busy busy(this);
+    bare::Volume* volume = mount->volume;
     File* fp = new File;
     fp->_error = bare::Volume::Error::OK;
-    fp->_rawFile = _fatFS.open(name);
+    fp->_fileSystem = this;
+    fp->_volume = volume;
+    fp->_blockCache = mount->blockCache;
+    fp->_rawFile = acquireRawFile(volume, rest);
     if (!fp->_rawFile) {
         if (mode == OpenMode::Write) {
             // File does not exist, create it
-            fp->_error = create(name);
+            fp->_error = volume->create(rest);
             if (fp->_error != bare::Volume::Error::OK) {
                 return fp;
             }
             
-            fp->_rawFile = _fatFS.open(name);
+            fp->_rawFile = acquireRawFile(volume, rest);
             if (!fp->_rawFile) {
                 fp->_error = bare::Volume::Error::InternalError;
                 return fp;
@@ -83,104 +313,603 @@ File* FileSystem::open(const char* name, OpenMode mode, OpenOption option)
         fp->_canWrite = true;
     }
     
+    _files.push_back(fp);
     return fp;
 }
 
 bare::Volume::Error FileSystem::create(const char* name)
 {
-    return _fatFS.create(name);
+    const char* rest;
+    const Mount* mount = findMount(name, rest);
+    if (!mount) {
+        return bare::Volume::Error::NotMounted;
+    }
+    
+    Busy busy(this);
+    return mount->volume->create(rest);
+}
+
+bare::Volume::Error FileSystem::createDirectory(const char* name)
+{
+    const char* rest;
+    const Mount* mount = findMount(name, rest);
+    if (!mount) {
+        return bare::Volume::Error::NotMounted;
+    }
+    
+    Busy busy(this);
+    bare::Volume::Error error = mount->volume->createDirectory(rest);
+    if (error != bare::Volume::Error::OK) {
+        return error;
+    }
+    return flush();
 }
 
 bare::Volume::Error FileSystem::remove(const char* name)
 {
-    return _fatFS.remove(name);
+    const char* rest;
+    const Mount* mount = findMount(name, rest);
+    if (!mount) {
+        return bare::Volume::Error::NotMounted;
+    }
+    
+    Busy busy(this);
+    if (!forgetRawFile(mount->volume, rest)) {
+        return bare::Volume::Error::FileBusy;
+    }
+    bare::Volume::Error error = mount->volume->remove(rest);
+    if (error != bare::Volume::Error::OK) {
+        return error;
+    }
+    return flush();
+}
+
+bare::Volume::Error FileSystem::flush()
+{
+    Busy busy(this);
+    for (const Mount& mount : _mounts) {
+        bare::Volume::Error error = mount.volume->sync();
+        if (error != bare::Volume::Error::OK) {
+            return error;
+        }
+    }
+    return _blockCache.flush();
 }
 
-bool File::prepareBuffer(off_t offset)
+bool FileSystem::submit(IORequest& request, IOCompletion completion)
 {
-    if (offset / bare::BlockSize == _bufferAddr) {
-        _error = bare::Volume::Error::OK;
+    // A completion which interrupted a file system call can't start a request
+    if (!request.file || _busy) {
+        return false;
+    }
+    
+    // Only submit takes a slot and a completion frees one with a single
+    // store, so finding a free one needs no locking
+    QueuedRequest* queued = nullptr;
+    for (QueuedRequest& slot : _requests) {
+        if (!slot.inUse) {
+            queued = &slot;
+            break;
+        }
+    }
+    if (!queued) {
+        return false;
+    }
+    
+    if (!_requestTimer) {
+        _requestTimer = bare::Timer::create([this](std::shared_ptr<bare::Timer>) { fireCompletedRequests(); });
+    }
+    
+    request.transferred = 0;
+    request.error = bare::Volume::Error::OK;
+    queued->request = &request;
+    queued->completion = completion;
+    queued->size = 0;
+    queued->transferCount = 0;
+    queued->submitted = false;
+    queued->next = nullptr;
+    queued->inUse = true;
+    
+    queued->error = startRequest(*queued);
+    
+    // Transfers still on the device complete the request from their
+    // interrupt. If they've all finished it waits for the timer.
+    bare::disableIRQ();
+    queued->submitted = true;
+    if (allTransfersDone(*queued)) {
+        if (_completedTail) {
+            _completedTail->next = queued;
+        } else {
+            _completedHead = queued;
+        }
+        _completedTail = queued;
+        
+        // Timer::start sorts the timer list, which the timer interrupt walks
+        if (!_requestTimerStarted) {
+            _requestTimerStarted = true;
+            _requestTimer->start(0, false);
+        }
+    }
+    bare::enableIRQ();
+    return true;
+}
+
+bare::Volume::Error FileSystem::startRequest(QueuedRequest& queued)
+{
+    Busy busy(this);
+    
+    IORequest& request = *queued.request;
+    File* file = request.file;
+    bool write = request.op == IORequest::Op::Write;
+    if (write && !file->_canWrite) {
+        return bare::Volume::Error::ReadOnly;
+    }
+    if (!write && !file->_canRead) {
+        return bare::Volume::Error::WriteOnly;
+    }
+    
+    size_t size = 0;
+    for (uint32_t i = 0; i < request.count; ++i) {
+        size += request.iov[i].size;
+    }
+    
+    off_t fileSize = file->_rawFile->size();
+    off_t end = request.offset + static_cast<off_t>(size);
+    if (write && end > fileSize) {
+        // Allocate the space now, so the blocks can be mapped
+        // FIXME: support > 32 bit size
+        uint32_t newSize = static_cast<uint32_t>(end);
+        bare::Volume::Error error = file->_rawFile->reserve(newSize);
+        if (error != bare::Volume::Error::OK) {
+            return error;
+        }
+        file->_rawFile->setSize(newSize);
+        file->_needsSizeUpate = true;
+    } else if (!write && end > fileSize) {
+        size = (request.offset < fileSize) ? static_cast<size_t>(fileSize - request.offset) : 0;
+    }
+    queued.size = size;
+    if (size == 0) {
+        return bare::Volume::Error::OK;
+    }
+    
+    // Other Files open on the same file have their own buffers
+    uint32_t firstBlock = static_cast<uint32_t>(request.offset / bare::BlockSize);
+    uint32_t blocks = static_cast<uint32_t>((request.offset + size + bare::BlockSize - 1) / bare::BlockSize) - firstBlock;
+    if (!syncSharedBuffers(file, firstBlock, blocks, write)) {
+        return file->_error;
+    }
+    
+    off_t savedOffset = file->_offset;
+    off_t offset = request.offset;
+    size_t sizeRemaining = size;
+    bare::Volume::Error error = bare::Volume::Error::OK;
+    
+    for (uint32_t i = 0; i < request.count && sizeRemaining && error == bare::Volume::Error::OK; ++i) {
+        char* buf = request.iov[i].base;
+        size_t amount = (request.iov[i].size < sizeRemaining) ? request.iov[i].size : sizeRemaining;
+        sizeRemaining -= amount;
+        
+        while (amount && error == bare::Volume::Error::OK) {
+            // Runs of whole blocks which are contiguous on the device go to
+            // it as one transfer each. Partial blocks go through the File's
+            // buffer now, and so does everything once there's no transfer
+            // left or the buffer isn't aligned for RawIO.
+            bool queue = file->_blockCache && queued.transferCount < MaxTransfers && (reinterpret_cast<uintptr_t>(buf) & 3) == 0;
+            uint32_t blockOffset = static_cast<uint32_t>(offset % bare::BlockSize);
+            size_t piece;
+            
+            if (queue && blockOffset == 0 && amount >= bare::BlockSize) {
+                uint32_t logicalBlock = static_cast<uint32_t>(offset / bare::BlockSize);
+                uint32_t blocks = static_cast<uint32_t>(amount / bare::BlockSize);
+                bare::Block physicalBlock;
+                error = file->_rawFile->logicalToPhysicalBlock(logicalBlock, physicalBlock);
+                if (error != bare::Volume::Error::OK) {
+                    break;
+                }
+                
+                uint32_t run = 1;
+                for ( ; run < blocks; ++run) {
+                    bare::Block nextBlock;
+                    if (file->_rawFile->logicalToPhysicalBlock(logicalBlock + run, nextBlock) != bare::Volume::Error::OK ||
+                            nextBlock.value() != physicalBlock.value() + run) {
+                        break;
+                    }
+                }
+                
+                if (!file->syncBuffer(logicalBlock, run, write)) {
+                    error = file->_error;
+                    break;
+                }
+                error = queueTransfer(queued, buf, physicalBlock, run, write);
+                piece = run * bare::BlockSize;
+            } else {
+                piece = amount;
+                if (queue && blockOffset && amount > bare::BlockSize - blockOffset) {
+                    piece = bare::BlockSize - blockOffset;
+                }
+                
+                file->_offset = offset;
+                if (file->io(buf, piece, write) != piece) {
+                    error = file->_error;
+                }
+            }
+            
+            offset += piece;
+            buf += piece;
+            amount -= piece;
+        }
+    }
+    
+    file->_offset = savedOffset;
+    return error;
+}
+
+bare::Volume::Error FileSystem::queueTransfer(QueuedRequest& queued, char* buf, bare::Block blockAddr, uint32_t blocks, bool write)
+{
+    uint32_t index = queued.transferCount++;
+    bare::Volume::RawIO::Request& transfer = queued.transfers[index];
+    transfer.write = write;
+    transfer.buf = buf;
+    transfer.blockAddr = blockAddr;
+    transfer.blocks = blocks;
+    transfer.completion = [this, &queued](bare::Volume::RawIO::Request* finished, bare::Volume::Error error)
+    {
+        transferFinished(queued, static_cast<uint32_t>(finished - queued.transfers), error);
+    };
+    queued.transferDone[index] = false;
+    queued.transferError[index] = bare::Volume::Error::OK;
+    
+    bare::Volume::Error error = queued.request->file->_blockCache->submit(&transfer);
+    if (error != bare::Volume::Error::OK) {
+        // The transfer never started, so there's no completion to wait for
+        queued.transferDone[index] = true;
+    }
+    return error;
+}
+
+void FileSystem::transferFinished(QueuedRequest& queued, uint32_t index, bare::Volume::Error error)
+{
+    queued.transferError[index] = error;
+    queued.transferDone[index] = true;
+    
+    // Until all the transfers are queued submit checks for itself
+    if (queued.submitted && allTransfersDone(queued)) {
+        completeRequest(queued);
+    }
+}
+
+bool FileSystem::allTransfersDone(const QueuedRequest& queued) const
+{
+    for (uint32_t i = 0; i < queued.transferCount; ++i) {
+        if (!queued.transferDone[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void FileSystem::completeRequest(QueuedRequest& queued)
+{
+    IORequest& request = *queued.request;
+    request.error = queued.error;
+    for (uint32_t i = 0; i < queued.transferCount && request.error == bare::Volume::Error::OK; ++i) {
+        request.error = queued.transferError[i];
+    }
+    request.transferred = (request.error == bare::Volume::Error::OK) ? queued.size : 0;
+    
+    if (queued.completion) {
+        queued.completion(request);
+    }
+    queued.inUse = false;
+}
+
+FileSystem::QueuedRequest* FileSystem::nextCompleted()
+{
+    QueuedRequest* queued = _completedHead;
+    if (queued) {
+        _completedHead = queued->next;
+        if (!_completedHead) {
+            _completedTail = nullptr;
+        }
+    }
+    return queued;
+}
+
+void FileSystem::fireCompletedRequests()
+{
+    // Called from the request timer, in interrupt context on the Pi
+    while (QueuedRequest* queued = nextCompleted()) {
+        completeRequest(*queued);
+    }
+    _requestTimerStarted = false;
+}
+
+void FileSystem::waitForRequests()
+{
+    // Transfers still on the device finish from their interrupt
+    while (pendingRequests()) {
+        bare::disableIRQ();
+        QueuedRequest* queued = nextCompleted();
+        bare::enableIRQ();
+        
+        if (queued) {
+            completeRequest(*queued);
+        }
+    }
+}
+
+uint32_t FileSystem::pendingRequests() const
+{
+    uint32_t count = 0;
+    for (const QueuedRequest& queued : _requests) {
+        if (queued.inUse) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+static bare::ObjectCache<File> fileCache("File");
+
+void* File::operator new(size_t size)
+{
+    return (size == sizeof(File)) ? fileCache.alloc() : ::operator new(size);
+}
+
+void File::operator delete(void* p, size_t size)
+{
+    if (size == sizeof(File)) {
+        fileCache.free(static_cast<File*>(p));
+    } else {
+        ::operator delete(p);
+    }
+}
+
+File::~File()
+{
+    // Releasing the RawFile and buffer changes the FileSystem's tables
+    FileSystem::Busy busy(_fileSystem);
+    
+    while (!_mappings.empty()) {
+        unmap(_mappings.back().view);
+    }
+    close();
+    
+    if (!_fileSystem) {
+        bare::aligned_free(_buffer, BufferAlignment);
+        return;
+    }
+    
+    _fileSystem->_streamStats.add(_stats);
+    for (auto it = _fileSystem->_files.begin(); it != _fileSystem->_files.end(); ++it) {
+        if (*it == this) {
+            _fileSystem->_files.erase(it);
+            break;
+        }
+    }
+    if (_rawFile) {
+        _fileSystem->releaseRawFile(_rawFile);
+    }
+    
+    // Give the buffer to the next File
+    if (_buffer && _fileSystem->_buffers.size() < FileSystem::MaxPooledBuffers) {
+        _fileSystem->_buffers.push_back({ _buffer, _bufferCapacity });
+    } else {
+        bare::aligned_free(_buffer, BufferAlignment);
+    }
+}
+
+bool File::reserveBuffer(uint32_t blocks)
+{
+    if (blocks <= _bufferCapacity) {
         return true;
     }
+    
+    // Use a pooled buffer if it's big enough
+    if (!_buffer && _fileSystem && !_fileSystem->_buffers.empty()) {
+        FileSystem::Buffer buffer = _fileSystem->_buffers.back();
+        _fileSystem->_buffers.pop_back();
+        _buffer = buffer.data;
+        _bufferCapacity = buffer.capacity;
+        if (blocks <= _bufferCapacity) {
+            return true;
+        }
+    }
+    
+    char* buffer = static_cast<char*>(bare::aligned_alloc(BufferAlignment, blocks * bare::BlockSize));
+    if (!buffer) {
+        return false;
+    }
+    if (_bufferBlocks) {
+        bare::memcpy(buffer, _buffer, _bufferBlocks * bare::BlockSize);
+    }
+    bare::aligned_free(_buffer, BufferAlignment);
+    _buffer = buffer;
+    _bufferCapacity = blocks;
+    return true;
+}
 
-    // Write out any needed data
-    if (_bufferNeedsWriting) {
-    _error = _rawFile->write(_buffer, _bufferAddr, 1);
-    if (_error != bare::Volume::Error::OK) {
+bool File::writeBuffer()
+{
+    if (_dirtyEnd > _dirtyStart) {
+        uint32_t blocks = _dirtyEnd - _dirtyStart;
+        _error = _rawFile->write(_buffer + _dirtyStart * bare::BlockSize, _bufferAddr + _dirtyStart, blocks);
+        if (_error != bare::Volume::Error::OK) {
             return false;
         }
-        _bufferNeedsWriting = false;
+        ++_stats.writes;
+        _stats.blocksWritten += blocks;
+        _dirtyStart = 0;
+        _dirtyEnd = 0;
     }
-    _bufferValid = false;
     return true;
 }
 
-size_t File::io(char* buf, size_t size, bool write)
+bool File::prepareBuffer(off_t offset, bool write)
 {
-    if (!prepareBuffer(_offset)) {
-        return 0;
+    uint32_t block = static_cast<uint32_t>(offset / bare::BlockSize);
+    if (_bufferBlocks && block >= _bufferAddr && block < _bufferAddr + _bufferBlocks) {
+        if (block != _lastBlock) {
+            ++_stats.hits;
+            _lastBlock = block;
+        }
+        _error = bare::Volume::Error::OK;
+        return true;
     }
+    ++_stats.misses;
     
-    size_t sizeRemaining = size;
-    uint32_t bufferAddr = static_cast<uint32_t>(_offset / bare::BlockSize);
-    uint32_t bufferOffset = _offset % bare::BlockSize;
-    
-    if (write && !_bufferValid) {
-        // We need to preload the buffer to fill the parts we're not
-        // going to change
-        _error = _rawFile->read(_buffer, bufferAddr, 1);
-        if (_error == bare::Volume::Error::EndOfFile && write) {
-            bare::memset(_buffer, 0, sizeof(_buffer));
+    bool sequential = _bufferBlocks && block == _bufferAddr + _bufferBlocks;
+    _window = sequential ? ((_window * 2 < MaxWindow) ? _window * 2 : MaxWindow) : 1;
+    if (_window > _stats.maxWindow) {
+        _stats.maxWindow = _window;
+    }
+    _lastBlock = block;
+    
+    // Writing past the end of the file starts with an empty block
+    if (write && sequential && _bufferBlocks < _window && reserveBuffer(_bufferBlocks + 1)) {
+        char* data = _buffer + _bufferBlocks * bare::BlockSize;
+        _error = _rawFile->read(data, block, 1);
+        if (_error == bare::Volume::Error::EndOfFile) {
+            bare::memset(data, 0, bare::BlockSize);
         } else if (_error != bare::Volume::Error::OK) {
-            return 0;
+            return false;
+        }
+        ++_bufferBlocks;
+        _error = bare::Volume::Error::OK;
+        return true;
+    }
+    
+    // Write out any needed data
+    if (!writeBuffer()) {
+        return false;
+    }
+    _bufferBlocks = 0;
+    
+    // Load the block. When writing we need the parts of the block we're
+    // not going to change. When reading, read ahead as far as the window
+    // goes, without going past the end of the file.
+    uint32_t blocks = 1;
+    if (!write) {
+        uint32_t fileBlocks = static_cast<uint32_t>((static_cast<uint64_t>(_rawFile->size()) + bare::BlockSize - 1) / bare::BlockSize);
+        if (block + _window <= fileBlocks) {
+            blocks = _window;
+        } else if (block < fileBlocks) {
+            blocks = fileBlocks - block;
+        }
+    }
+    if (!reserveBuffer(blocks)) {
+        blocks = _bufferCapacity;
+        if (blocks == 0) {
+            _error = bare::Volume::Error::Failed;
+            return false;
+        }
+    }
+    
+    _error = _rawFile->read(_buffer, block, blocks);
+    if (_error == bare::Volume::Error::EndOfFile && write) {
+        bare::memset(_buffer, 0, bare::BlockSize);
+    } else if (_error != bare::Volume::Error::OK) {
+        return false;
+    }
+    
+    ++_stats.reads;
+    _stats.readAheadBlocks += blocks - 1;
+    _bufferBlocks = blocks;
+    _bufferAddr = block;
+    _error = bare::Volume::Error::OK;
+    return true;
+}
+
+bool File::syncBuffer(uint32_t blockAddr, uint32_t blocks, bool write)
+{
+    // Keep the buffer coherent if it holds any of the blocks. Changes in the
+    // buffer are written out first. A write replaces the blocks, so then the
+    // buffer is dropped.
+    if (_bufferBlocks && _bufferAddr < blockAddr + blocks && blockAddr < _bufferAddr + _bufferBlocks) {
+        if (!writeBuffer()) {
+            return false;
+        }
+        if (write) {
+            _bufferBlocks = 0;
         }
-        
-        _bufferValid = true;
-        _bufferAddr = bufferAddr++;
     }
+    return true;
+}
 
-    while (1) {
-        if (!_bufferValid) {
-            _error = write ? 
-                _rawFile->write(_buffer, bufferAddr, 1) :
-                _rawFile->read(_buffer, bufferAddr, 1);
-            
-            if (_error != bare::Volume::Error::OK) {
+bool File::directIO(char* buf, uint32_t blockAddr, uint32_t blocks, bool write)
+{
+    if (!syncBuffer(blockAddr, blocks, write)) {
+        return false;
+    }
+    
+    _error = write ? _rawFile->write(buf, blockAddr, blocks) : _rawFile->read(buf, blockAddr, blocks);
+    return _error == bare::Volume::Error::OK;
+}
+
+size_t File::io(char* buf, size_t size, bool write)
+{
+    FileSystem::Busy busy(_fileSystem);
+    size_t sizeRemaining = size;
+    
+    // Other Files open on the same file have their own buffers
+    uint32_t firstBlock = static_cast<uint32_t>(_offset / bare::BlockSize);
+    uint32_t blocks = static_cast<uint32_t>((_offset + size + bare::BlockSize - 1) / bare::BlockSize) - firstBlock;
+    if (_fileSystem && size && !_fileSystem->syncSharedBuffers(this, firstBlock, blocks, write)) {
+        return 0;
+    }
+    
+    while (sizeRemaining > 0) {
+        uint32_t bufferOffset = _offset % bare::BlockSize;
+        
+        // Runs of whole blocks go straight between the caller's buffer and
+        // the file in one transfer. Only partial blocks at the start and end
+        // go through the block buffer. A single block goes through the
+        // buffer too, so reading a block at a time gets read-ahead. RawFile
+        // needs 4 byte alignment.
+        if (bufferOffset == 0 && sizeRemaining >= 2 * bare::BlockSize && (reinterpret_cast<uintptr_t>(buf) & 3) == 0) {
+            uint32_t blocks = static_cast<uint32_t>(sizeRemaining / bare::BlockSize);
+            if (!directIO(buf, static_cast<uint32_t>(_offset / bare::BlockSize), blocks, write)) {
                 return 0;
             }
             
-            _bufferValid = true;
-            _bufferAddr = bufferAddr++;
-            if (write) {
-                _bufferNeedsWriting = false;
-            }
+            size_t amount = blocks * bare::BlockSize;
+            _offset += amount;
+            buf += amount;
+            sizeRemaining -= amount;
+            continue;
+        }
+        
+        if (!prepareBuffer(_offset, write)) {
+            return 0;
         }
         
+        uint32_t block = static_cast<uint32_t>(_offset / bare::BlockSize) - _bufferAddr;
+        char* data = _buffer + block * bare::BlockSize + bufferOffset;
         size_t amountInBuffer = bare::BlockSize - bufferOffset;
         size_t amountToCopy = (sizeRemaining <= amountInBuffer) ? sizeRemaining : amountInBuffer;
         
         if (write) {
-            bare::memcpy(_buffer + bufferOffset, buf, amountToCopy);
-            _bufferNeedsWriting = true;
+            bare::memcpy(data, buf, amountToCopy);
+            if (_dirtyEnd == _dirtyStart) {
+                _dirtyStart = block;
+                _dirtyEnd = block + 1;
+            } else if (block < _dirtyStart) {
+                _dirtyStart = block;
+            } else if (block >= _dirtyEnd) {
+                _dirtyEnd = block + 1;
+            }
         } else {
-            bare::memcpy(buf, _buffer + bufferOffset, amountToCopy);
+            bare::memcpy(buf, data, amountToCopy);
         }
         
         _offset += amountToCopy;
         buf += amountToCopy;
-        bufferOffset += amountToCopy;
         sizeRemaining -= amountToCopy;
-        
-        if (bufferOffset >= bare::BlockSize) {
-            _bufferValid = false;
-            bufferOffset = 0;
-        }
-        
-        if (sizeRemaining == 0) {
-            _error = bare::Volume::Error::OK;
-            return size;
-        }
     }
+    
+    _error = bare::Volume::Error::OK;
+    return size;
 }
 
 size_t File::read(char* buf, size_t size)
@@ -208,6 +937,156 @@ size_t File::write(const char* buf, size_t size)
     return io(const_cast<char*>(buf), size, true);
 }
 
+size_t File::readv(const IOVec* iov, uint32_t count)
+{
+    if (!_canRead) {
+        _error = bare::Volume::Error::WriteOnly;
+        return -1;
+    }
+    
+    size_t total = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (iov[i].size && io(iov[i].base, iov[i].size, false) != iov[i].size) {
+            return 0;
+        }
+        total += iov[i].size;
+    }
+    return total;
+}
+
+size_t File::writev(const IOVec* iov, uint32_t count)
+{
+    if (!_canWrite) {
+        _error = bare::Volume::Error::ReadOnly;
+        return -1;
+    }
+    
+    // Grow the file once for the whole write
+    size_t total = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        total += iov[i].size;
+    }
+    if (_offset + total > _rawFile->size()) {
+        // FIXME: support > 32 bit size
+        _rawFile->setSize(static_cast<uint32_t>(_offset + total));
+        _needsSizeUpate = true;
+    }
+    
+    for (uint32_t i = 0; i < count; ++i) {
+        if (iov[i].size && io(iov[i].base, iov[i].size, true) != iov[i].size) {
+            return 0;
+        }
+    }
+    return total;
+}
+
+bool File::submit(IORequest& request, IOCompletion completion)
+{
+    if (!_fileSystem) {
+        return false;
+    }
+    request.file = this;
+    return _fileSystem->submit(request, completion);
+}
+
+const char* File::map(off_t offset, size_t length)
+{
+    if (!_canRead) {
+        _error = bare::Volume::Error::WriteOnly;
+        return nullptr;
+    }
+    if (length == 0 || offset < 0 || offset + length > _rawFile->size()) {
+        _error = bare::Volume::Error::EndOfFile;
+        return nullptr;
+    }
+    
+    FileSystem::Busy busy(_fileSystem);
+    
+    uint32_t block = static_cast<uint32_t>(offset / bare::BlockSize);
+    uint32_t blockOffset = static_cast<uint32_t>(offset % bare::BlockSize);
+    uint32_t blocks = static_cast<uint32_t>((blockOffset + length + bare::BlockSize - 1) / bare::BlockSize);
+    
+    // Changes still in this or other Files' buffers need to be in the
+    // cache or on the device
+    if (!writeBuffer() || (_fileSystem && !_fileSystem->syncSharedBuffers(this, block, blocks, false))) {
+        return nullptr;
+    }
+    
+    if (blocks == 1) {
+        bare::Block physicalBlock;
+        if (_rawFile->logicalToPhysicalBlock(block, physicalBlock) == bare::Volume::Error::OK) {
+            char* data = _blockCache ? _blockCache->pin(physicalBlock) : nullptr;
+            if (data) {
+                _mappings.push_back({ data + blockOffset, nullptr, physicalBlock.value() });
+                _error = bare::Volume::Error::OK;
+                return _mappings.back().view;
+            }
+        }
+        
+        // The volume doesn't use the cache or everything in it is pinned,
+        // so use a staging buffer
+    }
+    
+    char* staging = static_cast<char*>(bare::aligned_alloc(BufferAlignment, blocks * bare::BlockSize));
+    if (!staging) {
+        _error = bare::Volume::Error::Failed;
+        return nullptr;
+    }
+    
+    _error = _rawFile->read(staging, block, blocks);
+    if (_error != bare::Volume::Error::OK) {
+        bare::aligned_free(staging, BufferAlignment);
+        return nullptr;
+    }
+    
+    ++_stats.reads;
+    _mappings.push_back({ staging + blockOffset, staging, 0 });
+    return _mappings.back().view;
+}
+
+void File::unmap(const char* view)
+{
+    FileSystem::Busy busy(_fileSystem);
+    for (auto it = _mappings.begin(); it != _mappings.end(); ++it) {
+        if (it->view != view) {
+            continue;
+        }
+        
+        if (it->staging) {
+            bare::aligned_free(it->staging, BufferAlignment);
+        } else {
+            _blockCache->unpin(it->block, false);
+        }
+        _mappings.erase(it);
+        return;
+    }
+}
+
+bare::Volume::Error File::reserve(uint32_t size)
+{
+    if (!_canWrite) {
+        _error = bare::Volume::Error::ReadOnly;
+        return _error;
+    }
+    FileSystem::Busy busy(_fileSystem);
+    _error = _rawFile->reserve(size);
+    return _error;
+}
+
+bare::Volume::Error File::rename(const char* to)
+{
+    const char* rest = to;
+    if (_fileSystem) {
+        const FileSystem::Mount* mount = _fileSystem->findMount(to, rest);
+        if (!mount || mount->volume != _volume) {
+            return bare::Volume::Error::CrossVolume;
+        }
+    }
+    
+    FileSystem::Busy busy(_fileSystem);
+    return _rawFile->rename(rest);
+}
+
 bool File::seek(off_t offset, SeekWhence whence)
 {
     if (whence == SeekWhence::Cur) {
@@ -221,27 +1100,22 @@ bool File::seek(off_t offset, SeekWhence whence)
         offset = _rawFile->size();
     }
     _offset = offset;
-    _bufferValid = false;
     return true;
 }
 
 bare::Volume::Error File::flush()
 {
+    FileSystem::Busy busy(_fileSystem);
     _error = bare::Volume::Error::OK;
     
-    if (_bufferNeedsWriting && _bufferValid) {
-        bare::Volume::Error  error = _rawFile->write(_buffer, _bufferAddr, 1);
-        if (error != bare::Volume::Error::OK) {
-            return error;
-        }
-        _bufferNeedsWriting = false;
-        _bufferValid = false;
+    if (!writeBuffer()) {
+        return _error;
     }
+    _bufferBlocks = 0;
     
     if (_needsSizeUpate) {
         _error = _rawFile->updateSize();
         _needsSizeUpate = false;
     }
-    
     return _error;
 }
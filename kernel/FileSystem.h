@@ -12,25 +12,94 @@
 
 #pragma once
 
+#include "bare/BlockCache.h"
 #include "bare/FAT32.h"
+#include "bare/RAMDisk.h"
 #include "bare/SDCard.h"
+#include "bare/String.h"
+#include "bare/Timer.h"
+#include <functional>
+#include <vector>
 
 namespace placid {
 
     class File;
-
+    
+    // Counters for the read-ahead and write-behind done by Files. Files add
+    // theirs to the FileSystem totals when they are destroyed.
+    struct StreamStats
+    {
+        uint32_t hits = 0;              // moves to another block which was already buffered
+        uint32_t misses = 0;            // moves to another block which needed I/O
+        uint32_t readAheadBlocks = 0;   // blocks read beyond the one asked for
+        uint32_t reads = 0;             // transfers to fill the buffer
+        uint32_t writes = 0;            // transfers of dirty blocks from the buffer
+        uint32_t blocksWritten = 0;
+        uint32_t maxWindow = 1;         // largest window reached, in blocks
+        
+        void add(const StreamStats& other)
+        {
+            hits += other.hits;
+            misses += other.misses;
+            readAheadBlocks += other.readAheadBlocks;
+            reads += other.reads;
+            writes += other.writes;
+            blocksWritten += other.blocksWritten;
+            if (other.maxWindow > maxWindow) {
+                maxWindow = other.maxWindow;
+            }
+        }
+    };
+    
+    // Counters for the open file table
+    struct OpenFileStats
+    {
+        uint32_t hits = 0;      // opens which found the file already in the table
+        uint32_t misses = 0;    // opens which needed a new RawFile
+    };
+    
+    // One buffer of a vectored read or write
+    struct IOVec
+    {
+        char* base;
+        size_t size;
+    };
+    
+    // An asynchronous read or write of a File. The buffers are transferred in
+    // order to or from the contiguous range of the file starting at offset.
+    // The request, its buffers and the File must stay valid until it
+    // completes. The file position isn't changed.
+    struct IORequest
+    {
+        enum class Op { Read, Write };
+        
+        File* file = nullptr;
+        Op op = Op::Read;
+        off_t offset = 0;
+        const IOVec* iov = nullptr;
+        uint32_t count = 0;
+        
+        // Set when the request completes
+        size_t transferred = 0;
+        bare::Volume::Error error = bare::Volume::Error::OK;
+    };
+    
+    using IOCompletion = std::function<void(IORequest&)>;
+    
     // FileSystem
     //
-    // This is essentially a wrapper around bare::FS to give that file system
-    // more capabilities. bare::FS is really just a single device, so maybe 
-    // we'll rename it at some point. FileSystem should eventually be able to
-    // handle multiple bare::FS devices at different mount points, presenting
-    // a single unified file system. But for now we just support a single
-    // FS instance for the built-in FAT32 SD card.
+    // Presents the mounted bare::Volumes as a single file system. Each volume
+    // is mounted at a path and a name is looked up on the volume mounted at
+    // the longest path which matches its start, with that part removed.
+    // The FAT32 partition on the SD card is mounted at "/" and a RAM disk
+    // for scratch files is mounted at "/ram".
     class FileSystem
     {
+        friend class File;
+    
     public:
         FileSystem();
+        ~FileSystem();
         
         // Modes are slightly different than the C standard. Read and Append are
         // the same, but Write will not overwrite an existing file. Attempting to 
@@ -49,18 +118,188 @@ namespace placid {
         bare::DirectoryIterator* directoryIterator(const char* path);
         File* open(const char* name, OpenMode = OpenMode::Read, OpenOption = OpenOption::None);
         
+        // Names are paths from the root directory, with components separated
+        // by '/'. remove also removes empty directories. It returns FileBusy
+        // for a file which is open.
         bare::Volume::Error create(const char* name);
+        bare::Volume::Error createDirectory(const char* name);
         bare::Volume::Error remove(const char* name);
-
+        
+        // Write all cached blocks back to the card. Closing a File doesn't
+        // do this, so call it to make changes safe from a power loss.
+        bare::Volume::Error flush();
+        
+        // Mount a volume at path. The volume must already be mounted itself
+        // and must stay valid until it is unmounted. Pass the BlockCache if
+        // the volume goes through one, so File::map can use its blocks.
+        bare::Volume::Error mount(const char* path, bare::Volume*, bare::BlockCache* = nullptr);
+        bare::Volume::Error unmount(const char* path);
+        
+        // Call f with the path and volume of each mount
+        void forEachMount(const std::function<void(const char* path, const bare::Volume*)>& f) const;
+        
+        // Start a request in the background. Space for a write is allocated
+        // and partial blocks are transferred before submit returns. Runs of
+        // whole blocks are queued on the device through the block cache, up
+        // to MaxTransfers of them, and the rest are done before returning
+        // too. The completion is called from the device's interrupt when
+        // the last transfer finishes, or from a timer callback if they all
+        // finished during submit, as they do on a volume without a block
+        // cache. It can be in interrupt context, so it must not call File
+        // or FileSystem functions. Returns false if MaxRequests are already
+        // pending or a File or FileSystem call is in progress.
+        static constexpr uint32_t MaxRequests = 16;
+        static constexpr uint32_t MaxTransfers = 8;
+        bool submit(IORequest&, IOCompletion);
+        
+        // Wait until every pending request has completed, calling the
+        // completions still waiting for the timer. Don't call it from a
+        // completion.
+        void waitForRequests();
+        uint32_t pendingRequests() const;
+        
+        uint64_t freeSpace() const { return static_cast<uint64_t>(_fatFS.freeClusterCount()) * _fatFS.clusterSize(); }
+        
+        // Turn the metadata journal on the SD card on or off. It stays on
+        // across resets until it's turned off.
+        bare::Volume::Error setJournal(bool enable) { return enable ? _fatFS.enableJournal() : _fatFS.disableJournal(); }
+        bool journalEnabled() const { return _fatFS.journalEnabled(); }
+        
         const char* errorDetail(bare::Volume::Error error) const { return _fatFS.errorDetail(error); }
         bare::Volume::Error error() const { return _fatFS.error(); }
         
-        static FileSystem* sharedFileSystem();
+        const bare::SDCard& sdCard() const { return _sdCard; }
+        const bare::BlockCache& blockCache() const { return _blockCache; }
+        const bare::FAT32::FATStats& fatStats() const { return _fatFS.fatStats(); }
+        const StreamStats& streamStats() const { return _streamStats; }
+        const OpenFileStats& openFileStats() const { return _openFileStats; }
+        const bare::RAMDisk& ramDisk() const { return _ramDisk; }
         
+        static FileSystem* sharedFileSystem();
+    
     private:
+        // Size of the RAM disk, 128KB
+        static constexpr uint32_t RAMDiskBlocks = 256;
+        
+        // Files share one RawFile per open file, which holds its size,
+        // extent map and directory location. A RawFile stays in the table
+        // after its last File closes, so reopening a recently used file
+        // needs no I/O or allocation. Up to MaxCachedFiles closed files
+        // are kept, most recently used last.
+        static constexpr uint32_t MaxCachedFiles = 8;
+        
+        struct OpenFile
+        {
+            bare::Volume* volume;
+            bare::RawFile* rawFile;
+            uint32_t refs;
+        };
+        
+        bare::RawFile* acquireRawFile(bare::Volume*, const char* name);
+        void releaseRawFile(bare::RawFile*);
+        
+        // Called before a file is removed, so it is never found again.
+        // Returns false if the file is open, and it must not be removed.
+        bool forgetRawFile(bare::Volume*, const char* name);
+        
+        // Keep the buffers of Files sharing file's RawFile coherent before
+        // file transfers blocks block to block + blocks. Before a read the
+        // other Files write their buffered changes. Before a write the ones
+        // holding any of the blocks also empty their buffers. Returns false
+        // with file's error set if a write fails.
+        bool syncSharedBuffers(File* file, uint32_t block, uint32_t blocks, bool write);
+        
+        // Buffers of closed Files are kept for new ones
+        static constexpr uint32_t MaxPooledBuffers = 4;
+        
+        struct Buffer
+        {
+            char* data;
+            uint32_t capacity;  // in blocks
+        };
+        
+        // Requests start only when the file system isn't already in use.
+        // Every call that uses the volumes or the File tables holds one of
+        // these while it runs, and so does submit.
+        class Busy
+        {
+        public:
+            Busy(FileSystem* fs) : _fs(fs) { if (_fs) { ++_fs->_busy; } }
+            ~Busy() { if (_fs) { --_fs->_busy; } }
+        
+        private:
+            FileSystem* _fs;
+        };
+        
+        struct Mount
+        {
+            bare::String path;          // without leading or trailing '/', "" for the root
+            bare::Volume* volume;
+            bare::BlockCache* blockCache;
+        };
+        
+        // Return the mount holding path and set rest to the part of path
+        // within that volume
+        const Mount* findMount(const char* path, const char*& rest) const;
+        
+        // A pending request and its transfers on the device. Each transfer
+        // sets its done flag when it finishes. Whichever of submit and the
+        // device's interrupt sees the last one done after all of them were
+        // queued completes the request. Nothing else changes a flag from
+        // both sides, so IRQs only need disabling around that check.
+        struct QueuedRequest
+        {
+            IORequest* request = nullptr;
+            IOCompletion completion;
+            size_t size = 0;
+            bare::Volume::Error error = bare::Volume::Error::OK;
+            
+            bare::Volume::RawIO::Request transfers[MaxTransfers];
+            volatile bool transferDone[MaxTransfers];
+            bare::Volume::Error transferError[MaxTransfers];
+            uint32_t transferCount = 0;
+            
+            volatile bool inUse = false;
+            volatile bool submitted = false;    // all the transfers are on the device
+            QueuedRequest* next = nullptr;      // in the completed list
+        };
+        
+        // Do the parts of the request which aren't queued on the device and
+        // queue the rest. Returns the first error.
+        bare::Volume::Error startRequest(QueuedRequest&);
+        bare::Volume::Error queueTransfer(QueuedRequest&, char* buf, bare::Block blockAddr, uint32_t blocks, bool write);
+        
+        // Called as each transfer finishes, maybe in interrupt context
+        void transferFinished(QueuedRequest&, uint32_t index, bare::Volume::Error);
+        
+        bool allTransfersDone(const QueuedRequest&) const;
+        void completeRequest(QueuedRequest&);
+        
+        // Requests whose transfers all finished during submit wait in the
+        // completed list for the request timer. nextCompleted takes the
+        // first one off, and the caller disables IRQs around it unless it's
+        // in interrupt context.
+        QueuedRequest* nextCompleted();
+        void fireCompletedRequests();
+        
         bare::SDCard _sdCard;
+        bare::BlockCache _blockCache;
         bare::FAT32 _fatFS;
-
+        bare::RAMDisk _ramDisk;
+        std::vector<Mount> _mounts;
+        std::vector<OpenFile> _openFiles;
+        std::vector<File*> _files;          // Files open on a RawFile
+        std::vector<Buffer> _buffers;
+        StreamStats _streamStats;
+        OpenFileStats _openFileStats;
+        
+        QueuedRequest _requests[MaxRequests];
+        QueuedRequest* volatile _completedHead = nullptr;
+        QueuedRequest* _completedTail = nullptr;
+        std::shared_ptr<bare::Timer> _requestTimer;
+        volatile bool _requestTimerStarted = false;
+        volatile uint32_t _busy = 0;
+        
         static FileSystem* _sharedFileSystem;
     };
     
@@ -71,44 +310,118 @@ namespace placid {
     public:
         enum class SeekWhence { Set, Cur, End };
         
+        // Largest read-ahead or write-behind window, in blocks
+        static constexpr uint32_t MaxWindow = 64;
+        
         File() { }
-        ~File() { close(); }
+        ~File();
+        
+        // Files come from an ObjectCache
+        static void* operator new(size_t);
+        static void operator delete(void*, size_t);
         
         bare::Volume::Error close() { return flush(); }
       
         size_t read(char* buf, size_t size);
         size_t write(const char* buf, size_t size);
         
+        // Transfer count buffers in order to or from the file, as one
+        // read or write of their total size
+        size_t readv(const IOVec*, uint32_t count);
+        size_t writev(const IOVec*, uint32_t count);
+        
+        // Queue an asynchronous request on this file (see FileSystem::submit)
+        bool submit(IORequest&, IOCompletion);
+        
         uint32_t size() const { return _rawFile->size(); }
         
-        bare::Volume::Error rename(const char* to) { return _rawFile->rename(to); }
-    
+        // The new name must be on the same volume
+        bare::Volume::Error rename(const char* to);
+        
+        // Allocate space for the file to grow to size bytes, ideally in one
+        // contiguous run. The size of the file doesn't change.
+        bare::Volume::Error reserve(uint32_t size);
+        
         bool seek(off_t offset, SeekWhence);
         off_t tell() const { return _offset; }
         bool eof() const { return _offset >= static_cast<off_t>(_rawFile->size()); }
         
+        // Write this File's buffered blocks and size to the volume. Like the
+        // rest of the volume's changes they stay in the block cache until
+        // FileSystem::flush, an unmount or a reset.
         bare::Volume::Error flush();
     
         bool valid() const { return _error == bare::Volume::Error::OK; }
         bare::Volume::Error error() const { return _error; }
-
+        
+        // Return a read-only view of length bytes of the file starting at
+        // offset, or nullptr on error. A view within one block points into
+        // the pinned block cache page. Longer views are read into a staging
+        // buffer, in one transfer when the blocks are contiguous on the
+        // device. A view has the same alignment as offset. It stays valid
+        // until it is unmapped or the File is destroyed, but doesn't see
+        // writes made after it was mapped.
+        const char* map(off_t offset, size_t length);
+        void unmap(const char* view);
+        
+        uint32_t window() const { return _window; }
+        const StreamStats& streamStats() const { return _stats; }
+    
     private:
-        bool prepareBuffer(off_t offset);
+        // Make sure the block containing offset is in the buffer. Moving to
+        // the block just past the buffer is sequential access, which doubles
+        // the window. Reads then fill the buffer with a window of blocks in
+        // one transfer. Writes add the block to the buffer until the window
+        // is full and then write all the dirty blocks in one transfer.
+        bool prepareBuffer(off_t offset, bool write);
+        
+        // Write the dirty blocks in the buffer
+        bool writeBuffer();
+        
+        bool reserveBuffer(uint32_t blocks);
+        
+        struct Mapping
+        {
+            const char* view;
+            char* staging;      // nullptr if the view is in a pinned cache block
+            uint32_t block;     // device block pinned
+        };
+        
+        // Write back the buffer if it holds any of the blocks, and drop it
+        // too before they're written
+        bool syncBuffer(uint32_t blockAddr, uint32_t blocks, bool write);
+        
+        // Transfer whole blocks without going through the block buffer
+        bool directIO(char* buf, uint32_t blockAddr, uint32_t blocks, bool write);
         size_t io(char* buf, size_t size, bool write);
 
         off_t _offset = 0;
         bare::Volume::Error _error = bare::Volume::Error::OK;
-        bare::RawFile* _rawFile;
-        bool _bufferValid = false;
-        bool _bufferNeedsWriting = false;
+        FileSystem* _fileSystem = nullptr;
+        bare::RawFile* _rawFile = nullptr;
+        bare::Volume* _volume = nullptr;
+        bare::BlockCache* _blockCache = nullptr;   // nullptr if the volume doesn't use one
         bool _canWrite;
         bool _canRead;
         bool _appendOnly;
         bool _needsSizeUpate = false;
-        uint32_t _bufferAddr = 0; // Block addr of the contents of the buffer, if any
-
-        // RawFile has a requirement for 4 byte alignment
-        char _buffer[bare::BlockSize] __attribute__((aligned(4)));
+        
+        // The buffer holds _bufferBlocks blocks starting at _bufferAddr.
+        // Blocks _dirtyStart to _dirtyEnd (relative to _bufferAddr) need
+        // writing. It grows to the size of the window as needed and is
+        // aligned for DMA. Other Files on the same RawFile write or drop
+        // theirs before this one transfers, see syncSharedBuffers.
+        char* _buffer = nullptr;
+        uint32_t _bufferCapacity = 0;
+        uint32_t _bufferBlocks = 0;
+        uint32_t _bufferAddr = 0;
+        uint32_t _dirtyStart = 0;
+        uint32_t _dirtyEnd = 0;
+        uint32_t _lastBlock = 0;
+        uint32_t _window = 1;
+        StreamStats _stats;
+        
+        std::vector<Mapping> _mappings;
     };
 
 }
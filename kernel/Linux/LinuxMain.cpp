@@ -0,0 +1,49 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "bare.h"
+
+#include "bare/Serial.h"
+#include "FileSystem.h"
+#include <stdlib.h>
+
+// Run the kernel as a Linux process:
+//
+//     placid [<SD card image>]
+//
+// Characters from Serial go to the shell like they do from the UART
+// interrupt on the Pi. File system requests complete from the timer,
+// which fires while Serial::read waits for input. When the input ends the
+// remaining requests complete, the file system is flushed and the process
+// exits.
+
+extern "C" void init();
+extern "C" void inputChar(uint8_t c);
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1) {
+        setenv("PLACID_SDCARD", argv[1], 1);
+    }
+    
+    init();
+    
+    placid::FileSystem* fs = placid::FileSystem::sharedFileSystem();
+    uint8_t c;
+    while (bare::Serial::read(c) == bare::Serial::Error::OK) {
+        inputChar(c);
+    }
+    
+    fs->waitForRequests();
+    fs->flush();
+    return 0;
+}
@@ -13,6 +13,7 @@
 #include "Process.h"
 
 #include "ELFLoader.h"
+#include "bare/Serial.h"
 
 using namespace placid;
 
@@ -31,6 +32,6 @@ Process::Process(const bare::String& name)
 
 void Process::run()
 {
-    printf("Process::run: addr=%p\n", _memory);
+    bare::Serial::printf("Process::run: addr=%p\n", _memory);
     bare::runCode(_memory, _size, _startOffset);
 }
@@ -0,0 +1,359 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Microbenchmarks for the baremetal primitives, the kernel allocator and
+// the file system. It runs as a Linux process on the Linux platform, so
+// everything is the code the kernel runs: memcpy and friends come from
+// utilities.cpp and operator new goes to the kernel Allocator.
+//
+// Each result is a line of JSON on stdout, so runs on different commits
+// can be compared with a script:
+//
+//     {"name":"memcpy","size":4096,"iterations":65536,"ns_per_op":512.3,"mb_per_s":7995.1}
+//
+// The first line has the revision the bench was built from. A group of
+// benchmarks which fails prints an "error" line instead.
+
+#include "bare.h"
+
+#include "bare/Formatter.h"
+#include "bare/Memory.h"
+#include "bare/ObjectCache.h"
+#include "bare/String.h"
+#include "bare/Timer.h"
+#include "Allocator.h"
+#include "FileSystem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+using namespace bare;
+using namespace placid;
+
+// A run is timed once it takes at least this long. The best of Runs runs
+// is reported, which is the one least disturbed by the host.
+static constexpr int64_t MinRunNS = 20000000;
+static constexpr uint32_t Runs = 5;
+
+// Much bigger than the kernel's heap, so allocation patterns can run long
+// enough to time
+static constexpr uint32_t HeapSize = 64 * 1024 * 1024;
+static Memory::KernelHeap<HeapSize, Memory::DefaultPageSize> kernelHeap;
+
+// Results are stored here so the compiler can't throw the work away
+static volatile uint32_t sink;
+
+static const char* onlyName = nullptr;
+
+static bool selected(const char* name)
+{
+    return !onlyName || strncmp(name, onlyName, strlen(onlyName)) == 0;
+}
+
+static void report(const char* name, uint32_t size, uint64_t iterations, int64_t ns, const char* extra = nullptr)
+{
+    double nsPerOp = static_cast<double>(ns) / iterations;
+    printf("{\"name\":\"%s\",\"size\":%u,\"iterations\":%llu,\"ns_per_op\":%.1f",
+           name, size, static_cast<unsigned long long>(iterations), nsPerOp);
+    if (size) {
+        printf(",\"mb_per_s\":%.1f", size / nsPerOp * 1000);
+    }
+    if (extra) {
+        printf(",%s", extra);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+template<typename F> static int64_t timeRun(uint64_t iterations, F f)
+{
+    int64_t start = Timer::systemTimeNS();
+    for (uint64_t i = 0; i < iterations; ++i) {
+        f();
+    }
+    return Timer::systemTimeNS() - start;
+}
+
+// Run f enough times to time it and report the time for each call. size
+// is the number of bytes f handles, or 0.
+template<typename F> static void bench(const char* name, uint32_t size, F f)
+{
+    if (!selected(name)) {
+        return;
+    }
+    
+    uint64_t iterations = 1;
+    int64_t ns;
+    while ((ns = timeRun(iterations, f)) < MinRunNS) {
+        iterations *= 2;
+    }
+    for (uint32_t i = 1; i < Runs; ++i) {
+        int64_t t = timeRun(iterations, f);
+        if (t < ns) {
+            ns = t;
+        }
+    }
+    report(name, size, iterations, ns);
+}
+
+static void benchMemory()
+{
+    static constexpr uint32_t MaxSize = 65536;
+    static char src[MaxSize + 16] __attribute__((aligned(16)));
+    static char dst[MaxSize + 16] __attribute__((aligned(16)));
+    
+    for (uint32_t i = 0; i < sizeof(src); ++i) {
+        src[i] = static_cast<char>('a' + i % 26);
+    }
+    
+    for (uint32_t size : { 16, 256, 4096, 65536 }) {
+        bench("memcpy", size, [size] { memcpy(dst, src, size); });
+        bench("memcpy_unaligned", size, [size] { memcpy(dst + 1, src + 3, size); });
+        bench("memset", size, [size] { memset(dst, size, size); });
+        bench("memcmp", size, [size] { memcpy(dst, src, size); sink = memcmp(dst, src, size); });
+    }
+    
+    for (uint32_t size : { 16, 256, 4096 }) {
+        src[size] = '\0';
+        bench("strlen", size, [] { sink = static_cast<uint32_t>(strlen(src)); });
+        src[size] = 'a';
+    }
+}
+
+static void benchFormatter()
+{
+    char buf[Formatter::MaxStringSize];
+    auto print = [&buf](const char* fmt, ...)
+    {
+        char* p = buf;
+        va_list args;
+        va_start(args, fmt);
+        sink = Formatter::vformat([&p](char c) { *p++ = c; }, fmt, args);
+        va_end(args);
+    };
+    
+    bench("format_int", 0, [&print] { print("%d", 123456789); });
+    bench("format_hex", 0, [&print] { print("%08x", 0xdeadbeef); });
+    bench("format_string", 0, [&print] { print("%-20s|", "placid"); });
+    bench("format_float", 0, [&print] { print("%.3f", 3.14159); });
+    bench("format_mixed", 0, [&print] { print("file %s: %d bytes at 0x%08x (%.1f%%)\n", "kernel.bin", 81920, 0x8000, 42.5); });
+}
+
+static void benchString()
+{
+    bench("string_append_char", 256, []
+    {
+        String s;
+        for (uint32_t i = 0; i < 256; ++i) {
+            s += static_cast<char>('a' + i % 26);
+        }
+        sink = static_cast<uint32_t>(s.size());
+    });
+    
+    bench("string_append_string", 256, []
+    {
+        String s;
+        for (uint32_t i = 0; i < 32; ++i) {
+            s += "placid! ";
+        }
+        sink = static_cast<uint32_t>(s.size());
+    });
+    
+    String line;
+    for (uint32_t i = 0; i < 32; ++i) {
+        line += "word ";
+    }
+    bench("string_split", static_cast<uint32_t>(line.size()), [&line]
+    {
+        sink = static_cast<uint32_t>(line.split(" ", true).size());
+    });
+}
+
+static void benchAllocator()
+{
+    Allocator& allocator = Allocator::kernelAllocator();
+    
+    for (uint32_t size : { 16, 256, 2048 }) {
+        bench("alloc_free", size, [&allocator, size]
+        {
+            void* p;
+            allocator.alloc(size, p);
+            allocator.free(p);
+        });
+    }
+    
+    static ObjectCacheBase cache("bench", 64, alignof(void*));
+    bench("cache_alloc_free", 64, []
+    {
+        cache.free(cache.alloc());
+    });
+    
+    // Allocate a batch of blocks of mixed sizes, then free them in a
+    // different order than they were allocated
+    static constexpr uint32_t BatchSize = 64;
+    static void* blocks[BatchSize];
+    bench("alloc_batch", 0, [&allocator]
+    {
+        uint32_t seed = 12345;
+        for (uint32_t i = 0; i < BatchSize; ++i) {
+            seed = seed * 1103515245 + 12345;
+            allocator.alloc(16 + (seed >> 16) % 1024, blocks[i]);
+        }
+        for (uint32_t i = 0; i < BatchSize; ++i) {
+            allocator.free(blocks[(i * 7) % BatchSize]);
+        }
+    });
+}
+
+// Blocks transferred to or from the SD card image so far
+static uint32_t deviceBlocks(FileSystem* fs)
+{
+    const BlockCache::Stats& stats = fs->blockCache().stats();
+    return stats.misses + stats.uncached + stats.writeBacks;
+}
+
+// FAT blocks read from or written to either copy of the FAT so far
+static uint32_t fatIOs(FileSystem* fs)
+{
+    const FAT32::FATStats& stats = fs->fatStats();
+    return stats.reads + stats.writes + stats.mirrorWrites;
+}
+
+static void reportFAT(const char* name, uint32_t size, uint32_t iterations, int64_t ns, uint32_t blocks, uint32_t fatBlocks)
+{
+    char extra[96];
+    double megabytes = static_cast<double>(size) * iterations / 1048576;
+    snprintf(extra, sizeof(extra), "\"device_blocks_per_mb\":%.1f,\"fat_ios_per_mb\":%.1f", blocks / megabytes, fatBlocks / megabytes);
+    report(name, size, iterations, ns, extra);
+}
+
+static void benchFAT()
+{
+    if (!selected("fat")) {
+        return;
+    }
+    
+    FileSystem* fs = FileSystem::sharedFileSystem();
+    if (fs->error() != Volume::Error::OK) {
+        fprintf(stderr, "SD card image could not be mounted: %s\n", fs->errorDetail(fs->error()));
+        return;
+    }
+    
+    static constexpr uint32_t FileSize = 1024 * 1024;
+    static constexpr uint32_t ChunkSize = 4096;
+    static constexpr uint32_t Iterations = 8;
+    static char chunk[ChunkSize];
+    memset(chunk, 'x', ChunkSize);
+    
+    fs->createDirectory("bench");
+    
+    // Append 1MB to a new file in 4KB writes, then flush everything
+    int64_t ns = 0;
+    uint32_t blocks = deviceBlocks(fs);
+    uint32_t fatBlocks = fatIOs(fs);
+    for (uint32_t i = 0; i < Iterations; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "bench/append%u", i);
+        fs->remove(name);
+        
+        int64_t start = Timer::systemTimeNS();
+        File* fp = fs->open(name, FileSystem::OpenMode::Write);
+        for (uint32_t offset = 0; fp->valid() && offset < FileSize; offset += ChunkSize) {
+            fp->write(chunk, ChunkSize);
+        }
+        delete fp;
+        fs->flush();
+        ns += Timer::systemTimeNS() - start;
+    }
+    reportFAT("fat_append", FileSize, Iterations, ns, deviceBlocks(fs) - blocks, fatIOs(fs) - fatBlocks);
+    
+    // Read the files back in 4KB reads
+    ns = 0;
+    blocks = deviceBlocks(fs);
+    fatBlocks = fatIOs(fs);
+    for (uint32_t i = 0; i < Iterations; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "bench/append%u", i);
+        
+        int64_t start = Timer::systemTimeNS();
+        File* fp = fs->open(name);
+        while (fp->valid() && fp->read(chunk, ChunkSize) == ChunkSize) { }
+        delete fp;
+        ns += Timer::systemTimeNS() - start;
+    }
+    reportFAT("fat_read", FileSize, Iterations, ns, deviceBlocks(fs) - blocks, fatIOs(fs) - fatBlocks);
+    
+    bench("fat_open", 0, [fs]
+    {
+        File* fp = fs->open("bench/append0");
+        sink = fp->valid();
+        delete fp;
+    });
+    
+    for (uint32_t i = 0; i < Iterations; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "bench/append%u", i);
+        fs->remove(name);
+    }
+    fs->remove("bench");
+    fs->flush();
+}
+
+// Each group runs in its own process, so it starts with a fresh heap and
+// isn't slowed by what earlier groups left in it. A group which crashes
+// is reported and the rest still run.
+static void runGroup(const char* name, void (*group)())
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        initSystem();
+        Memory::init(&kernelHeap);
+        group();
+        fflush(stdout);
+        _exit(0);
+    }
+    
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("{\"name\":\"%s\",\"error\":\"group failed\"}\n", name);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: bench <SD card image> [<name prefix>]\n");
+        return 1;
+    }
+    setenv("PLACID_SDCARD", argv[1], 1);
+    if (argc > 2) {
+        onlyName = argv[2];
+    }
+    
+    printf("{\"revision\":\"%s\"}\n", BENCH_REVISION);
+    fflush(stdout);
+    
+    runGroup("memory", benchMemory);
+    runGroup("format", benchFormatter);
+    runGroup("string", benchString);
+    runGroup("alloc", benchAllocator);
+    runGroup("fat", benchFAT);
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// The parts of the bare platform layer which the FAT32 code uses, for
+// host side tools. Serial goes to stdio and memory comes from the C
+// library.
+
+#include "bare.h"
+
+#include "bare/Memory.h"
+#include "bare/Serial.h"
+#include <cstdio>
+#include <cstdlib>
+
+using namespace bare;
+
+// There is no kernel heap, so ObjectCache slabs come from operator new
+Memory::Heap* Memory::_kernelHeap = nullptr;
+
+void Serial::init(uint32_t baudrate)
+{
+}
+
+Serial::Error Serial::read(uint8_t& c)
+{
+    int value = getchar();
+    if (value == EOF) {
+        return Error::NoData;
+    }
+    c = static_cast<uint8_t>(value);
+    return Error::OK;
+}
+
+bool Serial::rxReady()
+{
+    return true;
+}
+
+Serial::Error Serial::write(uint8_t c)
+{
+    if (c != '\r') {
+        fputc(c, stderr);
+    }
+    return Error::OK;
+}
+
+void Serial::clearInput()
+{
+}
+
+void Serial::handleInterrupt()
+{
+}
+
+bool bare::useAllocator()
+{
+    return false;
+}
+
+void* bare::aligned_alloc(size_t alignment, size_t size)
+{
+    return ::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void bare::aligned_free(void* p, size_t)
+{
+    ::free(p);
+}
@@ -0,0 +1,559 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// fatimage - build and check FAT32 card images on the host
+//
+//      fatimage create <image> <size in MB> [<blocks per cluster>]
+//      fatimage add <image> <host file or directory> [<path in image>]
+//      fatimage verify <image> [<threads>]
+//
+// The image is used through bare::FAT32, the same code the kernel uses
+// for the SD card, so an image which verifies here will mount there.
+// verify walks the cluster chains of every file and directory on worker
+// threads, checking for chains which run off the volume or into free
+// clusters, cross-linked clusters, sizes which don't match their chains,
+// lost clusters, differences between the two FATs and a stale FSInfo.
+
+#include "bare.h"
+
+#include "bare/BlockCache.h"
+#include "bare/FAT32.h"
+#include "bare/FAT32DirectoryIterator.h"
+#include "bare/FAT32RawFile.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace bare;
+
+// RawIO on an image file. pread and pwrite don't share a file position,
+// so the verify threads can read through it at the same time.
+class ImageFile : public Volume::RawIO
+{
+public:
+    ImageFile(const char* path, bool writable)
+    {
+        _fd = open(path, writable ? O_RDWR : O_RDONLY);
+    }
+    
+    ~ImageFile()
+    {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+    
+    bool valid() const { return _fd >= 0; }
+    
+    virtual Volume::Error read(char* buf, Block blockAddr, uint32_t blocks) override
+    {
+        size_t size = blocks * BlockSize;
+        ssize_t result = pread(_fd, buf, size, static_cast<off_t>(blockAddr.value()) * BlockSize);
+        return (result == static_cast<ssize_t>(size)) ? Volume::Error::OK : Volume::Error::Failed;
+    }
+    
+    virtual Volume::Error write(const char* buf, Block blockAddr, uint32_t blocks) override
+    {
+        size_t size = blocks * BlockSize;
+        ssize_t result = pwrite(_fd, buf, size, static_cast<off_t>(blockAddr.value()) * BlockSize);
+        return (result == static_cast<ssize_t>(size)) ? Volume::Error::OK : Volume::Error::Failed;
+    }
+    
+    virtual Volume::Error flush() override
+    {
+        return (fsync(_fd) == 0) ? Volume::Error::OK : Volume::Error::Failed;
+    }
+
+private:
+    int _fd = -1;
+};
+
+static int usage()
+{
+    fprintf(stderr,
+            "usage: fatimage create <image> <size in MB> [<blocks per cluster>]\n"
+            "       fatimage add <image> <host file or directory> [<path in image>]\n"
+            "       fatimage verify <image> [<threads>]\n");
+    return 2;
+}
+
+static int error(const char* message, const char* detail)
+{
+    fprintf(stderr, "fatimage: %s: %s\n", message, detail);
+    return 1;
+}
+
+static int create(const char* path, uint32_t megabytes, uint8_t blocksPerCluster)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, static_cast<off_t>(megabytes) * 1024 * 1024) != 0) {
+        return error("can't create image", path);
+    }
+    close(fd);
+    
+    ImageFile image(path, true);
+    if (FAT32::format(&image, megabytes * 2048, blocksPerCluster) != Volume::Error::OK) {
+        return error("format failed", path);
+    }
+    return 0;
+}
+
+// Copy a host file or directory tree into the volume
+class Populator
+{
+public:
+    Populator(FAT32& fat32) : _fat32(fat32) { }
+    
+    bool add(const std::string& hostPath, const std::string& path)
+    {
+        struct stat info;
+        if (stat(hostPath.c_str(), &info) != 0) {
+            error("can't read", hostPath.c_str());
+            return false;
+        }
+        return S_ISDIR(info.st_mode) ? addDirectory(hostPath, path) : addFile(hostPath, path, static_cast<uint32_t>(info.st_size));
+    }
+    
+    uint32_t files() const { return _files; }
+    uint32_t directories() const { return _directories; }
+
+private:
+    static constexpr uint32_t ChunkBlocks = 128;
+    
+    bool addDirectory(const std::string& hostPath, const std::string& path)
+    {
+        if (!path.empty() && !_fat32.exists(path.c_str())) {
+            if (_fat32.createDirectory(path.c_str()) != Volume::Error::OK) {
+                error("can't create directory", path.c_str());
+                return false;
+            }
+            ++_directories;
+        }
+        
+        DIR* dir = opendir(hostPath.c_str());
+        if (!dir) {
+            error("can't read directory", hostPath.c_str());
+            return false;
+        }
+        
+        bool result = true;
+        while (struct dirent* entry = readdir(dir)) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            if (!add(hostPath + "/" + entry->d_name, path + "/" + entry->d_name)) {
+                result = false;
+                break;
+            }
+        }
+        closedir(dir);
+        return result;
+    }
+    
+    bool addFile(const std::string& hostPath, const std::string& path, uint32_t size)
+    {
+        FILE* fp = fopen(hostPath.c_str(), "rb");
+        if (!fp) {
+            error("can't read", hostPath.c_str());
+            return false;
+        }
+        
+        // Replace any file which is already there
+        if (_fat32.exists(path.c_str())) {
+            _fat32.remove(path.c_str());
+        }
+        RawFile* file = (_fat32.create(path.c_str()) == Volume::Error::OK) ? _fat32.open(path.c_str()) : nullptr;
+        if (!file) {
+            fclose(fp);
+            error("can't create", path.c_str());
+            return false;
+        }
+        
+        // Allocate the whole file up front, so it gets a single extent
+        // if there is one big enough
+        Volume::Error result = file->reserve(size);
+        std::vector<char> buf(ChunkBlocks * BlockSize);
+        for (uint32_t block = 0; block * BlockSize < size && result == Volume::Error::OK; block += ChunkBlocks) {
+            size_t bytes = fread(buf.data(), 1, buf.size(), fp);
+            memset(buf.data() + bytes, 0, buf.size() - bytes);
+            uint32_t blocks = static_cast<uint32_t>((bytes + BlockSize - 1) / BlockSize);
+            result = (blocks == 0) ? Volume::Error::Failed : file->write(buf.data(), block, blocks);
+        }
+        if (result == Volume::Error::OK) {
+            file->setSize(size);
+            result = file->updateSize();
+        }
+        fclose(fp);
+        delete file;
+        
+        if (result != Volume::Error::OK) {
+            error("write failed", path.c_str());
+            return false;
+        }
+        ++_files;
+        return true;
+    }
+    
+    FAT32& _fat32;
+    uint32_t _files = 0;
+    uint32_t _directories = 0;
+};
+
+static int add(const char* imagePath, const char* hostPath, const char* path)
+{
+    ImageFile image(imagePath, true);
+    if (!image.valid()) {
+        return error("can't open image", imagePath);
+    }
+    
+    BlockCache cache(&image, 256);
+    FAT32 fat32(&cache, 0);
+    if (fat32.mount() != Volume::Error::OK) {
+        return error("mount failed", fat32.errorDetail(fat32.error()));
+    }
+    
+    std::string root = path;
+    while (!root.empty() && root.back() == '/') {
+        root.pop_back();
+    }
+    
+    Populator populator(fat32);
+    bool result = populator.add(hostPath, root);
+    
+    if (fat32.sync() != Volume::Error::OK || cache.flush() != Volume::Error::OK) {
+        return error("sync failed", fat32.errorDetail(fat32.error()));
+    }
+    printf("added %u files and %u directories\n", populator.files(), populator.directories());
+    return result ? 0 : 1;
+}
+
+// Checks the cluster chains of a mounted volume against an in memory copy
+// of its FATs
+class Verifier
+{
+public:
+    Verifier(FAT32& fat32, ImageFile& image, uint32_t threads)
+        : _fat32(fat32)
+        , _image(image)
+        , _threads(threads)
+    {
+    }
+    
+    bool run()
+    {
+        if (!loadFATs()) {
+            return false;
+        }
+        
+        Chain root;
+        root.path = "/";
+        root.cluster = _fat32.rootDirectoryStartCluster().value();
+        root.directory = true;
+        _chains.push_back(root);
+        if (!collect(root.cluster, "")) {
+            return false;
+        }
+        
+        // Walk the chains, then look at every cluster, both spread over
+        // the worker threads
+        _owners = std::vector<std::atomic<uint32_t>>(_fat32.clusterCount() + 2);
+        parallel([this](uint32_t) {
+            for (uint32_t i = _nextChain++; i < _chains.size(); i = _nextChain++) {
+                walk(i);
+            }
+        });
+        
+        std::vector<Counts> counts(_threads);
+        parallel([this, &counts](uint32_t thread) {
+            uint32_t clusters = _fat32.clusterCount();
+            uint32_t first = 2 + static_cast<uint32_t>(static_cast<uint64_t>(clusters) * thread / _threads);
+            uint32_t last = 2 + static_cast<uint32_t>(static_cast<uint64_t>(clusters) * (thread + 1) / _threads);
+            scan(first, last, counts[thread]);
+        });
+        for (const Counts& c : counts) {
+            _counts.free += c.free;
+            _counts.lost += c.lost;
+            _counts.mismatched += c.mismatched;
+        }
+        
+        checkFSInfo();
+        report();
+        return _problems == 0;
+    }
+
+private:
+    static constexpr uint32_t MaxReported = 20;
+    static constexpr uint32_t EndOfChain = 0x0ffffff8;
+    
+    struct Chain
+    {
+        std::string path;
+        uint32_t cluster = 0;
+        uint32_t size = 0;
+        bool directory = false;
+    };
+    
+    struct Counts
+    {
+        uint32_t free = 0;
+        uint32_t lost = 0;
+        uint32_t mismatched = 0;
+    };
+    
+    bool loadFATs()
+    {
+        uint32_t blocks = _fat32.blocksPerFAT();
+        _fat.resize(blocks * BlockSize / sizeof(uint32_t));
+        _mirror.resize(_fat.size());
+        if (_image.read(reinterpret_cast<char*>(&_fat[0]), _fat32.startFATBlock(), blocks) != Volume::Error::OK ||
+                _image.read(reinterpret_cast<char*>(&_mirror[0]), _fat32.startFATBlock() + Block(blocks), blocks) != Volume::Error::OK) {
+            error("can't read", "FAT");
+            return false;
+        }
+        return true;
+    }
+    
+    uint32_t fatEntry(uint32_t cluster) const
+    {
+        return FAT32::bufToUInt32(reinterpret_cast<uint8_t*>(const_cast<uint32_t*>(&_fat[cluster]))) & 0x0fffffff;
+    }
+    
+    bool validCluster(uint32_t cluster) const { return cluster >= 2 && cluster < _fat32.clusterCount() + 2; }
+    
+    // Add the files and subdirectories of a directory to the chain list
+    bool collect(uint32_t directory, const std::string& path)
+    {
+        std::vector<uint32_t> subdirs;
+        std::vector<std::string> subdirPaths;
+        for (FAT32DirectoryIterator it(&_fat32, directory); it; it.next()) {
+            Chain chain;
+            chain.path = path + "/" + it.name();
+            chain.cluster = it.baseCluster().value();
+            chain.size = it.size();
+            chain.directory = it.subdir();
+            _chains.push_back(chain);
+            
+            if (chain.directory) {
+                if (!validCluster(chain.cluster)) {
+                    problem(chain.path + ": directory has invalid first cluster");
+                    continue;
+                }
+                subdirs.push_back(chain.cluster);
+                subdirPaths.push_back(chain.path);
+            }
+        }
+        
+        for (size_t i = 0; i < subdirs.size(); ++i) {
+            // A directory which is its own ancestor would recurse forever.
+            // Its chain is cross-linked, which the walk reports.
+            if (_visited.size() > _fat32.clusterCount()) {
+                problem("directory tree has a loop");
+                return false;
+            }
+            _visited.push_back(subdirs[i]);
+            if (!collect(subdirs[i], subdirPaths[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    void walk(uint32_t index)
+    {
+        const Chain& chain = _chains[index];
+        if (chain.cluster == 0) {
+            if (chain.size != 0) {
+                problem(chain.path + ": has a size but no clusters");
+            }
+            return;
+        }
+        
+        uint32_t length = 0;
+        for (uint32_t cluster = chain.cluster; ; ) {
+            if (!validCluster(cluster)) {
+                problem(chain.path + ": chain runs off the volume");
+                return;
+            }
+            
+            // Claim the cluster for this chain. If another chain already
+            // has it they are cross-linked. If this one has it the chain
+            // loops.
+            uint32_t owner = 0;
+            if (!_owners[cluster].compare_exchange_strong(owner, index + 1)) {
+                problem(chain.path + ": cross-linked with " + ((owner == index + 1) ? std::string("itself") : _chains[owner - 1].path));
+                return;
+            }
+            ++length;
+            
+            uint32_t next = fatEntry(cluster);
+            if (next >= EndOfChain) {
+                break;
+            }
+            if (next == 0) {
+                problem(chain.path + ": chain runs into a free cluster");
+                return;
+            }
+            cluster = next;
+        }
+        
+        uint32_t clusterSize = _fat32.clusterSize();
+        if (!chain.directory && length != (chain.size + clusterSize - 1) / clusterSize) {
+            problem(chain.path + ": size " + std::to_string(chain.size) + " doesn't match " + std::to_string(length) + " clusters");
+        }
+        _usedClusters += length;
+    }
+    
+    void scan(uint32_t first, uint32_t last, Counts& counts)
+    {
+        for (uint32_t cluster = first; cluster < last; ++cluster) {
+            if (_fat[cluster] != _mirror[cluster]) {
+                ++counts.mismatched;
+            }
+            if (fatEntry(cluster) == 0) {
+                ++counts.free;
+            } else if (_owners[cluster] == 0) {
+                ++counts.lost;
+            }
+        }
+    }
+    
+    void checkFSInfo()
+    {
+        if (_fat32.fsInfoBlock().value() == 0) {
+            return;
+        }
+        
+        char buf[BlockSize];
+        if (_image.read(buf, _fat32.fsInfoBlock(), 1) != Volume::Error::OK) {
+            problem("can't read FSInfo");
+            return;
+        }
+        uint32_t freeCount = FAT32::bufToUInt32(reinterpret_cast<uint8_t*>(buf) + 488);
+        if (freeCount != 0xffffffff && freeCount != _counts.free) {
+            problem("FSInfo free count " + std::to_string(freeCount) + " should be " + std::to_string(_counts.free));
+        }
+    }
+    
+    template<typename F>
+    void parallel(F f)
+    {
+        std::vector<std::thread> workers;
+        for (uint32_t i = 0; i < _threads; ++i) {
+            workers.emplace_back(f, i);
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+    
+    void problem(const std::string& message)
+    {
+        std::lock_guard<std::mutex> lock(_problemMutex);
+        if (++_problems <= MaxReported) {
+            printf("%s\n", message.c_str());
+        }
+    }
+    
+    void report()
+    {
+        if (_counts.lost) {
+            problem(std::to_string(_counts.lost) + " lost clusters");
+        }
+        if (_counts.mismatched) {
+            problem(std::to_string(_counts.mismatched) + " FAT entries differ between the two FATs");
+        }
+        if (_problems > MaxReported) {
+            printf("... %u more problems\n", _problems - MaxReported);
+        }
+        
+        uint32_t files = 0;
+        for (const Chain& chain : _chains) {
+            if (!chain.directory) {
+                ++files;
+            }
+        }
+        printf("%u files, %u directories, %u clusters used, %u free, %u problems\n",
+               files, static_cast<uint32_t>(_chains.size()) - files, _usedClusters.load(), _counts.free, _problems);
+    }
+    
+    FAT32& _fat32;
+    ImageFile& _image;
+    uint32_t _threads;
+    
+    std::vector<uint32_t> _fat;
+    std::vector<uint32_t> _mirror;
+    std::vector<Chain> _chains;
+    std::vector<uint32_t> _visited;
+    
+    // The index + 1 of the chain using each cluster, 0 if none does
+    std::vector<std::atomic<uint32_t>> _owners;
+    std::atomic<uint32_t> _nextChain { 0 };
+    std::atomic<uint32_t> _usedClusters { 0 };
+    Counts _counts;
+    
+    std::mutex _problemMutex;
+    uint32_t _problems = 0;
+};
+
+static int verify(const char* imagePath, uint32_t threads)
+{
+    // The image is opened read only. A volume with a journal transaction
+    // to replay can't be mounted that way, so mount it on the device first.
+    ImageFile image(imagePath, false);
+    if (!image.valid()) {
+        return error("can't open image", imagePath);
+    }
+    
+    FAT32 fat32(&image, 0);
+    if (fat32.mount() != Volume::Error::OK) {
+        return error("mount failed", fat32.errorDetail(fat32.error()));
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    Verifier verifier(fat32, image, threads);
+    bool result = verifier.run();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    printf("verified in %lldms with %u threads\n", static_cast<long long>(elapsed.count()), threads);
+    return result ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        return usage();
+    }
+    
+    std::string command = argv[1];
+    if (command == "create" && (argc == 4 || argc == 5)) {
+        uint32_t megabytes = static_cast<uint32_t>(atoi(argv[3]));
+        uint8_t blocksPerCluster = static_cast<uint8_t>((argc == 5) ? atoi(argv[4]) : 8);
+        return create(argv[2], megabytes, blocksPerCluster);
+    }
+    if (command == "add" && (argc == 4 || argc == 5)) {
+        return add(argv[2], argv[3], (argc == 5) ? argv[4] : "");
+    }
+    if (command == "verify" && (argc == 3 || argc == 4)) {
+        uint32_t threads = (argc == 4) ? static_cast<uint32_t>(atoi(argv[3])) : std::thread::hardware_concurrency();
+        return verify(argv[2], (threads == 0) ? 1 : threads);
+    }
+    return usage();
+}
@@ -0,0 +1,1163 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of Placid
+    
+    For the latest info, see http:www.marrin.org/
+    
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Regression tests for the SD card driver, FAT32, the file system and the
+// kernel allocator. It runs as a Linux process on the Linux platform, the
+// same way as the bench, so the SD card is an image file and operator new
+// goes to the kernel Allocator.
+//
+// Each test runs in its own process, so it starts with a fresh heap and
+// mounts the image again. A test which fails or crashes is reported and
+// the rest still run. Tests which use the file system work in their own
+// directory and remove it when they pass.
+
+#include "bare.h"
+
+#include "bare/BlockCache.h"
+#include "bare/FAT32.h"
+#include "bare/FAT32DirectoryIterator.h"
+#include "bare/Memory.h"
+#include "bare/RAMDisk.h"
+#include "bare/SDCard.h"
+#include "Allocator.h"
+#include "FileSystem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace bare;
+using namespace placid;
+
+static constexpr uint32_t HeapSize = 16 * 1024 * 1024;
+static Memory::KernelHeap<HeapSize, Memory::DefaultPageSize> kernelHeap;
+
+static const char* imagePath = nullptr;
+static const char* onlyName = nullptr;
+
+// Check a condition and end the test if it's false
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("    %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            fflush(stdout); \
+            _exit(1); \
+        } \
+    } while (0)
+
+static FileSystem* fileSystem = nullptr;
+
+static FileSystem* mountedFileSystem()
+{
+    fileSystem = FileSystem::sharedFileSystem();
+    CHECK(fileSystem->error() == Volume::Error::OK);
+    return fileSystem;
+}
+
+// Check the image with fatimage. It looks for broken and cross-linked
+// cluster chains, lost clusters, differences between the two FATs and a
+// stale FSInfo. The file system is flushed first. A FAT32 used directly
+// must be synced by the test.
+static bool verifyImage()
+{
+    if (fileSystem && fileSystem->flush() != Volume::Error::OK) {
+        return false;
+    }
+    
+    char command[256];
+    snprintf(command, sizeof(command), "../fatimage/fatimage verify %s 1", imagePath);
+    fflush(stdout);
+    return system(command) == 0;
+}
+
+// FAT blocks read from or written to either copy of the FAT so far
+static uint32_t fatIOs(FileSystem* fs)
+{
+    const FAT32::FATStats& stats = fs->fatStats();
+    return stats.reads + stats.writes + stats.mirrorWrites;
+}
+
+// Fill buf with a pattern which is different for each seed and offset
+static void fill(char* buf, size_t size, uint32_t seed)
+{
+    for (size_t i = 0; i < size; ++i) {
+        buf[i] = static_cast<char>((i * 7 + seed * 13 + (i >> 9)) & 0xff);
+    }
+}
+
+static bool matches(const char* buf, size_t size, uint32_t seed)
+{
+    for (size_t i = 0; i < size; ++i) {
+        if (buf[i] != static_cast<char>((i * 7 + seed * 13 + (i >> 9)) & 0xff)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A contiguous file read in one call should go to the card in one
+// multi-block transfer, and a file read a block at a time should be read
+// ahead in transfers of many blocks
+static void testSDCardCommands()
+{
+    static constexpr uint32_t FileSize = 1024 * 1024;
+    static constexpr uint32_t FileBlocks = FileSize / BlockSize;
+    
+    FileSystem* fs = mountedFileSystem();
+    const SDCard::Stats& stats = fs->sdCard().stats();
+    CHECK(fs->createDirectory("sdcard") == Volume::Error::OK);
+    
+    char* buf = new char[FileSize];
+    fill(buf, FileSize, 1);
+    File* fp = fs->open("sdcard/contiguous", FileSystem::OpenMode::Write);
+    CHECK(fp->valid());
+    CHECK(fp->reserve(FileSize) == Volume::Error::OK);
+    CHECK(fp->write(buf, FileSize) == FileSize);
+    delete fp;
+    
+    memset(buf, 0, FileSize);
+    fp = fs->open("sdcard/contiguous");
+    CHECK(fp->valid());
+    SDCard::Stats before = stats;
+    CHECK(fp->read(buf, FileSize) == FileSize);
+    uint32_t commands = stats.commands - before.commands;
+    uint32_t blocks = stats.blocks - before.blocks;
+    printf("    one read: %u commands, %u blocks for %u bytes\n", commands, blocks, FileSize);
+    CHECK(matches(buf, FileSize, 1));
+    CHECK(blocks >= FileBlocks && blocks <= FileBlocks + 4);
+    CHECK(commands <= 8);
+    delete fp;
+    
+    fp = fs->open("sdcard/contiguous");
+    CHECK(fp->valid());
+    before = stats;
+    for (uint32_t offset = 0; offset < FileSize; offset += BlockSize) {
+        CHECK(fp->read(buf + offset, BlockSize) == BlockSize);
+    }
+    commands = stats.commands - before.commands;
+    blocks = stats.blocks - before.blocks;
+    printf("    block reads: %u commands, %u blocks for %u bytes\n", commands, blocks, FileSize);
+    CHECK(matches(buf, FileSize, 1));
+    CHECK(blocks >= FileBlocks && blocks <= FileBlocks + 4);
+    CHECK(commands <= 2 * FileBlocks / File::MaxWindow + 16);
+    delete fp;
+    delete [ ] buf;
+    
+    CHECK(fs->remove("sdcard/contiguous") == Volume::Error::OK);
+    CHECK(fs->remove("sdcard") == Volume::Error::OK);
+}
+
+// Counts the requests which reach the device
+struct SubmitCounter : public Volume::RawIO
+{
+    SubmitCounter(Volume::RawIO* device) : device(device) { }
+    
+    virtual Volume::Error read(char* buf, Block blockAddr, uint32_t blocks) override { return device->read(buf, blockAddr, blocks); }
+    virtual Volume::Error write(const char* buf, Block blockAddr, uint32_t blocks) override { return device->write(buf, blockAddr, blocks); }
+    virtual Volume::Error submit(Request* request) override
+    {
+        ++submits;
+        return device->submit(request);
+    }
+    
+    Volume::RawIO* device;
+    uint32_t submits = 0;
+};
+
+// Requests submitted through the block cache reach the device's submit.
+// They see blocks still dirty in the cache, and leave its copies matching
+// what they wrote.
+static void testBlockCacheSubmit()
+{
+    static constexpr uint32_t Blocks = 4;
+    
+    SDCard sdCard;
+    SubmitCounter device(&sdCard);
+    Block block;
+    {
+        // The last cluster of the volume, which is free
+        FAT32 fat(&sdCard, 0);
+        CHECK(fat.mount() == Volume::Error::OK);
+        block = fat.clusterToBlock(fat.clusterCount() + 1);
+    }
+    
+    char* saved = new char[Blocks * BlockSize];
+    char* buf = new char[Blocks * BlockSize];
+    char* data = new char[Blocks * BlockSize];
+    CHECK(sdCard.read(saved, block, Blocks) == Volume::Error::OK);
+    
+    BlockCache cache(&device, 8);
+    fill(data, BlockSize, 20);
+    CHECK(cache.write(data, block + Block(1), 1) == Volume::Error::OK);
+    CHECK(cache.dirtyCount() == 1);
+    
+    uint32_t completed = 0;
+    Volume::RawIO::Request request;
+    request.buf = buf;
+    request.blockAddr = block;
+    request.blocks = Blocks;
+    request.completion = [&completed](Volume::RawIO::Request*, Volume::Error error)
+    {
+        CHECK(error == Volume::Error::OK);
+        ++completed;
+    };
+    CHECK(cache.submit(&request) == Volume::Error::OK);
+    CHECK(completed == 1 && device.submits == 1);
+    CHECK(matches(buf + BlockSize, BlockSize, 20));
+    CHECK(cache.dirtyCount() == 0);
+    
+    fill(data, Blocks * BlockSize, 21);
+    request.write = true;
+    request.buf = data;
+    CHECK(cache.submit(&request) == Volume::Error::OK);
+    CHECK(completed == 2 && device.submits == 2);
+    CHECK(cache.read(buf, block + Block(1), 1) == Volume::Error::OK);
+    CHECK(memcmp(buf, data + BlockSize, BlockSize) == 0);
+    CHECK(cache.flush() == Volume::Error::OK);
+    CHECK(sdCard.read(buf, block, Blocks) == Volume::Error::OK);
+    CHECK(memcmp(buf, data, Blocks * BlockSize) == 0);
+    
+    CHECK(sdCard.write(saved, block, Blocks) == Volume::Error::OK);
+    delete [ ] data;
+    delete [ ] buf;
+    delete [ ] saved;
+}
+
+// Sequential I/O should hardly touch the FAT once it's cached, and the
+// second FAT must match the first after it's mirrored at sync time
+static void testFATIO()
+{
+    static constexpr uint32_t FileSize = 4 * 1024 * 1024;
+    static constexpr uint32_t ChunkSize = 4096;
+    
+    FileSystem* fs = mountedFileSystem();
+    CHECK(fs->createDirectory("fatio") == Volume::Error::OK);
+    
+    char* chunk = new char[ChunkSize];
+    uint32_t fatBlocks = fatIOs(fs);
+    File* fp = fs->open("fatio/sequential", FileSystem::OpenMode::Write);
+    CHECK(fp->valid());
+    for (uint32_t offset = 0; offset < FileSize; offset += ChunkSize) {
+        fill(chunk, ChunkSize, offset / ChunkSize);
+        CHECK(fp->write(chunk, ChunkSize) == ChunkSize);
+    }
+    delete fp;
+    CHECK(fs->flush() == Volume::Error::OK);
+    uint32_t writeIOs = fatIOs(fs) - fatBlocks;
+    
+    fatBlocks = fatIOs(fs);
+    fp = fs->open("fatio/sequential");
+    CHECK(fp->valid());
+    for (uint32_t offset = 0; offset < FileSize; offset += ChunkSize) {
+        CHECK(fp->read(chunk, ChunkSize) == ChunkSize);
+        CHECK(matches(chunk, ChunkSize, offset / ChunkSize));
+    }
+    delete fp;
+    uint32_t readIOs = fatIOs(fs) - fatBlocks;
+    delete [ ] chunk;
+    
+    uint32_t megabytes = FileSize / (1024 * 1024);
+    printf("    FAT I/Os per MB: write %u, read %u\n", writeIOs / megabytes, readIOs / megabytes);
+    CHECK(writeIOs <= 16 * megabytes);
+    CHECK(readIOs <= 4 * megabytes);
+    CHECK(verifyImage());
+    
+    CHECK(fs->remove("fatio/sequential") == Volume::Error::OK);
+    CHECK(fs->remove("fatio") == Volume::Error::OK);
+}
+
+// Create, grow and remove files at random. Afterwards the free cluster
+// count kept by FAT32 must match a recount of the FAT, and removing
+// everything must give all the space back.
+static void testFATRandom()
+{
+    static constexpr uint32_t Files = 24;
+    static constexpr uint32_t Operations = 400;
+    static constexpr uint32_t MaxWrite = 24 * 1024;
+    
+    FileSystem* fs = mountedFileSystem();
+    uint64_t freeSpace = fs->freeSpace();
+    CHECK(fs->createDirectory("random") == Volume::Error::OK);
+    CHECK(fs->createDirectory("random/sub") == Volume::Error::OK);
+    
+    uint32_t sizes[Files] = { };
+    bool exists[Files] = { };
+    char* buf = new char[MaxWrite];
+    uint32_t seed = 12345;
+    auto random = [&seed](uint32_t range)
+    {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) % range;
+    };
+    auto name = [](uint32_t i, char* buf, size_t size)
+    {
+        snprintf(buf, size, (i % 2) ? "random/sub/file%u" : "random/file%u", i);
+    };
+    
+    for (uint32_t op = 0; op < Operations; ++op) {
+        uint32_t i = random(Files);
+        char path[32];
+        name(i, path, sizeof(path));
+        
+        if (exists[i] && random(4) == 0) {
+            CHECK(fs->remove(path) == Volume::Error::OK);
+            exists[i] = false;
+            sizes[i] = 0;
+            continue;
+        }
+        
+        File* fp = fs->open(path, exists[i] ? FileSystem::OpenMode::Append : FileSystem::OpenMode::Write);
+        CHECK(fp->valid());
+        fp->seek(0, File::SeekWhence::End);
+        uint32_t size = random(MaxWrite) + 1;
+        fill(buf, size, i);
+        CHECK(fp->write(buf, size) == size);
+        CHECK(fp->size() == sizes[i] + size);
+        delete fp;
+        exists[i] = true;
+        sizes[i] += size;
+    }
+    delete [ ] buf;
+    
+    CHECK(fs->flush() == Volume::Error::OK);
+    CHECK(verifyImage());
+    
+    for (uint32_t i = 0; i < Files; ++i) {
+        if (exists[i]) {
+            char path[32];
+            name(i, path, sizeof(path));
+            File* fp = fs->open(path);
+            CHECK(fp->valid() && fp->size() == sizes[i]);
+            delete fp;
+            CHECK(fs->remove(path) == Volume::Error::OK);
+        }
+    }
+    CHECK(fs->remove("random/sub") == Volume::Error::OK);
+    CHECK(fs->remove("random") == Volume::Error::OK);
+    CHECK(fs->freeSpace() == freeSpace);
+    CHECK(verifyImage());
+}
+
+// Allocation should take the smallest free run that fits, not break up a
+// bigger one which comes first
+static void testFATBestFit()
+{
+    SDCard sdCard;
+    FAT32 fat(&sdCard, 0);
+    CHECK(fat.mount() == Volume::Error::OK);
+    CHECK(fat.createDirectory("bestfit") == Volume::Error::OK);
+    
+    // Allocate these one after another, then remove the holes
+    struct Piece
+    {
+        const char* name;
+        uint32_t clusters;
+        bool hole;
+        uint32_t firstBlock;
+    };
+    Piece pieces[] = {
+        { "bestfit/a", 4, false, 0 },
+        { "bestfit/hole16", 16, true, 0 },
+        { "bestfit/b", 4, false, 0 },
+        { "bestfit/hole4", 4, true, 0 },
+        { "bestfit/c", 4, false, 0 },
+    };
+    
+    auto allocate = [&fat](const char* name, uint32_t clusters, uint32_t& firstBlock)
+    {
+        CHECK(fat.create(name) == Volume::Error::OK);
+        RawFile* file = fat.open(name);
+        CHECK(file);
+        CHECK(file->reserve(clusters * fat.clusterSize()) == Volume::Error::OK);
+        Block block;
+        CHECK(file->logicalToPhysicalBlock(0, block) == Volume::Error::OK);
+        firstBlock = block.value();
+        delete file;
+    };
+    
+    for (Piece& piece : pieces) {
+        allocate(piece.name, piece.clusters, piece.firstBlock);
+    }
+    for (Piece& piece : pieces) {
+        if (piece.hole) {
+            CHECK(fat.remove(piece.name) == Volume::Error::OK);
+        }
+    }
+    
+    uint32_t firstBlock;
+    allocate("bestfit/small", 4, firstBlock);
+    CHECK(firstBlock == pieces[3].firstBlock);
+    allocate("bestfit/large", 16, firstBlock);
+    CHECK(firstBlock == pieces[1].firstBlock);
+    
+    for (const char* name : { "bestfit/a", "bestfit/b", "bestfit/c", "bestfit/small", "bestfit/large", "bestfit" }) {
+        CHECK(fat.remove(name) == Volume::Error::OK);
+    }
+    CHECK(fat.sync() == Volume::Error::OK);
+    CHECK(verifyImage());
+}
+
+// Make name a file with no clusters, the way other systems write empty
+// files. FAT32::create always gives a file its first cluster.
+static void createEmptyFile(const char* name)
+{
+    SDCard sdCard;
+    FAT32 fat(&sdCard, 0);
+    CHECK(fat.mount() == Volume::Error::OK);
+    CHECK(fat.create(name) == Volume::Error::OK);
+    
+    uint64_t id;
+    CHECK(fat.fileID(name, id));
+    Block block(static_cast<uint32_t>(id >> 4));
+    char buf[BlockSize] __attribute__((aligned(4)));
+    CHECK(fat.rawRead(buf, block, 1) == Volume::Error::OK);
+    
+    FATDirEntry* entry = reinterpret_cast<FATDirEntry*>(buf) + (id & 0x0f);
+    Cluster cluster = (static_cast<uint32_t>(FAT32::bufToUInt16(entry->firstClusterHi)) << 16) | FAT32::bufToUInt16(entry->firstClusterLo);
+    FAT32::uint16ToBuf(0, entry->firstClusterHi);
+    FAT32::uint16ToBuf(0, entry->firstClusterLo);
+    CHECK(fat.writeMetadata(buf, block, 1) == Volume::Error::OK);
+    CHECK(fat.freeClusters(cluster));
+    CHECK(fat.sync() == Volume::Error::OK);
+}
+
+// Writing to or reserving space in a file with no clusters has to give it
+// its first one
+static void testFATEmptyFile()
+{
+    static constexpr uint32_t WriteSize = 5000;
+    
+    {
+        SDCard sdCard;
+        FAT32 fat(&sdCard, 0);
+        CHECK(fat.mount() == Volume::Error::OK);
+        CHECK(fat.createDirectory("empty") == Volume::Error::OK);
+        CHECK(fat.sync() == Volume::Error::OK);
+    }
+    createEmptyFile("empty/append");
+    createEmptyFile("empty/reserve");
+    
+    FileSystem* fs = mountedFileSystem();
+    char* buf = new char[WriteSize];
+    fill(buf, WriteSize, 8);
+    
+    File* fp = fs->open("empty/append", FileSystem::OpenMode::Append);
+    CHECK(fp->valid() && fp->size() == 0);
+    CHECK(fp->write(buf, WriteSize) == WriteSize);
+    CHECK(fp->close() == Volume::Error::OK);
+    delete fp;
+    
+    fp = fs->open("empty/reserve", FileSystem::OpenMode::Append);
+    CHECK(fp->valid() && fp->size() == 0);
+    CHECK(fp->reserve(WriteSize) == Volume::Error::OK);
+    CHECK(fp->write(buf, WriteSize) == WriteSize);
+    delete fp;
+    
+    for (const char* name : { "empty/append", "empty/reserve" }) {
+        memset(buf, 0, WriteSize);
+        fp = fs->open(name);
+        CHECK(fp->valid() && fp->size() == WriteSize);
+        CHECK(fp->read(buf, WriteSize) == WriteSize);
+        CHECK(matches(buf, WriteSize, 8));
+        delete fp;
+    }
+    delete [ ] buf;
+    CHECK(verifyImage());
+    
+    CHECK(fs->remove("empty/append") == Volume::Error::OK);
+    CHECK(fs->remove("empty/reserve") == Volume::Error::OK);
+    CHECK(fs->remove("empty") == Volume::Error::OK);
+    CHECK(verifyImage());
+}
+
+// strcpy copies the terminator, so a name copied over a longer one has no
+// tail of the old one
+static void testStrcpy()
+{
+    char buf[32];
+    memset(buf, 'x', sizeof(buf));
+    CHECK(strcpy(buf, "placid") == buf);
+    CHECK(buf[6] == '\0' && strcmp(buf, "placid") == 0);
+    CHECK(strcmp(strcpy(buf, ""), "") == 0);
+    
+    FileSystem* fs = mountedFileSystem();
+    static const char* const names[] = { "A_Much_Longer_Mixed_Name.dat", "Short Name", "x y" };
+    CHECK(fs->createDirectory("names") == Volume::Error::OK);
+    for (const char* name : names) {
+        char path[64];
+        snprintf(path, sizeof(path), "names/%s", name);
+        File* fp = fs->open(path, FileSystem::OpenMode::Write);
+        CHECK(fp->valid());
+        delete fp;
+    }
+    
+    uint32_t found = 0;
+    DirectoryIterator* it = fs->directoryIterator("names");
+    CHECK(it);
+    for ( ; *it; it->next()) {
+        bool known = false;
+        for (const char* name : names) {
+            known = known || strcmp(it->name(), name) == 0;
+        }
+        if (!known) {
+            printf("    unexpected name '%s'\n", it->name());
+        }
+        CHECK(known);
+        ++found;
+    }
+    delete it;
+    CHECK(found == sizeof(names) / sizeof(names[0]));
+    
+    for (const char* name : names) {
+        char path[64];
+        snprintf(path, sizeof(path), "names/%s", name);
+        CHECK(fs->remove(path) == Volume::Error::OK);
+    }
+    CHECK(fs->remove("names") == Volume::Error::OK);
+    CHECK(verifyImage());
+}
+
+// Outstanding requests complete by themselves, in order, from the request
+// timer. On Linux the device finishes every transfer during submit, and a
+// RAM disk file has no transfers, so the completions all wait for the
+// timer. Nothing polls for them.
+static void testRequests()
+{
+    static constexpr uint32_t Requests = 3;
+    static constexpr uint32_t RequestSize = 3000;
+    static constexpr uint32_t ReadOffset = 1000;
+    
+    FileSystem* fs = mountedFileSystem();
+    char* buf = new char[Requests * RequestSize];
+    char* readBuf = new char[Requests * RequestSize];
+    fill(buf, Requests * RequestSize, 9);
+    
+    for (const char* name : { "requests", "ram/requests" }) {
+        File* fp = fs->open(name, FileSystem::OpenMode::Write);
+        CHECK(fp->valid());
+        
+        IOVec iov[Requests];
+        IORequest requests[Requests];
+        uint32_t completed = 0;
+        auto completion = [&requests, &completed](IORequest& request)
+        {
+            CHECK(&request == &requests[completed % Requests]);
+            ++completed;
+        };
+        
+        for (uint32_t i = 0; i < Requests; ++i) {
+            iov[i] = { buf + i * RequestSize, RequestSize };
+            requests[i].op = IORequest::Op::Write;
+            requests[i].offset = i * RequestSize;
+            requests[i].iov = &iov[i];
+            requests[i].count = 1;
+            CHECK(fp->submit(requests[i], completion));
+        }
+        CHECK(fs->pendingRequests() == Requests && completed == 0);
+        
+        // Fire the timer the way its interrupt does
+        Timer::handleInterrupt();
+        CHECK(fs->pendingRequests() == 0 && completed == Requests);
+        for (const IORequest& request : requests) {
+            CHECK(request.error == Volume::Error::OK && request.transferred == RequestSize);
+        }
+        CHECK(fp->size() == Requests * RequestSize);
+        delete fp;
+        
+        // Read it back the same way, with the last request past the end
+        fp = fs->open(name);
+        memset(readBuf, 0, Requests * RequestSize);
+        for (uint32_t i = 0; i < Requests; ++i) {
+            iov[i] = { readBuf + i * RequestSize, RequestSize };
+            requests[i].op = IORequest::Op::Read;
+            requests[i].offset = i * RequestSize + ReadOffset;
+            CHECK(fp->submit(requests[i], completion));
+        }
+        CHECK(fs->pendingRequests() == Requests && completed == Requests);
+        fs->waitForRequests();
+        CHECK(fs->pendingRequests() == 0 && completed == 2 * Requests);
+        for (uint32_t i = 0; i < Requests; ++i) {
+            size_t size = (i == Requests - 1) ? RequestSize - ReadOffset : RequestSize;
+            CHECK(requests[i].error == Volume::Error::OK && requests[i].transferred == size);
+        }
+        CHECK(memcmp(readBuf, buf + ReadOffset, Requests * RequestSize - ReadOffset) == 0);
+        
+        memset(readBuf, 0, Requests * RequestSize);
+        CHECK(fp->read(readBuf, Requests * RequestSize) == Requests * RequestSize);
+        CHECK(matches(readBuf, Requests * RequestSize, 9));
+        delete fp;
+        
+        CHECK(fs->remove(name) == Volume::Error::OK);
+    }
+    delete [ ] buf;
+    delete [ ] readBuf;
+    CHECK(verifyImage());
+}
+
+// A RAM disk file can't be removed while it's open, and removing it gives
+// back all its blocks, including ones at the top of a bitmap word
+static void testRAMDiskRemove()
+{
+    static constexpr uint32_t DiskBlocks = 64;
+    static constexpr uint32_t FileBlocks = 40;
+    
+    RAMDisk disk(DiskBlocks);
+    CHECK(disk.mount() == Volume::Error::OK);
+    CHECK(disk.create("a") == Volume::Error::OK);
+    
+    char* buf = new char[FileBlocks * BlockSize];
+    fill(buf, FileBlocks * BlockSize, 10);
+    RawFile* file = disk.open("a");
+    CHECK(file);
+    CHECK(file->write(buf, 0, FileBlocks) == Volume::Error::OK);
+    CHECK(disk.freeBlocks() == DiskBlocks - FileBlocks);
+    
+    CHECK(disk.remove("a") == Volume::Error::FileBusy);
+    CHECK(disk.exists("a"));
+    CHECK(disk.create("b") == Volume::Error::OK);
+    RawFile* other = disk.open("b");
+    CHECK(other);
+    CHECK(other->write(buf, 0, 1) == Volume::Error::OK);
+    delete other;
+    
+    memset(buf, 0, FileBlocks * BlockSize);
+    CHECK(file->read(buf, 0, FileBlocks) == Volume::Error::OK);
+    CHECK(matches(buf, FileBlocks * BlockSize, 10));
+    delete file;
+    delete [ ] buf;
+    
+    CHECK(disk.remove("a") == Volume::Error::OK);
+    CHECK(disk.remove("b") == Volume::Error::OK);
+    CHECK(!disk.exists("a"));
+    CHECK(disk.freeBlocks() == DiskBlocks);
+}
+
+// Removing an open file is refused, so its File can't write into clusters
+// given to another file
+static void testRemoveOpen()
+{
+    static constexpr uint32_t WriteSize = 20000;
+    
+    FileSystem* fs = mountedFileSystem();
+    char* buf = new char[WriteSize];
+    
+    for (const char* dir : { "", "ram/" }) {
+        char a[16];
+        char b[16];
+        snprintf(a, sizeof(a), "%sa", dir);
+        snprintf(b, sizeof(b), "%sb", dir);
+        
+        File* fpA = fs->open(a, FileSystem::OpenMode::Write);
+        CHECK(fpA->valid());
+        fill(buf, WriteSize, 11);
+        CHECK(fpA->write(buf, WriteSize) == WriteSize);
+        CHECK(fs->remove(a) == Volume::Error::FileBusy);
+        
+        File* fpB = fs->open(b, FileSystem::OpenMode::Write);
+        CHECK(fpB->valid());
+        fill(buf, WriteSize, 12);
+        CHECK(fpB->write(buf, WriteSize) == WriteSize);
+        delete fpB;
+        
+        fill(buf, WriteSize, 13);
+        CHECK(fpA->write(buf, WriteSize) == WriteSize);
+        CHECK(fpA->close() == Volume::Error::OK);
+        delete fpA;
+        CHECK(fs->flush() == Volume::Error::OK);
+        
+        memset(buf, 0, WriteSize);
+        fpB = fs->open(b);
+        CHECK(fpB->size() == WriteSize);
+        CHECK(fpB->read(buf, WriteSize) == WriteSize);
+        CHECK(matches(buf, WriteSize, 12));
+        delete fpB;
+        
+        fpA = fs->open(a);
+        CHECK(fpA->size() == 2 * WriteSize);
+        CHECK(fpA->seek(WriteSize, File::SeekWhence::Set));
+        CHECK(fpA->read(buf, WriteSize) == WriteSize);
+        CHECK(matches(buf, WriteSize, 13));
+        delete fpA;
+        
+        CHECK(fs->remove(a) == Volume::Error::OK);
+        CHECK(fs->remove(b) == Volume::Error::OK);
+        CHECK(verifyImage());
+    }
+    delete [ ] buf;
+    CHECK(fs->ramDisk().freeBlocks() == fs->ramDisk().sizeInBlocks());
+}
+
+// Random allocations and frees, mostly small with some large ones. Without
+// coalescing the heap ran out after about 100k operations. Every block is
+// checked before it's freed, and all the memory is given back at the end.
+static constexpr uint32_t AllocOps = 2000000;
+
+static uint32_t nextRandom(uint32_t& seed)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed;
+}
+
+static size_t randomAllocSize(uint32_t& seed)
+{
+    uint32_t r = nextRandom(seed);
+    return ((r >> 8) % 8 == 0) ? (r >> 12) % 20000 : (r >> 12) % 300;
+}
+
+// Blocks are always word aligned, so most of one is checked a word at a time
+static bool filledWith(const void* p, size_t size, uint8_t tag)
+{
+    const uint32_t* words = reinterpret_cast<const uint32_t*>(p);
+    uint32_t word = tag * 0x01010101u;
+    for (size_t i = 0; i < size / 4; ++i) {
+        if (words[i] != word) {
+            return false;
+        }
+    }
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(p);
+    for (size_t i = size & ~size_t(3); i < size; ++i) {
+        if (bytes[i] != tag) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void testAllocRandom()
+{
+    static constexpr uint32_t Blocks = 2000;
+    static void* blocks[Blocks];
+    static size_t sizes[Blocks];
+    static uint8_t tags[Blocks];
+    
+    Allocator allocator;
+    uint32_t seed = 1;
+    for (uint32_t i = 0; i < AllocOps; ++i) {
+        uint32_t k = (nextRandom(seed) >> 8) % Blocks;
+        if (blocks[k]) {
+            CHECK(filledWith(blocks[k], sizes[k], tags[k]));
+            allocator.free(blocks[k]);
+            blocks[k] = nullptr;
+            continue;
+        }
+        
+        sizes[k] = randomAllocSize(seed);
+        tags[k] = static_cast<uint8_t>(seed >> 24);
+        if (!allocator.alloc(sizes[k], blocks[k])) {
+            printf("    out of memory after %u operations\n", i);
+            CHECK(false);
+        }
+        memset(blocks[k], tags[k], sizes[k]);
+    }
+    
+    for (uint32_t k = 0; k < Blocks; ++k) {
+        if (blocks[k]) {
+            CHECK(filledWith(blocks[k], sizes[k], tags[k]));
+            allocator.free(blocks[k]);
+        }
+    }
+    
+    Allocator::Stats stats = allocator.stats();
+    printf("    %u operations, %u segments left, %u bytes mapped\n", AllocOps, stats.segments, static_cast<uint32_t>(stats.mapped));
+    CHECK(stats.inUse == 0);
+    CHECK(stats.mapped <= Allocator::KeepFreeSize);
+}
+
+// Random reallocs, allocations and frees. Contents up to the smaller size
+// must survive each realloc, and most reallocs should stay in place.
+static void testAllocRealloc()
+{
+    static constexpr uint32_t Blocks = 1000;
+    static void* blocks[Blocks];
+    static size_t sizes[Blocks];
+    static uint8_t tags[Blocks];
+    
+    Allocator allocator;
+    uint32_t seed = 1;
+    uint32_t reallocs = 0;
+    uint32_t inPlace = 0;
+    for (uint32_t i = 0; i < AllocOps; ++i) {
+        uint32_t k = (nextRandom(seed) >> 8) % Blocks;
+        size_t size = randomAllocSize(seed);
+        if (!blocks[k]) {
+            CHECK(allocator.alloc(size, blocks[k]));
+            sizes[k] = size;
+            tags[k] = static_cast<uint8_t>(seed >> 24);
+            memset(blocks[k], tags[k], size);
+            continue;
+        }
+        
+        CHECK(filledWith(blocks[k], sizes[k], tags[k]));
+        if ((seed >> 4) % 3 == 0) {
+            allocator.free(blocks[k]);
+            blocks[k] = nullptr;
+            continue;
+        }
+        
+        void* mem;
+        CHECK(allocator.realloc(blocks[k], size, mem));
+        ++reallocs;
+        if (mem == blocks[k]) {
+            ++inPlace;
+        }
+        size_t kept = (sizes[k] < size) ? sizes[k] : size;
+        CHECK(filledWith(mem, kept, tags[k]));
+        memset(reinterpret_cast<char*>(mem) + kept, tags[k], size - kept);
+        blocks[k] = mem;
+        sizes[k] = size;
+    }
+    
+    for (uint32_t k = 0; k < Blocks; ++k) {
+        if (blocks[k]) {
+            allocator.free(blocks[k]);
+        }
+    }
+    
+    printf("    %u reallocs, %u in place\n", reallocs, inPlace);
+    CHECK(inPlace > reallocs / 2);
+    CHECK(allocator.stats().inUse == 0);
+}
+
+// Closing a File writes its changes to the block cache, not the card.
+// Only FileSystem::flush writes them back.
+static void testCloseNoFlush()
+{
+    static constexpr uint32_t FileSize = 10000;
+    static constexpr uint32_t AppendSize = 100;
+    
+    FileSystem* fs = mountedFileSystem();
+    const SDCard::Stats& stats = fs->sdCard().stats();
+    char* buf = new char[FileSize + AppendSize];
+    fill(buf, FileSize + AppendSize, 14);
+    
+    File* fp = fs->open("close", FileSystem::OpenMode::Write);
+    CHECK(fp->write(buf, FileSize) == FileSize);
+    delete fp;
+    CHECK(fs->flush() == Volume::Error::OK);
+    
+    fp = fs->open("close");
+    CHECK(fp->read(buf, FileSize) == FileSize);
+    uint32_t transfers = stats.transfers;
+    CHECK(fp->close() == Volume::Error::OK);
+    delete fp;
+    CHECK(stats.transfers == transfers);
+    
+    fp = fs->open("nonexistent");
+    CHECK(!fp->valid());
+    delete fp;
+    CHECK(stats.transfers == transfers);
+    
+    fp = fs->open("close", FileSystem::OpenMode::Append);
+    CHECK(fp->seek(0, File::SeekWhence::End));
+    CHECK(fp->write(buf + FileSize, AppendSize) == AppendSize);
+    transfers = stats.transfers;
+    delete fp;
+    CHECK(stats.transfers == transfers);
+    
+    fp = fs->open("close");
+    CHECK(fp->size() == FileSize + AppendSize);
+    memset(buf, 0, FileSize + AppendSize);
+    CHECK(fp->read(buf, FileSize + AppendSize) == FileSize + AppendSize);
+    CHECK(matches(buf, FileSize + AppendSize, 14));
+    delete fp;
+    delete [ ] buf;
+    
+    CHECK(fs->flush() == Volume::Error::OK);
+    CHECK(stats.transfers > transfers);
+    CHECK(fs->remove("close") == Volume::Error::OK);
+    CHECK(verifyImage());
+}
+
+// Files open on the same file see each other's writes without closing
+// or flushing, and writes to the same block through two Files both land
+static void testSharedFile()
+{
+    static constexpr uint32_t FileSize = 20000;
+    static constexpr uint32_t PatchOffset = 3000;
+    static constexpr uint32_t PatchSize = 100;
+    
+    FileSystem* fs = mountedFileSystem();
+    char* buf = new char[FileSize];
+    char* patch = new char[PatchSize];
+    
+    for (const char* name : { "shared", "ram/shared" }) {
+        File* writer = fs->open(name, FileSystem::OpenMode::Write);
+        CHECK(writer->valid());
+        fill(buf, FileSize, 15);
+        CHECK(writer->write(buf, FileSize) == FileSize);
+        
+        File* reader = fs->open(name);
+        CHECK(reader->valid());
+        CHECK(reader->size() == FileSize);
+        memset(buf, 0, FileSize);
+        CHECK(reader->read(buf, FileSize) == FileSize);
+        CHECK(matches(buf, FileSize, 15));
+        
+        // The reader's buffer holds the old contents of the patched blocks
+        fill(patch, PatchSize, 16);
+        CHECK(writer->seek(PatchOffset, File::SeekWhence::Set));
+        CHECK(writer->write(patch, PatchSize) == PatchSize);
+        CHECK(reader->seek(PatchOffset, File::SeekWhence::Set));
+        memset(buf, 0, PatchSize);
+        CHECK(reader->read(buf, PatchSize) == PatchSize);
+        CHECK(matches(buf, PatchSize, 16));
+        
+        // Interleaved writes to one block through two Files
+        File* updater = fs->open(name, FileSystem::OpenMode::Read, FileSystem::OpenOption::Update);
+        CHECK(updater->valid());
+        fill(patch, PatchSize, 17);
+        CHECK(writer->seek(0, File::SeekWhence::Set));
+        CHECK(writer->write(patch, PatchSize) == PatchSize);
+        fill(patch, PatchSize, 18);
+        CHECK(updater->seek(PatchSize, File::SeekWhence::Set));
+        CHECK(updater->write(patch, PatchSize) == PatchSize);
+        
+        delete updater;
+        delete writer;
+        delete reader;
+        
+        File* fp = fs->open(name);
+        CHECK(fp->read(buf, PatchSize) == PatchSize);
+        CHECK(matches(buf, PatchSize, 17));
+        CHECK(fp->read(buf, PatchSize) == PatchSize);
+        CHECK(matches(buf, PatchSize, 18));
+        delete fp;
+        CHECK(fs->remove(name) == Volume::Error::OK);
+    }
+    delete [ ] patch;
+    delete [ ] buf;
+    CHECK(verifyImage());
+}
+
+// Set the free count in the FSInfo block of the image. Returns the old one.
+static uint32_t setFSInfoFreeCount(uint32_t freeCount)
+{
+    // Offsets from the FAT32 spec: the partition start in the MBR, the
+    // FSInfo block in the boot block and the free count in FSInfo
+    SDCard sdCard;
+    char buf[BlockSize] __attribute__((aligned(4)));
+    CHECK(sdCard.read(buf, 0, 1) == Volume::Error::OK);
+    uint32_t partitionStart = FAT32::bufToUInt32(reinterpret_cast<uint8_t*>(buf + 0x1be + 8));
+    CHECK(sdCard.read(buf, partitionStart, 1) == Volume::Error::OK);
+    Block infoBlock = partitionStart + FAT32::bufToUInt16(reinterpret_cast<uint8_t*>(buf + 48));
+    CHECK(sdCard.read(buf, infoBlock, 1) == Volume::Error::OK);
+    uint8_t* p = reinterpret_cast<uint8_t*>(buf + 488);
+    uint32_t oldFreeCount = FAT32::bufToUInt32(p);
+    FAT32::uint32ToBuf(freeCount, p);
+    CHECK(sdCard.write(buf, infoBlock, 1) == Volume::Error::OK);
+    return oldFreeCount;
+}
+
+// Mounting takes the free count from FSInfo and reads almost none of the
+// FAT. Without a count in FSInfo it counts the whole FAT.
+static void testFATMount()
+{
+    uint32_t freeClusters;
+    {
+        SDCard sdCard;
+        FAT32 fat(&sdCard, 0);
+        CHECK(fat.mount() == Volume::Error::OK);
+        printf("    FAT reads to mount: %u\n", fat.fatStats().reads);
+        CHECK(fat.fatStats().reads <= 2);
+        freeClusters = fat.freeClusterCount();
+    }
+    
+    uint32_t oldFreeCount = setFSInfoFreeCount(0xffffffff);
+    CHECK(oldFreeCount == freeClusters);
+    {
+        SDCard sdCard;
+        FAT32 fat(&sdCard, 0);
+        CHECK(fat.mount() == Volume::Error::OK);
+        printf("    FAT reads to mount without a free count: %u\n", fat.fatStats().reads);
+        CHECK(fat.fatStats().reads >= freeClusters / (BlockSize / 4));
+        CHECK(fat.freeClusterCount() == freeClusters);
+        
+        // The count is written back to FSInfo
+        CHECK(fat.sync() == Volume::Error::OK);
+    }
+    CHECK(verifyImage());
+}
+
+// On a full volume with every other cluster free there is no run longer
+// than one cluster. Each search for a longer run has to be bounded rather
+// than look at every FAT block.
+static void testFATFragmented()
+{
+    SDCard sdCard;
+    FAT32 fat(&sdCard, 0);
+    CHECK(fat.mount() == Volume::Error::OK);
+    
+    std::vector<uint32_t> clusters;
+    while (fat.freeClusterCount()) {
+        Cluster cluster = fat.allocateCluster(0);
+        CHECK(cluster.value() != 0);
+        clusters.push_back(cluster.value());
+    }
+    for (size_t i = 1; i < clusters.size(); i += 2) {
+        CHECK(fat.freeClusters(clusters[i]));
+    }
+    
+    // The search looks at up to 64 blocks for a fit and 8 more after the
+    // first candidate (FAT32::RunSearch). The run comes in 4 pieces.
+    static constexpr uint32_t MaxLookupsPerSearch = 64 + 8 + 2;
+    const FAT32::FATStats& stats = fat.fatStats();
+    uint32_t lookups = stats.hits + stats.misses;
+    uint32_t allocated;
+    Cluster run = fat.allocateClusters(0, 4, allocated);
+    lookups = stats.hits + stats.misses - lookups;
+    printf("    %u FAT blocks, %u lookups to allocate 4 clusters\n", static_cast<uint32_t>(clusters.size() / 128), lookups);
+    CHECK(run.value() != 0 && allocated == 4);
+    CHECK(lookups <= 4 * MaxLookupsPerSearch);
+    
+    CHECK(fat.freeClusters(run));
+    for (size_t i = 0; i < clusters.size(); i += 2) {
+        CHECK(fat.freeClusters(clusters[i]));
+    }
+    CHECK(fat.sync() == Volume::Error::OK);
+    CHECK(verifyImage());
+}
+
+// With the journal on, metadata reaches the card only in commits made
+// between operations, so the card is consistent after every one. Even an
+// allocation or free of most of the volume never commits part of itself,
+// and the whole job takes fewer transfers than without the journal.
+static void testFATJournal()
+{
+    static constexpr uint32_t Directories = 500;
+    
+    SDCard sdCard;
+    const SDCard::Stats& stats = sdCard.stats();
+    uint32_t transfers[2];
+    char name[64];
+    
+    for (bool journal : { false, true }) {
+        FAT32 fat(&sdCard, 0);
+        CHECK(fat.mount() == Volume::Error::OK);
+        if (journal) {
+            CHECK(fat.enableJournal() == Volume::Error::OK);
+        }
+        CHECK(fat.createDirectory("journal") == Volume::Error::OK);
+        CHECK(fat.sync() == Volume::Error::OK);
+        
+        uint32_t start = stats.transfers;
+        uint32_t commits = fat.fatStats().journalCommits;
+        for (uint32_t i = 0; i < Directories; ++i) {
+            snprintf(name, sizeof(name), "journal/a directory with a long name %u", i);
+            CHECK(fat.createDirectory(name) == Volume::Error::OK);
+            if (fat.fatStats().journalCommits != commits) {
+                commits = fat.fatStats().journalCommits;
+                CHECK(verifyImage());
+            }
+        }
+        CHECK(fat.sync() == Volume::Error::OK);
+        transfers[journal] = stats.transfers - start;
+        
+        CHECK(fat.create("journal/big") == Volume::Error::OK);
+        RawFile* file = fat.open("journal/big");
+        CHECK(file);
+        uint32_t size = (fat.freeClusterCount() - 1000) * fat.clusterSize();
+        commits = fat.fatStats().journalCommits;
+        CHECK(file->reserve(size) == Volume::Error::OK);
+        file->setSize(size);
+        CHECK(file->updateSize() == Volume::Error::OK);
+        delete file;
+        CHECK(!journal || fat.fatStats().journalCommits > commits);
+        
+        CHECK(fat.remove("journal/big") == Volume::Error::OK);
+        for (uint32_t i = 0; i < Directories; ++i) {
+            snprintf(name, sizeof(name), "journal/a directory with a long name %u", i);
+            CHECK(fat.remove(name) == Volume::Error::OK);
+        }
+        CHECK(fat.remove("journal") == Volume::Error::OK);
+        if (journal) {
+            printf("    %u commits, %u FAT blocks\n", fat.fatStats().journalCommits, fat.blocksPerFAT());
+            CHECK(fat.disableJournal() == Volume::Error::OK);
+        }
+        CHECK(fat.sync() == Volume::Error::OK);
+        CHECK(verifyImage());
+    }
+    
+    printf("    %u transfers without the journal, %u with it\n", transfers[0], transfers[1]);
+    CHECK(transfers[1] < transfers[0]);
+}
+
+struct Test
+{
+    const char* name;
+    void (*test)();
+};
+
+static const Test tests[] = {
+    { "sdcard_commands", testSDCardCommands },
+    { "block_cache_submit", testBlockCacheSubmit },
+    { "fat_io", testFATIO },
+    { "fat_random", testFATRandom },
+    { "fat_best_fit", testFATBestFit },
+    { "fat_fragmented", testFATFragmented },
+    { "fat_empty_file", testFATEmptyFile },
+    { "fat_mount", testFATMount },
+    { "fat_journal", testFATJournal },
+    { "strcpy", testStrcpy },
+    { "requests", testRequests },
+    { "ramdisk_remove", testRAMDiskRemove },
+    { "remove_open", testRemoveOpen },
+    { "close_no_flush", testCloseNoFlush },
+    { "shared_file", testSharedFile },
+    { "alloc_random", testAllocRandom },
+    { "alloc_realloc", testAllocRealloc },
+};
+
+// Run a test in its own process. Returns false if it failed.
+static bool runTest(const Test& test)
+{
+    printf("%s\n", test.name);
+    fflush(stdout);
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        initSystem();
+        Memory::init(&kernelHeap);
+        test.test();
+        fflush(stdout);
+        _exit(0);
+    }
+    
+    int status = 0;
+    bool passed = pid >= 0 && waitpid(pid, &status, 0) >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    printf("    %s\n", passed ? "passed" : "FAILED");
+    fflush(stdout);
+    return passed;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: test <SD card image> [<name prefix>]\n");
+        return 1;
+    }
+    imagePath = argv[1];
+    setenv("PLACID_SDCARD", imagePath, 1);
+    if (argc > 2) {
+        onlyName = argv[2];
+    }
+    
+    int failures = 0;
+    for (const Test& test : tests) {
+        if (!onlyName || strncmp(test.name, onlyName, strlen(onlyName)) == 0) {
+            failures += runTest(test) ? 0 : 1;
+        }
+    }
+    printf("%d failed\n", failures);
+    return failures;
+}